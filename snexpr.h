@@ -30,12 +30,24 @@
 extern "C" {
 #endif
 
-#include <ctype.h> /* for isspace */
 #include <limits.h>
 #include <math.h> /* for pow */
+#include <stddef.h> /* for offsetof */
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifndef SNEXPR_NO_REGEX
+#include <regex.h> /* for the match operators */
+#endif
+#ifdef SNEXPR_THREADS
+#include <pthread.h> /* for the pool of threads */
+#endif
+#if defined(SNEXPR_JIT) && defined(__x86_64__) \
+		&& (defined(__unix__) || defined(__APPLE__))
+#include <sys/mman.h> /* for the native code */
+#include <unistd.h>
+#endif
 
 #define SNEXPR_TOP (1 << 0)
 #define SNEXPR_TOPEN (1 << 1)
@@ -50,21 +62,164 @@ extern "C" {
 #define SNEXPR_EXPALLOC (1 << 18)
 #define SNEXPR_VALALLOC (1 << 19)
 #define SNEXPR_VALASSIGN (1 << 20)
+#define SNEXPR_ARENA (1 << 21)
+#define SNEXPR_OPNUM (1 << 22)
+#define SNEXPR_VALSSO (1 << 23)
+#define SNEXPR_VALHANDLE (1 << 24)
+#define SNEXPR_VALBORROW (1 << 25)
+#define SNEXPR_DUALNUM (1 << 26)
+#define SNEXPR_DUALSTZ (1 << 27)
+#define SNEXPR_VALCSE (1 << 28)
+
+/* size of the inline buffer for short strings, including the ending 0 */
+#ifndef SNEXPR_SSO_SIZE
+#define SNEXPR_SSO_SIZE 16
+#endif
+
+/*
+ * Type of the numbers - float by default, 64-bit integer when SNEXPR_INT64
+ * is defined, then the division is an integer division, the numbers with
+ * fraction are truncated and the invalid numbers are 0 instead of NaN. The
+ * integer additions, subtractions and multiplications wrap around.
+ */
+#ifdef SNEXPR_INT64
+typedef long long snexpr_num_t;
+#define SNEXPR_NUM_NAN 0
+#define snexpr_num_isnan(x) 0
+#define snexpr_num_add(a, b) \
+	((snexpr_num_t)((unsigned long long)(a) + (unsigned long long)(b)))
+#define snexpr_num_sub(a, b) \
+	((snexpr_num_t)((unsigned long long)(a) - (unsigned long long)(b)))
+#define snexpr_num_mul(a, b) \
+	((snexpr_num_t)((unsigned long long)(a) * (unsigned long long)(b)))
+#define snexpr_num_neg(a) ((snexpr_num_t)(0ULL - (unsigned long long)(a)))
+#define snexpr_num_div(a, b) \
+	(((b) == -1) ? (snexpr_num_t)(0ULL - (unsigned long long)(a)) : (a) / (b))
+#define snexpr_num_rem(a, b) (((b) == -1) ? 0 : (a) % (b))
+#define snexpr_num_pow(a, b) snexpr_ipow(a, b)
+#else
+typedef float snexpr_num_t;
+#define SNEXPR_NUM_NAN NAN
+#define snexpr_num_isnan(x) isnan(x)
+#define snexpr_num_add(a, b) ((a) + (b))
+#define snexpr_num_sub(a, b) ((a) - (b))
+#define snexpr_num_mul(a, b) ((a) * (b))
+#define snexpr_num_neg(a) (-(a))
+#define snexpr_num_div(a, b) ((a) / (b))
+#define snexpr_num_rem(a, b) fmodf(a, b)
+#define snexpr_num_pow(a, b) powf(a, b)
+#endif
+
+/*
+ * Memory allocation - all the allocations and releases of the library are
+ * done with these macros, which can be defined before including snexpr.h
+ * to use the allocator of the application (e.g., a pool in shared memory)
+ */
+#ifndef SNEXPR_MALLOC
+#define SNEXPR_MALLOC(s) malloc(s)
+#endif
+#ifndef SNEXPR_CALLOC
+#define SNEXPR_CALLOC(n, s) calloc(n, s)
+#endif
+#ifndef SNEXPR_REALLOC
+#define SNEXPR_REALLOC(p, s) realloc(p, s)
+#endif
+#ifndef SNEXPR_FREE
+#define SNEXPR_FREE(p) free(p)
+#endif
+
+/* marks the functions the compiler must not inline */
+#ifndef SNEXPR_NOINLINE
+#if defined(__GNUC__)
+#define SNEXPR_NOINLINE __attribute__((noinline))
+#else
+#define SNEXPR_NOINLINE
+#endif
+#endif
+
+/*
+ * Profiling - with SNEXPR_PROFILE defined, each node counts its evaluations
+ * with snexpr_eval_r(), their time and allocations (including the ones of
+ * the children), and the function nodes and the variables the time of the
+ * callbacks; print them with snexpr_prof_dump(). The counters are not
+ * updated atomically, profile with one thread.
+ */
+#ifdef SNEXPR_PROFILE
+#include <time.h>
+
+struct snexpr_prof
+{
+	unsigned long count; /* evaluations */
+	unsigned long nalloc; /* allocations during the evaluations */
+	unsigned long long time; /* ns of the evaluations */
+	unsigned long cbcount; /* calls of the callback */
+	unsigned long long cbtime; /* ns of the callback */
+	unsigned long long cbstart;
+	int soff; /* offset and length of the token in the source */
+	int slen;
+};
+
+static unsigned long _snexpr_prof_nalloc = 0;
+
+static inline unsigned long long snexpr_prof_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL
+		   + (unsigned long long)ts.tv_nsec;
+}
 
+#define snexpr_prof_cb_begin(p) ((p)->cbstart = snexpr_prof_now())
+#define snexpr_prof_cb_end(p) \
+	((p)->cbtime += snexpr_prof_now() - (p)->cbstart, (p)->cbcount++)
+#define snexpr_prof_mark(es, src, tok, n)                           \
+	((void)(sne_vec_len(es) > 0                                     \
+					? (sne_vec_peek(es).prof.soff = (int)((tok) - (src)), \
+							sne_vec_peek(es).prof.slen = (int)(n))        \
+					: 0))
+#define snexpr_malloc(s) (_snexpr_prof_nalloc++, SNEXPR_MALLOC(s))
+#define snexpr_calloc(n, s) (_snexpr_prof_nalloc++, SNEXPR_CALLOC(n, s))
+#define snexpr_realloc(p, s) (_snexpr_prof_nalloc++, SNEXPR_REALLOC(p, s))
+#else
+#define snexpr_prof_cb_begin(p) ((void)0)
+#define snexpr_prof_cb_end(p) ((void)0)
+#define snexpr_prof_mark(es, src, tok, n) ((void)0)
+#define snexpr_malloc(s) SNEXPR_MALLOC(s)
+#define snexpr_calloc(n, s) SNEXPR_CALLOC(n, s)
+#define snexpr_realloc(p, s) SNEXPR_REALLOC(p, s)
+#endif
+#define snexpr_free(p) SNEXPR_FREE(p)
+
+
+static inline char *snexpr_strdup(const char *s)
+{
+	size_t len = strlen(s) + 1;
+	char *p = (char *)snexpr_malloc(len);
+
+	if(p != NULL) {
+		memcpy(p, s, len);
+	}
+	return p;
+}
 
 /*
- * Simple expandable vector implementation
+ * Simple expandable vector implementation - the buffer pointer is read and
+ * written with memcpy(), it is not a char * and the compiler may assume it
+ * is not changed by a store through a char **
  */
-static int sne_vec_expand(char **buf, int *length, int *cap, int memsz)
+static int sne_vec_expand(void *bufp, int *length, int *cap, int memsz)
 {
 	if(*length + 1 > *cap) {
+		void *buf;
 		void *ptr;
 		int n = (*cap == 0) ? 1 : *cap << 1;
-		ptr = realloc(*buf, n * memsz);
+		memcpy(&buf, bufp, sizeof(void *));
+		ptr = snexpr_realloc(buf, n * memsz);
 		if(ptr == NULL) {
 			return -1; /* allocation failed */
 		}
-		*buf = (char *)ptr;
+		memcpy(bufp, &ptr, sizeof(void *));
 		*cap = n;
 	}
 	return 0;
@@ -82,13 +237,13 @@ static int sne_vec_expand(char **buf, int *length, int *cap, int memsz)
 	}
 #define sne_vec_len(v) ((v)->len)
 #define sne_vec_unpack(v) \
-	(char **)&(v)->buf, &(v)->len, &(v)->cap, sizeof(*(v)->buf)
+	(void *)&(v)->buf, &(v)->len, &(v)->cap, sizeof(*(v)->buf)
 #define sne_vec_push(v, val) \
-	sne_vec_expand(sne_vec_unpack(v)) ? -1 : ((v)->buf[(v)->len++] = (val), 0)
+	(sne_vec_expand(sne_vec_unpack(v)) ? -1 : ((v)->buf[(v)->len++] = (val), 0))
 #define sne_vec_nth(v, i) (v)->buf[i]
 #define sne_vec_peek(v) (v)->buf[(v)->len - 1]
 #define sne_vec_pop(v) (v)->buf[--(v)->len]
-#define sne_vec_free(v) (free((v)->buf), (v)->buf = NULL, (v)->len = (v)->cap = 0)
+#define sne_vec_free(v) (snexpr_free((v)->buf), (v)->buf = NULL, (v)->len = (v)->cap = 0)
 #define sne_vec_foreach(v, var, iter)                                             \
 	if((v)->len > 0)                                                          \
 		for((iter) = 0; (iter) < (v)->len && (((var) = (v)->buf[(iter)]), 1); \
@@ -99,7 +254,12 @@ static int sne_vec_expand(char **buf, int *length, int *cap, int memsz)
  */
 struct snexpr;
 struct snexpr_func;
+struct snexpr_fmemo;
 struct snexpr_var;
+struct snexpr_ctx;
+struct snexpr_cse;
+struct snexpr_match;
+struct snexpr_set;
 
 enum snexpr_type
 {
@@ -125,6 +285,9 @@ enum snexpr_type
 	SNE_OP_GE,
 	SNE_OP_EQ,
 	SNE_OP_NE,
+	SNE_OP_MATCH,
+	SNE_OP_NMATCH,
+	SNE_OP_IN,
 
 	SNE_OP_BITWISE_AND,
 	SNE_OP_BITWISE_OR,
@@ -142,14 +305,18 @@ enum snexpr_type
 	SNE_OP_FUNC,
 };
 
-static int prec[] = {0, 1, 1, 1, 2, 2, 2, 2, 3, 3, 4, 4, 5, 5, 5, 5, 5, 5, 6, 7,
-		8, 9, 10, 11, 12, 0, 0, 0, 0};
+static int prec[] = {0, 1, 1, 1, 2, 2, 2, 2, 3, 3, 4, 4, 5, 5, 5, 5, 5, 5, 5, 5,
+		5, 6, 7, 8, 9, 10, 11, 12, 0, 0, 0, 0};
 
 typedef sne_vec(struct snexpr) sne_vec_expr_t;
 typedef void (*snexprfn_cleanup_t)(struct snexpr_func *f, void *context);
 typedef struct snexpr* (*snexprfn_t)(struct snexpr_func *f, sne_vec_expr_t *args, void *context);
+typedef struct snexpr* (*snexprfn_ctx_t)(struct snexpr_func *f, sne_vec_expr_t *args, void *context, struct snexpr_ctx *ctx);
 
 typedef struct snexpr* (*snexternval_cbf_t)(char *vname);
+typedef struct snexpr* (*snexternval_ctx_cbf_t)(struct snexpr_ctx *ctx, char *vname);
+typedef int (*snexternval_resolve_cbf_t)(void *data, char *vname);
+typedef struct snexpr* (*snexternval_handle_cbf_t)(struct snexpr_ctx *ctx, int hid);
 
 static snexternval_cbf_t _snexternval_cbf = NULL;
 
@@ -161,11 +328,20 @@ struct snexpr
 	{
 		struct
 		{
-			float nval;
+			snexpr_num_t nval;
+			/* the number as string, for a literal with SNEXPR_DUALSTZ */
+			size_t dslen;
+			char dsbuf[SNEXPR_SSO_SIZE];
 		} num;
 		struct
 		{
 			char *sval;
+			size_t slen; /* length of sval, 0 for empty or not known */
+			/* inline storage for short strings, sval points to it when the
+			 * SNEXPR_VALSSO flag is set */
+			char sbuf[SNEXPR_SSO_SIZE];
+			/* the string as number, for a literal with SNEXPR_DUALNUM */
+			snexpr_num_t dnval;
 		} stz;
 		struct
 		{
@@ -174,26 +350,62 @@ struct snexpr
 		struct
 		{
 			sne_vec_expr_t args;
+			/* compiled pattern of SNE_OP_MATCH and SNE_OP_NMATCH */
+			struct snexpr_match *match;
+			/* members of SNE_OP_IN, which has only the left operand */
+			struct snexpr_set *set;
 		} op;
 		struct
 		{
 			struct snexpr_func *f;
 			sne_vec_expr_t args;
 			void *context;
+			struct snexpr_fmemo *memo; /* last call, for SNEXPR_FN_PURE */
 		} func;
 	} param;
+#ifdef SNEXPR_PROFILE
+	struct snexpr_prof prof;
+#endif
 };
 
+#ifdef __cplusplus
+/* value initialization, the designated initializers are C++20 */
+#define snexpr_init() snexpr()
+#else
 #define snexpr_init()                \
 	{                                \
 		.type = (enum snexpr_type)0, \
 		.eflags = 0u                 \
 	}
+#endif
 
+/* items of the operators stack, op is unknown for parenthesis and calls */
 struct snexpr_string
 {
 	const char *s;
 	int n;
+	enum snexpr_type op;
+};
+
+enum snexpr_tkind
+{
+	SNE_TK_SPACE = 0,
+	SNE_TK_COMMENT,
+	SNE_TK_NEWLINE,
+	SNE_TK_NUMBER,
+	SNE_TK_STRING,
+	SNE_TK_WORD,
+	SNE_TK_OPEN,
+	SNE_TK_CLOSE,
+	SNE_TK_OP
+};
+
+struct snexpr_token
+{
+	enum snexpr_tkind kind;
+	enum snexpr_type op;
+	size_t offset;
+	int len;
 };
 struct snexpr_arg
 {
@@ -224,64 +436,128 @@ static int snexpr_prec(enum snexpr_type a, enum snexpr_type b)
 	return (left && prec[a] >= prec[b]) || (prec[a] > prec[b]);
 }
 
-#define isfirstvarchr(c) \
-	(((unsigned char)c >= '@' && c != '^' && c != '|') || c == '$')
-#define isvarchr(c)                                                            \
-	(((unsigned char)c >= '@' && c != '^' && c != '|') || c == '$' || c == '#' \
-			|| (c >= '0' && c <= '9'))
+/*
+ * Classes of the characters, looked up by the tokenizer
+ */
+#define SNE_CC_SPACE (1 << 0)
+#define SNE_CC_DIGIT (1 << 1)
+#define SNE_CC_VFIRST (1 << 2)
+#define SNE_CC_VAR (1 << 3)
 
-static struct
-{
-	const char *s;
-	const enum snexpr_type op;
-} OPS[] = {
-		{"-u", SNE_OP_UNARY_MINUS},
-		{"!u", SNE_OP_UNARY_LOGICAL_NOT},
-		{"^u", SNE_OP_UNARY_BITWISE_NOT},
-		{"**", SNE_OP_POWER},
-		{"*", SNE_OP_MULTIPLY},
-		{"/", SNE_OP_DIVIDE},
-		{"%", SNE_OP_REMAINDER},
-		{"+", SNE_OP_PLUS},
-		{"-", SNE_OP_MINUS},
-		{"<<", SNE_OP_SHL},
-		{">>", SNE_OP_SHR},
-		{"<", SNE_OP_LT},
-		{"<=", SNE_OP_LE},
-		{">", SNE_OP_GT},
-		{">=", SNE_OP_GE},
-		{"==", SNE_OP_EQ},
-		{"!=", SNE_OP_NE},
-		{"&", SNE_OP_BITWISE_AND},
-		{"|", SNE_OP_BITWISE_OR},
-		{"^", SNE_OP_BITWISE_XOR},
-		{"&&", SNE_OP_LOGICAL_AND},
-		{"||", SNE_OP_LOGICAL_OR},
-		{"=", SNE_OP_ASSIGN},
-		{",", SNE_OP_COMMA},
-
-		/* These are used by lexer and must be ignored by parser, so we put
-       them at the end */
-		{"-", SNE_OP_UNARY_MINUS},
-		{"!", SNE_OP_UNARY_LOGICAL_NOT},
-		{"^", SNE_OP_UNARY_BITWISE_NOT},
+static const unsigned char snexpr_cclass[256] = {
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0,
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+		1, 0, 0, 8, 12, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+		10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 0, 0, 0, 0, 0, 0,
+		12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12,
+		12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 0, 12,
+		12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12,
+		12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 0, 12, 12, 12,
+		12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12,
+		12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12,
+		12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12,
+		12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12,
+		12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12,
+		12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12,
+		12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12,
+		12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12,
 };
 
-static enum snexpr_type snexpr_op(const char *s, size_t len, int unary)
+#define snexpr_cclass_is(c, m) (snexpr_cclass[(unsigned char)(c)] & (m))
+#define isfirstvarchr(c) snexpr_cclass_is(c, SNE_CC_VFIRST)
+#define isvarchr(c) snexpr_cclass_is(c, SNE_CC_VAR)
+#define snexpr_isspace(c) snexpr_cclass_is(c, SNE_CC_SPACE)
+#define snexpr_isdigit(c) snexpr_cclass_is(c, SNE_CC_DIGIT)
+
+/*
+ * Match the binary operator at the start of s, the longest one - return
+ * its length, 0 if there is no operator
+ */
+static int snexpr_op_match(const char *s, size_t len, enum snexpr_type *op)
 {
-	unsigned int i;
-	for(i = 0; i < sizeof(OPS) / sizeof(OPS[0]); i++) {
-		if(strlen(OPS[i].s) == len && strncmp(OPS[i].s, s, len) == 0
-				&& (unary == -1 || snexpr_is_unary(OPS[i].op) == unary)) {
-			return OPS[i].op;
-		}
+	char c = (len > 1) ? s[1] : '\0';
+
+	switch(s[0]) {
+		case '*':
+			if(c == '*') {
+				*op = SNE_OP_POWER;
+				return 2;
+			}
+			*op = SNE_OP_MULTIPLY;
+			return 1;
+		case '/':
+			*op = SNE_OP_DIVIDE;
+			return 1;
+		case '%':
+			*op = SNE_OP_REMAINDER;
+			return 1;
+		case '+':
+			*op = SNE_OP_PLUS;
+			return 1;
+		case '-':
+			*op = SNE_OP_MINUS;
+			return 1;
+		case '<':
+			if(c == '<' || c == '=') {
+				*op = (c == '<') ? SNE_OP_SHL : SNE_OP_LE;
+				return 2;
+			}
+			*op = SNE_OP_LT;
+			return 1;
+		case '>':
+			if(c == '>' || c == '=') {
+				*op = (c == '>') ? SNE_OP_SHR : SNE_OP_GE;
+				return 2;
+			}
+			*op = SNE_OP_GT;
+			return 1;
+		case '=':
+			if(c == '=' || c == '~') {
+				*op = (c == '=') ? SNE_OP_EQ : SNE_OP_MATCH;
+				return 2;
+			}
+			*op = SNE_OP_ASSIGN;
+			return 1;
+		case '!':
+			if(c == '=' || c == '~') {
+				*op = (c == '=') ? SNE_OP_NE : SNE_OP_NMATCH;
+				return 2;
+			}
+			return 0;
+		case '&':
+			if(c == '&') {
+				*op = SNE_OP_LOGICAL_AND;
+				return 2;
+			}
+			*op = SNE_OP_BITWISE_AND;
+			return 1;
+		case '|':
+			if(c == '|') {
+				*op = SNE_OP_LOGICAL_OR;
+				return 2;
+			}
+			*op = SNE_OP_BITWISE_OR;
+			return 1;
+		case '^':
+			*op = SNE_OP_BITWISE_XOR;
+			return 1;
+		case ',':
+			*op = SNE_OP_COMMA;
+			return 1;
+		default:
+			return 0;
 	}
-	return SNE_OP_UNKNOWN;
 }
 
-static float snexpr_parse_number(const char *s, size_t len)
+/*
+ * Parse the number in s of len chars into num - return -1 if not valid. The
+ * digits are added in an integer and the fraction is applied once at the end.
+ * With SNEXPR_INT64 the integers above LLONG_MAX are not valid.
+ */
+static int snexpr_parse_numv(const char *s, size_t len, snexpr_num_t *num)
 {
-	float num = 0;
+	unsigned long long m = 0;
+	double d = 0;
 	unsigned int frac = 0;
 	unsigned int digits = 0;
 	unsigned int i;
@@ -290,32 +566,79 @@ static float snexpr_parse_number(const char *s, size_t len)
 			frac++;
 			continue;
 		}
-		if(isdigit(s[i])) {
-			digits++;
-			if(frac > 0) {
-				frac++;
-			}
-			num = num * 10 + (s[i] - '0');
+		if(!snexpr_isdigit(s[i])) {
+			return -1;
+		}
+		digits++;
+		if(frac > 0) {
+#ifdef SNEXPR_INT64
+			continue; /* the fraction is truncated */
+#else
+			frac++;
+#endif
+		}
+#ifdef SNEXPR_INT64
+		/* the integers out of the range of snexpr_num_t are not valid */
+		if(m > (unsigned long long)(LLONG_MAX - (s[i] - '0')) / 10) {
+			return -1;
+		}
+		m = m * 10 + (s[i] - '0');
+		continue;
+#endif
+		if(digits <= 19) {
+			m = m * 10 + (s[i] - '0');
 		} else {
-			return NAN;
+			if(digits == 20) {
+				d = (double)m;
+			}
+			d = d * 10 + (s[i] - '0');
 		}
 	}
-	while(frac > 1) {
-		num = num / 10;
-		frac--;
+	if(digits == 0) {
+		return -1;
+	}
+	if(digits <= 19) {
+		d = (double)m;
+	}
+#ifdef SNEXPR_INT64
+	*num = (snexpr_num_t)m;
+#else
+	*num = (frac > 1) ? (snexpr_num_t)(d / pow(10, frac - 1)) : (snexpr_num_t)d;
+#endif
+	return 0;
+}
+
+static snexpr_num_t snexpr_parse_number(const char *s, size_t len)
+{
+	snexpr_num_t num;
+	if(snexpr_parse_numv(s, len, &num) < 0) {
+		return SNEXPR_NUM_NAN;
 	}
-	return (digits > 0 ? num : NAN);
+	return num;
 }
 
 /*
  * Functions
  */
+/* the result depends only on the parameters, it can be computed when the
+ * expression is optimized if they are constants */
+#define SNEXPR_FN_FOLD (1 << 0)
+/* like SNEXPR_FN_FOLD, and the result of the last call of each function node
+ * is kept, the function being called only when the parameters change */
+#define SNEXPR_FN_PURE (1 << 1)
+/* the number of parameters is checked when the expression is parsed */
+#define SNEXPR_FN_NARGS (1 << 2)
+
 struct snexpr_func
 {
 	const char *name;
 	snexprfn_t f;
 	snexprfn_cleanup_t cleanup;
 	size_t ctxsz;
+	snexprfn_ctx_t fctx; /* used instead of f when set, gets the evaluation context */
+	unsigned int fflags; /* SNEXPR_FN_... */
+	int nargs; /* number of parameters, with SNEXPR_FN_NARGS */
+	enum snexpr_type rtype; /* SNE_OP_CONSTNUM or SNE_OP_CONSTSTZ, if always the same */
 };
 
 static struct snexpr_func *snexpr_func_find(
@@ -330,6 +653,29 @@ static struct snexpr_func *snexpr_func_find(
 	return NULL;
 }
 
+/* reserved for the function nodes of the $() macros */
+#define SNEXPR_FN_MACRO (1 << 3)
+#define SNEXPR_MACRO_NARGS 9 /* parameters $1 to $9 */
+#define SNEXPR_MACRO_OPT (1 << 0) /* the body is optimized */
+#define SNEXPR_MACRO_VISIT (1 << 1) /* checks of the images */
+#define SNEXPR_MACRO_DONE (1 << 2)
+
+/*
+ * Macro defined with $(name, body...) - the body is built once and the
+ * calls are function nodes referencing it. The parameters of a call are
+ * evaluated first, then they are assigned to the variables $1, $2, ...
+ * during the evaluation of the body, restoring the previous values after.
+ */
+struct snexpr_macro
+{
+	struct snexpr_func f; /* first, the function of the call nodes */
+	struct snexpr body;
+	struct snexpr_var *params[SNEXPR_MACRO_NARGS];
+	int refs; /* call nodes and parser, -1 when in an arena */
+	unsigned int mflags;
+	int depth; /* of the body, 0 until known */
+};
+
 /*
  * Variables
  */
@@ -339,42 +685,271 @@ struct snexpr_var
 	char *name;
 	union
 	{
-		float nval;
+		snexpr_num_t nval;
 		char *sval;
 	} v;
+	size_t vlen; /* length of v.sval, 0 for empty or not known */
 	struct snexpr_var *next;
+	struct snexpr_var *hnext; /* next in the hash table bucket */
+	unsigned int hashid;
+	size_t nlen;
+	int slot; /* index in the slots table of the list */
+#ifdef SNEXPR_PROFILE
+	struct snexpr_prof prof; /* calls of the callback for external variables */
+#endif
+	int hid;  /* handle given by the host, with SNEXPR_VALHANDLE */
+	unsigned int ver; /* changes of the value, for the cached subtrees */
 };
 
+/*
+ * List of variables, initialized with zeros - the variables are also kept
+ * in a hash table for lookup by name, and in a table of slots, where the
+ * index of a variable does not change until the list is destroyed
+ */
 struct snexpr_var_list
 {
 	struct snexpr_var *head;
+	struct snexpr_var **htable;
+	unsigned int hsize;
+	struct snexpr_var **slots;
+	int nslots;
+	int cslots;
 };
 
+#define SNEXPR_VAR_HSIZE 16
+
+static inline unsigned int snexpr_var_hash(const char *s, size_t len)
+{
+	unsigned int h = 2166136261u;
+	size_t i;
+	for(i = 0; i < len; i++) {
+		h = (h ^ (unsigned char)s[i]) * 16777619u;
+	}
+	return h;
+}
+
+/* add the variable in the hash table and in the slots table */
+static int snexpr_var_index(struct snexpr_var_list *vars, struct snexpr_var *v)
+{
+	struct snexpr_var **ptr;
+	unsigned int i;
+	int n;
+
+	if(vars->nslots >= vars->cslots) {
+		n = (vars->cslots == 0) ? SNEXPR_VAR_HSIZE : 2 * vars->cslots;
+		ptr = (struct snexpr_var **)snexpr_realloc(
+				vars->slots, n * sizeof(struct snexpr_var *));
+		if(ptr == NULL) {
+			return -1;
+		}
+		vars->slots = ptr;
+		vars->cslots = n;
+	}
+	if((unsigned int)vars->nslots >= vars->hsize) {
+		/* keep the load factor under 1, rebuild the buckets */
+		n = (vars->hsize == 0) ? SNEXPR_VAR_HSIZE : 2 * vars->hsize;
+		ptr = (struct snexpr_var **)snexpr_calloc(n, sizeof(struct snexpr_var *));
+		if(ptr == NULL) {
+			return -1;
+		}
+		if(vars->htable != NULL) {
+			snexpr_free(vars->htable);
+		}
+		vars->htable = ptr;
+		vars->hsize = n;
+		for(i = 0; i < (unsigned int)vars->nslots; i++) {
+			ptr = &vars->htable[vars->slots[i]->hashid & (vars->hsize - 1)];
+			vars->slots[i]->hnext = *ptr;
+			*ptr = vars->slots[i];
+		}
+	}
+	v->slot = vars->nslots;
+	vars->slots[vars->nslots++] = v;
+	ptr = &vars->htable[v->hashid & (vars->hsize - 1)];
+	v->hnext = *ptr;
+	*ptr = v;
+	return 0;
+}
+
 static struct snexpr_var *snexpr_var_find(
 		struct snexpr_var_list *vars, const char *s, size_t len)
 {
 	struct snexpr_var *v = NULL;
+	unsigned int hashid;
+
 	if(len == 0 || !isfirstvarchr(*s)) {
 		return NULL;
 	}
-	for(v = vars->head; v; v = v->next) {
-		if(strlen(v->name) == len && strncmp(v->name, s, len) == 0) {
-			return v;
+	if(vars->htable == NULL && vars->head != NULL) {
+		/* list built by linking the variables directly */
+		for(v = vars->head; v; v = v->next) {
+			v->nlen = strlen(v->name);
+			v->hashid = snexpr_var_hash(v->name, v->nlen);
+			if(snexpr_var_index(vars, v) < 0) {
+				return NULL;
+			}
+		}
+	}
+	hashid = snexpr_var_hash(s, len);
+	if(vars->htable != NULL) {
+		for(v = vars->htable[hashid & (vars->hsize - 1)]; v; v = v->hnext) {
+			if(v->hashid == hashid && v->nlen == len
+					&& memcmp(v->name, s, len) == 0) {
+				return v;
+			}
 		}
 	}
-	v = (struct snexpr_var *)calloc(1, sizeof(struct snexpr_var) + len + 1);
+	v = (struct snexpr_var *)snexpr_calloc(1, sizeof(struct snexpr_var) + len + 1);
 	if(v == NULL) {
 		return NULL; /* allocation failed */
 	}
-	memset(v, 0, sizeof(struct snexpr_var) + len + 1);
-	v->next = vars->head;
 	v->name = (char *)v + sizeof(struct snexpr_var);
-	strncpy(v->name, s, len);
+	memcpy(v->name, s, len);
 	v->name[len] = '\0';
+	v->nlen = len;
+	v->hashid = hashid;
+	if(snexpr_var_index(vars, v) < 0) {
+		snexpr_free(v);
+		return NULL;
+	}
+	v->next = vars->head;
 	vars->head = v;
 	return v;
 }
 
+/*
+ * Slot of the variable with the name s, adding it if not found - return -1
+ * on error. The values of the variables can be set by slot, without lookup
+ * by name.
+ */
+static inline int snexpr_var_slot(
+		struct snexpr_var_list *vars, const char *s, size_t len)
+{
+	struct snexpr_var *v = snexpr_var_find(vars, s, len);
+	return (v != NULL) ? v->slot : -1;
+}
+
+static inline struct snexpr_var *snexpr_var_at(
+		struct snexpr_var_list *vars, int slot)
+{
+	if(slot < 0 || slot >= vars->nslots) {
+		return NULL;
+	}
+	return vars->slots[slot];
+}
+
+/*
+ * Set the value of the variable at slot, the value is used instead of the
+ * one given by the callback for external variables
+ */
+static inline int snexpr_var_set_num(
+		struct snexpr_var_list *vars, int slot, snexpr_num_t nval)
+{
+	struct snexpr_var *v = snexpr_var_at(vars, slot);
+	if(v == NULL) {
+		return -1;
+	}
+	if(v->evflags & SNEXPR_VALALLOC) {
+		snexpr_free(v->v.sval);
+	}
+	v->evflags &= ~(SNEXPR_TSTRING | SNEXPR_VALALLOC);
+	v->evflags |= SNEXPR_VALASSIGN;
+	v->v.nval = nval;
+	v->ver++;
+	return 0;
+}
+
+static inline int snexpr_var_set_stz(
+		struct snexpr_var_list *vars, int slot, const char *sval)
+{
+	struct snexpr_var *v = snexpr_var_at(vars, slot);
+	char *p;
+	if(v == NULL || sval == NULL) {
+		return -1;
+	}
+	p = snexpr_strdup(sval);
+	if(p == NULL) {
+		return -1;
+	}
+	if(v->evflags & SNEXPR_VALALLOC) {
+		snexpr_free(v->v.sval);
+	}
+	v->evflags |= SNEXPR_TSTRING | SNEXPR_VALALLOC | SNEXPR_VALASSIGN;
+	v->v.sval = p;
+	v->vlen = strlen(p);
+	v->ver++;
+	return 0;
+}
+
+/*
+ * Resolve the names of the variables to handles of the host, calling rcbf
+ * once for each variable not resolved yet - it returns the handle (>= 0) or
+ * -1 if the name is not known. The evaluations with a context having the
+ * handle callback get the value of a resolved variable by its handle, not
+ * by its name. It has to be done again for the variables added to the list
+ * later. Return the number of variables resolved.
+ */
+static inline int snexpr_var_resolve(
+		struct snexpr_var_list *vars, snexternval_resolve_cbf_t rcbf, void *data)
+{
+	int hid;
+	int n = 0;
+	int i;
+
+	for(i = 0; i < vars->nslots; i++) {
+		if(vars->slots[i]->evflags & SNEXPR_VALHANDLE) {
+			continue;
+		}
+		hid = rcbf(data, vars->slots[i]->name);
+		if(hid >= 0) {
+			vars->slots[i]->hid = hid;
+			vars->slots[i]->evflags |= SNEXPR_VALHANDLE;
+			n++;
+		}
+	}
+	return n;
+}
+
+#ifdef SNEXPR_INT64
+#define to_int(x) (x)
+
+static long long snexpr_ipow(long long a, long long b)
+{
+	unsigned long long r = 1;
+	unsigned long long m = (unsigned long long)a;
+
+	if(b < 0) {
+		return (a == 1 || a == -1) ? ((b & 1) ? a : 1) : 0;
+	}
+	for(; b > 0; b >>= 1) {
+		if(b & 1) {
+			r *= m;
+		}
+		m *= m;
+	}
+	return (long long)r;
+}
+
+/*
+ * Shifts, the counts below 0 or not smaller than the width of the integers
+ * give 0 (-1 for a negative number shifted right) in all the evaluators
+ */
+static inline long long snexpr_num_shl(long long a, long long b)
+{
+	if(b < 0 || b >= 64) {
+		return 0;
+	}
+	return (long long)((unsigned long long)a << b);
+}
+
+static inline long long snexpr_num_shr(long long a, long long b)
+{
+	if(b < 0 || b >= 64) {
+		return (a < 0) ? -1 : 0;
+	}
+	return a >> b;
+}
+#else
 static int to_int(float x)
 {
 	if(isnan(x)) {
@@ -386,43 +961,115 @@ static int to_int(float x)
 	}
 }
 
+/* shifts of the integer parts, like with SNEXPR_INT64 for 32-bit integers */
+static inline float snexpr_num_shl(float a, float b)
+{
+	int n = to_int(b);
+
+	if(n < 0 || n >= 32) {
+		return 0;
+	}
+	return (float)(int)((unsigned int)to_int(a) << n);
+}
+
+static inline float snexpr_num_shr(float a, float b)
+{
+	int n = to_int(b);
+
+	if(n < 0 || n >= 32) {
+		return (to_int(a) < 0) ? -1 : 0;
+	}
+	return (float)(to_int(a) >> n);
+}
+#endif
+
+
+#define SNEXPR_NUMSTZ_SIZE 24
 
-static int snexpr_format_num(char **out, float value)
+/* format an integer in out - return its length, -2 if it does not fit */
+static int snexpr_format_int(char *out, size_t size, long long value)
 {
+	char buf[SNEXPR_NUMSTZ_SIZE];
+	unsigned long long u;
+	int n = 0;
 	int ret = 0;
-	*out = (char*)malloc(24*sizeof(char));
-	if(*out==NULL) {
-		return -1;
+
+	u = (value < 0) ? -(unsigned long long)value : (unsigned long long)value;
+	do {
+		buf[n++] = (char)('0' + u % 10);
+		u /= 10;
+	} while(u != 0);
+	if(value < 0) {
+		buf[n++] = '-';
+	}
+	if((size_t)n >= size) {
+		return -2;
+	}
+	while(n > 0) {
+		out[ret++] = buf[--n];
 	}
+	out[ret] = '\0';
+	return ret;
+}
+
+static int snexpr_format_numb(char *out, size_t size, snexpr_num_t value)
+{
+#ifdef SNEXPR_INT64
+	return snexpr_format_int(out, size, value);
+#else
+	int ret = 0;
 	if(value - (long)value != 0) {
 #ifdef SNEXPR_FLOAT_FULLPREC
-		ret = snprintf(*out, 24, "%g", value);
+		ret = snprintf(out, size, "%g", value);
 #else
-		ret = snprintf(*out, 24, "%.4g", value);
+		ret = snprintf(out, size, "%.4g", value);
 #endif
 	} else {
-		ret = snprintf(*out, 24, "%lld", (long long)value);
+		return snexpr_format_int(out, size, (long long)value);
+	}
+	if((ret < 0) || (ret >= (int)size)) {
+		return -2;
+	}
+	return ret;
+#endif
+}
+
+static int snexpr_format_num(char **out, snexpr_num_t value)
+{
+	*out = (char*)snexpr_malloc(SNEXPR_NUMSTZ_SIZE*sizeof(char));
+	if(*out==NULL) {
+		return -1;
 	}
-	if((ret < 0) || (ret >= 24)) {
-		free(*out);
+	if(snexpr_format_numb(*out, SNEXPR_NUMSTZ_SIZE, value) < 0) {
+		snexpr_free(*out);
 		*out = NULL;
 		return -2;
 	}
 	return 0;
 }
 
-static struct snexpr *snexpr_convert_num(float value, unsigned int ctype)
+static struct snexpr *snexpr_convert_num(snexpr_num_t value, unsigned int ctype)
 {
-	struct snexpr *e = (struct snexpr *)malloc(sizeof(struct snexpr));
+	int ret;
+	struct snexpr *e = (struct snexpr *)snexpr_malloc(sizeof(struct snexpr));
 	if(e == NULL) {
 		return NULL;
 	}
 	memset(e, 0, sizeof(struct snexpr));
 
 	if(ctype == SNE_OP_CONSTSTZ) {
-		e->eflags |= SNEXPR_EXPALLOC | SNEXPR_VALALLOC;
+		e->eflags |= SNEXPR_EXPALLOC;
 		e->type = SNE_OP_CONSTSTZ;
-		snexpr_format_num(&e->param.stz.sval, value);
+		ret = snexpr_format_numb(
+				e->param.stz.sbuf, SNEXPR_SSO_SIZE, value);
+		if(ret >= 0) {
+			e->eflags |= SNEXPR_VALSSO;
+			e->param.stz.sval = e->param.stz.sbuf;
+			e->param.stz.slen = ret;
+		} else if(snexpr_format_num(&e->param.stz.sval, value) == 0) {
+			e->eflags |= SNEXPR_VALALLOC;
+			e->param.stz.slen = strlen(e->param.stz.sval);
+		}
 		return e;
 	}
 
@@ -438,7 +1085,7 @@ static struct snexpr *snexpr_convert_stzl(char *value, size_t len, unsigned int
 	if(value==NULL) {
 		return NULL;
 	}
-	e = (struct snexpr *)malloc(sizeof(struct snexpr));
+	e = (struct snexpr *)snexpr_malloc(sizeof(struct snexpr));
 	if(e == NULL) {
 		return NULL;
 	}
@@ -451,19 +1098,25 @@ static struct snexpr *snexpr_convert_stzl(char *value, size_t len, unsigned int
 		return e;
 	}
 
-	e->param.stz.sval = (char *)malloc(len + 1);
-	if(e->param.stz.sval == NULL) {
-		free(e);
-		return NULL;
+	if(len < SNEXPR_SSO_SIZE) {
+		e->param.stz.sval = e->param.stz.sbuf;
+		e->eflags |= SNEXPR_EXPALLOC | SNEXPR_VALSSO;
+	} else {
+		e->param.stz.sval = (char *)snexpr_malloc(len + 1);
+		if(e->param.stz.sval == NULL) {
+			snexpr_free(e);
+			return NULL;
+		}
+		e->eflags |= SNEXPR_EXPALLOC | SNEXPR_VALALLOC;
 	}
-	e->eflags |= SNEXPR_EXPALLOC | SNEXPR_VALALLOC;
 	e->type = SNE_OP_CONSTSTZ;
 	memcpy(e->param.stz.sval, value, len);
 	e->param.stz.sval[len] = '\0';
+	e->param.stz.slen = len;
 	return e;
 }
 
-static struct snexpr *snexpr_convert_stz(char *value, unsigned int ctype)
+static inline struct snexpr *snexpr_convert_stz(char *value, unsigned int ctype)
 {
 	if(value==NULL) {
 		return NULL;
@@ -472,26 +1125,70 @@ static struct snexpr *snexpr_convert_stz(char *value, unsigned int ctype)
 	return snexpr_convert_stzl(value, strlen(value), ctype);
 }
 
-static struct snexpr *snexpr_concat_strz(char *value0, char *value1)
+/*
+ * Set e to a string borrowed from the host - it is not copied and it does
+ * not need to end with '\0', but it has to stay valid during the evaluation.
+ * The callbacks for external variables can return e, kept by the host.
+ */
+static inline struct snexpr *snexpr_stz_borrow(
+		struct snexpr *e, const char *value, size_t len)
+{
+	if(value == NULL) {
+		return NULL;
+	}
+	e->type = SNE_OP_CONSTSTZ;
+	e->eflags = SNEXPR_VALBORROW;
+	e->param.stz.sval = (char *)value;
+	e->param.stz.slen = len;
+	return e;
+}
+
+static inline struct snexpr *snexpr_concat_strz(char *value0, char *value1)
 {
-	struct snexpr *e = (struct snexpr *)malloc(sizeof(struct snexpr));
+	size_t l0 = strlen(value0);
+	size_t l1 = strlen(value1);
+	struct snexpr *e = (struct snexpr *)snexpr_malloc(sizeof(struct snexpr));
 	if(e == NULL) {
 		return NULL;
 	}
 	memset(e, 0, sizeof(struct snexpr));
 
-	e->param.stz.sval = (char *)malloc(strlen(value0) + strlen(value1) + 1);
+	e->param.stz.sval = (char *)snexpr_malloc(l0 + l1 + 1);
 	if(e->param.stz.sval == NULL) {
-		free(e);
+		snexpr_free(e);
 		return NULL;
 	}
 	e->eflags |= SNEXPR_EXPALLOC | SNEXPR_VALALLOC;
 	e->type = SNE_OP_CONSTSTZ;
-	strcpy(e->param.stz.sval, value0);
-	strcat(e->param.stz.sval, value1);
+	memcpy(e->param.stz.sval, value0, l0);
+	memcpy(e->param.stz.sval + l0, value1, l1 + 1);
+	e->param.stz.slen = l0 + l1;
 	return e;
 }
 
+/*
+ * Length of a string value - the values from the callbacks may not have it
+ * set, then it is computed, except for the borrowed strings
+ */
+static inline size_t snexpr_stz_len(struct snexpr *e)
+{
+	if(e->param.stz.slen == 0 && !(e->eflags & SNEXPR_VALBORROW)
+			&& e->param.stz.sval[0] != '\0') {
+		e->param.stz.slen = strlen(e->param.stz.sval);
+	}
+	return e->param.stz.slen;
+}
+
+/*
+ * Release of an allocated result, not inlined - the results are often on
+ * the stack of the caller and, once inlined, the compiler warns for the
+ * free() it cannot see guarded by SNEXPR_EXPALLOC
+ */
+static SNEXPR_NOINLINE void snexpr_result_release(struct snexpr *e)
+{
+	snexpr_free(e);
+}
+
 static void snexpr_result_free(struct snexpr *e)
 {
 	if(e == NULL) {
@@ -499,954 +1196,8058 @@ static void snexpr_result_free(struct snexpr *e)
 	}
 	if((e->eflags & SNEXPR_VALALLOC) && (e->type == SNE_OP_CONSTSTZ)
 			&& (e->param.stz.sval != NULL)) {
-		free(e->param.stz.sval);
+		snexpr_free(e->param.stz.sval);
 	}
-	if(!(e->eflags & SNEXPR_EXPALLOC)) {
-		return;
+	if(e->eflags & SNEXPR_EXPALLOC) {
+		snexpr_result_release(e);
 	}
-	free(e);
 }
 
-#define snexpr_eval_check_val(val, vtype) do { \
-		if(val==NULL || val->type != vtype) { \
-			goto error; \
-		} \
-	} while(0)
+/*
+ * Scratch area for the evaluations that write the result in a value
+ * provided by the caller - it holds the value stack of the compiled
+ * programs and the intermediate strings, both reused by the following
+ * evaluations. Initialize it with zeros, release it with
+ * snexpr_scratch_free().
+ */
+#define SNEXPR_SCRATCH_SIZE 256
 
-#define snexpr_eval_check_null(val, vtype) do { \
-		if(val==NULL) { \
-			goto error; \
-		} \
-	} while(0)
+struct snexpr_sblock
+{
+	struct snexpr_sblock *next;
+	size_t size;
+	size_t used;
+};
 
-#define snexpr_eval_cmp(_CMPOP_) do { \
-			rv0 = snexpr_eval(&e->param.op.args.buf[0]); \
-			snexpr_eval_check_null(rv0, SNE_OP_CONSTNUM); \
-			rv1 = snexpr_eval(&e->param.op.args.buf[1]); \
-			snexpr_eval_check_null(rv1, SNE_OP_CONSTNUM); \
-			if(rv0->type == SNE_OP_CONSTSTZ) { \
-				/* string comparison */ \
-				if(rv1->type == SNE_OP_CONSTNUM) { \
-					tv = snexpr_convert_num(rv1->param.num.nval, SNE_OP_CONSTSTZ); \
-					snexpr_result_free(rv1); \
-					rv1 = tv; \
-					snexpr_eval_check_val(rv1, SNE_OP_CONSTSTZ); \
-				} \
-				if(strcmp(rv0->param.stz.sval, rv1->param.stz.sval) _CMPOP_ 0) { \
-					lv = snexpr_convert_num(1, SNE_OP_CONSTNUM); \
-				} else { \
-					lv = snexpr_convert_num(0, SNE_OP_CONSTNUM); \
-				} \
-			} else { \
-				/* number comparison */ \
-				if(rv1->type == SNE_OP_CONSTSTZ) { \
-					tv = snexpr_convert_stz(rv1->param.stz.sval, SNE_OP_CONSTNUM); \
-					snexpr_result_free(rv1); \
-					rv1 = tv; \
-					snexpr_eval_check_val(rv1, SNE_OP_CONSTNUM); \
-				} \
-				lv = snexpr_convert_num( \
-						rv0->param.num.nval _CMPOP_ rv1->param.num.nval, SNE_OP_CONSTNUM); \
-			} \
-	} while(0)
+/*
+ * Stack of snexpr_eval_stack(), the frames of the nodes being evaluated and the
+ * values of their operands - kept in the scratch area, reused by the next
+ * evaluations and by the nested ones above the frames in use
+ */
+#define SNEXPR_EVAL_LSTACK 16
 
-static struct snexpr *snexpr_eval(struct snexpr *e)
+struct snexpr_eframe
 {
-	float n;
-	struct snexpr *lv = NULL;
-	struct snexpr *rv0 = NULL;
-	struct snexpr *rv1 = NULL;
-	struct snexpr *tv = NULL;
+	struct snexpr *e;
+	int state; /* operands evaluated */
+	int vbase; /* values on the stack below the operands */
+	int chain; /* operands of a chain a + b + ..., -1 for its inner nodes */
+#ifdef SNEXPR_PROFILE
+	unsigned long nalloc;
+	unsigned long long t;
+#endif
+};
 
-	switch(e->type) {
-		case SNE_OP_UNARY_MINUS:
-			rv0 = snexpr_eval(&e->param.op.args.buf[0]);
-			snexpr_eval_check_val(rv0, SNE_OP_CONSTNUM);
-			lv = snexpr_convert_num(-(rv0->param.num.nval), SNE_OP_CONSTNUM);
-			goto done;
-		case SNE_OP_UNARY_LOGICAL_NOT:
-			rv0 = snexpr_eval(&e->param.op.args.buf[0]);
-			snexpr_eval_check_val(rv0, SNE_OP_CONSTNUM);
-			lv = snexpr_convert_num(!(rv0->param.num.nval), SNE_OP_CONSTNUM);
-			goto done;
-		case SNE_OP_UNARY_BITWISE_NOT:
-			rv0 = snexpr_eval(&e->param.op.args.buf[0]);
-			snexpr_eval_check_val(rv0, SNE_OP_CONSTNUM);
-			lv = snexpr_convert_num(~(to_int(rv0->param.num.nval)), SNE_OP_CONSTNUM);
-			goto done;
-		case SNE_OP_POWER:
-			rv0 = snexpr_eval(&e->param.op.args.buf[0]);
-			snexpr_eval_check_val(rv0, SNE_OP_CONSTNUM);
-			rv1 = snexpr_eval(&e->param.op.args.buf[1]);
-			snexpr_eval_check_val(rv1, SNE_OP_CONSTNUM);
-			lv = snexpr_convert_num(
-					powf(rv0->param.num.nval, rv1->param.num.nval),
-					SNE_OP_CONSTNUM);
-			goto done;
-		case SNE_OP_MULTIPLY:
-			rv0 = snexpr_eval(&e->param.op.args.buf[0]);
-			snexpr_eval_check_val(rv0, SNE_OP_CONSTNUM);
-			rv1 = snexpr_eval(&e->param.op.args.buf[1]);
-			snexpr_eval_check_val(rv1, SNE_OP_CONSTNUM);
-			lv = snexpr_convert_num(
-					rv0->param.num.nval * rv1->param.num.nval, SNE_OP_CONSTNUM);
-			goto done;
-		case SNE_OP_DIVIDE:
-			rv0 = snexpr_eval(&e->param.op.args.buf[0]);
-			snexpr_eval_check_val(rv0, SNE_OP_CONSTNUM);
-			rv1 = snexpr_eval(&e->param.op.args.buf[1]);
-			snexpr_eval_check_val(rv1, SNE_OP_CONSTNUM);
-			if(rv1->param.num.nval == 0) {
-				goto error;
-			}
-			lv = snexpr_convert_num(
-					rv0->param.num.nval / rv1->param.num.nval, SNE_OP_CONSTNUM);
-			goto done;
-		case SNE_OP_REMAINDER:
-			rv0 = snexpr_eval(&e->param.op.args.buf[0]);
-			snexpr_eval_check_val(rv0, SNE_OP_CONSTNUM);
-			rv1 = snexpr_eval(&e->param.op.args.buf[1]);
-			snexpr_eval_check_val(rv1, SNE_OP_CONSTNUM);
-			lv = snexpr_convert_num(
-					fmodf(rv0->param.num.nval, rv1->param.num.nval),
-					SNE_OP_CONSTNUM);
-			goto done;
-		case SNE_OP_PLUS:
-			rv0 = snexpr_eval(&e->param.op.args.buf[0]);
-			snexpr_eval_check_null(rv0, SNE_OP_CONSTNUM);
-			rv1 = snexpr_eval(&e->param.op.args.buf[1]);
-			snexpr_eval_check_null(rv1, SNE_OP_CONSTNUM);
-			if(rv0->type == SNE_OP_CONSTSTZ) {
-				/* string concatenation */
-				if(rv1->type == SNE_OP_CONSTNUM) {
-					tv = snexpr_convert_num(rv1->param.num.nval, SNE_OP_CONSTSTZ);
-					snexpr_result_free(rv1);
-					rv1 = tv;
-					snexpr_eval_check_val(rv1, SNE_OP_CONSTSTZ);
-				}
-				lv = snexpr_concat_strz(rv0->param.stz.sval, rv1->param.stz.sval);
-			} else {
-				/* add */
-				if(rv1->type == SNE_OP_CONSTSTZ) {
-					tv = snexpr_convert_stz(rv1->param.stz.sval, SNE_OP_CONSTNUM);
-					snexpr_result_free(rv1);
-					rv1 = tv;
-					snexpr_eval_check_val(rv1, SNE_OP_CONSTNUM);
-				}
-				lv = snexpr_convert_num(
-						rv0->param.num.nval + rv1->param.num.nval, SNE_OP_CONSTNUM);
-			}
-			goto done;
-		case SNE_OP_MINUS:
-			rv0 = snexpr_eval(&e->param.op.args.buf[0]);
-			snexpr_eval_check_val(rv0, SNE_OP_CONSTNUM);
-			rv1 = snexpr_eval(&e->param.op.args.buf[1]);
-			snexpr_eval_check_val(rv1, SNE_OP_CONSTNUM);
-			lv = snexpr_convert_num(
-					rv0->param.num.nval - rv1->param.num.nval, SNE_OP_CONSTNUM);
-			goto done;
-		case SNE_OP_SHL:
-			rv0 = snexpr_eval(&e->param.op.args.buf[0]);
-			snexpr_eval_check_val(rv0, SNE_OP_CONSTNUM);
-			rv1 = snexpr_eval(&e->param.op.args.buf[1]);
-			snexpr_eval_check_val(rv1, SNE_OP_CONSTNUM);
-			lv = snexpr_convert_num(
-					to_int(rv0->param.num.nval) << to_int(rv1->param.num.nval),
-					SNE_OP_CONSTNUM);
-			goto done;
-		case SNE_OP_SHR:
-			rv0 = snexpr_eval(&e->param.op.args.buf[0]);
-			snexpr_eval_check_val(rv0, SNE_OP_CONSTNUM);
-			rv1 = snexpr_eval(&e->param.op.args.buf[1]);
-			snexpr_eval_check_val(rv1, SNE_OP_CONSTNUM);
-			lv = snexpr_convert_num(
-					to_int(rv0->param.num.nval) >> to_int(rv1->param.num.nval),
-					SNE_OP_CONSTNUM);
-			goto done;
-		case SNE_OP_LT:
-			snexpr_eval_cmp(<);
-			goto done;
-		case SNE_OP_LE:
-			snexpr_eval_cmp(<=);
-			goto done;
-		case SNE_OP_GT:
-			snexpr_eval_cmp(>);
-			goto done;
-		case SNE_OP_GE:
-			snexpr_eval_cmp(>=);
-			goto done;
-		case SNE_OP_EQ:
-			snexpr_eval_cmp(==);
-			goto done;
-		case SNE_OP_NE:
-			snexpr_eval_cmp(!=);
-			goto done;
-		case SNE_OP_BITWISE_AND:
-			rv0 = snexpr_eval(&e->param.op.args.buf[0]);
-			snexpr_eval_check_val(rv0, SNE_OP_CONSTNUM);
-			rv1 = snexpr_eval(&e->param.op.args.buf[1]);
-			snexpr_eval_check_val(rv1, SNE_OP_CONSTNUM);
-			lv = snexpr_convert_num(
-					to_int(rv0->param.num.nval) & to_int(rv1->param.num.nval),
-					SNE_OP_CONSTNUM);
-			goto done;
-		case SNE_OP_BITWISE_OR:
-			rv0 = snexpr_eval(&e->param.op.args.buf[0]);
-			snexpr_eval_check_val(rv0, SNE_OP_CONSTNUM);
-			rv1 = snexpr_eval(&e->param.op.args.buf[1]);
-			snexpr_eval_check_val(rv1, SNE_OP_CONSTNUM);
-			lv = snexpr_convert_num(
-					to_int(rv0->param.num.nval) | to_int(rv1->param.num.nval),
-					SNE_OP_CONSTNUM);
-			goto done;
-		case SNE_OP_BITWISE_XOR:
-			rv0 = snexpr_eval(&e->param.op.args.buf[0]);
-			snexpr_eval_check_val(rv0, SNE_OP_CONSTNUM);
-			rv1 = snexpr_eval(&e->param.op.args.buf[1]);
-			snexpr_eval_check_val(rv1, SNE_OP_CONSTNUM);
-			lv = snexpr_convert_num(
-					to_int(rv0->param.num.nval) ^ to_int(rv1->param.num.nval),
-					SNE_OP_CONSTNUM);
-			goto done;
-		case SNE_OP_LOGICAL_AND:
-			rv0 = snexpr_eval(&e->param.op.args.buf[0]);
-			n = rv0->param.num.nval;
-			if(n != 0) {
-				rv1 = snexpr_eval(&e->param.op.args.buf[1]);
-				n = rv1->param.num.nval;
-				if(n != 0) {
-					lv = snexpr_convert_num(n, SNE_OP_CONSTNUM);
-					goto done;
-				}
-			}
-			lv = snexpr_convert_num(0, SNE_OP_CONSTNUM);
-			goto done;
-		case SNE_OP_LOGICAL_OR:
-			rv0 = snexpr_eval(&e->param.op.args.buf[0]);
-			n = rv0->param.num.nval;
-			if(n != 0 && !isnan(n)) {
-				lv = snexpr_convert_num(n, SNE_OP_CONSTNUM);
-				goto done;
-			} else {
-				rv1 = snexpr_eval(&e->param.op.args.buf[1]);
-				n = rv1->param.num.nval;
-				if(n != 0) {
-					lv = snexpr_convert_num(n, SNE_OP_CONSTNUM);
-					goto done;
-				}
-			}
-			lv = snexpr_convert_num(0, SNE_OP_CONSTNUM);
-			goto done;
-		case SNE_OP_ASSIGN:
-			rv1 = snexpr_eval(&e->param.op.args.buf[1]);
-			snexpr_eval_check_null(rv1, SNE_OP_CONSTNUM);
-			if(sne_vec_nth(&e->param.op.args, 0).type == SNE_OP_VAR) {
-				if(e->param.op.args.buf[0].param.var.vref->evflags & SNEXPR_VALALLOC) {
-					if(e->param.op.args.buf[0].param.var.vref->v.sval!=NULL) {
-						free(e->param.op.args.buf[0].param.var.vref->v.sval);
-						e->param.op.args.buf[0].param.var.vref->v.sval = NULL;
-					}
-					e->param.op.args.buf[0].param.var.vref->evflags &= ~(SNEXPR_TSTRING|SNEXPR_VALALLOC);
-				}
-				if(rv1->type == SNE_OP_CONSTSTZ) {
-					e->param.op.args.buf[0].param.var.vref->v.sval = strdup(rv1->param.stz.sval);
-					e->param.op.args.buf[0].param.var.vref->evflags |= SNEXPR_VALASSIGN|SNEXPR_TSTRING|SNEXPR_VALALLOC;
-					lv = snexpr_convert_stz(rv1->param.stz.sval, SNE_OP_CONSTSTZ);
-				} else {
-					n = rv1->param.num.nval;
-					e->param.op.args.buf[0].param.var.vref->v.nval = n;
-					e->param.op.args.buf[0].param.var.vref->evflags |= SNEXPR_VALASSIGN;
-					lv = snexpr_convert_num(n, SNE_OP_CONSTNUM);
-				}
-			}
-			goto done;
-		case SNE_OP_COMMA:
-			rv0 = snexpr_eval(&e->param.op.args.buf[0]);
-			rv1 = snexpr_eval(&e->param.op.args.buf[1]);
-			if(rv1->type == SNE_OP_CONSTSTZ) {
-				lv = snexpr_convert_stz(rv1->param.stz.sval, SNE_OP_CONSTSTZ);
-			} else {
-				lv = snexpr_convert_num(rv1->param.num.nval, SNE_OP_CONSTNUM);
-			}
-			goto done;
-		case SNE_OP_CONSTNUM:
-			lv = snexpr_convert_num(e->param.num.nval, SNE_OP_CONSTNUM);
-			goto done;
-		case SNE_OP_CONSTSTZ:
-			lv = snexpr_convert_stz(e->param.stz.sval, SNE_OP_CONSTSTZ);
-			goto done;
-		case SNE_OP_VAR:
-			if((_snexternval_cbf == NULL)
-					|| (e->param.var.vref->evflags & SNEXPR_VALASSIGN)) {
-				if(e->param.var.vref->evflags & SNEXPR_TSTRING) {
-					lv = snexpr_convert_stz(e->param.var.vref->v.sval, SNE_OP_CONSTSTZ);
-				} else {
-					lv = snexpr_convert_num(e->param.var.vref->v.nval, SNE_OP_CONSTNUM);
-				}
-			} else {
-				lv = _snexternval_cbf(e->param.var.vref->name);
-			}
-			goto done;
-		case SNE_OP_FUNC:
-			rv0 = e->param.func.f->f(e->param.func.f, &e->param.func.args,
-							e->param.func.context);
-			if(rv0->type == SNE_OP_CONSTSTZ) {
-				lv = snexpr_convert_stz(rv0->param.stz.sval, SNE_OP_CONSTSTZ);
-			} else {
-				lv = snexpr_convert_num(rv0->param.num.nval, SNE_OP_CONSTNUM);
-			}
-			goto done;
-		default:
-			lv = snexpr_convert_num(NAN, SNE_OP_CONSTNUM);
-			goto done;
-	}
+struct snexpr_estack
+{
+	struct snexpr_eframe *fstk;
+	int flen;
+	int fcap;
+	struct snexpr *vstk;
+	int vlen;
+	int vcap;
+};
 
-done:
-	if(rv0 != NULL) {
-		snexpr_result_free(rv0);
-	}
-	if(rv1 != NULL) {
-		snexpr_result_free(rv1);
-	}
-	return lv;
+/* patterns of the match operators compiled during the evaluations */
+#define SNEXPR_MATCH_CACHE 4
 
-error:
-	if(rv0 != NULL) {
-		snexpr_result_free(rv0);
-	}
-	if(rv1 != NULL) {
-		snexpr_result_free(rv1);
-	}
-	return NULL;
+struct snexpr_scratch
+{
+	struct snexpr *vstk;
+	int vlen;
+	int vcap;
+	int *hstk;
+	int hlen;
+	int hcap;
+	struct snexpr_estack est;
+	struct snexpr_sblock *sblock;
+	int depth;
+	struct snexpr_match *mcache[SNEXPR_MATCH_CACHE]; /* dynamic patterns */
+	int mnext; /* the oldest one in mcache */
+};
+
+/*
+ * Evaluation context - it carries the callbacks for the external variables,
+ * the user data and the scratch area, so the expressions can be evaluated
+ * at the same time by many threads, each with its own context. The
+ * expressions evaluated with a context must be created with snexpr_parse()
+ * or snexpr_create() without callback, and must not assign variables shared
+ * with other threads.
+ */
+struct snexpr_ctx
+{
+	snexternval_ctx_cbf_t evcbf;
+	snexternval_handle_cbf_t evhcbf; /* for the resolved variables */
+	void *data;
+	struct snexpr_scratch scratch;
+	struct snexpr_cse *cse; /* values shared in a rule set evaluation */
+	const snexpr_num_t *vals; /* by slot, bound by snexpr_jit_eval() */
+	int nvals;
+};
 
+static inline void snexpr_ctx_init(
+		struct snexpr_ctx *ctx, snexternval_ctx_cbf_t evcbf, void *data)
+{
+	memset(ctx, 0, sizeof(struct snexpr_ctx));
+	ctx->evcbf = evcbf;
+	ctx->data = data;
 }
 
-static int snexpr_next_token(const char *s, size_t len, int *flags)
+/* set the callback giving the values of the variables by their handles */
+static inline void snexpr_ctx_set_handle_cbf(
+		struct snexpr_ctx *ctx, snexternval_handle_cbf_t evhcbf)
 {
-	unsigned int i = 0;
-	char b;
-	int bsf = 0;
-	if(len == 0) {
-		return 0;
-	}
-	char c = s[0];
-	if(c == '#') {
-		for(; i < len && s[i] != '\n'; i++)
-			;
-		return i;
-	} else if(c == '\n') {
-		for(; i < len && isspace(s[i]); i++)
-			;
-		if(*flags & SNEXPR_TOP) {
-			if(i == len || s[i] == ')') {
-				*flags = *flags & (~SNEXPR_COMMA);
-			} else {
-				*flags = SNEXPR_TNUMBER | SNEXPR_TSTRING | SNEXPR_TWORD | SNEXPR_TOPEN
-						 | SNEXPR_COMMA;
-			}
-		}
-		return i;
-	} else if(isspace(c)) {
-		while(i < len && isspace(s[i]) && s[i] != '\n') {
-			i++;
-		}
-		return i;
-	} else if(isdigit(c)) {
-		if((*flags & SNEXPR_TNUMBER) == 0) {
-			return -1; // unexpected number
-		}
-		*flags = SNEXPR_TOP | SNEXPR_TCLOSE;
-		while((c == '.' || isdigit(c)) && i < len) {
-			i++;
-			c = s[i];
-		}
-		return i;
-	} else if(c == '"' || c == '\'') {
-		if((*flags & SNEXPR_TSTRING) == 0) {
-			return -1; // unexpected string
-		}
-		if(i == len - 1) {
-			return -1; // invalud start of string
-		}
-		*flags = SNEXPR_TOP | SNEXPR_TCLOSE;
-		b = c;
-		i++;
-		c = s[i];
-		while(i < len && (bsf==1 || c != b)) {
-			if(bsf == 0 && c == '\\') {
-				bsf = 1;
-			} else {
-				bsf = 0;
-			}
-			i++;
-			c = s[i];
-		}
-		return i + 1;
-	} else if(isfirstvarchr(c)) {
-		if((*flags & SNEXPR_TWORD) == 0) {
-			return -2; // unexpected word
-		}
-		*flags = SNEXPR_TOP | SNEXPR_TOPEN | SNEXPR_TCLOSE;
-		while((isvarchr(c)) && i < len) {
-			i++;
-			c = s[i];
-		}
-		return i;
-	} else if(c == '(' || c == ')') {
-		if(c == '(' && (*flags & SNEXPR_TOPEN) != 0) {
-			*flags = SNEXPR_TNUMBER | SNEXPR_TSTRING | SNEXPR_TWORD | SNEXPR_TOPEN
-					 | SNEXPR_TCLOSE;
-		} else if(c == ')' && (*flags & SNEXPR_TCLOSE) != 0) {
-			*flags = SNEXPR_TOP | SNEXPR_TCLOSE;
-		} else {
-			return -3; // unexpected parenthesis
-		}
-		return 1;
-	} else {
-		if((*flags & SNEXPR_TOP) == 0) {
-			if(snexpr_op(&c, 1, 1) == SNE_OP_UNKNOWN) {
-				return -4; // missing expected operand
-			}
-			*flags = SNEXPR_TNUMBER | SNEXPR_TSTRING | SNEXPR_TWORD | SNEXPR_TOPEN
-					 | SNEXPR_UNARY;
-			return 1;
-		} else {
-			int found = 0;
-			while(!isvarchr(c) && !isspace(c) && c != '(' && c != ')'
-					&& i < len) {
-				if(snexpr_op(s, i + 1, 0) != SNE_OP_UNKNOWN) {
-					found = 1;
-				} else if(found) {
-					break;
-				}
-				i++;
-				c = s[i];
-			}
-			if(!found) {
-				return -5; // unknown operator
-			}
-			*flags = SNEXPR_TNUMBER | SNEXPR_TSTRING | SNEXPR_TWORD | SNEXPR_TOPEN;
-			return i;
-		}
-	}
+	ctx->evhcbf = evhcbf;
 }
 
-#define SNEXPR_PAREN_ALLOWED 0
-#define SNEXPR_PAREN_EXPECTED 1
-#define SNEXPR_PAREN_FORBIDDEN 2
+#define snexpr_ctx_scratch(ctx) (((ctx) != NULL) ? &(ctx)->scratch : NULL)
+
+#define snexpr_sblock_data(b) ((char *)(b) + sizeof(struct snexpr_sblock))
 
-static int snexpr_bind(const char *s, size_t len, sne_vec_expr_t *es)
+static inline char *snexpr_scratch_alloc(struct snexpr_scratch *sc, size_t len)
 {
-	enum snexpr_type op = snexpr_op(s, len, -1);
-	if(op == SNE_OP_UNKNOWN) {
-		return -1;
-	}
+	struct snexpr_sblock *b = sc->sblock;
+	size_t sz;
+	char *p;
 
-	if(snexpr_is_unary(op)) {
-		if(sne_vec_len(es) < 1) {
-			return -1;
-		}
-		struct snexpr arg = sne_vec_pop(es);
-		struct snexpr unary = snexpr_init();
-		unary.type = op;
-		sne_vec_push(&unary.param.op.args, arg);
-		sne_vec_push(es, unary);
-	} else {
-		if(sne_vec_len(es) < 2) {
-			return -1;
+	if(b == NULL || b->size - b->used < len) {
+		sz = (b == NULL) ? SNEXPR_SCRATCH_SIZE : 2 * b->size;
+		if(sz < len) {
+			sz = len;
 		}
-		struct snexpr b = sne_vec_pop(es);
-		struct snexpr a = sne_vec_pop(es);
-		struct snexpr binary = snexpr_init();
-		binary.type = op;
-		if(op == SNE_OP_ASSIGN && a.type != SNE_OP_VAR) {
-			return -1; /* Bad assignment */
+		b = (struct snexpr_sblock *)snexpr_malloc(sizeof(struct snexpr_sblock) + sz);
+		if(b == NULL) {
+			return NULL;
 		}
-		sne_vec_push(&binary.param.op.args, a);
-		sne_vec_push(&binary.param.op.args, b);
-		sne_vec_push(es, binary);
+		b->size = sz;
+		b->used = 0;
+		b->next = sc->sblock;
+		sc->sblock = b;
 	}
-	return 0;
+	p = snexpr_sblock_data(b) + b->used;
+	b->used += len;
+	return p;
 }
 
-static struct snexpr snexpr_constnum(float value)
+/* give back the unused tail of the last allocation */
+static inline void snexpr_scratch_trim(
+		struct snexpr_scratch *sc, char *p, size_t len)
 {
-	struct snexpr e = snexpr_init();
-	e.type = SNE_OP_CONSTNUM;
-	e.param.num.nval = value;
-	return e;
+	struct snexpr_sblock *b = sc->sblock;
+	if(b != NULL && p >= snexpr_sblock_data(b)
+			&& p < snexpr_sblock_data(b) + b->used) {
+		b->used = (p - snexpr_sblock_data(b)) + len;
+	}
 }
 
-static struct snexpr snexpr_varref(struct snexpr_var *v)
+/* drop the strings of the previous evaluation, keeping one large block */
+static inline void snexpr_scratch_reset(struct snexpr_scratch *sc)
 {
-	struct snexpr e = snexpr_init();
-	e.type = SNE_OP_VAR;
-	e.param.var.vref = v;
-	return e;
-}
+	struct snexpr_sblock *b;
+	size_t sz = 0;
 
-static struct snexpr snexpr_conststr(const char *value, int len)
-{
-	struct snexpr e = snexpr_init();
-	char *p;
+	if(sc->sblock == NULL) {
+		return;
+	}
+	if(sc->sblock->next == NULL) {
+		sc->sblock->used = 0;
+		return;
+	}
+	while(sc->sblock != NULL) {
+		b = sc->sblock;
+		sc->sblock = b->next;
+		sz += b->size;
+		snexpr_free(b);
+	}
+	b = (struct snexpr_sblock *)snexpr_malloc(sizeof(struct snexpr_sblock) + sz);
+	if(b != NULL) {
+		b->size = sz;
+		b->used = 0;
+		b->next = NULL;
+		sc->sblock = b;
+	}
+}
+
+static void snexpr_match_free(struct snexpr_match *m);
+
+static inline void snexpr_scratch_free(struct snexpr_scratch *sc)
+{
+	struct snexpr_sblock *b;
 	int i;
-	int bsf = 0;
-	if(len < 2) {
-		len = 0;
-	} else {
-		/* skip the quotes */
-		len -= 2;
+
+	if(sc == NULL) {
+		return;
 	}
-	e.type = SNE_OP_CONSTSTZ;
-	e.param.stz.sval = malloc(len + 1);
-	if(e.param.stz.sval) {
-		if(len > 0) {
-			/* do not copy the quotes - start from value[1] */
-			p = e.param.stz.sval;
-			for(i=0; i<len; i++) {
-				if(bsf==0 && value[i+1]=='\\') {
-					bsf = 1;
-				} else if(bsf==1) {
-					bsf = 0;
-					switch(value[i+1]) {
-						case 'n':
-							*p = '\n';
-						break;
-						case 'r':
-							*p = '\r';
-						break;
-						case 't':
-							*p = '\t';
-						break;
-						default:
-							*p = value[i+1];
-					}
-					p++;
-				} else {
-					bsf = 0;
-					*p = value[i+1];
-					p++;
-				}
-			}
-			*p = '\0';
-		} else {
-			e.param.stz.sval[0] = '\0';
-		}
+	for(i = 0; i < SNEXPR_MATCH_CACHE; i++) {
+		snexpr_match_free(sc->mcache[i]);
 	}
-	return e;
+	while(sc->sblock != NULL) {
+		b = sc->sblock;
+		sc->sblock = b->next;
+		snexpr_free(b);
+	}
+	if(sc->vstk != NULL) {
+		snexpr_free(sc->vstk);
+	}
+	if(sc->hstk != NULL) {
+		snexpr_free(sc->hstk);
+	}
+	if(sc->est.fstk != NULL) {
+		snexpr_free(sc->est.fstk);
+	}
+	if(sc->est.vstk != NULL) {
+		snexpr_free(sc->est.vstk);
+	}
+	memset(sc, 0, sizeof(struct snexpr_scratch));
 }
 
-static struct snexpr snexpr_binary(
-		enum snexpr_type type, struct snexpr a, struct snexpr b)
+static inline void snexpr_ctx_free(struct snexpr_ctx *ctx)
 {
-	struct snexpr e = snexpr_init();
-	e.type = type;
-	sne_vec_push(&e.param.op.args, a);
-	sne_vec_push(&e.param.op.args, b);
-	return e;
+	if(ctx != NULL) {
+		snexpr_scratch_free(&ctx->scratch);
+	}
 }
 
-static inline void snexpr_copy(struct snexpr *dst, struct snexpr *src)
+/*
+ * Operations on the values used by the evaluators - a value is a struct
+ * snexpr of type SNE_OP_CONSTNUM or SNE_OP_CONSTSTZ, owning the string only
+ * when SNEXPR_VALALLOC is set. The new strings are allocated in the scratch
+ * area when one is given, otherwise with SNEXPR_MALLOC().
+ */
+static inline void snexpr_val_release(struct snexpr *v)
 {
-	int i;
-	struct snexpr arg;
-	dst->type = src->type;
-	if(src->type == SNE_OP_FUNC) {
-		dst->param.func.f = src->param.func.f;
-		sne_vec_foreach(&src->param.func.args, arg, i)
-		{
-			struct snexpr tmp = snexpr_init();
-			snexpr_copy(&tmp, &arg);
-			sne_vec_push(&dst->param.func.args, tmp);
+	if((v->eflags & SNEXPR_VALALLOC) && (v->type == SNE_OP_CONSTSTZ)
+			&& (v->param.stz.sval != NULL)) {
+		snexpr_free(v->param.stz.sval);
+	}
+	v->eflags = 0;
+}
+
+/* copy a value, the string stays in the inline buffer of the copy */
+static inline void snexpr_val_move(struct snexpr *dst, struct snexpr *src)
+{
+	*dst = *src;
+	if((dst->eflags & SNEXPR_VALSSO) && dst->type == SNE_OP_CONSTSTZ) {
+		dst->param.stz.sval = dst->param.stz.sbuf;
+	}
+}
+
+static inline void snexpr_val_setnum(struct snexpr *v, snexpr_num_t n)
+{
+	v->type = SNE_OP_CONSTNUM;
+	v->eflags = 0;
+	v->param.num.nval = n;
+}
+
+static inline char *snexpr_val_stzbuf(
+		struct snexpr_scratch *sc, struct snexpr *v, size_t len)
+{
+	char *p;
+	if(sc != NULL) {
+		p = snexpr_scratch_alloc(sc, len);
+		v->eflags = 0;
+	} else if(len <= SNEXPR_SSO_SIZE) {
+		p = v->param.stz.sbuf;
+		v->eflags = SNEXPR_VALSSO;
+	} else {
+		p = (char *)snexpr_malloc(len);
+		v->eflags = SNEXPR_VALALLOC;
+	}
+	v->type = SNE_OP_CONSTSTZ;
+	v->param.stz.sval = p;
+	v->param.stz.slen = 0;
+	return p;
+}
+
+static inline int snexpr_val_setstz(
+		struct snexpr_scratch *sc, struct snexpr *v, char *s, size_t len)
+{
+	char *p;
+	if(s == NULL) {
+		return -1;
+	}
+	p = snexpr_val_stzbuf(sc, v, len + 1);
+	if(p == NULL) {
+		v->eflags = 0;
+		return -1;
+	}
+	memcpy(p, s, len);
+	p[len] = '\0';
+	v->param.stz.slen = len;
+	return 0;
+}
+
+/* move the content of a result returned by a callback into a value */
+static inline int snexpr_val_take(struct snexpr *v, struct snexpr *r)
+{
+	if(r == NULL) {
+		return -1;
+	}
+	if(r->type == SNE_OP_CONSTSTZ) {
+		v->type = SNE_OP_CONSTSTZ;
+		v->eflags = r->eflags & (SNEXPR_VALALLOC | SNEXPR_VALSSO | SNEXPR_VALBORROW);
+		v->param.stz.sval = r->param.stz.sval;
+		v->param.stz.slen = r->param.stz.slen;
+		if(v->eflags & SNEXPR_VALSSO) {
+			memcpy(v->param.stz.sbuf, r->param.stz.sbuf, SNEXPR_SSO_SIZE);
+			v->param.stz.sval = v->param.stz.sbuf;
 		}
-		if(src->param.func.f->ctxsz > 0) {
-			dst->param.func.context = calloc(1, src->param.func.f->ctxsz);
+		if(v->param.stz.sval != NULL) {
+			snexpr_stz_len(v);
 		}
-	} else if(src->type == SNE_OP_CONSTNUM) {
-		dst->param.num.nval = src->param.num.nval;
-	} else if(src->type == SNE_OP_VAR) {
-		dst->param.var.vref = src->param.var.vref;
 	} else {
-		sne_vec_foreach(&src->param.op.args, arg, i)
-		{
-			struct snexpr tmp = snexpr_init();
-			snexpr_copy(&tmp, &arg);
-			sne_vec_push(&dst->param.op.args, tmp);
-		}
+		snexpr_val_setnum(v, r->param.num.nval);
 	}
+	if(r->eflags & SNEXPR_EXPALLOC) {
+		snexpr_free(r);
+	}
+	return (v->type == SNE_OP_CONSTSTZ && v->param.stz.sval == NULL) ? -1 : 0;
 }
 
-static void snexpr_destroy_args(struct snexpr *e);
-
-static struct snexpr *snexpr_create(const char *s, size_t len,
-		struct snexpr_var_list *vars, struct snexpr_func *funcs,
-		snexternval_cbf_t evcbf)
+static inline int snexpr_val_tostz(struct snexpr_scratch *sc, struct snexpr *v)
 {
-	float num;
-	struct snexpr_var *v;
-	const char *id = NULL;
-	size_t idn = 0;
+	char buf[SNEXPR_NUMSTZ_SIZE];
+	int ret;
 
-	struct snexpr *result = NULL;
+	if(v->type == SNE_OP_CONSTSTZ) {
+		return (v->param.stz.sval == NULL) ? -1 : 0;
+	}
+	ret = snexpr_format_numb(buf, SNEXPR_NUMSTZ_SIZE, v->param.num.nval);
+	if(ret < 0) {
+		return -1;
+	}
+	if(snexpr_val_setstz(sc, v, buf, ret) < 0) {
+		snexpr_val_setnum(v, 0);
+		return -1;
+	}
+	return 0;
+}
 
-	_snexternval_cbf = evcbf;
+static inline void snexpr_val_tonum(struct snexpr *v)
+{
+	snexpr_num_t n;
+	if(v->type != SNE_OP_CONSTSTZ) {
+		return;
+	}
+	n = snexpr_parse_number(v->param.stz.sval, v->param.stz.slen);
+	snexpr_val_release(v);
+	snexpr_val_setnum(v, n);
+}
 
-	sne_vec_expr_t es = sne_vec_init();
-	sne_vec_str_t os = sne_vec_init();
-	sne_vec_arg_t as = sne_vec_init();
+/*
+ * Numeric value of a result as used by the logical operators: numbers are
+ * taken as they are, strings are true (1) when not empty
+ */
+static inline snexpr_num_t snexpr_val_num(struct snexpr *v)
+{
+	if(v->type == SNE_OP_CONSTSTZ) {
+		if(v->eflags & SNEXPR_VALBORROW) {
+			return (v->param.stz.slen > 0) ? 1 : 0;
+		}
+		return (v->param.stz.sval != NULL && v->param.stz.sval[0] != '\0') ? 1
+																			: 0;
+	}
+	return v->param.num.nval;
+}
 
-	struct macro
-	{
-		char *name;
-		sne_vec_expr_t body;
-	};
-	sne_vec(struct macro) macros = sne_vec_init();
+/*
+ * Set the value v of the literal lit to the other representation of lit,
+ * computed by snexpr_optimize() - used for the right operand when it has
+ * to be converted to the type of the left one
+ */
+static inline void snexpr_val_dual(struct snexpr *v, struct snexpr *lit)
+{
+	if(lit->type == SNE_OP_CONSTNUM && (lit->eflags & SNEXPR_DUALSTZ)) {
+		v->type = SNE_OP_CONSTSTZ;
+		v->eflags = 0;
+		v->param.stz.sval = lit->param.num.dsbuf;
+		v->param.stz.slen = lit->param.num.dslen;
+	} else if(lit->type == SNE_OP_CONSTSTZ && (lit->eflags & SNEXPR_DUALNUM)) {
+		snexpr_val_setnum(v, lit->param.stz.dnval);
+	}
+}
 
-	int flags = SNEXPR_TDEFAULT;
-	int paren = SNEXPR_PAREN_ALLOWED;
-	for(;;) {
-		int n = snexpr_next_token(s, len, &flags);
-		if(n == 0) {
-			break;
-		} else if(n < 0) {
-			goto cleanup;
+/* a = a + b (string concatenation or addition), b is released */
+static inline int snexpr_val_plus(
+		struct snexpr_scratch *sc, struct snexpr *a, struct snexpr *b)
+{
+	struct snexpr r;
+	size_t l0, l1;
+	char *p;
+
+	if(a->type == SNE_OP_CONSTSTZ) {
+		if(snexpr_val_tostz(sc, b) < 0) {
+			return -1;
 		}
-		const char *tok = s;
-		s = s + n;
-		len = len - n;
-		if(*tok == '#') {
-			continue;
+		l0 = a->param.stz.slen;
+		l1 = b->param.stz.slen;
+		p = snexpr_val_stzbuf(sc, &r, l0 + l1 + 1);
+		if(p == NULL) {
+			return -1;
 		}
-		if(flags & SNEXPR_UNARY) {
-			if(n == 1) {
-				switch(*tok) {
-					case '-':
-						tok = "-u";
-						break;
-					case '^':
-						tok = "^u";
-						break;
-					case '!':
-						tok = "!u";
-						break;
-					default:
-						goto cleanup;
-				}
-				n = 2;
-			}
+		memcpy(p, a->param.stz.sval, l0);
+		memcpy(p + l0, b->param.stz.sval, l1);
+		p[l0 + l1] = '\0';
+		r.param.stz.slen = l0 + l1;
+		snexpr_val_release(a);
+		snexpr_val_release(b);
+		snexpr_val_move(a, &r);
+		return 0;
+	}
+	snexpr_val_tonum(b);
+	a->param.num.nval = snexpr_num_add(a->param.num.nval, b->param.num.nval);
+	snexpr_val_release(b);
+	return 0;
+}
+
+static inline int snexpr_cmp_num(
+		enum snexpr_type op, snexpr_num_t n0, snexpr_num_t n1)
+{
+	switch(op) {
+		case SNE_OP_LT:
+			return (n0 < n1);
+		case SNE_OP_LE:
+			return (n0 <= n1);
+		case SNE_OP_GT:
+			return (n0 > n1);
+		case SNE_OP_GE:
+			return (n0 >= n1);
+		case SNE_OP_EQ:
+			return (n0 == n1);
+		default:
+			return (n0 != n1);
+	}
+}
+
+/*
+ * vals[0] = vals[0] + vals[1] + ... + vals[k - 1], with the same result as
+ * adding them one by one, but the strings are copied once in a buffer of
+ * the size of the result. The values after the first one are released, the
+ * first one is released by the caller on error.
+ */
+static inline int snexpr_val_concat(
+		struct snexpr_scratch *sc, struct snexpr *vals, int k)
+{
+	struct snexpr r;
+	size_t len = 0;
+	char *p;
+	int ret = 0;
+	int i;
+
+	if(vals[0].type != SNE_OP_CONSTSTZ) {
+		for(i = 1; i < k; i++) {
+			snexpr_val_tonum(&vals[i]);
+			vals[0].param.num.nval = snexpr_num_add(
+					vals[0].param.num.nval, vals[i].param.num.nval);
 		}
-		if(*tok == '\n' && (flags & SNEXPR_COMMA)) {
-			flags = flags & (~SNEXPR_COMMA);
-			n = 1;
-			tok = ",";
+		return 0;
+	}
+	for(i = 0; i < k; i++) {
+		if(snexpr_val_tostz(sc, &vals[i]) < 0) {
+			ret = -1;
+			break;
 		}
-		if(isspace(*tok)) {
-			continue;
+		len += vals[i].param.stz.slen;
+	}
+	if(ret == 0) {
+		p = snexpr_val_stzbuf(sc, &r, len + 1);
+		if(p == NULL) {
+			ret = -1;
+		} else {
+			for(i = 0; i < k; i++) {
+				memcpy(p, vals[i].param.stz.sval, vals[i].param.stz.slen);
+				p += vals[i].param.stz.slen;
+			}
+			*p = '\0';
+			r.param.stz.slen = len;
 		}
-		int paren_next = SNEXPR_PAREN_ALLOWED;
+	}
+	for(i = 1; i < k; i++) {
+		snexpr_val_release(&vals[i]);
+	}
+	if(ret == 0) {
+		snexpr_val_release(&vals[0]);
+		snexpr_val_move(&vals[0], &r);
+	}
+	return ret;
+}
 
-		if(idn > 0) {
-			if(n == 1 && *tok == '(') {
-				int i;
-				int has_macro = 0;
-				struct macro m;
-				sne_vec_foreach(&macros, m, i)
-				{
-					if(strlen(m.name) == idn && strncmp(m.name, id, idn) == 0) {
-						has_macro = 1;
-						break;
-					}
-				}
-				if((idn == 1 && id[0] == '$') || has_macro
-						|| snexpr_func_find(funcs, id, idn) != NULL) {
-					struct snexpr_string str = {id, (int)idn};
-					sne_vec_push(&os, str);
-					paren = SNEXPR_PAREN_EXPECTED;
-				} else {
-					goto cleanup; /* invalid function name */
-				}
-			} else if((v = snexpr_var_find(vars, id, idn)) != NULL) {
-				sne_vec_push(&es, snexpr_varref(v));
-				paren = SNEXPR_PAREN_FORBIDDEN;
-			}
-			id = NULL;
-			idn = 0;
+/* number of operands of a chain a + b + c ..., 0 when it is not a chain */
+static inline int snexpr_concat_len(struct snexpr *e)
+{
+	int k = 1;
+
+	if(e->type != SNE_OP_PLUS || (e->eflags & SNEXPR_OPNUM)
+			|| e->param.op.args.buf[0].type != SNE_OP_PLUS
+			|| (e->param.op.args.buf[0].eflags & SNEXPR_OPNUM)) {
+		return 0;
+	}
+	for(; e->type == SNE_OP_PLUS && !(e->eflags & SNEXPR_OPNUM);
+			e = &e->param.op.args.buf[0]) {
+		k++;
+	}
+	return k;
+}
+
+/* compare two strings by their lengths, with the sign like strcmp() */
+static inline int snexpr_stz_cmp(struct snexpr *a, struct snexpr *b)
+{
+	size_t l0 = a->param.stz.slen;
+	size_t l1 = b->param.stz.slen;
+	int r;
+
+	r = memcmp(a->param.stz.sval, b->param.stz.sval, (l0 < l1) ? l0 : l1);
+	if(r != 0) {
+		return r;
+	}
+	return (l0 < l1) ? -1 : (l0 > l1);
+}
+
+/* a = a <op> b for the comparison operators, b is released */
+static inline int snexpr_val_cmp(struct snexpr_scratch *sc, enum snexpr_type op,
+		struct snexpr *a, struct snexpr *b)
+{
+	int r = 0;
+
+	if(a->type == SNE_OP_CONSTSTZ) {
+		if(snexpr_val_tostz(sc, b) < 0) {
+			return -1;
 		}
+		/* the sign of the string comparison is compared with 0 */
+		r = snexpr_cmp_num(op, snexpr_stz_cmp(a, b), 0);
+	} else {
+		snexpr_val_tonum(b);
+		r = snexpr_cmp_num(op, a->param.num.nval, b->param.num.nval);
+	}
+	snexpr_val_release(a);
+	snexpr_val_release(b);
+	snexpr_val_setnum(a, r);
+	return 0;
+}
 
-		if(n == 1 && *tok == '(') {
-			if(paren == SNEXPR_PAREN_EXPECTED) {
-				struct snexpr_string str = {"{", 1};
-				sne_vec_push(&os, str);
-				struct snexpr_arg arg = {sne_vec_len(&os), sne_vec_len(&es), sne_vec_init()};
-				sne_vec_push(&as, arg);
-			} else if(paren == SNEXPR_PAREN_ALLOWED) {
-				struct snexpr_string str = {"(", 1};
-				sne_vec_push(&os, str);
-			} else {
-				goto cleanup; // Bad call
-			}
-		} else if(paren == SNEXPR_PAREN_EXPECTED) {
-			goto cleanup; // Bad call
-		} else if(n == 1 && *tok == ')') {
-			int minlen = (sne_vec_len(&as) > 0 ? sne_vec_peek(&as).oslen : 0);
-			while(sne_vec_len(&os) > minlen && *sne_vec_peek(&os).s != '('
-					&& *sne_vec_peek(&os).s != '{') {
-				struct snexpr_string str = sne_vec_pop(&os);
-				if(snexpr_bind(str.s, str.n, &es) == -1) {
-					goto cleanup;
-				}
-			}
-			if(sne_vec_len(&os) == 0) {
-				goto cleanup; // Bad parens
-			}
-			struct snexpr_string str = sne_vec_pop(&os);
-			if(str.n == 1 && *str.s == '{') {
-				str = sne_vec_pop(&os);
-				struct snexpr_arg arg = sne_vec_pop(&as);
-				if(sne_vec_len(&es) > arg.eslen) {
-					sne_vec_push(&arg.args, sne_vec_pop(&es));
-				}
-				if(str.n == 1 && str.s[0] == '$') {
-					if(sne_vec_len(&arg.args) < 1) {
-						sne_vec_free(&arg.args);
-						goto cleanup; /* too few arguments for $() function */
-					}
-					struct snexpr *u = &sne_vec_nth(&arg.args, 0);
-					if(u->type != SNE_OP_VAR) {
-						sne_vec_free(&arg.args);
-						goto cleanup; /* first argument is not a variable */
-					}
-					struct snexpr_var *v;
-					for(v = vars->head; v; v = v->next) {
-						if(v == u->param.var.vref) {
-							struct macro m = {v->name, arg.args};
-							sne_vec_push(&macros, m);
-							break;
-						}
-					}
-					sne_vec_push(&es, snexpr_constnum(0));
-				} else {
-					int i = 0;
-					int found = -1;
-					struct macro m;
-					sne_vec_foreach(&macros, m, i)
-					{
-						if(strlen(m.name) == (size_t)str.n
-								&& strncmp(m.name, str.s, str.n) == 0) {
-							found = i;
-						}
-					}
-					if(found != -1) {
-						m = sne_vec_nth(&macros, found);
-						struct snexpr root = snexpr_constnum(0);
-						struct snexpr *p = &root;
-						int j;
-						/* Assign macro parameters */
-						for(j = 0; j < sne_vec_len(&arg.args); j++) {
-							char varname[4];
-							snprintf(varname, sizeof(varname) - 1, "$%d",
-									(j + 1));
-							struct snexpr_var *v =
-									snexpr_var_find(vars, varname, strlen(varname));
-							struct snexpr ev = snexpr_varref(v);
-							struct snexpr assign = snexpr_binary(
-									SNE_OP_ASSIGN, ev, sne_vec_nth(&arg.args, j));
-							*p = snexpr_binary(
-									SNE_OP_COMMA, assign, snexpr_constnum(0));
-							p = &sne_vec_nth(&p->param.op.args, 1);
-						}
-						/* Expand macro body */
-						for(j = 1; j < sne_vec_len(&m.body); j++) {
-							if(j < sne_vec_len(&m.body) - 1) {
-								*p = snexpr_binary(SNE_OP_COMMA, snexpr_constnum(0),
-										snexpr_constnum(0));
-								snexpr_copy(&sne_vec_nth(&p->param.op.args, 0),
-										&sne_vec_nth(&m.body, j));
-							} else {
-								snexpr_copy(p, &sne_vec_nth(&m.body, j));
-							}
-							p = &sne_vec_nth(&p->param.op.args, 1);
-						}
-						sne_vec_push(&es, root);
-						sne_vec_free(&arg.args);
-					} else {
-						struct snexpr_func *f = snexpr_func_find(funcs, str.s, str.n);
-						struct snexpr bound_func = snexpr_init();
-						bound_func.type = SNE_OP_FUNC;
-						bound_func.param.func.f = f;
-						bound_func.param.func.args = arg.args;
-						if(f->ctxsz > 0) {
-							void *p = calloc(1, f->ctxsz);
-							if(p == NULL) {
-								goto cleanup; /* allocation failed */
-							}
-							bound_func.param.func.context = p;
-						}
-						sne_vec_push(&es, bound_func);
-					}
-				}
-			}
-			paren_next = SNEXPR_PAREN_FORBIDDEN;
-		} else if(!isnan(num = snexpr_parse_number(tok, n))) {
-			sne_vec_push(&es, snexpr_constnum(num));
-			paren_next = SNEXPR_PAREN_FORBIDDEN;
-		} else if(*tok == '"' || *tok == '\'') {
-			sne_vec_push(&es, snexpr_conststr(tok, n));
-			paren_next = SNEXPR_PAREN_FORBIDDEN;
-		} else if(snexpr_op(tok, n, -1) != SNE_OP_UNKNOWN) {
-			enum snexpr_type op = snexpr_op(tok, n, -1);
-			struct snexpr_string o2 = {NULL, 0};
-			if(sne_vec_len(&os) > 0) {
-				o2 = sne_vec_peek(&os);
+/*
+ * Patterns of the match operators - POSIX extended regular expressions,
+ * compiled once for the node when the pattern is a literal. The other ones
+ * are kept in the scratch area of the context, the node being shared by the
+ * threads, or compiled for each evaluation without a context. The patterns
+ * made only of text, optionally anchored with '^' and '$', are matched with
+ * memcmp() without the regex engine, the only ones supported when building
+ * with SNEXPR_NO_REGEX.
+ */
+#define SNEXPR_MATCH_META ".[]()*+?{}|^$\\"
+
+#define snexpr_is_match(op) ((op) == SNE_OP_MATCH || (op) == SNE_OP_NMATCH)
+
+enum snexpr_mkind
+{
+	SNE_MK_SUBSTR,
+	SNE_MK_PREFIX,
+	SNE_MK_SUFFIX,
+	SNE_MK_EXACT,
+	SNE_MK_REGEX,
+};
+
+struct snexpr_match
+{
+	enum snexpr_mkind kind;
+	char *src; /* the pattern */
+	size_t slen;
+	char *lit; /* the text to match for the kinds without regex */
+	size_t llen;
+#ifndef SNEXPR_NO_REGEX
+	regex_t re;
+#endif
+};
+
+/* kind of the pattern, setting its text when it does not need the regex */
+static enum snexpr_mkind snexpr_match_kind(struct snexpr_match *m)
+{
+	const char *s = m->src;
+	size_t n = m->slen;
+	char *p = m->lit;
+	int first = 0;
+	int last = 0;
+	size_t i;
+
+	if(n > 0 && s[0] == '^') {
+		first = 1;
+		s++;
+		n--;
+	}
+	for(i = 0; i < n; i++) {
+		if(s[i] == '\\') {
+			/* an escaped special char stays text */
+			if(i + 1 == n
+					|| memchr(SNEXPR_MATCH_META, s[i + 1],
+							   sizeof(SNEXPR_MATCH_META) - 1)
+							   == NULL) {
+				return SNE_MK_REGEX;
 			}
-			for(;;) {
-				if(n == 1 && *tok == ',' && sne_vec_len(&os) > 0) {
-					struct snexpr_string str = sne_vec_peek(&os);
-					if(str.n == 1 && *str.s == '{') {
-						struct snexpr e = sne_vec_pop(&es);
-						sne_vec_push(&sne_vec_peek(&as).args, e);
-						break;
-					}
-				}
-				enum snexpr_type type2 = snexpr_op(o2.s, o2.n, -1);
-				if(!(type2 != SNE_OP_UNKNOWN && snexpr_prec(op, type2))) {
-					struct snexpr_string str = {tok, n};
-					sne_vec_push(&os, str);
-					break;
-				}
+			*p++ = s[++i];
+		} else if(s[i] == '$' && i == n - 1) {
+			last = 1;
+		} else if(memchr(SNEXPR_MATCH_META, s[i], sizeof(SNEXPR_MATCH_META) - 1)
+				  != NULL) {
+			return SNE_MK_REGEX;
+		} else {
+			*p++ = s[i];
+		}
+	}
+	m->llen = p - m->lit;
+	if(first) {
+		return last ? SNE_MK_EXACT : SNE_MK_PREFIX;
+	}
+	return last ? SNE_MK_SUFFIX : SNE_MK_SUBSTR;
+}
 
-				if(snexpr_bind(o2.s, o2.n, &es) == -1) {
-					goto cleanup;
-				}
-				(void)sne_vec_pop(&os);
-				if(sne_vec_len(&os) > 0) {
-					o2 = sne_vec_peek(&os);
-				} else {
-					o2.n = 0;
+static void snexpr_match_free(struct snexpr_match *m)
+{
+	if(m == NULL) {
+		return;
+	}
+#ifndef SNEXPR_NO_REGEX
+	if(m->kind == SNE_MK_REGEX) {
+		regfree(&m->re);
+	}
+#endif
+	snexpr_free(m);
+}
+
+/* compile the pattern s of len chars - return NULL if it is not valid */
+static struct snexpr_match *snexpr_match_new(const char *s, size_t len)
+{
+	struct snexpr_match *m;
+
+	m = (struct snexpr_match *)snexpr_malloc(
+			sizeof(struct snexpr_match) + 2 * (len + 1));
+	if(m == NULL) {
+		return NULL;
+	}
+	m->src = (char *)(m + 1);
+	memcpy(m->src, s, len);
+	m->src[len] = '\0';
+	m->slen = len;
+	m->lit = m->src + len + 1;
+	m->llen = 0;
+	m->kind = snexpr_match_kind(m);
+	if(m->kind != SNE_MK_REGEX) {
+		return m;
+	}
+#ifndef SNEXPR_NO_REGEX
+	if(memchr(s, '\0', len) == NULL
+			&& regcomp(&m->re, m->src, REG_EXTENDED | REG_NOSUB) == 0) {
+		return m;
+	}
+#endif
+	snexpr_free(m);
+	return NULL;
+}
+
+/* if the string s of n chars matches, it ends with '\0' for a regex */
+static int snexpr_match_test(struct snexpr_match *m, const char *s, size_t n)
+{
+	size_t i;
+
+	switch(m->kind) {
+		case SNE_MK_EXACT:
+			return n == m->llen && memcmp(s, m->lit, n) == 0;
+		case SNE_MK_PREFIX:
+			return n >= m->llen && memcmp(s, m->lit, m->llen) == 0;
+		case SNE_MK_SUFFIX:
+			return n >= m->llen && memcmp(s + n - m->llen, m->lit, m->llen) == 0;
+		case SNE_MK_SUBSTR:
+			for(i = 0; i + m->llen <= n; i++) {
+				if(memcmp(s + i, m->lit, m->llen) == 0) {
+					return 1;
 				}
 			}
+			return 0;
+		default:
+#ifndef SNEXPR_NO_REGEX
+			return regexec(&m->re, s, 0, NULL, 0) == 0;
+#else
+			return 0;
+#endif
+	}
+}
+
+static inline int snexpr_result_unborrow(
+		struct snexpr_scratch *sc, struct snexpr *res);
+
+/*
+ * The pattern s of len chars from the cache of the scratch area, compiled
+ * in place of the oldest one when it is not there - NULL if not valid
+ */
+static struct snexpr_match *snexpr_scratch_match(
+		struct snexpr_scratch *sc, const char *s, size_t len)
+{
+	struct snexpr_match *m;
+	int i;
+
+	for(i = 0; i < SNEXPR_MATCH_CACHE; i++) {
+		m = sc->mcache[i];
+		if(m != NULL && m->slen == len && memcmp(m->src, s, len) == 0) {
+			return m;
+		}
+	}
+	m = snexpr_match_new(s, len);
+	if(m == NULL) {
+		return NULL;
+	}
+	i = sc->mnext;
+	sc->mnext = (i + 1) % SNEXPR_MATCH_CACHE;
+	snexpr_match_free(sc->mcache[i]);
+	sc->mcache[i] = m;
+	return m;
+}
+
+/*
+ * a = a =~ b (or !~), b is released - nm is the pattern compiled for the
+ * node, not changed since the node can be evaluated by many threads
+ */
+static inline int snexpr_val_match(struct snexpr_scratch *sc,
+		enum snexpr_type op, struct snexpr_match *nm, struct snexpr *a,
+		struct snexpr *b)
+{
+	struct snexpr_match *m = nm;
+	struct snexpr_match *t = NULL;
+	int r;
+
+	if(snexpr_val_tostz(sc, a) < 0 || snexpr_val_tostz(sc, b) < 0) {
+		return -1;
+	}
+	if(m == NULL || m->slen != b->param.stz.slen
+			|| memcmp(m->src, b->param.stz.sval, m->slen) != 0) {
+		if(sc != NULL) {
+			m = snexpr_scratch_match(sc, b->param.stz.sval, b->param.stz.slen);
 		} else {
-			if(n > 0 && !isdigit(*tok)) {
-				/* Valid identifier, a variable or a function */
-				id = tok;
-				idn = n;
-			} else {
-				goto cleanup; // Bad variable name, e.g. '2.3.4' or '4ever'
+			m = t = snexpr_match_new(b->param.stz.sval, b->param.stz.slen);
+		}
+		if(m == NULL) {
+			return -1;
+		}
+	}
+	if(m->kind == SNE_MK_REGEX && snexpr_result_unborrow(sc, a) < 0) {
+		snexpr_match_free(t);
+		return -1;
+	}
+	r = snexpr_match_test(m, a->param.stz.sval, a->param.stz.slen);
+	snexpr_match_free(t);
+	snexpr_val_release(a);
+	snexpr_val_release(b);
+	snexpr_val_setnum(a, (op == SNE_OP_MATCH) ? r : !r);
+	return 0;
+}
+
+/*
+ * Sets of the operator in - the literals of its list are the keys of two
+ * open addressing hash tables built once for the node, one with their
+ * numbers and one with their strings, the table being chosen by the type
+ * of the left operand, with the conversions done by ==. The set is a
+ * single block without pointers, copied as it is, also in the images.
+ */
+#define SNEXPR_SET_MAX (1u << 20) /* members of a set */
+#define SNEXPR_SET_CHAIN 4 /* x == l1 || ... made a set by snexpr_optimize() */
+
+struct snexpr_nslot
+{
+	snexpr_num_t v;
+	uint32_t used;
+};
+
+struct snexpr_sslot
+{
+	uint32_t hash;
+	uint32_t len;
+	uint32_t off; /* of the string in the block, 0 for an empty slot */
+};
+
+struct snexpr_set
+{
+	uint32_t size; /* of the block */
+	uint32_t mask; /* of the tables, their size is a power of two */
+	uint32_t nnums;
+	uint32_t nstrs;
+};
+
+#define snexpr_set_nslots(s) \
+	((struct snexpr_nslot *)((char *)(s) + sizeof(struct snexpr_set)))
+#define snexpr_set_sslots(s) \
+	((struct snexpr_sslot *)(snexpr_set_nslots(s) + (s)->mask + 1))
+#define snexpr_set_base(tsize)                                       \
+	(sizeof(struct snexpr_set)                                       \
+			+ (tsize)                                                \
+					  * (sizeof(struct snexpr_nslot)                 \
+							  + sizeof(struct snexpr_sslot)))
+
+/* slot of the number, or the empty one where it goes */
+static uint32_t snexpr_set_nfind(struct snexpr_set *s, snexpr_num_t v)
+{
+	struct snexpr_nslot *t = snexpr_set_nslots(s);
+	uint32_t i;
+
+	if(v == 0) {
+		v = 0; /* -0 has the hash of 0 */
+	}
+	i = snexpr_var_hash((const char *)&v, sizeof(snexpr_num_t)) & s->mask;
+	for(; t[i].used && t[i].v != v; i = (i + 1) & s->mask)
+		;
+	return i;
+}
+
+/* slot of the string, or the empty one where it goes */
+static uint32_t snexpr_set_sfind(
+		struct snexpr_set *s, const char *p, uint32_t len, uint32_t h)
+{
+	struct snexpr_sslot *t = snexpr_set_sslots(s);
+	uint32_t i;
+
+	for(i = h & s->mask; t[i].off != 0; i = (i + 1) & s->mask) {
+		if(t[i].hash == h && t[i].len == len
+				&& (len == 0 || memcmp((char *)s + t[i].off, p, len) == 0)) {
+			break;
+		}
+	}
+	return i;
+}
+
+static void snexpr_set_addnum(struct snexpr_set *s, snexpr_num_t v)
+{
+	struct snexpr_nslot *t = snexpr_set_nslots(s);
+	uint32_t i;
+
+	if(snexpr_num_isnan(v)) {
+		return; /* not equal to any value */
+	}
+	i = snexpr_set_nfind(s, v);
+	if(!t[i].used) {
+		t[i].v = v;
+		t[i].used = 1;
+		s->nnums++;
+	}
+}
+
+static void snexpr_set_addstz(struct snexpr_set *s, const char *p, size_t len)
+{
+	struct snexpr_sslot *t = snexpr_set_sslots(s);
+	uint32_t h = snexpr_var_hash(p, len);
+	uint32_t i;
+
+	i = snexpr_set_sfind(s, p, (uint32_t)len, h);
+	if(t[i].off == 0) {
+		t[i].hash = h;
+		t[i].len = (uint32_t)len;
+		t[i].off = s->size;
+		memcpy((char *)s + s->size, p, len);
+		s->size += (uint32_t)len;
+		s->nstrs++;
+	}
+}
+
+/*
+ * The members of the list, a chain of commas, or of the chain of || with
+ * v == literal when v is given - NULL if one is not a literal, if there
+ * are less than min, or on error
+ */
+static struct snexpr_set *snexpr_set_new(
+		struct snexpr *list, struct snexpr_var *v, int min)
+{
+	sne_vec(struct snexpr *) stk = sne_vec_init();
+	sne_vec(struct snexpr *) items = sne_vec_init();
+	char buf[SNEXPR_NUMSTZ_SIZE];
+	struct snexpr_set *s = NULL;
+	struct snexpr_set *r;
+	struct snexpr *e;
+	snexpr_num_t n;
+	size_t psize = 0;
+	size_t tsize = 8;
+	int ret;
+	int i;
+
+	/* the members in order, from the chain */
+	if(sne_vec_push(&stk, list) < 0) {
+		goto done;
+	}
+	while(sne_vec_len(&stk) > 0) {
+		e = sne_vec_pop(&stk);
+		if(e->type == ((v == NULL) ? SNE_OP_COMMA : SNE_OP_LOGICAL_OR)) {
+			if(sne_vec_push(&stk, &e->param.op.args.buf[1]) < 0
+					|| sne_vec_push(&stk, &e->param.op.args.buf[0]) < 0) {
+				goto done;
 			}
+			continue;
+		}
+		if(v != NULL) {
+			if(e->type != SNE_OP_EQ || e->param.op.args.buf[0].type != SNE_OP_VAR
+					|| e->param.op.args.buf[0].param.var.vref != v) {
+				goto done;
+			}
+			e = &e->param.op.args.buf[1];
+		}
+		if(e->type == SNE_OP_UNARY_MINUS
+				&& e->param.op.args.buf[0].type == SNE_OP_CONSTNUM) {
+			psize += SNEXPR_NUMSTZ_SIZE;
+		} else if(e->type == SNE_OP_CONSTNUM) {
+			psize += SNEXPR_NUMSTZ_SIZE;
+		} else if(e->type == SNE_OP_CONSTSTZ && e->param.stz.sval != NULL) {
+			psize += e->param.stz.slen;
+		} else {
+			goto done; /* not a literal */
+		}
+		if(sne_vec_len(&items) >= (int)SNEXPR_SET_MAX
+				|| sne_vec_push(&items, e) < 0) {
+			goto done;
+		}
+	}
+	if(sne_vec_len(&items) < min) {
+		goto done;
+	}
+	while(tsize < 2 * (size_t)sne_vec_len(&items)) {
+		tsize <<= 1;
+	}
+	if(psize > UINT32_MAX - snexpr_set_base(tsize)) {
+		goto done;
+	}
+	s = (struct snexpr_set *)snexpr_calloc(1, snexpr_set_base(tsize) + psize);
+	if(s == NULL) {
+		goto done;
+	}
+	s->mask = (uint32_t)tsize - 1;
+	s->size = (uint32_t)snexpr_set_base(tsize);
+	sne_vec_foreach(&items, e, i)
+	{
+		if(e->type == SNE_OP_CONSTSTZ) {
+			snexpr_set_addstz(s, e->param.stz.sval, e->param.stz.slen);
+			snexpr_set_addnum(s,
+					snexpr_parse_number(e->param.stz.sval, e->param.stz.slen));
+			continue;
+		}
+		n = (e->type == SNE_OP_CONSTNUM) ? e->param.num.nval
+										 : -e->param.op.args.buf[0].param.num.nval;
+		snexpr_set_addnum(s, n);
+		ret = snexpr_format_numb(buf, sizeof(buf), n);
+		if(ret >= 0) {
+			snexpr_set_addstz(s, buf, ret);
 		}
-		paren = paren_next;
+	}
+	/* the pool was sized for the longest numbers */
+	r = (struct snexpr_set *)snexpr_realloc(s, s->size);
+	if(r != NULL) {
+		s = r;
 	}
 
-	if(idn > 0) {
-		sne_vec_push(&es, snexpr_varref(snexpr_var_find(vars, id, idn)));
+done:
+	sne_vec_free(&stk);
+	sne_vec_free(&items);
+	return s;
+}
+
+static inline void snexpr_set_free(struct snexpr_set *s)
+{
+	if(s != NULL) {
+		snexpr_free(s);
 	}
+}
 
-	while(sne_vec_len(&os) > 0) {
-		struct snexpr_string rest = sne_vec_pop(&os);
-		if(rest.n == 1 && (*rest.s == '(' || *rest.s == ')')) {
-			goto cleanup; // Bad paren
+static struct snexpr_set *snexpr_set_copy(struct snexpr_set *s)
+{
+	struct snexpr_set *c;
+
+	c = (struct snexpr_set *)snexpr_malloc(s->size);
+	if(c != NULL) {
+		memcpy(c, s, s->size);
+	}
+	return c;
+}
+
+/* copy of the set kept in a binary image, NULL if it is not valid */
+static struct snexpr_set *snexpr_set_load(const char *p, size_t len)
+{
+	struct snexpr_set h;
+	struct snexpr_set *s;
+	struct snexpr_sslot *st;
+	size_t tsize;
+	uint32_t nn = 0;
+	uint32_t ns = 0;
+	uint32_t i;
+
+	if(len < sizeof(struct snexpr_set)) {
+		return NULL;
+	}
+	memcpy(&h, p, sizeof(struct snexpr_set));
+	tsize = (size_t)h.mask + 1;
+	if(h.size != len || tsize < 8 || tsize > 2 * (size_t)SNEXPR_SET_MAX
+			|| (tsize & h.mask) != 0 || snexpr_set_base(tsize) > len) {
+		return NULL;
+	}
+	s = (struct snexpr_set *)snexpr_malloc(len);
+	if(s == NULL) {
+		return NULL;
+	}
+	memcpy(s, p, len);
+	st = snexpr_set_sslots(s);
+	/* the lookups end at an empty slot, the strings are in the block */
+	for(i = 0; i < tsize; i++) {
+		nn += (snexpr_set_nslots(s)[i].used != 0);
+		if(st[i].off != 0) {
+			if(st[i].off < snexpr_set_base(tsize) || st[i].off > len
+					|| st[i].len > len - st[i].off) {
+				break;
+			}
+			ns++;
+		}
+	}
+	if(i < tsize || nn != h.nnums || ns != h.nstrs || nn >= tsize
+			|| ns >= tsize) {
+		snexpr_free(s);
+		return NULL;
+	}
+	return s;
+}
+
+/* a = a in s, with the type of a */
+static inline int snexpr_val_in(struct snexpr_set *s, struct snexpr *a)
+{
+	uint32_t i;
+	int r;
+
+	if(s == NULL) {
+		return -1;
+	}
+	if(a->type == SNE_OP_CONSTSTZ) {
+		if(a->param.stz.sval == NULL) {
+			return -1;
+		}
+		r = 0;
+		if(a->param.stz.slen <= UINT32_MAX) {
+			i = snexpr_set_sfind(s, a->param.stz.sval,
+					(uint32_t)a->param.stz.slen,
+					snexpr_var_hash(a->param.stz.sval, a->param.stz.slen));
+			r = (snexpr_set_sslots(s)[i].off != 0);
+		}
+		snexpr_val_release(a);
+	} else {
+		r = !snexpr_num_isnan(a->param.num.nval)
+			&& snexpr_set_nslots(s)[snexpr_set_nfind(s, a->param.num.nval)].used;
+	}
+	snexpr_val_setnum(a, r);
+	return 0;
+}
+
+/* the operators keeping data compiled for the node */
+#define snexpr_is_compiled(op) (snexpr_is_match(op) || (op) == SNE_OP_IN)
+
+static void snexpr_compiled_free(struct snexpr *e)
+{
+	if(e->type == SNE_OP_IN) {
+		snexpr_set_free(e->param.op.set);
+		e->param.op.set = NULL;
+	} else {
+		snexpr_match_free(e->param.op.match);
+		e->param.op.match = NULL;
+	}
+}
+
+/* a = a <op> b for the operators working only with numbers */
+static inline int snexpr_val_numop(
+		enum snexpr_type op, struct snexpr *a, struct snexpr *b)
+{
+	snexpr_num_t n0 = a->param.num.nval;
+	snexpr_num_t n1 = b->param.num.nval;
+
+	switch(op) {
+		case SNE_OP_POWER:
+			n0 = snexpr_num_pow(n0, n1);
+			break;
+		case SNE_OP_MULTIPLY:
+			n0 = snexpr_num_mul(n0, n1);
+			break;
+		case SNE_OP_DIVIDE:
+			if(n1 == 0) {
+				return -1;
+			}
+			n0 = snexpr_num_div(n0, n1);
+			break;
+		case SNE_OP_REMAINDER:
+#ifdef SNEXPR_INT64
+			if(n1 == 0) {
+				return -1;
+			}
+#endif
+			n0 = snexpr_num_rem(n0, n1);
+			break;
+		case SNE_OP_MINUS:
+			n0 = snexpr_num_sub(n0, n1);
+			break;
+		case SNE_OP_SHL:
+			n0 = snexpr_num_shl(n0, n1);
+			break;
+		case SNE_OP_SHR:
+			n0 = snexpr_num_shr(n0, n1);
+			break;
+		case SNE_OP_BITWISE_AND:
+			n0 = to_int(n0) & to_int(n1);
+			break;
+		case SNE_OP_BITWISE_OR:
+			n0 = to_int(n0) | to_int(n1);
+			break;
+		case SNE_OP_BITWISE_XOR:
+			n0 = to_int(n0) ^ to_int(n1);
+			break;
+		default:
+			return -1;
+	}
+	a->param.num.nval = n0;
+	return 0;
+}
+
+/* assignment of a value to a variable */
+static inline int snexpr_var_assign(struct snexpr_var *v, struct snexpr *val)
+{
+	v->ver++;
+	if(v->evflags & SNEXPR_VALALLOC) {
+		if(v->v.sval != NULL) {
+			snexpr_free(v->v.sval);
+			v->v.sval = NULL;
+		}
+		v->evflags &= ~(SNEXPR_TSTRING | SNEXPR_VALALLOC);
+	}
+	if(val->type == SNE_OP_CONSTSTZ) {
+		v->v.sval = (char *)snexpr_malloc(val->param.stz.slen + 1);
+		if(v->v.sval == NULL) {
+			return -1;
+		}
+		memcpy(v->v.sval, val->param.stz.sval, val->param.stz.slen);
+		v->v.sval[val->param.stz.slen] = '\0';
+		v->vlen = val->param.stz.slen;
+		v->evflags |= SNEXPR_VALASSIGN | SNEXPR_TSTRING | SNEXPR_VALALLOC;
+	} else {
+		v->v.nval = val->param.num.nval;
+		v->evflags |= SNEXPR_VALASSIGN;
+	}
+	return 0;
+}
+
+/*
+ * Value of a variable, from the callback when it was not assigned - the
+ * handle callback of the context for a resolved variable, otherwise the
+ * name callback of the context, or the one given to snexpr_create() without
+ * context
+ */
+static int snexpr_cse_value(
+		struct snexpr_ctx *ctx, struct snexpr *res, int slot);
+
+static inline int snexpr_val_var(
+		struct snexpr_ctx *ctx, struct snexpr *res, struct snexpr_var *v)
+{
+	int ext = (ctx != NULL) ? (ctx->evcbf != NULL) : (_snexternval_cbf != NULL);
+	struct snexpr *r;
+
+	if(v->evflags & SNEXPR_VALCSE) {
+		/* reference to a subtree shared in a rule set */
+		return snexpr_cse_value(ctx, res, v->hid);
+	}
+	if(ctx != NULL && v->slot >= 0 && v->slot < ctx->nvals) {
+		/* the values bound in the context, the variable is not changed */
+		snexpr_val_setnum(res, ctx->vals[v->slot]);
+		return 0;
+	}
+	if(ctx != NULL && ctx->evhcbf != NULL
+			&& (v->evflags & (SNEXPR_VALHANDLE | SNEXPR_VALASSIGN))
+					   == SNEXPR_VALHANDLE) {
+		snexpr_val_setnum(res, 0);
+		snexpr_prof_cb_begin(&v->prof);
+		r = ctx->evhcbf(ctx, v->hid);
+		snexpr_prof_cb_end(&v->prof);
+		return snexpr_val_take(res, r);
+	}
+
+	if(!ext || (v->evflags & SNEXPR_VALASSIGN)) {
+		if(v->evflags & SNEXPR_TSTRING) {
+			if(v->v.sval == NULL) {
+				return -1;
+			}
+			if(v->vlen == 0 && v->v.sval[0] != '\0') {
+				v->vlen = strlen(v->v.sval);
+			}
+			return snexpr_val_setstz(
+					snexpr_ctx_scratch(ctx), res, v->v.sval, v->vlen);
+		}
+		snexpr_val_setnum(res, v->v.nval);
+		return 0;
+	}
+	snexpr_val_setnum(res, 0);
+	snexpr_prof_cb_begin(&v->prof);
+	r = (ctx != NULL) ? ctx->evcbf(ctx, v->name) : _snexternval_cbf(v->name);
+	snexpr_prof_cb_end(&v->prof);
+	return snexpr_val_take(res, r);
+}
+
+/* call the function of the node, checking the type of the result */
+static inline int snexpr_val_call(
+		struct snexpr_ctx *ctx, struct snexpr *res, struct snexpr *e)
+{
+	struct snexpr_func *f = e->param.func.f;
+	struct snexpr *r;
+	int ret;
+
+	snexpr_val_setnum(res, 0);
+	snexpr_prof_cb_begin(&e->prof);
+	if(f->fctx != NULL) {
+		r = f->fctx(f, &e->param.func.args, e->param.func.context, ctx);
+	} else {
+		r = f->f(f, &e->param.func.args, e->param.func.context);
+	}
+	snexpr_prof_cb_end(&e->prof);
+	ret = snexpr_val_take(res, r);
+	if(ret == 0 && f->rtype != SNE_OP_UNKNOWN && res->type != f->rtype) {
+		snexpr_val_release(res);
+		snexpr_val_setnum(res, 0);
+		return -1;
+	}
+	return ret;
+}
+
+/*
+ * Memoization of the functions with SNEXPR_FN_PURE - the parameters are
+ * evaluated and compared with the ones of the last call, kept with its
+ * result in the function node. The functions with more parameters or with
+ * parameters that have side effects are always called.
+ */
+#define SNEXPR_FMEMO_NARGS 8
+
+struct snexpr_fmemo
+{
+	int usable;
+	int valid;
+	struct snexpr res;
+	struct snexpr args[SNEXPR_FMEMO_NARGS];
+};
+
+static int snexpr_eval_r(
+		struct snexpr *e, struct snexpr_ctx *ctx, struct snexpr *res);
+static int snexpr_has_effects(struct snexpr *e);
+
+/* release the values of the last call */
+static void snexpr_fmemo_clear(struct snexpr_fmemo *m)
+{
+	int i;
+
+	snexpr_val_release(&m->res);
+	for(i = 0; i < SNEXPR_FMEMO_NARGS; i++) {
+		snexpr_val_release(&m->args[i]);
+	}
+	memset(m, 0, sizeof(struct snexpr_fmemo));
+	m->usable = 1;
+}
+
+static void snexpr_fmemo_free(struct snexpr_fmemo *m)
+{
+	if(m != NULL) {
+		snexpr_fmemo_clear(m);
+		snexpr_free(m);
+	}
+}
+
+/* value with the same content as v - the string is allocated when sc is NULL */
+static inline int snexpr_val_dup(
+		struct snexpr_scratch *sc, struct snexpr *dst, struct snexpr *v)
+{
+	if(v->type == SNE_OP_CONSTSTZ) {
+		return snexpr_val_setstz(sc, dst, v->param.stz.sval, v->param.stz.slen);
+	}
+	snexpr_val_setnum(dst, v->param.num.nval);
+	return 0;
+}
+
+static inline int snexpr_val_same(struct snexpr *a, struct snexpr *b)
+{
+	if(a->type != b->type) {
+		return 0;
+	}
+	if(a->type == SNE_OP_CONSTSTZ) {
+		return (a->param.stz.slen == b->param.stz.slen
+				&& memcmp(a->param.stz.sval, b->param.stz.sval,
+						   a->param.stz.slen)
+						   == 0);
+	}
+	return (a->param.num.nval == b->param.num.nval);
+}
+
+/* keep the parameters and the result of the call */
+static void snexpr_fmemo_store(
+		struct snexpr_fmemo *m, struct snexpr *vals, int n, struct snexpr *res)
+{
+	int i;
+
+	snexpr_fmemo_clear(m);
+	if(snexpr_val_dup(NULL, &m->res, res) < 0) {
+		return;
+	}
+	for(i = 0; i < n; i++) {
+		if(snexpr_val_dup(NULL, &m->args[i], &vals[i]) < 0) {
+			snexpr_fmemo_clear(m);
+			return;
+		}
+	}
+	m->valid = 1;
+}
+
+/* call of a macro, its parameters being assigned only during the call */
+static int snexpr_macro_call(
+		struct snexpr_ctx *ctx, struct snexpr *res, struct snexpr *e)
+{
+	struct snexpr_macro *m = (struct snexpr_macro *)e->param.func.f;
+	sne_vec_expr_t *args = &e->param.func.args;
+	struct snexpr vals[SNEXPR_MACRO_NARGS];
+	struct snexpr_var saved[SNEXPR_MACRO_NARGS];
+	struct snexpr_var *v;
+	int n = sne_vec_len(args);
+	int ret = -1;
+	int i;
+	int k = 0;
+
+	snexpr_val_setnum(res, 0);
+	if(n > SNEXPR_MACRO_NARGS) {
+		return -1;
+	}
+	for(i = 0; i < n; i++) {
+		if(m->params[i] == NULL
+				|| snexpr_eval_r(&sne_vec_nth(args, i), ctx, &vals[i]) < 0) {
+			goto done;
+		}
+	}
+	for(k = 0; k < n; k++) {
+		v = m->params[k];
+		saved[k] = *v;
+		/* the old string is kept in the frame */
+		v->evflags &= ~(SNEXPR_TSTRING | SNEXPR_VALALLOC);
+		if(snexpr_var_assign(v, &vals[k]) < 0) {
+			k++;
+			goto done;
+		}
+	}
+	ret = snexpr_eval_r(&m->body, ctx, res);
+
+done:
+	while(k-- > 0) {
+		v = m->params[k];
+		if(v->evflags & SNEXPR_VALALLOC) {
+			snexpr_free(v->v.sval);
+		}
+		v->evflags = saved[k].evflags;
+		v->v = saved[k].v;
+		v->vlen = saved[k].vlen;
+		v->ver++;
+	}
+	while(i-- > 0) {
+		snexpr_val_release(&vals[i]);
+	}
+	return ret;
+}
+
+static int snexpr_val_func(
+		struct snexpr_ctx *ctx, struct snexpr *res, struct snexpr *e)
+{
+	struct snexpr_func *f = e->param.func.f;
+	sne_vec_expr_t *args = &e->param.func.args;
+	struct snexpr_fmemo *m = e->param.func.memo;
+	struct snexpr vals[SNEXPR_FMEMO_NARGS];
+	int hit;
+	int ret;
+	int n = sne_vec_len(args);
+	int i;
+
+	if(f->fflags & SNEXPR_FN_MACRO) {
+		return snexpr_macro_call(ctx, res, e);
+	}
+	if(!(f->fflags & SNEXPR_FN_PURE) || n > SNEXPR_FMEMO_NARGS
+			|| (m != NULL && !m->usable)) {
+		return snexpr_val_call(ctx, res, e);
+	}
+	if(m == NULL) {
+		m = (struct snexpr_fmemo *)snexpr_calloc(1, sizeof(struct snexpr_fmemo));
+		if(m == NULL) {
+			return snexpr_val_call(ctx, res, e);
+		}
+		for(i = 0; i < n; i++) {
+			if(snexpr_has_effects(&sne_vec_nth(args, i))) {
+				break;
+			}
+		}
+		m->usable = (i == n);
+		e->param.func.memo = m;
+	}
+	if(!m->usable) {
+		return snexpr_val_call(ctx, res, e);
+	}
+	hit = m->valid;
+	for(i = 0; i < n; i++) {
+		if(snexpr_eval_r(&sne_vec_nth(args, i), ctx, &vals[i]) < 0) {
+			break;
+		}
+		hit = hit && snexpr_val_same(&vals[i], &m->args[i]);
+	}
+	if(i < n) {
+		/* the function reports the error of its parameter */
+		ret = snexpr_val_call(ctx, res, e);
+	} else if(hit) {
+		ret = snexpr_val_dup(snexpr_ctx_scratch(ctx), res, &m->res);
+	} else {
+		ret = snexpr_val_call(ctx, res, e);
+		if(ret == 0) {
+			snexpr_fmemo_store(m, vals, n, res);
+		}
+	}
+	while(i-- > 0) {
+		snexpr_val_release(&vals[i]);
+	}
+	return ret;
+}
+
+/*
+ * Make the string of a result independent of the expression and of the
+ * scratch area, so it can be used after they are reused or destroyed
+ */
+static inline int snexpr_result_keep(struct snexpr *res)
+{
+	if(res->type != SNE_OP_CONSTSTZ
+			|| (res->eflags & (SNEXPR_VALALLOC | SNEXPR_VALSSO))) {
+		return 0;
+	}
+	return snexpr_val_setstz(
+			NULL, res, res->param.stz.sval, res->param.stz.slen);
+}
+
+/*
+ * Copy a borrowed string of a result, so it ends with '\0' and stays valid
+ * after the evaluation - the borrowed strings are copied only when they are
+ * the result
+ */
+static inline int snexpr_result_unborrow(
+		struct snexpr_scratch *sc, struct snexpr *res)
+{
+	if(res->type != SNE_OP_CONSTSTZ || !(res->eflags & SNEXPR_VALBORROW)) {
+		return 0;
+	}
+	return snexpr_val_setstz(sc, res, res->param.stz.sval, res->param.stz.slen);
+}
+
+/* allocated result from a value, as returned by snexpr_eval() */
+static inline struct snexpr *snexpr_val_result(struct snexpr *v)
+{
+	struct snexpr *r;
+
+	if(v->type == SNE_OP_CONSTSTZ) {
+		if(!(v->eflags & SNEXPR_VALALLOC)) {
+			return snexpr_convert_stzl(
+					v->param.stz.sval, v->param.stz.slen, SNE_OP_CONSTSTZ);
+		}
+		r = (struct snexpr *)snexpr_malloc(sizeof(struct snexpr));
+		if(r == NULL) {
+			snexpr_val_release(v);
+			return NULL;
+		}
+		*r = *v;
+		r->eflags |= SNEXPR_EXPALLOC;
+		return r;
+	}
+	return snexpr_convert_num(v->param.num.nval, SNE_OP_CONSTNUM);
+}
+
+/*
+ * Evaluation of the expression tree, writing the result in res
+ */
+static int snexpr_eval_r(
+		struct snexpr *e, struct snexpr_ctx *ctx, struct snexpr *res);
+
+#define SNEXPR_CONCAT_LSIZE 16
+
+/*
+ * Depth of the nodes evaluated with recursive calls (at least 1), the
+ * deeper ones are evaluated with an explicit stack - the recursion is faster
+ * for the usual expressions, the stack bounds the native one used by the
+ * deep trees
+ */
+#ifndef SNEXPR_EVAL_RDEPTH
+#define SNEXPR_EVAL_RDEPTH 32
+#endif
+
+#ifdef SNEXPR_PROFILE
+#define snexpr_prof_enter(f) \
+	((f)->nalloc = _snexpr_prof_nalloc, (f)->t = snexpr_prof_now())
+#define snexpr_prof_leave(f, n)                          \
+	((n)->prof.time += snexpr_prof_now() - (f)->t,       \
+			(n)->prof.nalloc += _snexpr_prof_nalloc - (f)->nalloc, \
+			(n)->prof.count++)
+#else
+#define snexpr_prof_enter(f) ((void)0)
+#define snexpr_prof_leave(f, n) ((void)0)
+#endif
+
+/* the nodes evaluated without a frame, evaluated with snexpr_eval_d() */
+#define snexpr_is_leaf(t)                                           \
+	((t) == SNE_OP_CONSTNUM || (t) == SNE_OP_CONSTSTZ || (t) == SNE_OP_VAR \
+			|| (t) == SNE_OP_FUNC)
+
+static inline int snexpr_eval_d(struct snexpr *e, struct snexpr_ctx *ctx,
+		struct snexpr *res, int depth);
+
+/*
+ * Room for one more frame or value on the stack, whose first buffers can be
+ * the local ones of the caller (lf and lv) - the values are moved, so their
+ * inline strings are pointed again
+ */
+static int snexpr_estack_grow(struct snexpr_estack *st, int value,
+		struct snexpr_eframe *lf, struct snexpr *lv)
+{
+	void *p;
+	int n;
+	int i;
+
+	if(value) {
+		n = (st->vcap < SNEXPR_EVAL_LSTACK) ? SNEXPR_EVAL_LSTACK : 2 * st->vcap;
+		if(st->vstk == lv) {
+			p = snexpr_malloc(n * sizeof(struct snexpr));
+			if(p != NULL && st->vlen > 0) {
+				memcpy(p, lv, st->vlen * sizeof(struct snexpr));
+			}
+		} else {
+			p = snexpr_realloc(st->vstk, n * sizeof(struct snexpr));
+		}
+		if(p == NULL) {
+			return -1;
+		}
+		st->vstk = (struct snexpr *)p;
+		st->vcap = n;
+		for(i = 0; i < st->vlen; i++) {
+			if((st->vstk[i].eflags & SNEXPR_VALSSO)
+					&& st->vstk[i].type == SNE_OP_CONSTSTZ) {
+				st->vstk[i].param.stz.sval = st->vstk[i].param.stz.sbuf;
+			}
+		}
+		return 0;
+	}
+	n = (st->fcap < SNEXPR_EVAL_LSTACK) ? SNEXPR_EVAL_LSTACK : 2 * st->fcap;
+	if(st->fstk == lf) {
+		p = snexpr_malloc(n * sizeof(struct snexpr_eframe));
+		if(p != NULL && st->flen > 0) {
+			memcpy(p, lf, st->flen * sizeof(struct snexpr_eframe));
+		}
+	} else {
+		p = snexpr_realloc(st->fstk, n * sizeof(struct snexpr_eframe));
+	}
+	if(p == NULL) {
+		return -1;
+	}
+	st->fstk = (struct snexpr_eframe *)p;
+	st->fcap = n;
+	return 0;
+}
+
+/* push the value v on the stack, releasing it on error */
+static inline int snexpr_estack_push(struct snexpr_estack *st,
+		struct snexpr *v, struct snexpr_eframe *lf, struct snexpr *lv)
+{
+	if(st->vlen == st->vcap && snexpr_estack_grow(st, 1, lf, lv) < 0) {
+		snexpr_val_release(v);
+		return -1;
+	}
+	snexpr_val_move(&st->vstk[st->vlen++], v);
+	return 0;
+}
+
+/*
+ * Evaluation of the expression tree with an explicit stack, in the scratch
+ * area of the context or local (allocated when it is too small) without
+ * one, so the depth of the tree does not use the native stack. The
+ * functions, the macros and the shared subexpressions evaluate their
+ * parameters and bodies with nested calls.
+ */
+static int snexpr_eval_stack(
+		struct snexpr *e, struct snexpr_ctx *ctx, struct snexpr *res)
+{
+	struct snexpr_scratch *sc = snexpr_ctx_scratch(ctx);
+	struct snexpr_eframe lfstk[SNEXPR_EVAL_LSTACK];
+	struct snexpr lvstk[SNEXPR_EVAL_LSTACK];
+	struct snexpr_estack lst;
+	struct snexpr_estack *st = &lst;
+	struct snexpr_eframe *lf = lfstk;
+	struct snexpr *lv = lvstk;
+	struct snexpr_eframe *f;
+	struct snexpr *a;
+	struct snexpr *b;
+	struct snexpr *c;
+	struct snexpr tv;
+	snexpr_num_t n;
+	int fbase;
+	int ret = -1;
+	int chain;
+
+	if(snexpr_is_leaf(e->type)) {
+		return snexpr_eval_d(e, ctx, res, 0);
+	}
+	if(sc != NULL) {
+		st = &sc->est;
+		lf = NULL;
+		lv = NULL;
+	} else {
+		lst.fstk = lfstk;
+		lst.flen = 0;
+		lst.fcap = SNEXPR_EVAL_LSTACK;
+		lst.vstk = lvstk;
+		lst.vlen = 0;
+		lst.vcap = SNEXPR_EVAL_LSTACK;
+	}
+	fbase = st->flen;
+	snexpr_val_setnum(res, 0);
+	c = e;
+	chain = 0;
+	goto push;
+
+	for(;;) {
+		/* the stack can be moved by the nested evaluations */
+		f = &st->fstk[st->flen - 1];
+		e = f->e;
+		a = (f->state > 0) ? &st->vstk[f->vbase] : NULL;
+		b = (f->state > 1) ? a + 1 : NULL;
+		switch(e->type) {
+			case SNE_OP_UNARY_MINUS:
+			case SNE_OP_UNARY_LOGICAL_NOT:
+			case SNE_OP_UNARY_BITWISE_NOT:
+				if(f->state == 0) {
+					break;
+				}
+				if(a->type != SNE_OP_CONSTNUM) {
+					goto error;
+				}
+				n = a->param.num.nval;
+				if(e->type == SNE_OP_UNARY_MINUS) {
+					n = snexpr_num_neg(n);
+				} else if(e->type == SNE_OP_UNARY_LOGICAL_NOT) {
+					n = !n;
+				} else {
+					n = ~(to_int(n));
+				}
+				a->param.num.nval = n;
+				goto pop;
+			case SNE_OP_POWER:
+			case SNE_OP_MULTIPLY:
+			case SNE_OP_DIVIDE:
+			case SNE_OP_REMAINDER:
+			case SNE_OP_MINUS:
+			case SNE_OP_SHL:
+			case SNE_OP_SHR:
+			case SNE_OP_BITWISE_AND:
+			case SNE_OP_BITWISE_OR:
+			case SNE_OP_BITWISE_XOR:
+				if(f->state == 0) {
+					break;
+				}
+				/* the right side is not evaluated after an error */
+				if(a->type != SNE_OP_CONSTNUM
+						|| (f->state == 2 && b->type != SNE_OP_CONSTNUM)) {
+					goto error;
+				}
+				if(f->state == 1) {
+					break;
+				}
+				st->vlen--;
+				if(snexpr_val_numop(e->type, a, b) < 0) {
+					goto error;
+				}
+				goto pop;
+			case SNE_OP_PLUS:
+			case SNE_OP_LT:
+			case SNE_OP_LE:
+			case SNE_OP_GT:
+			case SNE_OP_GE:
+			case SNE_OP_EQ:
+			case SNE_OP_NE:
+				if(f->state < 2) {
+					if(f->state == 0 && f->chain == 0) {
+						f->chain = snexpr_concat_len(e);
+					}
+					break;
+				}
+				if(f->chain < 0) {
+					/* operands of the chain, added by its top node */
+					st->flen--;
+					goto next;
+				}
+				if(f->chain > 0) {
+					if(snexpr_val_concat(sc, a, f->chain) < 0) {
+						goto error;
+					}
+					st->vlen = f->vbase + 1;
+					goto pop;
+				}
+				if(a->type != b->type
+						&& (e->param.op.args.buf[1].eflags
+								& (SNEXPR_DUALNUM | SNEXPR_DUALSTZ))) {
+					snexpr_val_dual(b, &e->param.op.args.buf[1]);
+				}
+				st->vlen--;
+				if(e->eflags & SNEXPR_OPNUM) {
+					/* both operands are numbers, set by snexpr_optimize() */
+					a->param.num.nval =
+							(e->type == SNE_OP_PLUS)
+									? snexpr_num_add(a->param.num.nval,
+											  b->param.num.nval)
+									: snexpr_cmp_num(e->type, a->param.num.nval,
+											b->param.num.nval);
+					goto pop;
+				}
+				if(((e->type == SNE_OP_PLUS) ? snexpr_val_plus(sc, a, b)
+											 : snexpr_val_cmp(sc, e->type, a, b))
+						< 0) {
+					snexpr_val_release(b);
+					goto error;
+				}
+				goto pop;
+			case SNE_OP_MATCH:
+			case SNE_OP_NMATCH:
+				if(f->state < 2) {
+					break;
+				}
+				st->vlen--;
+				if(snexpr_val_match(sc, e->type, e->param.op.match, a, b) < 0) {
+					snexpr_val_release(b);
+					goto error;
+				}
+				goto pop;
+			case SNE_OP_IN:
+				if(f->state == 0) {
+					break;
+				}
+				if(snexpr_val_in(e->param.op.set, a) < 0) {
+					goto error;
+				}
+				goto pop;
+			case SNE_OP_LOGICAL_AND:
+			case SNE_OP_LOGICAL_OR:
+				if(f->state == 0) {
+					break;
+				}
+				n = snexpr_val_num(a);
+				snexpr_val_release(a);
+				if(f->state == 1
+						&& ((e->type == SNE_OP_LOGICAL_AND)
+										? (n != 0)
+										: (n == 0 || snexpr_num_isnan(n)))) {
+					st->vlen--;
+					break;
+				}
+				snexpr_val_setnum(a, (n != 0) ? n : 0);
+				goto pop;
+			case SNE_OP_ASSIGN:
+				if(f->state == 0) {
+					/* the value first, then the variable */
+					f->state = 1;
+					c = &e->param.op.args.buf[1];
+					chain = 0;
+					goto push;
+				}
+				if(sne_vec_nth(&e->param.op.args, 0).type != SNE_OP_VAR
+						|| snexpr_var_assign(
+								   e->param.op.args.buf[0].param.var.vref, a)
+								   < 0) {
+					goto error;
+				}
+				goto pop;
+			case SNE_OP_COMMA:
+				if(f->state == 1) {
+					/* value of the left side, after an error there is none */
+					while(st->vlen > f->vbase) {
+						snexpr_val_release(&st->vstk[--st->vlen]);
+					}
+				} else if(f->state == 2) {
+					goto pop;
+				}
+				break;
+			default:
+				snexpr_val_setnum(&tv, SNEXPR_NUM_NAN);
+				if(snexpr_estack_push(st, &tv, lf, lv) < 0) {
+					goto error;
+				}
+				goto pop;
+		}
+
+		/* evaluate the next operand */
+		c = &e->param.op.args.buf[f->state];
+		chain = (f->state == 0 && f->chain != 0 && c->type == SNE_OP_PLUS
+						&& !(c->eflags & SNEXPR_OPNUM))
+						? -1
+						: 0;
+		f->state++;
+
+	push:
+		if(snexpr_is_leaf(c->type)) {
+			if(st->vlen == st->vcap && snexpr_estack_grow(st, 1, lf, lv) < 0) {
+				goto failed;
+			}
+#ifndef SNEXPR_PROFILE
+			if(c->type == SNE_OP_CONSTNUM) {
+				snexpr_val_setnum(&st->vstk[st->vlen++], c->param.num.nval);
+				continue;
+			}
+#endif
+			if(sc == NULL || c->type == SNE_OP_CONSTSTZ) {
+				/* the local stack is not used by the nested evaluations */
+				if(snexpr_eval_d(c, ctx, &st->vstk[st->vlen], 0) < 0) {
+					goto failed;
+				}
+				st->vlen++;
+				continue;
+			}
+			if(snexpr_eval_d(c, ctx, &tv, 0) < 0
+					|| snexpr_estack_push(st, &tv, lf, lv) < 0) {
+				goto failed;
+			}
+			continue;
+		}
+		if(st->flen == st->fcap && snexpr_estack_grow(st, 0, lf, lv) < 0) {
+			goto failed;
+		}
+		f = &st->fstk[st->flen++];
+		f->e = c;
+		f->state = 0;
+		f->vbase = st->vlen;
+		f->chain = chain;
+		snexpr_prof_enter(f);
+		continue;
+
+	pop:
+		f = &st->fstk[--st->flen];
+		snexpr_prof_leave(f, f->e);
+
+	next:
+		if(st->flen == fbase) {
+			snexpr_val_move(res, &st->vstk[--st->vlen]);
+			ret = 0;
+			goto done;
+		}
+		continue;
+
+	error:
+		/* the node on top failed, its operands are released */
+		f = &st->fstk[st->flen - 1];
+		while(st->vlen > f->vbase) {
+			snexpr_val_release(&st->vstk[--st->vlen]);
+		}
+		st->flen--;
+		if(f->chain >= 0) {
+			snexpr_prof_leave(f, f->e);
+		}
+
+	failed:
+		/* an operand of the node on top failed */
+		if(st->flen == fbase) {
+			goto done;
+		}
+		f = &st->fstk[st->flen - 1];
+		if(f->e->type == SNE_OP_COMMA && f->state == 1) {
+			continue; /* errors on the left side are ignored */
+		}
+		goto error;
+	}
+
+done:
+	if(sc == NULL) {
+		if(lst.fstk != lfstk) {
+			snexpr_free(lst.fstk);
+		}
+		if(lst.vstk != lvstk) {
+			snexpr_free(lst.vstk);
+		}
+	}
+	return ret;
+}
+
+/* evaluate a chain of k operands added with snexpr_val_concat() */
+static int snexpr_eval_concat(struct snexpr *e, struct snexpr_ctx *ctx,
+		struct snexpr *res, int k, int depth)
+{
+	struct snexpr lvals[SNEXPR_CONCAT_LSIZE];
+	struct snexpr *lops[SNEXPR_CONCAT_LSIZE];
+	struct snexpr *vals = lvals;
+	struct snexpr **ops = lops;
+	int ret = -1;
+	int i;
+
+	if(k > SNEXPR_CONCAT_LSIZE) {
+		vals = (struct snexpr *)snexpr_malloc(
+				k * (sizeof(struct snexpr) + sizeof(struct snexpr *)));
+		if(vals == NULL) {
+			return -1;
+		}
+		ops = (struct snexpr **)(vals + k);
+	}
+	/* the operands are on the right side going down the chain */
+	for(i = k - 1; i > 0; i--) {
+		ops[i] = &e->param.op.args.buf[1];
+		e = &e->param.op.args.buf[0];
+	}
+	ops[0] = e;
+	depth++;
+	for(i = 0; i < k; i++) {
+		if(snexpr_eval_d(ops[i], ctx, &vals[i], depth) < 0) {
+			while(--i >= 0) {
+				snexpr_val_release(&vals[i]);
+			}
+			goto done;
+		}
+	}
+	ret = snexpr_val_concat(snexpr_ctx_scratch(ctx), vals, k);
+	if(ret < 0) {
+		snexpr_val_release(&vals[0]);
+	} else {
+		snexpr_val_move(res, &vals[0]);
+	}
+
+done:
+	if(vals != lvals) {
+		snexpr_free(vals);
+	}
+	return ret;
+}
+
+static int snexpr_eval_node(
+		struct snexpr *e, struct snexpr_ctx *ctx, struct snexpr *res, int depth)
+{
+	struct snexpr_scratch *sc = snexpr_ctx_scratch(ctx);
+	struct snexpr rv;
+	snexpr_num_t n;
+	int k;
+
+	depth++;
+	snexpr_val_setnum(res, 0);
+	switch(e->type) {
+		case SNE_OP_UNARY_MINUS:
+		case SNE_OP_UNARY_LOGICAL_NOT:
+		case SNE_OP_UNARY_BITWISE_NOT:
+			if(snexpr_eval_d(&e->param.op.args.buf[0], ctx, res, depth) < 0) {
+				return -1;
+			}
+			if(res->type != SNE_OP_CONSTNUM) {
+				goto error;
+			}
+			n = res->param.num.nval;
+			if(e->type == SNE_OP_UNARY_MINUS) {
+				n = snexpr_num_neg(n);
+			} else if(e->type == SNE_OP_UNARY_LOGICAL_NOT) {
+				n = !n;
+			} else {
+				n = ~(to_int(n));
+			}
+			res->param.num.nval = n;
+			return 0;
+		case SNE_OP_POWER:
+		case SNE_OP_MULTIPLY:
+		case SNE_OP_DIVIDE:
+		case SNE_OP_REMAINDER:
+		case SNE_OP_MINUS:
+		case SNE_OP_SHL:
+		case SNE_OP_SHR:
+		case SNE_OP_BITWISE_AND:
+		case SNE_OP_BITWISE_OR:
+		case SNE_OP_BITWISE_XOR:
+			if(snexpr_eval_d(&e->param.op.args.buf[0], ctx, res, depth) < 0) {
+				return -1;
+			}
+			if(res->type != SNE_OP_CONSTNUM) {
+				goto error;
+			}
+			if(snexpr_eval_d(&e->param.op.args.buf[1], ctx, &rv, depth) < 0) {
+				goto error;
+			}
+			if(rv.type != SNE_OP_CONSTNUM) {
+				snexpr_val_release(&rv);
+				goto error;
+			}
+			return snexpr_val_numop(e->type, res, &rv);
+		case SNE_OP_PLUS:
+		case SNE_OP_LT:
+		case SNE_OP_LE:
+		case SNE_OP_GT:
+		case SNE_OP_GE:
+		case SNE_OP_EQ:
+		case SNE_OP_NE:
+			if(e->type == SNE_OP_PLUS && (k = snexpr_concat_len(e)) > 0) {
+				return snexpr_eval_concat(e, ctx, res, k, depth);
+			}
+			if(snexpr_eval_d(&e->param.op.args.buf[0], ctx, res, depth) < 0) {
+				return -1;
+			}
+			if(snexpr_eval_d(&e->param.op.args.buf[1], ctx, &rv, depth) < 0) {
+				goto error;
+			}
+			if(res->type != rv.type
+					&& (e->param.op.args.buf[1].eflags
+							& (SNEXPR_DUALNUM | SNEXPR_DUALSTZ))) {
+				snexpr_val_dual(&rv, &e->param.op.args.buf[1]);
+			}
+			if(e->eflags & SNEXPR_OPNUM) {
+				/* both operands are numbers, set by snexpr_optimize() */
+				res->param.num.nval = (e->type == SNE_OP_PLUS)
+											  ? snexpr_num_add(res->param.num.nval,
+													  rv.param.num.nval)
+											  : snexpr_cmp_num(e->type,
+													  res->param.num.nval,
+													  rv.param.num.nval);
+				return 0;
+			}
+			if(((e->type == SNE_OP_PLUS) ? snexpr_val_plus(sc, res, &rv)
+										 : snexpr_val_cmp(sc, e->type, res, &rv))
+					< 0) {
+				snexpr_val_release(&rv);
+				goto error;
+			}
+			return 0;
+		case SNE_OP_MATCH:
+		case SNE_OP_NMATCH:
+			if(snexpr_eval_d(&e->param.op.args.buf[0], ctx, res, depth) < 0) {
+				return -1;
+			}
+			if(snexpr_eval_d(&e->param.op.args.buf[1], ctx, &rv, depth) < 0) {
+				goto error;
+			}
+			if(snexpr_val_match(sc, e->type, e->param.op.match, res, &rv) < 0) {
+				snexpr_val_release(&rv);
+				goto error;
+			}
+			return 0;
+		case SNE_OP_IN:
+			if(snexpr_eval_d(&e->param.op.args.buf[0], ctx, res, depth) < 0) {
+				return -1;
+			}
+			if(snexpr_val_in(e->param.op.set, res) < 0) {
+				goto error;
+			}
+			return 0;
+		case SNE_OP_LOGICAL_AND:
+			if(snexpr_eval_d(&e->param.op.args.buf[0], ctx, res, depth) < 0) {
+				return -1;
+			}
+			n = snexpr_val_num(res);
+			snexpr_val_release(res);
+			if(n != 0) {
+				if(snexpr_eval_d(&e->param.op.args.buf[1], ctx, res, depth) < 0) {
+					return -1;
+				}
+				n = snexpr_val_num(res);
+				snexpr_val_release(res);
+				if(n != 0) {
+					snexpr_val_setnum(res, n);
+					return 0;
+				}
+			}
+			snexpr_val_setnum(res, 0);
+			return 0;
+		case SNE_OP_LOGICAL_OR:
+			if(snexpr_eval_d(&e->param.op.args.buf[0], ctx, res, depth) < 0) {
+				return -1;
+			}
+			n = snexpr_val_num(res);
+			snexpr_val_release(res);
+			if(n != 0 && !snexpr_num_isnan(n)) {
+				snexpr_val_setnum(res, n);
+				return 0;
+			}
+			if(snexpr_eval_d(&e->param.op.args.buf[1], ctx, res, depth) < 0) {
+				return -1;
+			}
+			n = snexpr_val_num(res);
+			snexpr_val_release(res);
+			snexpr_val_setnum(res, (n != 0) ? n : 0);
+			return 0;
+		case SNE_OP_ASSIGN:
+			if(snexpr_eval_d(&e->param.op.args.buf[1], ctx, res, depth) < 0) {
+				return -1;
+			}
+			if(sne_vec_nth(&e->param.op.args, 0).type != SNE_OP_VAR) {
+				goto error;
+			}
+			if(snexpr_var_assign(e->param.op.args.buf[0].param.var.vref, res)
+					< 0) {
+				goto error;
+			}
+			return 0;
+		case SNE_OP_COMMA:
+			/* errors on the left side are ignored */
+			if(snexpr_eval_d(&e->param.op.args.buf[0], ctx, res, depth) == 0) {
+				snexpr_val_release(res);
+			}
+			return snexpr_eval_d(&e->param.op.args.buf[1], ctx, res, depth);
+		case SNE_OP_CONSTNUM:
+			res->param.num.nval = e->param.num.nval;
+			return 0;
+		case SNE_OP_CONSTSTZ:
+			/* the string of the node is used without copying it */
+			if(e->param.stz.sval == NULL) {
+				return -1;
+			}
+			res->type = SNE_OP_CONSTSTZ;
+			res->param.stz.sval = e->param.stz.sval;
+			res->param.stz.slen = e->param.stz.slen;
+			return 0;
+		case SNE_OP_VAR:
+			if(snexpr_val_var(ctx, res, e->param.var.vref) < 0) {
+				goto error;
+			}
+			return 0;
+		case SNE_OP_FUNC:
+			if(snexpr_val_func(ctx, res, e) < 0) {
+				goto error;
+			}
+			return 0;
+		default:
+			res->param.num.nval = SNEXPR_NUM_NAN;
+			return 0;
+	}
+
+error:
+	snexpr_val_release(res);
+	return -1;
+}
+
+/* evaluation of the node e at depth in the recursion */
+static inline int snexpr_eval_d(
+		struct snexpr *e, struct snexpr_ctx *ctx, struct snexpr *res, int depth)
+{
+#ifdef SNEXPR_PROFILE
+	struct snexpr_eframe f;
+	int ret;
+#endif
+
+	if(depth >= SNEXPR_EVAL_RDEPTH) {
+		return snexpr_eval_stack(e, ctx, res);
+	}
+#ifdef SNEXPR_PROFILE
+	snexpr_prof_enter(&f);
+	ret = snexpr_eval_node(e, ctx, res, depth);
+	snexpr_prof_leave(&f, e);
+	return ret;
+#else
+	return snexpr_eval_node(e, ctx, res, depth);
+#endif
+}
+
+static int snexpr_eval_r(
+		struct snexpr *e, struct snexpr_ctx *ctx, struct snexpr *res)
+{
+	return snexpr_eval_d(e, ctx, res, 0);
+}
+
+#ifdef SNEXPR_PROFILE
+static inline sne_vec_expr_t *snexpr_prof_args(struct snexpr *e)
+{
+	if(e->type == SNE_OP_FUNC) {
+		return &e->param.func.args;
+	}
+	if(e->type == SNE_OP_VAR || e->type == SNE_OP_CONSTNUM
+			|| e->type == SNE_OP_CONSTSTZ) {
+		return NULL;
+	}
+	return &e->param.op.args;
+}
+
+/* reset the counters of the nodes and of their variables */
+static inline void snexpr_prof_reset(struct snexpr *e)
+{
+	sne_vec_expr_t *args = snexpr_prof_args(e);
+	struct snexpr_prof *p = &e->prof;
+	int i;
+
+	if(e->type == SNE_OP_VAR) {
+		p = &e->param.var.vref->prof;
+		p->count = p->nalloc = p->cbcount = 0;
+		p->time = p->cbtime = 0;
+		p = &e->prof;
+	}
+	p->count = p->nalloc = p->cbcount = 0;
+	p->time = p->cbtime = 0;
+	for(i = 0; args != NULL && i < sne_vec_len(args); i++) {
+		snexpr_prof_reset(&sne_vec_nth(args, i));
+	}
+}
+
+static void snexpr_prof_dump_r(
+		FILE *fp, struct snexpr *e, const char *s, int depth)
+{
+	sne_vec_expr_t *args = snexpr_prof_args(e);
+	struct snexpr_prof *cp = (e->type == SNE_OP_VAR) ? &e->param.var.vref->prof
+													 : &e->prof;
+	int i;
+
+	fprintf(fp, "%6d %10lu %12llu %10.1f %8lu %10lu %12llu  %*s", e->prof.soff,
+			e->prof.count, e->prof.time,
+			e->prof.count ? (double)e->prof.time / e->prof.count : 0.0,
+			e->prof.nalloc, cp->cbcount, cp->cbtime, 2 * depth, "");
+	if(s != NULL && e->prof.slen > 0) {
+		fprintf(fp, "%.*s\n", e->prof.slen, s + e->prof.soff);
+	} else {
+		fprintf(fp, "<%d>\n", (int)e->type);
+	}
+	for(i = 0; args != NULL && i < sne_vec_len(args); i++) {
+		snexpr_prof_dump_r(fp, &sne_vec_nth(args, i), s, depth + 1);
+	}
+}
+
+/*
+ * Print the counters of each node of the expression created from the
+ * source s, indented by depth, with the offset and the token in s (the
+ * node type when s is NULL or the node was added by the optimizer); the
+ * callback columns are for the functions and the external variables
+ */
+static inline void snexpr_prof_dump(FILE *fp, struct snexpr *e, const char *s)
+{
+	fprintf(fp, "%6s %10s %12s %10s %8s %10s %12s  %s\n", "offset", "count",
+			"ns", "avg-ns", "allocs", "cb-count", "cb-ns", "node");
+	snexpr_prof_dump_r(fp, e, s, 0);
+}
+#endif
+
+/*
+ * Evaluate the expression, writing the result in the value res - return 0
+ * on success, -1 on error. Numbers are stored in res, strings are either
+ * referenced from the expression or built in the scratch area of the
+ * context, staying valid until the next evaluation using the context. A
+ * string result is allocated only if ctx is NULL or snexpr_result_keep() is
+ * used. Release the result with snexpr_result_free(). With a NULL ctx, the
+ * callback given to snexpr_create() is used for the external variables.
+ */
+static inline int snexpr_eval_into(
+		struct snexpr *e, struct snexpr_ctx *ctx, struct snexpr *res)
+{
+	int ret;
+
+	if(ctx != NULL && ctx->scratch.depth++ == 0) {
+		snexpr_scratch_reset(&ctx->scratch);
+	}
+	ret = snexpr_eval_r(e, ctx, res);
+	if(ret == 0 && snexpr_result_unborrow(snexpr_ctx_scratch(ctx), res) < 0) {
+		ret = -1;
+	}
+	if(ctx != NULL) {
+		ctx->scratch.depth--;
+	}
+	return ret;
+}
+
+/*
+ * Evaluate the expression with a context, returning the result like
+ * snexpr_eval() - to be used also by the functions with a context for
+ * evaluating their parameters
+ */
+static inline struct snexpr *snexpr_eval_ctx(
+		struct snexpr *e, struct snexpr_ctx *ctx)
+{
+	struct snexpr v;
+
+	if(snexpr_eval_into(e, ctx, &v) < 0) {
+		return NULL;
+	}
+	return snexpr_val_result(&v);
+}
+
+static inline struct snexpr *snexpr_eval(struct snexpr *e)
+{
+	struct snexpr v;
+
+	if(snexpr_eval_into(e, NULL, &v) < 0) {
+		return NULL;
+	}
+	return snexpr_val_result(&v);
+}
+
+/*
+ * Get the token at the position pos of the source - return its length, 0
+ * at the end, negative on error. The kind of the token, its operator and
+ * its position are set in tk.
+ */
+static int snexpr_next_token(const char *src, size_t len, size_t pos,
+		int *flags, struct snexpr_token *tk)
+{
+	const char *s = src + pos;
+	unsigned int i = 0;
+	char b;
+	int bsf = 0;
+
+	len -= pos;
+	tk->kind = SNE_TK_SPACE;
+	tk->op = SNE_OP_UNKNOWN;
+	tk->offset = pos;
+	tk->len = 0;
+	if(len == 0) {
+		return 0;
+	}
+	char c = s[0];
+	if(c == '#') {
+		tk->kind = SNE_TK_COMMENT;
+		for(; i < len && s[i] != '\n'; i++)
+			;
+	} else if(c == '\n') {
+		tk->kind = SNE_TK_NEWLINE;
+		for(; i < len && snexpr_isspace(s[i]); i++)
+			;
+		if(*flags & SNEXPR_TOP) {
+			if(i == len || s[i] == ')') {
+				*flags = *flags & (~SNEXPR_COMMA);
+			} else {
+				*flags = SNEXPR_TNUMBER | SNEXPR_TSTRING | SNEXPR_TWORD | SNEXPR_TOPEN
+						 | SNEXPR_COMMA;
+			}
+		}
+	} else if(snexpr_isspace(c)) {
+		while(i < len && snexpr_isspace(s[i]) && s[i] != '\n') {
+			i++;
+		}
+	} else if(snexpr_isdigit(c)) {
+		if((*flags & SNEXPR_TNUMBER) == 0) {
+			return -1; // unexpected number
+		}
+		*flags = SNEXPR_TOP | SNEXPR_TCLOSE;
+		tk->kind = SNE_TK_NUMBER;
+		while(i < len && (s[i] == '.' || snexpr_isdigit(s[i]))) {
+			i++;
+		}
+	} else if(c == '"' || c == '\'') {
+		if((*flags & SNEXPR_TSTRING) == 0) {
+			return -1; // unexpected string
+		}
+		if(i == len - 1) {
+			return -1; // invalud start of string
+		}
+		*flags = SNEXPR_TOP | SNEXPR_TCLOSE;
+		tk->kind = SNE_TK_STRING;
+		b = c;
+		i++;
+		c = s[i];
+		while(i < len && (bsf==1 || c != b)) {
+			if(bsf == 0 && c == '\\') {
+				bsf = 1;
+			} else {
+				bsf = 0;
+			}
+			i++;
+			c = s[i];
+		}
+		if(i >= len) {
+			return -1; // unterminated string
+		}
+		i++;
+	} else if(isfirstvarchr(c)) {
+		if((*flags & SNEXPR_TOP) && len >= 2 && s[0] == 'i' && s[1] == 'n'
+				&& (len == 2 || !isvarchr(s[2]))) {
+			/* the word operator, after an operand */
+			*flags = SNEXPR_TNUMBER | SNEXPR_TSTRING | SNEXPR_TWORD | SNEXPR_TOPEN;
+			tk->kind = SNE_TK_OP;
+			tk->op = SNE_OP_IN;
+			tk->len = 2;
+			return 2;
+		}
+		if((*flags & SNEXPR_TWORD) == 0) {
+			return -2; // unexpected word
+		}
+		*flags = SNEXPR_TOP | SNEXPR_TOPEN | SNEXPR_TCLOSE;
+		tk->kind = SNE_TK_WORD;
+		while(i < len && isvarchr(s[i])) {
+			i++;
+		}
+	} else if(c == '(' || c == ')') {
+		if(c == '(' && (*flags & SNEXPR_TOPEN) != 0) {
+			*flags = SNEXPR_TNUMBER | SNEXPR_TSTRING | SNEXPR_TWORD | SNEXPR_TOPEN
+					 | SNEXPR_TCLOSE;
+			tk->kind = SNE_TK_OPEN;
+		} else if(c == ')' && (*flags & SNEXPR_TCLOSE) != 0) {
+			*flags = SNEXPR_TOP | SNEXPR_TCLOSE;
+			tk->kind = SNE_TK_CLOSE;
+		} else {
+			return -3; // unexpected parenthesis
+		}
+		i = 1;
+	} else if((*flags & SNEXPR_TOP) == 0) {
+		switch(c) {
+			case '-':
+				tk->op = SNE_OP_UNARY_MINUS;
+				break;
+			case '!':
+				tk->op = SNE_OP_UNARY_LOGICAL_NOT;
+				break;
+			case '^':
+				tk->op = SNE_OP_UNARY_BITWISE_NOT;
+				break;
+			default:
+				return -4; // missing expected operand
+		}
+		*flags = SNEXPR_TNUMBER | SNEXPR_TSTRING | SNEXPR_TWORD | SNEXPR_TOPEN;
+		tk->kind = SNE_TK_OP;
+		i = 1;
+	} else {
+		i = snexpr_op_match(s, len, &tk->op);
+		if(i == 0) {
+			return -5; // unknown operator
+		}
+		*flags = SNEXPR_TNUMBER | SNEXPR_TSTRING | SNEXPR_TWORD | SNEXPR_TOPEN;
+		tk->kind = SNE_TK_OP;
+	}
+	tk->len = i;
+	return i;
+}
+
+/*
+ * Maximum depth of the expressions created by snexpr_parse() and loaded by
+ * snexpr_image_load(), with the bodies of the macros counted below their
+ * calls - the deeper ones fail, since the optimizer, the compiler, the image
+ * writer, the arenas and the flat expressions walk the tree recursively. Per
+ * level of native stack (x86-64, -O2): about 210 bytes for the optimizer,
+ * 250 for snexpr_ruleset_build(), 130 for the flat expressions, 80 for the
+ * compiler and the images and 50 for the arenas, so the default limit needs
+ * about 128 KiB of stack.
+ */
+#ifndef SNEXPR_MAX_DEPTH
+#define SNEXPR_MAX_DEPTH 512
+#endif
+
+#define SNEXPR_PAREN_ALLOWED 0
+#define SNEXPR_PAREN_EXPECTED 1
+#define SNEXPR_PAREN_FORBIDDEN 2
+
+static void snexpr_destroy_args(struct snexpr *e);
+
+static int snexpr_bind(enum snexpr_type op, sne_vec_expr_t *es)
+{
+	if(op == SNE_OP_UNKNOWN) {
+		return -1;
+	}
+
+	if(snexpr_is_unary(op)) {
+		if(sne_vec_len(es) < 1) {
+			return -1;
+		}
+		struct snexpr arg = sne_vec_pop(es);
+		struct snexpr unary = snexpr_init();
+		unary.type = op;
+		sne_vec_push(&unary.param.op.args, arg);
+		sne_vec_push(es, unary);
+	} else {
+		if(sne_vec_len(es) < 2) {
+			return -1;
+		}
+		struct snexpr b = sne_vec_pop(es);
+		struct snexpr a = sne_vec_pop(es);
+		struct snexpr binary = snexpr_init();
+		binary.type = op;
+		if(op == SNE_OP_ASSIGN && a.type != SNE_OP_VAR) {
+			return -1; /* Bad assignment */
+		}
+		sne_vec_push(&binary.param.op.args, a);
+		if(op == SNE_OP_IN) {
+			/* the list is only kept in the set */
+			binary.param.op.set = snexpr_set_new(&b, NULL, 1);
+			snexpr_destroy_args(&b);
+			sne_vec_push(es, binary);
+			return (binary.param.op.set == NULL) ? -1 : 0; /* Bad list */
+		}
+		sne_vec_push(&binary.param.op.args, b);
+		if(snexpr_is_match(op) && b.type == SNE_OP_CONSTSTZ
+				&& b.param.stz.sval != NULL) {
+			/* the literal pattern is compiled once */
+			binary.param.op.match =
+					snexpr_match_new(b.param.stz.sval, b.param.stz.slen);
+			if(binary.param.op.match == NULL) {
+				sne_vec_push(es, binary);
+				return -1; /* Bad pattern */
+			}
+		}
+		sne_vec_push(es, binary);
+	}
+	return 0;
+}
+
+static struct snexpr snexpr_constnum(snexpr_num_t value)
+{
+	struct snexpr e = snexpr_init();
+	e.type = SNE_OP_CONSTNUM;
+	e.param.num.nval = value;
+	return e;
+}
+
+static struct snexpr snexpr_varref(struct snexpr_var *v)
+{
+	struct snexpr e = snexpr_init();
+	e.type = SNE_OP_VAR;
+	e.param.var.vref = v;
+	return e;
+}
+
+static struct snexpr snexpr_conststr(const char *value, int len)
+{
+	struct snexpr e = snexpr_init();
+	char *p;
+	int i;
+	int bsf = 0;
+	if(len < 2) {
+		len = 0;
+	} else {
+		/* skip the quotes */
+		len -= 2;
+	}
+	e.type = SNE_OP_CONSTSTZ;
+	e.param.stz.sval = (char *)snexpr_malloc(len + 1);
+	if(e.param.stz.sval) {
+		if(len > 0) {
+			/* do not copy the quotes - start from value[1] */
+			p = e.param.stz.sval;
+			for(i=0; i<len; i++) {
+				if(bsf==0 && value[i+1]=='\\') {
+					bsf = 1;
+				} else if(bsf==1) {
+					bsf = 0;
+					switch(value[i+1]) {
+						case 'n':
+							*p = '\n';
+						break;
+						case 'r':
+							*p = '\r';
+						break;
+						case 't':
+							*p = '\t';
+						break;
+						default:
+							*p = value[i+1];
+					}
+					p++;
+				} else {
+					bsf = 0;
+					*p = value[i+1];
+					p++;
+				}
+			}
+			*p = '\0';
+			e.param.stz.slen = p - e.param.stz.sval;
+		} else {
+			e.param.stz.sval[0] = '\0';
+		}
+	}
+	return e;
+}
+
+static struct snexpr snexpr_binary(
+		enum snexpr_type type, struct snexpr a, struct snexpr b)
+{
+	struct snexpr e = snexpr_init();
+	e.type = type;
+	sne_vec_push(&e.param.op.args, a);
+	sne_vec_push(&e.param.op.args, b);
+	return e;
+}
+
+/*
+ * copy of the node without its operands, returning the ones of src and of
+ * dst, allocated with the same length and initialized to be copied
+ */
+static void snexpr_copy_node(struct snexpr *dst, struct snexpr *src,
+		sne_vec_expr_t **sargs, sne_vec_expr_t **dargs)
+{
+	int i;
+
+	*sargs = NULL;
+	*dargs = NULL;
+	dst->type = src->type;
+	if(src->type == SNE_OP_FUNC) {
+		dst->param.func.f = src->param.func.f;
+		*sargs = &src->param.func.args;
+		*dargs = &dst->param.func.args;
+		if(src->param.func.f->ctxsz > 0) {
+			dst->param.func.context = snexpr_calloc(1, src->param.func.f->ctxsz);
+		}
+		if((src->param.func.f->fflags & SNEXPR_FN_MACRO)
+				&& ((struct snexpr_macro *)src->param.func.f)->refs > 0) {
+			((struct snexpr_macro *)src->param.func.f)->refs++;
+		}
+	} else if(src->type == SNE_OP_CONSTNUM) {
+		dst->param.num.nval = src->param.num.nval;
+	} else if(src->type == SNE_OP_CONSTSTZ) {
+		dst->param.stz.sval = (src->param.stz.sval != NULL)
+									  ? snexpr_strdup(src->param.stz.sval)
+									  : NULL;
+		dst->param.stz.slen = src->param.stz.slen;
+	} else if(src->type == SNE_OP_VAR) {
+		dst->param.var.vref = src->param.var.vref;
+	} else {
+		*sargs = &src->param.op.args;
+		*dargs = &dst->param.op.args;
+		if(snexpr_is_match(src->type) && src->param.op.match != NULL) {
+			/* compiled again at evaluation if it fails */
+			dst->param.op.match = snexpr_match_new(
+					src->param.op.match->src, src->param.op.match->slen);
+		} else if(src->type == SNE_OP_IN && src->param.op.set != NULL) {
+			/* the evaluation fails without it */
+			dst->param.op.set = snexpr_set_copy(src->param.op.set);
+		}
+	}
+	if(*sargs == NULL || sne_vec_len(*sargs) == 0) {
+		return;
+	}
+	(*dargs)->buf = (struct snexpr *)snexpr_malloc(
+			sne_vec_len(*sargs) * sizeof(struct snexpr));
+	if((*dargs)->buf == NULL) {
+		return; /* copied without operands */
+	}
+	(*dargs)->len = (*dargs)->cap = sne_vec_len(*sargs);
+	for(i = 0; i < (*dargs)->len; i++) {
+		struct snexpr tmp = snexpr_init();
+		(*dargs)->buf[i] = tmp;
+	}
+}
+
+/* copy of the tree src in dst, walked with an explicit stack */
+static inline void snexpr_copy(struct snexpr *dst, struct snexpr *src)
+{
+	struct snexpr *lstk[2 * SNEXPR_EVAL_LSTACK];
+	struct snexpr **stk = lstk;
+	struct snexpr **p;
+	sne_vec_expr_t *sargs;
+	sne_vec_expr_t *dargs;
+	int cap = SNEXPR_EVAL_LSTACK;
+	int n = 0;
+	int i;
+
+	for(;;) {
+		snexpr_copy_node(dst, src, &sargs, &dargs);
+		for(i = 0; dargs != NULL && i < sne_vec_len(dargs); i++) {
+			if(n == cap) {
+				p = (struct snexpr **)((stk == lstk)
+						? snexpr_malloc(4 * cap * sizeof(struct snexpr *))
+						: snexpr_realloc(stk, 4 * cap * sizeof(struct snexpr *)));
+				if(p == NULL) {
+					/* no memory for the stack, the rest is recursive */
+					snexpr_copy(&dargs->buf[i], &sargs->buf[i]);
+					continue;
+				}
+				if(stk == lstk) {
+					memcpy(p, lstk, 2 * n * sizeof(struct snexpr *));
+				}
+				stk = p;
+				cap *= 2;
+			}
+			stk[2 * n] = &dargs->buf[i];
+			stk[2 * n + 1] = &sargs->buf[i];
+			n++;
+		}
+		if(n == 0) {
+			break;
+		}
+		n--;
+		dst = stk[2 * n];
+		src = stk[2 * n + 1];
+	}
+	if(stk != lstk) {
+		snexpr_free(stk);
+	}
+}
+
+static void snexpr_macro_release(struct snexpr_macro *m);
+static int snexpr_depth(struct snexpr *e, int max);
+
+/*
+ * Macro with the statements of args as body (the first one is the name),
+ * taking them - its reference is kept by the parser until the end
+ */
+static struct snexpr_macro *snexpr_macro_new(char *name, sne_vec_expr_t *args)
+{
+	struct snexpr_macro *m;
+	struct snexpr *p;
+	struct snexpr e;
+	int i;
+
+	m = (struct snexpr_macro *)snexpr_calloc(1, sizeof(struct snexpr_macro));
+	if(m == NULL) {
+		sne_vec_foreach(args, e, i)
+		{
+			snexpr_destroy_args(&e);
+		}
+		sne_vec_free(args);
+		return NULL;
+	}
+	m->f.name = name;
+	m->f.fflags = SNEXPR_FN_MACRO;
+	m->refs = 1;
+	m->body = snexpr_constnum(0);
+	p = &m->body;
+	for(i = 1; i < sne_vec_len(args); i++) {
+		if(i < sne_vec_len(args) - 1) {
+			*p = snexpr_binary(
+					SNE_OP_COMMA, sne_vec_nth(args, i), snexpr_constnum(0));
+			p = &sne_vec_nth(&p->param.op.args, 1);
+		} else {
+			*p = sne_vec_nth(args, i);
+		}
+	}
+	sne_vec_free(args);
+	m->depth = snexpr_depth(&m->body, SNEXPR_MAX_DEPTH);
+	return m;
+}
+
+/*
+ * Parse the expression without changing the global callback for external
+ * variables, to be used with an evaluation context
+ */
+static struct snexpr *snexpr_parse(const char *s, size_t len,
+		struct snexpr_var_list *vars, struct snexpr_func *funcs)
+{
+	snexpr_num_t num;
+	struct snexpr_var *v;
+	struct snexpr_token tk;
+	const char *id = NULL;
+	size_t idn = 0;
+	size_t pos = 0;
+
+	struct snexpr *result = NULL;
+
+	sne_vec_expr_t es = sne_vec_init();
+	sne_vec_str_t os = sne_vec_init();
+	sne_vec_arg_t as = sne_vec_init();
+
+	struct macro
+	{
+		char *name;
+		struct snexpr_macro *m;
+	};
+	sne_vec(struct macro) macros = sne_vec_init();
+
+	int flags = SNEXPR_TDEFAULT;
+	int paren = SNEXPR_PAREN_ALLOWED;
+	for(;;) {
+		int n = snexpr_next_token(s, len, pos, &flags, &tk);
+		if(n == 0) {
+			break;
+		} else if(n < 0) {
+			goto cleanup;
+		}
+		const char *tok = s + pos;
+		pos += n;
+		if(tk.kind == SNE_TK_NEWLINE && (flags & SNEXPR_COMMA)) {
+			flags = flags & (~SNEXPR_COMMA);
+			tk.kind = SNE_TK_OP;
+			tk.op = SNE_OP_COMMA;
+		}
+		if(tk.kind == SNE_TK_SPACE || tk.kind == SNE_TK_COMMENT
+				|| tk.kind == SNE_TK_NEWLINE) {
+			continue;
+		}
+		int paren_next = SNEXPR_PAREN_ALLOWED;
+
+		if(idn > 0) {
+			if(tk.kind == SNE_TK_OPEN) {
+				int i;
+				int has_macro = 0;
+				struct macro m;
+				sne_vec_foreach(&macros, m, i)
+				{
+					if(strlen(m.name) == idn && strncmp(m.name, id, idn) == 0) {
+						has_macro = 1;
+						break;
+					}
+				}
+				if((idn == 1 && id[0] == '$') || has_macro
+						|| snexpr_func_find(funcs, id, idn) != NULL) {
+					struct snexpr_string str = {id, (int)idn, SNE_OP_UNKNOWN};
+					sne_vec_push(&os, str);
+					paren = SNEXPR_PAREN_EXPECTED;
+				} else {
+					goto cleanup; /* invalid function name */
+				}
+			} else if((v = snexpr_var_find(vars, id, idn)) != NULL) {
+				sne_vec_push(&es, snexpr_varref(v));
+				snexpr_prof_mark(&es, s, id, idn);
+				paren = SNEXPR_PAREN_FORBIDDEN;
+			}
+			id = NULL;
+			idn = 0;
+		}
+
+		if(tk.kind == SNE_TK_OPEN) {
+			if(paren == SNEXPR_PAREN_EXPECTED) {
+				struct snexpr_string str = {"{", 1, SNE_OP_UNKNOWN};
+				sne_vec_push(&os, str);
+				struct snexpr_arg arg = {sne_vec_len(&os), sne_vec_len(&es), sne_vec_init()};
+				sne_vec_push(&as, arg);
+			} else if(paren == SNEXPR_PAREN_ALLOWED) {
+				struct snexpr_string str = {"(", 1, SNE_OP_UNKNOWN};
+				sne_vec_push(&os, str);
+			} else {
+				goto cleanup; // Bad call
+			}
+		} else if(paren == SNEXPR_PAREN_EXPECTED) {
+			goto cleanup; // Bad call
+		} else if(tk.kind == SNE_TK_CLOSE) {
+			int minlen = (sne_vec_len(&as) > 0 ? sne_vec_peek(&as).oslen : 0);
+			while(sne_vec_len(&os) > minlen && *sne_vec_peek(&os).s != '('
+					&& *sne_vec_peek(&os).s != '{') {
+				struct snexpr_string str = sne_vec_pop(&os);
+				if(snexpr_bind(str.op, &es) == -1) {
+					goto cleanup;
+				}
+				snexpr_prof_mark(&es, s, str.s, str.n);
+			}
+			if(sne_vec_len(&os) == 0) {
+				goto cleanup; // Bad parens
+			}
+			struct snexpr_string str = sne_vec_pop(&os);
+			if(str.n == 1 && *str.s == '{') {
+				str = sne_vec_pop(&os);
+				struct snexpr_arg arg = sne_vec_pop(&as);
+				if(sne_vec_len(&es) > arg.eslen) {
+					sne_vec_push(&arg.args, sne_vec_pop(&es));
+				}
+				if(str.n == 1 && str.s[0] == '$') {
+					if(sne_vec_len(&arg.args) < 1) {
+						sne_vec_free(&arg.args);
+						goto cleanup; /* too few arguments for $() function */
+					}
+					struct snexpr *u = &sne_vec_nth(&arg.args, 0);
+					if(u->type != SNE_OP_VAR) {
+						int k;
+						for(k = 0; k < sne_vec_len(&arg.args); k++) {
+							snexpr_destroy_args(&sne_vec_nth(&arg.args, k));
+						}
+						sne_vec_free(&arg.args);
+						goto cleanup; /* first argument is not a variable */
+					}
+					struct macro m = {u->param.var.vref->name, NULL};
+					m.m = snexpr_macro_new(m.name, &arg.args);
+					if(m.m == NULL) {
+						goto cleanup; /* allocation failed */
+					}
+					if(m.m->depth > SNEXPR_MAX_DEPTH) {
+						snexpr_macro_release(m.m);
+						goto cleanup; /* body too deep */
+					}
+					if(sne_vec_push(&macros, m) < 0) {
+						snexpr_macro_release(m.m);
+						goto cleanup;
+					}
+					sne_vec_push(&es, snexpr_constnum(0));
+				} else {
+					int i = 0;
+					int found = -1;
+					struct macro m;
+					sne_vec_foreach(&macros, m, i)
+					{
+						if(strlen(m.name) == (size_t)str.n
+								&& strncmp(m.name, str.s, str.n) == 0) {
+							found = i;
+						}
+					}
+					if(found != -1) {
+						m = sne_vec_nth(&macros, found);
+						struct snexpr call = snexpr_init();
+						int j;
+						/* the variables of the parameters, $1 to $9 */
+						for(j = 0; j < sne_vec_len(&arg.args)
+								&& j < SNEXPR_MACRO_NARGS;
+								j++) {
+							char varname[3] = {'$', (char)('1' + j), '\0'};
+							if(m.m->params[j] == NULL) {
+								m.m->params[j] = snexpr_var_find(vars, varname, 2);
+							}
+							if(m.m->params[j] == NULL) {
+								break;
+							}
+						}
+						if(j < sne_vec_len(&arg.args)) {
+							for(j = 0; j < sne_vec_len(&arg.args); j++) {
+								snexpr_destroy_args(&sne_vec_nth(&arg.args, j));
+							}
+							sne_vec_free(&arg.args);
+							goto cleanup; /* too many parameters */
+						}
+						call.type = SNE_OP_FUNC;
+						call.param.func.f = &m.m->f;
+						call.param.func.args = arg.args;
+						m.m->refs++;
+						sne_vec_push(&es, call);
+						snexpr_prof_mark(&es, s, str.s, str.n);
+					} else {
+						struct snexpr_func *f = snexpr_func_find(funcs, str.s, str.n);
+						struct snexpr bound_func = snexpr_init();
+						if((f->fflags & SNEXPR_FN_NARGS)
+								&& sne_vec_len(&arg.args) != f->nargs) {
+							int k;
+							for(k = 0; k < sne_vec_len(&arg.args); k++) {
+								snexpr_destroy_args(&sne_vec_nth(&arg.args, k));
+							}
+							sne_vec_free(&arg.args);
+							goto cleanup; /* wrong number of parameters */
+						}
+						bound_func.type = SNE_OP_FUNC;
+						bound_func.param.func.f = f;
+						bound_func.param.func.args = arg.args;
+						if(f->ctxsz > 0) {
+							void *p = snexpr_calloc(1, f->ctxsz);
+							if(p == NULL) {
+								goto cleanup; /* allocation failed */
+							}
+							bound_func.param.func.context = p;
+						}
+						sne_vec_push(&es, bound_func);
+						snexpr_prof_mark(&es, s, str.s, str.n);
+					}
+				}
+			}
+			paren_next = SNEXPR_PAREN_FORBIDDEN;
+		} else if(tk.kind == SNE_TK_NUMBER) {
+			if(snexpr_parse_numv(tok, n, &num) < 0) {
+				goto cleanup; // Bad number, e.g. '2.3.4'
+			}
+			sne_vec_push(&es, snexpr_constnum(num));
+			snexpr_prof_mark(&es, s, tok, n);
+			paren_next = SNEXPR_PAREN_FORBIDDEN;
+		} else if(tk.kind == SNE_TK_STRING) {
+			sne_vec_push(&es, snexpr_conststr(tok, n));
+			snexpr_prof_mark(&es, s, tok, n);
+			paren_next = SNEXPR_PAREN_FORBIDDEN;
+		} else if(tk.kind == SNE_TK_OP) {
+			enum snexpr_type op = tk.op;
+			struct snexpr_string o2 = {NULL, 0, SNE_OP_UNKNOWN};
+			if(sne_vec_len(&os) > 0) {
+				o2 = sne_vec_peek(&os);
+			}
+			for(;;) {
+				if(op == SNE_OP_COMMA && sne_vec_len(&os) > 0) {
+					struct snexpr_string str = sne_vec_peek(&os);
+					if(str.n == 1 && *str.s == '{') {
+						struct snexpr e = sne_vec_pop(&es);
+						sne_vec_push(&sne_vec_peek(&as).args, e);
+						break;
+					}
+				}
+				if(!(o2.op != SNE_OP_UNKNOWN && snexpr_prec(op, o2.op))) {
+					struct snexpr_string str = {tok, n, op};
+					sne_vec_push(&os, str);
+					break;
+				}
+
+				if(snexpr_bind(o2.op, &es) == -1) {
+					goto cleanup;
+				}
+				snexpr_prof_mark(&es, s, o2.s, o2.n);
+				(void)sne_vec_pop(&os);
+				if(sne_vec_len(&os) > 0) {
+					o2 = sne_vec_peek(&os);
+				} else {
+					o2.op = SNE_OP_UNKNOWN;
+				}
+			}
+		} else {
+			/* Valid identifier, a variable or a function */
+			id = tok;
+			idn = n;
+		}
+		paren = paren_next;
+	}
+
+	if(idn > 0) {
+		sne_vec_push(&es, snexpr_varref(snexpr_var_find(vars, id, idn)));
+		snexpr_prof_mark(&es, s, id, idn);
+	}
+
+	while(sne_vec_len(&os) > 0) {
+		struct snexpr_string rest = sne_vec_pop(&os);
+		if(rest.n == 1 && (*rest.s == '(' || *rest.s == ')')) {
+			goto cleanup; // Bad paren
+		}
+		if(snexpr_bind(rest.op, &es) == -1) {
+			goto cleanup;
+		}
+		snexpr_prof_mark(&es, s, rest.s, rest.n);
+	}
+
+	result = (struct snexpr *)snexpr_calloc(1, sizeof(struct snexpr));
+	if(result != NULL) {
+		if(sne_vec_len(&es) == 0) {
+			result->type = SNE_OP_CONSTNUM;
+		} else {
+			*result = sne_vec_pop(&es);
+		}
+		if(snexpr_depth(result, SNEXPR_MAX_DEPTH) > SNEXPR_MAX_DEPTH) {
+			snexpr_destroy_args(result);
+			snexpr_free(result);
+			result = NULL; /* too deep */
+		}
+	}
+
+	int i, j;
+	struct macro m;
+	struct snexpr e;
+	struct snexpr_arg a;
+cleanup:
+	sne_vec_foreach(&macros, m, i)
+	{
+		snexpr_macro_release(m.m);
+	}
+	sne_vec_free(&macros);
+
+	sne_vec_foreach(&es, e, i)
+	{
+		snexpr_destroy_args(&e);
+	}
+	sne_vec_free(&es);
+
+	sne_vec_foreach(&as, a, i)
+	{
+		sne_vec_foreach(&a.args, e, j)
+		{
+			snexpr_destroy_args(&e);
+		}
+		sne_vec_free(&a.args);
+	}
+	sne_vec_free(&as);
+
+	/*sne_vec_foreach(&os, o, i) {sne_vec_free(&m.body);}*/
+	sne_vec_free(&os);
+
+	return result;
+}
+
+static struct snexpr *snexpr_create(const char *s, size_t len,
+		struct snexpr_var_list *vars, struct snexpr_func *funcs,
+		snexternval_cbf_t evcbf)
+{
+	struct snexpr *result;
+
+	_snexternval_cbf = evcbf;
+	result = snexpr_parse(s, len, vars, funcs);
+	if(result==NULL) {
+		_snexternval_cbf = NULL;
+	}
+
+	return result;
+}
+
+/* release the node without its operands, which are moved to args */
+static void snexpr_destroy_node(struct snexpr *e, sne_vec_expr_t *args)
+{
+	args->buf = NULL;
+	args->len = args->cap = 0;
+	if(e->eflags & SNEXPR_ARENA) {
+		return; /* released with the arena */
+	}
+	if(e->type == SNE_OP_FUNC) {
+		*args = e->param.func.args;
+		e->param.func.args.buf = NULL;
+		e->param.func.args.len = e->param.func.args.cap = 0;
+		if(e->param.func.context != NULL) {
+			if(e->param.func.f->cleanup != NULL) {
+				e->param.func.f->cleanup(
+						e->param.func.f, e->param.func.context);
+			}
+			snexpr_free(e->param.func.context);
+		}
+		snexpr_fmemo_free(e->param.func.memo);
+		e->param.func.memo = NULL;
+		if(e->param.func.f->fflags & SNEXPR_FN_MACRO) {
+			snexpr_macro_release((struct snexpr_macro *)e->param.func.f);
+		}
+	} else if(e->type == SNE_OP_CONSTSTZ) {
+		if(e->param.stz.sval != NULL) {
+			snexpr_free(e->param.stz.sval);
+			e->param.stz.sval = NULL;
+		}
+	} else if(e->type != SNE_OP_CONSTNUM && e->type != SNE_OP_VAR) {
+		*args = e->param.op.args;
+		e->param.op.args.buf = NULL;
+		e->param.op.args.len = e->param.op.args.cap = 0;
+		if(snexpr_is_compiled(e->type)) {
+			snexpr_compiled_free(e);
+		}
+	}
+}
+
+/*
+ * Release the tree, walked with an explicit stack of the operands still to
+ * be released - the node e itself is not freed
+ */
+static void snexpr_destroy_args(struct snexpr *e)
+{
+	sne_vec_expr_t lstk[SNEXPR_EVAL_LSTACK];
+	sne_vec_expr_t *stk = lstk;
+	sne_vec_expr_t *p;
+	sne_vec_expr_t args;
+	sne_vec_expr_t op;
+	int cap = SNEXPR_EVAL_LSTACK;
+	int n = 0;
+	int i;
+	int k;
+
+	snexpr_destroy_node(e, &args);
+	for(;;) {
+		for(i = 0; i < sne_vec_len(&args); i++) {
+			snexpr_destroy_node(&sne_vec_nth(&args, i), &op);
+			if(sne_vec_len(&op) == 0) {
+				sne_vec_free(&op);
+				continue;
+			}
+			if(n == cap) {
+				p = (sne_vec_expr_t *)((stk == lstk)
+								? snexpr_malloc(2 * cap * sizeof(sne_vec_expr_t))
+								: snexpr_realloc(
+										stk, 2 * cap * sizeof(sne_vec_expr_t)));
+				if(p == NULL) {
+					/* no memory for the stack, these are released recursively */
+					for(k = 0; k < sne_vec_len(&op); k++) {
+						snexpr_destroy_args(&sne_vec_nth(&op, k));
+					}
+					sne_vec_free(&op);
+					continue;
+				}
+				if(stk == lstk) {
+					memcpy(p, lstk, n * sizeof(sne_vec_expr_t));
+				}
+				stk = p;
+				cap *= 2;
+			}
+			stk[n++] = op;
+		}
+		sne_vec_free(&args);
+		if(n == 0) {
+			break;
+		}
+		args = stk[--n];
+	}
+	if(stk != lstk) {
+		snexpr_free(stk);
+	}
+}
+
+/* parameters of the node, NULL for the leaves */
+static inline sne_vec_expr_t *snexpr_node_args(struct snexpr *e)
+{
+	switch(e->type) {
+		case SNE_OP_CONSTNUM:
+		case SNE_OP_CONSTSTZ:
+		case SNE_OP_VAR:
+			return NULL;
+		case SNE_OP_FUNC:
+			return &e->param.func.args;
+		default:
+			return &e->param.op.args;
+	}
+}
+
+/*
+ * Depth of the tree, the bodies of the macros being below their calls - the
+ * walk stops when it is more than max (also for a macro calling itself),
+ * returning max + 1
+ */
+static int snexpr_depth(struct snexpr *e, int max)
+{
+	struct dnode
+	{
+		struct snexpr *e;
+		int depth;
+	};
+	struct dnode lstk[SNEXPR_EVAL_LSTACK];
+	struct dnode *stk = lstk;
+	struct dnode *p;
+	struct snexpr_macro *m;
+	sne_vec_expr_t *args;
+	int cap = SNEXPR_EVAL_LSTACK;
+	int depth = 0;
+	int n = 0;
+	int d;
+	int k;
+	int i;
+
+	stk[n].e = e;
+	stk[n++].depth = 1;
+	while(n > 0 && depth <= max) {
+		e = stk[--n].e;
+		d = stk[n].depth;
+		k = d;
+		if(e->type == SNE_OP_FUNC && (e->param.func.f->fflags & SNEXPR_FN_MACRO)) {
+			m = (struct snexpr_macro *)e->param.func.f;
+			if(m->depth == 0 && d < max) {
+				/* only the depth left is walked, known when it fits */
+				m->depth = -1;
+				k = snexpr_depth(&m->body, max - d);
+				m->depth = (k <= max - d) ? k : 0;
+			}
+			k = (m->depth <= 0) ? max + 1 : d + m->depth;
+		}
+		if(k > depth) {
+			depth = k;
+		}
+		args = snexpr_node_args(e);
+		for(i = 0; args != NULL && i < sne_vec_len(args) && depth <= max; i++) {
+			if(n == cap) {
+				p = (struct dnode *)((stk == lstk)
+								? snexpr_malloc(2 * cap * sizeof(struct dnode))
+								: snexpr_realloc(stk, 2 * cap * sizeof(struct dnode)));
+				if(p == NULL) {
+					depth = max + 1; /* allocation failed */
+					break;
+				}
+				if(stk == lstk) {
+					memcpy(p, lstk, n * sizeof(struct dnode));
+				}
+				stk = p;
+				cap *= 2;
+			}
+			stk[n].e = &sne_vec_nth(args, i);
+			stk[n++].depth = d + 1;
+		}
+	}
+	if(stk != lstk) {
+		snexpr_free(stk);
+	}
+	return (depth > max) ? max + 1 : depth;
+}
+
+/* drop a reference to the macro, destroying it with the last one */
+static void snexpr_macro_release(struct snexpr_macro *m)
+{
+	if(m->refs < 0 || --m->refs > 0) {
+		return;
+	}
+	snexpr_destroy_args(&m->body);
+	snexpr_free(m);
+}
+
+/*
+ * Arena expressions - snexpr_arena_pack() moves the nodes, the strings and
+ * the function contexts of an expression in a single memory block, laid out
+ * in the order of evaluation and released at once by snexpr_destroy()
+ */
+#define SNEXPR_ARENA_ALIGN 16
+#define snexpr_arena_align(n) \
+	(((n) + SNEXPR_ARENA_ALIGN - 1) & ~((size_t)SNEXPR_ARENA_ALIGN - 1))
+
+struct snexpr_arena
+{
+	size_t size;
+	int nclean;
+	struct snexpr **clean; /* function nodes with a cleanup callback and
+							* match nodes */
+	struct snexpr root;
+};
+
+struct snexpr_apack
+{
+	size_t nsize; /* nodes and contexts (aligned) */
+	size_t ssize; /* strings */
+	int nclean;
+	char *np;
+	char *sp;
+	struct snexpr **clean;
+};
+
+#define snexpr_arena_of(e) \
+	((struct snexpr_arena *)((char *)(e) - offsetof(struct snexpr_arena, root)))
+
+/* function nodes with a context to clean up, a memo or a macro to release */
+#define snexpr_arena_needs_clean(e)                                          \
+	(((e)->param.func.context != NULL && (e)->param.func.f->cleanup != NULL) \
+			|| ((e)->param.func.f->fflags & (SNEXPR_FN_PURE | SNEXPR_FN_MACRO)))
+
+static void snexpr_arena_measure(struct snexpr_apack *ap, struct snexpr *e)
+{
+	int i;
+
+	switch(e->type) {
+		case SNE_OP_CONSTNUM:
+		case SNE_OP_VAR:
+			return;
+		case SNE_OP_CONSTSTZ:
+			if(e->param.stz.sval != NULL) {
+				ap->ssize += e->param.stz.slen + 1;
+			}
+			return;
+		case SNE_OP_FUNC:
+			ap->nsize += snexpr_arena_align(
+					sne_vec_len(&e->param.func.args) * sizeof(struct snexpr));
+			if(e->param.func.context != NULL) {
+				ap->nsize += snexpr_arena_align(e->param.func.f->ctxsz);
+			}
+			if(snexpr_arena_needs_clean(e)) {
+				ap->nclean++;
+			}
+			for(i = 0; i < sne_vec_len(&e->param.func.args); i++) {
+				snexpr_arena_measure(ap, &sne_vec_nth(&e->param.func.args, i));
+			}
+			return;
+		default:
+			ap->nsize += snexpr_arena_align(
+					sne_vec_len(&e->param.op.args) * sizeof(struct snexpr));
+			if(snexpr_is_compiled(e->type)) {
+				ap->nclean++;
+			}
+			for(i = 0; i < sne_vec_len(&e->param.op.args); i++) {
+				snexpr_arena_measure(ap, &sne_vec_nth(&e->param.op.args, i));
+			}
+			return;
+	}
+}
+
+static inline struct snexpr *snexpr_arena_nodes(struct snexpr_apack *ap, int n)
+{
+	struct snexpr *p = (struct snexpr *)ap->np;
+	ap->np += snexpr_arena_align(n * sizeof(struct snexpr));
+	return p;
+}
+
+/* copy src in dst, moving the function contexts out of src */
+static void snexpr_arena_copy(
+		struct snexpr_apack *ap, struct snexpr *dst, struct snexpr *src)
+{
+	sne_vec_expr_t *sargs = &src->param.op.args;
+	sne_vec_expr_t *dargs = &dst->param.op.args;
+	int i;
+	size_t n;
+
+	*dst = *src;
+	dst->eflags |= SNEXPR_ARENA;
+	switch(src->type) {
+		case SNE_OP_CONSTNUM:
+		case SNE_OP_VAR:
+			return;
+		case SNE_OP_CONSTSTZ:
+			if(src->param.stz.sval != NULL) {
+				n = src->param.stz.slen + 1;
+				memcpy(ap->sp, src->param.stz.sval, n);
+				dst->param.stz.sval = ap->sp;
+				ap->sp += n;
+			}
+			return;
+		case SNE_OP_FUNC:
+			if(snexpr_arena_needs_clean(src)) {
+				ap->clean[ap->nclean++] = dst;
+			}
+			/* the memo of the old node is released with it */
+			dst->param.func.memo = NULL;
+			if((src->param.func.f->fflags & SNEXPR_FN_MACRO)
+					&& ((struct snexpr_macro *)src->param.func.f)->refs > 0) {
+				((struct snexpr_macro *)src->param.func.f)->refs++;
+			}
+			if(src->param.func.context != NULL) {
+				dst->param.func.context = ap->np;
+				memcpy(ap->np, src->param.func.context, src->param.func.f->ctxsz);
+				ap->np += snexpr_arena_align(src->param.func.f->ctxsz);
+				snexpr_free(src->param.func.context);
+				src->param.func.context = NULL;
+			}
+			sargs = &src->param.func.args;
+			dargs = &dst->param.func.args;
+			break;
+		default:
+			if(snexpr_is_compiled(src->type)) {
+				/* the compiled pattern or set is moved */
+				ap->clean[ap->nclean++] = dst;
+				src->param.op.match = NULL;
+				src->param.op.set = NULL;
+			}
+			break;
+	}
+	dargs->buf = snexpr_arena_nodes(ap, sargs->len);
+	dargs->cap = sargs->len;
+	for(i = 0; i < sargs->len; i++) {
+		snexpr_arena_copy(ap, &dargs->buf[i], &sargs->buf[i]);
+	}
+}
+
+/*
+ * Move the expression in an arena - return the new expression, destroying
+ * the old one, or e itself if there is not enough memory
+ */
+static inline struct snexpr *snexpr_arena_pack(struct snexpr *e)
+{
+	struct snexpr_apack ap;
+	struct snexpr_arena *a;
+	size_t hsize;
+	size_t csize;
+
+	if(e == NULL || (e->eflags & SNEXPR_ARENA)) {
+		return e;
+	}
+	memset(&ap, 0, sizeof(struct snexpr_apack));
+	snexpr_arena_measure(&ap, e);
+	hsize = snexpr_arena_align(sizeof(struct snexpr_arena));
+	csize = snexpr_arena_align(ap.nclean * sizeof(struct snexpr *));
+	a = (struct snexpr_arena *)snexpr_malloc(hsize + csize + ap.nsize + ap.ssize);
+	if(a == NULL) {
+		return e;
+	}
+	a->size = hsize + csize + ap.nsize + ap.ssize;
+	a->nclean = ap.nclean;
+	a->clean = (struct snexpr **)((char *)a + hsize);
+	ap.clean = a->clean;
+	ap.nclean = 0;
+	ap.np = (char *)a + hsize + csize;
+	ap.sp = ap.np + ap.nsize;
+	snexpr_arena_copy(&ap, &a->root, e);
+
+	snexpr_destroy_args(e);
+	snexpr_free(e);
+	return &a->root;
+}
+
+/*
+ * Create an expression with snexpr_create() and move it in an arena
+ */
+static inline struct snexpr *snexpr_create_arena(const char *s, size_t len,
+		struct snexpr_var_list *vars, struct snexpr_func *funcs,
+		snexternval_cbf_t evcbf)
+{
+	return snexpr_arena_pack(snexpr_create(s, len, vars, funcs, evcbf));
+}
+
+/* size of the memory block of an arena expression, 0 if not in an arena */
+static inline size_t snexpr_arena_size(struct snexpr *e)
+{
+	if(e == NULL || !(e->eflags & SNEXPR_ARENA)) {
+		return 0;
+	}
+	return snexpr_arena_of(e)->size;
+}
+
+static inline void snexpr_arena_destroy(struct snexpr *e)
+{
+	struct snexpr_arena *a = snexpr_arena_of(e);
+	struct snexpr *f;
+	int i;
+
+	for(i = 0; i < a->nclean; i++) {
+		f = a->clean[i];
+		if(snexpr_is_compiled(f->type)) {
+			snexpr_compiled_free(f);
+			continue;
+		}
+		snexpr_fmemo_free(f->param.func.memo);
+		if(f->param.func.context != NULL && f->param.func.f->cleanup != NULL) {
+			f->param.func.f->cleanup(f->param.func.f, f->param.func.context);
+		}
+		if(f->param.func.f->fflags & SNEXPR_FN_MACRO) {
+			snexpr_macro_release((struct snexpr_macro *)f->param.func.f);
+		}
+	}
+	snexpr_free(a);
+}
+
+/*
+ * Destroy the expression and the variables list like snexpr_destroy(), but
+ * without resetting the callback given to snexpr_create(), for the
+ * expressions made without it (e.g., with snexpr_parse())
+ */
+static void snexpr_release(struct snexpr *e, struct snexpr_var_list *vars)
+{
+	struct snexpr_var *v;
+
+	if(e != NULL) {
+		if(e->eflags & SNEXPR_ARENA) {
+			snexpr_arena_destroy(e);
+		} else {
+			snexpr_destroy_args(e);
+			snexpr_free(e);
+		}
+	}
+	if(vars != NULL) {
+		for(v = vars->head; v;) {
+			struct snexpr_var *next = v->next;
+			if(v->evflags & SNEXPR_VALALLOC) {
+				snexpr_free(v->v.sval);
+			}
+			snexpr_free(v);
+			v = next;
+		}
+		if(vars->htable != NULL) {
+			snexpr_free(vars->htable);
+		}
+		if(vars->slots != NULL) {
+			snexpr_free(vars->slots);
+		}
+		memset(vars, 0, sizeof(struct snexpr_var_list));
+	}
+}
+
+static void snexpr_destroy(struct snexpr *e, struct snexpr_var_list *vars)
+{
+	if(_snexternval_cbf != NULL) {
+		_snexternval_cbf = NULL;
+	}
+	snexpr_release(e, vars);
+}
+
+/*
+ * Optimizer
+ *
+ * snexpr_optimize() changes in place the tree built by snexpr_create(),
+ * replacing the subtrees made only of constants with their values and
+ * marking the operators whose operand types are known before evaluation,
+ * so the checks and the conversions of the operands are done only once.
+ * The results of the evaluation stay the same.
+ */
+enum snexpr_stype
+{
+	SNE_ST_UNKNOWN = 0,
+	SNE_ST_NUM,
+	SNE_ST_STZ
+};
+
+/* type of the value of a node when its evaluation succeeds */
+static enum snexpr_stype snexpr_static_type(struct snexpr *e)
+{
+	switch(e->type) {
+		case SNE_OP_CONSTNUM:
+			return SNE_ST_NUM;
+		case SNE_OP_CONSTSTZ:
+			return SNE_ST_STZ;
+		case SNE_OP_VAR:
+			return SNE_ST_UNKNOWN;
+		case SNE_OP_FUNC:
+			/* the type of the result is checked when it is not the given one */
+			if(e->param.func.f->rtype == SNE_OP_CONSTNUM) {
+				return SNE_ST_NUM;
+			} else if(e->param.func.f->rtype == SNE_OP_CONSTSTZ) {
+				return SNE_ST_STZ;
+			}
+			return SNE_ST_UNKNOWN;
+		case SNE_OP_PLUS:
+			/* the result has the type of the left operand */
+			return snexpr_static_type(&e->param.op.args.buf[0]);
+		case SNE_OP_ASSIGN:
+		case SNE_OP_COMMA:
+			return snexpr_static_type(&e->param.op.args.buf[1]);
+		default:
+			return SNE_ST_NUM;
+	}
+}
+
+static inline int snexpr_is_const(struct snexpr *e)
+{
+	return (e->type == SNE_OP_CONSTNUM || e->type == SNE_OP_CONSTSTZ);
+}
+
+/* replace the node with the value v, which is released */
+static int snexpr_fold_node(struct snexpr *e, struct snexpr *v)
+{
+	char *p = NULL;
+	size_t len = 0;
+	snexpr_num_t n = 0;
+
+	if(v->type == SNE_OP_CONSTSTZ) {
+		len = v->param.stz.slen;
+		p = (char *)snexpr_malloc(len + 1);
+		if(p != NULL) {
+			memcpy(p, v->param.stz.sval, len + 1);
+		}
+		snexpr_val_release(v);
+		if(p == NULL) {
+			return -1;
+		}
+	} else {
+		n = v->param.num.nval;
+	}
+	snexpr_destroy_args(e);
+	memset(e, 0, sizeof(struct snexpr));
+	if(p != NULL) {
+		e->type = SNE_OP_CONSTSTZ;
+		e->param.stz.sval = p;
+		e->param.stz.slen = len;
+	} else {
+		e->type = SNE_OP_CONSTNUM;
+		e->param.num.nval = n;
+	}
+	return 0;
+}
+
+/* convert the literal of the right operand to the type of the left one */
+static int snexpr_convert_literal(struct snexpr *e, enum snexpr_stype st)
+{
+	char buf[SNEXPR_NUMSTZ_SIZE];
+	char *p;
+	snexpr_num_t n;
+	int ret;
+
+	if(st == SNE_ST_NUM && e->type == SNE_OP_CONSTSTZ) {
+		n = snexpr_parse_number(e->param.stz.sval, e->param.stz.slen);
+		snexpr_free(e->param.stz.sval);
+		e->type = SNE_OP_CONSTNUM;
+		e->param.num.nval = n;
+	} else if(st == SNE_ST_STZ && e->type == SNE_OP_CONSTNUM) {
+		ret = snexpr_format_numb(buf, sizeof(buf), e->param.num.nval);
+		if(ret < 0) {
+			return 0; /* it fails also at runtime */
+		}
+		p = snexpr_strdup(buf);
+		if(p == NULL) {
+			return -1;
+		}
+		e->type = SNE_OP_CONSTSTZ;
+		e->param.stz.sval = p;
+		e->param.stz.slen = ret;
+	}
+	return 0;
+}
+
+/*
+ * Keep the other representation of the literal next to its value, for the
+ * right operands of the operators with a left operand of unknown type
+ */
+static void snexpr_dual_literal(struct snexpr *e)
+{
+	int ret;
+
+	if(e->type == SNE_OP_CONSTSTZ && e->param.stz.sval != NULL) {
+		e->param.stz.dnval =
+				snexpr_parse_number(e->param.stz.sval, e->param.stz.slen);
+		e->eflags |= SNEXPR_DUALNUM;
+	} else if(e->type == SNE_OP_CONSTNUM) {
+		ret = snexpr_format_numb(
+				e->param.num.dsbuf, SNEXPR_SSO_SIZE, e->param.num.nval);
+		if(ret >= 0) {
+			e->param.num.dslen = ret;
+			e->eflags |= SNEXPR_DUALSTZ;
+		}
+	}
+}
+
+/* x == l1 || x == l2 || ... with literals, into x in (l1, l2, ...) */
+static int snexpr_optimize_in(struct snexpr *e)
+{
+	struct snexpr in = snexpr_init();
+	struct snexpr *l = e;
+	struct snexpr_var *v;
+
+	while(l->type == SNE_OP_LOGICAL_OR) {
+		l = &l->param.op.args.buf[0];
+	}
+	if(l->type != SNE_OP_EQ || l->param.op.args.buf[0].type != SNE_OP_VAR) {
+		return 0;
+	}
+	v = l->param.op.args.buf[0].param.var.vref;
+	/* the left operand is evaluated once, variables have no side effects */
+	in.param.op.set = snexpr_set_new(e, v, SNEXPR_SET_CHAIN);
+	if(in.param.op.set == NULL) {
+		return 0;
+	}
+	in.type = SNE_OP_IN;
+	if(sne_vec_push(&in.param.op.args, snexpr_varref(v)) < 0) {
+		snexpr_set_free(in.param.op.set);
+		return -1;
+	}
+	snexpr_destroy_args(e);
+	*e = in;
+	return 1;
+}
+
+static int snexpr_optimize_node(struct snexpr *e)
+{
+	struct snexpr_macro *m;
+	struct snexpr rv;
+	struct snexpr *a;
+	enum snexpr_stype st;
+	snexpr_num_t n;
+	int nconst = 0;
+	int i;
+
+	if(e->type == SNE_OP_LOGICAL_OR && (i = snexpr_optimize_in(e)) != 0) {
+		return (i < 0) ? -1 : 0;
+	}
+	if(e->type == SNE_OP_FUNC
+			&& (e->param.func.f->fflags & (SNEXPR_FN_FOLD | SNEXPR_FN_PURE))) {
+		/* called now if the parameters are constants */
+		for(i = 0; i < sne_vec_len(&e->param.func.args); i++) {
+			a = &sne_vec_nth(&e->param.func.args, i);
+			if(snexpr_optimize_node(a) < 0) {
+				return -1;
+			}
+			nconst += snexpr_is_const(a);
+		}
+		if(nconst == sne_vec_len(&e->param.func.args)
+				&& snexpr_eval_into(e, NULL, &rv) == 0) {
+			return snexpr_fold_node(e, &rv);
+		}
+		return 0;
+	}
+	if(e->type == SNE_OP_FUNC && (e->param.func.f->fflags & SNEXPR_FN_MACRO)) {
+		/* the shared body once, the parameters are evaluated by the call */
+		m = (struct snexpr_macro *)e->param.func.f;
+		if(!(m->mflags & SNEXPR_MACRO_OPT)) {
+			m->mflags |= SNEXPR_MACRO_OPT;
+			if(snexpr_optimize_node(&m->body) < 0) {
+				return -1;
+			}
+		}
+		for(i = 0; i < sne_vec_len(&e->param.func.args); i++) {
+			if(snexpr_optimize_node(&sne_vec_nth(&e->param.func.args, i)) < 0) {
+				return -1;
+			}
+		}
+		return 0;
+	}
+	if(e->type == SNE_OP_VAR || e->type == SNE_OP_FUNC || snexpr_is_const(e)) {
+		/* the function parameters are evaluated by the function itself */
+		return 0;
+	}
+	for(i = 0; i < sne_vec_len(&e->param.op.args); i++) {
+		a = &sne_vec_nth(&e->param.op.args, i);
+		if(snexpr_optimize_node(a) < 0) {
+			return -1;
+		}
+		nconst += snexpr_is_const(a);
+	}
+	if(sne_vec_len(&e->param.op.args) == 0) {
+		return 0;
+	}
+	a = e->param.op.args.buf;
+
+	if(e->type != SNE_OP_ASSIGN && nconst == sne_vec_len(&e->param.op.args)) {
+		/* errors are left for the evaluation to report them */
+		if(snexpr_eval_into(e, NULL, &rv) == 0) {
+			return snexpr_fold_node(e, &rv);
+		}
+		return 0;
+	}
+
+	switch(e->type) {
+		case SNE_OP_COMMA:
+			if(snexpr_is_const(&a[0])) {
+				/* the value of the left side is not used */
+				rv = a[1];
+				snexpr_destroy_args(&a[0]);
+				sne_vec_free(&e->param.op.args);
+				*e = rv;
+			}
+			return 0;
+		case SNE_OP_LOGICAL_AND:
+		case SNE_OP_LOGICAL_OR:
+			if(!snexpr_is_const(&a[0])) {
+				return 0;
+			}
+			/* the right side is not evaluated */
+			if(snexpr_eval_into(&a[0], NULL, &rv) < 0) {
+				return 0;
+			}
+			n = snexpr_val_num(&rv);
+			snexpr_val_release(&rv);
+			if((e->type == SNE_OP_LOGICAL_AND && n == 0)
+					|| (e->type == SNE_OP_LOGICAL_OR && n != 0
+							&& !snexpr_num_isnan(n))) {
+				/* a false && is 0, also for -0 */
+				snexpr_val_setnum(&rv, (n == 0) ? 0 : n);
+				return snexpr_fold_node(e, &rv);
+			}
+			return 0;
+		case SNE_OP_PLUS:
+		case SNE_OP_LT:
+		case SNE_OP_LE:
+		case SNE_OP_GT:
+		case SNE_OP_GE:
+		case SNE_OP_EQ:
+		case SNE_OP_NE:
+			st = snexpr_static_type(&a[0]);
+			if(snexpr_convert_literal(&a[1], st) < 0) {
+				return -1;
+			}
+			if(st == SNE_ST_UNKNOWN) {
+				snexpr_dual_literal(&a[1]);
+			}
+			if(st == SNE_ST_NUM && snexpr_static_type(&a[1]) == SNE_ST_NUM) {
+				e->eflags |= SNEXPR_OPNUM;
+			}
+			return 0;
+		case SNE_OP_MATCH:
+		case SNE_OP_NMATCH:
+			/* the pattern became a literal */
+			if(e->param.op.match == NULL && a[1].type == SNE_OP_CONSTSTZ
+					&& a[1].param.stz.sval != NULL) {
+				e->param.op.match = snexpr_match_new(
+						a[1].param.stz.sval, a[1].param.stz.slen);
+			}
+			return 0;
+		default:
+			return 0;
+	}
+}
+
+/*
+ * Optimize the expression in place, before compiling it or moving it in an
+ * arena - return 0 on success, -1 on error (the expression can still be
+ * evaluated, but it should be destroyed)
+ */
+static inline int snexpr_optimize(struct snexpr *e)
+{
+	if(e == NULL || (e->eflags & SNEXPR_ARENA)) {
+		return -1;
+	}
+	return snexpr_optimize_node(e);
+}
+
+/*
+ * Binary images - snexpr_image_write() flattens an expression in a buffer
+ * without pointers: the nodes in prefix order, the variables and functions
+ * referenced by index in a table of names and the string literals interned
+ * in a table of strings. The bodies of the macros follow the nodes of the
+ * expression, each one after a node giving the number of its parameters.
+ * snexpr_image_load() checks the image and builds
+ * from it an arena expression, resolving the names with the lists given
+ * to it; the string literals are not copied, the image (e.g., a read-only
+ * memory mapping of a file) must stay valid while the expression is used.
+ * The image uses the byte order and the number type of the writer.
+ */
+#define SNEXPR_IMAGE_MAGIC "SNXI"
+#define SNEXPR_IMAGE_VERSION 4
+#define SNEXPR_IMAGE_BOM 0x01020304u
+#define SNEXPR_IMAGE_INT64 (1u << 0) /* numbers are 64-bit integers */
+#define SNEXPR_IMAGE_OPNUM (1u << 0) /* node flag for SNEXPR_OPNUM */
+#define SNEXPR_IMAGE_MCALL (1u << 1) /* call of the macro idx */
+#define SNEXPR_IMAGE_MDEF (1u << 2) /* macro, its body and its parameters */
+
+struct snexpr_ihdr
+{
+	char magic[4];
+	uint32_t version;
+	uint32_t bom;
+	uint32_t flags;
+	uint32_t nnodes;
+	uint32_t nvars;
+	uint32_t nfuncs;
+	uint32_t ssize; /* size of the table of strings */
+};
+
+struct snexpr_iref
+{
+	uint32_t soff; /* offset in the table of strings */
+	uint32_t slen;
+};
+
+struct snexpr_inode
+{
+	uint16_t type;
+	uint16_t flags;
+	uint32_t nargs;
+	union
+	{
+		double fval;
+		int64_t ival;
+		struct snexpr_iref str; /* SNE_OP_CONSTSTZ, the set of SNE_OP_IN */
+		uint32_t idx; /* SNE_OP_VAR, SNE_OP_FUNC - index in the names */
+	} u;
+};
+
+struct snexpr_istate
+{
+	sne_vec(struct snexpr_iref) strs;
+	sne_vec(const char *) sptrs;
+	sne_vec(struct snexpr_var *) vars;
+	sne_vec(struct snexpr_func *) funcs;
+	sne_vec(struct snexpr_macro *) macros;
+	sne_vec(int) names; /* strings of the names of vars and funcs */
+	uint32_t nnodes;
+	uint32_t ssize;
+	struct snexpr_inode *np; /* output, NULL while measuring */
+};
+
+/* index of the string in the table, adding it if needed, -1 on error */
+static int snexpr_image_str(
+		struct snexpr_istate *is, const char *s, size_t len)
+{
+	struct snexpr_iref r;
+	int i;
+
+	for(i = 0; i < sne_vec_len(&is->strs); i++) {
+		if(sne_vec_nth(&is->strs, i).slen == len
+				&& memcmp(sne_vec_nth(&is->sptrs, i), s, len) == 0) {
+			return i;
+		}
+	}
+	if(len > UINT32_MAX - 1 || is->ssize > UINT32_MAX - 1 - len) {
+		return -1;
+	}
+	r.soff = is->ssize;
+	r.slen = (uint32_t)len;
+	if(sne_vec_push(&is->strs, r) < 0) {
+		return -1;
+	}
+	if(sne_vec_push(&is->sptrs, s) < 0) {
+		(void)sne_vec_pop(&is->strs);
+		return -1;
+	}
+	is->ssize += (uint32_t)len + 1;
+	return i;
+}
+
+static int snexpr_image_node(struct snexpr_istate *is, struct snexpr *e)
+{
+	sne_vec_expr_t *args = &e->param.op.args;
+	struct snexpr_inode n;
+	int i;
+
+	memset(&n, 0, sizeof(struct snexpr_inode));
+	n.type = (uint16_t)e->type;
+	n.flags = (e->eflags & SNEXPR_OPNUM) ? SNEXPR_IMAGE_OPNUM : 0;
+	switch(e->type) {
+		case SNE_OP_CONSTNUM:
+#ifdef SNEXPR_INT64
+			n.u.ival = e->param.num.nval;
+#else
+			n.u.fval = e->param.num.nval;
+#endif
+			args = NULL;
+			break;
+		case SNE_OP_CONSTSTZ:
+			i = snexpr_image_str(is,
+					(e->param.stz.sval != NULL) ? e->param.stz.sval : "",
+					(e->param.stz.sval != NULL) ? e->param.stz.slen : 0);
+			if(i < 0) {
+				return -1;
+			}
+			n.u.str = sne_vec_nth(&is->strs, i);
+			args = NULL;
+			break;
+		case SNE_OP_VAR:
+			for(i = 0; i < sne_vec_len(&is->vars); i++) {
+				if(sne_vec_nth(&is->vars, i) == e->param.var.vref) {
+					break;
+				}
+			}
+			if(i == sne_vec_len(&is->vars)
+					&& sne_vec_push(&is->vars, e->param.var.vref) < 0) {
+				return -1;
+			}
+			n.u.idx = (uint32_t)i;
+			args = NULL;
+			break;
+		case SNE_OP_FUNC:
+			if(e->param.func.f->fflags & SNEXPR_FN_MACRO) {
+				for(i = 0; i < sne_vec_len(&is->macros); i++) {
+					if(&sne_vec_nth(&is->macros, i)->f == e->param.func.f) {
+						break;
+					}
+				}
+				if(i == sne_vec_len(&is->macros)
+						&& sne_vec_push(&is->macros,
+								   (struct snexpr_macro *)e->param.func.f)
+								   < 0) {
+					return -1;
+				}
+				n.flags |= SNEXPR_IMAGE_MCALL;
+			} else {
+				for(i = 0; i < sne_vec_len(&is->funcs); i++) {
+					if(sne_vec_nth(&is->funcs, i) == e->param.func.f) {
+						break;
+					}
+				}
+				if(i == sne_vec_len(&is->funcs)
+						&& sne_vec_push(&is->funcs, e->param.func.f) < 0) {
+					return -1;
+				}
+			}
+			n.u.idx = (uint32_t)i;
+			args = &e->param.func.args;
+			break;
+		case SNE_OP_IN:
+			/* the set is in the strings, it has no pointers */
+			if(e->param.op.set == NULL) {
+				return -1;
+			}
+			i = snexpr_image_str(is, (const char *)e->param.op.set,
+					e->param.op.set->size);
+			if(i < 0) {
+				return -1;
+			}
+			n.u.str = sne_vec_nth(&is->strs, i);
+			break;
+		default:
+			break;
+	}
+	if(args != NULL) {
+		n.nargs = (uint32_t)sne_vec_len(args);
+	}
+	if(is->np != NULL) {
+		memcpy(is->np++, &n, sizeof(struct snexpr_inode));
+	}
+	is->nnodes++;
+	for(i = 0; i < (int)n.nargs; i++) {
+		if(snexpr_image_node(is, &sne_vec_nth(args, i)) < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* the macros after the expression, including the ones found in their bodies */
+static int snexpr_image_macros(struct snexpr_istate *is)
+{
+	struct snexpr_macro *m;
+	struct snexpr_inode n;
+	struct snexpr p;
+	int i;
+	int k;
+
+	for(k = 0; k < sne_vec_len(&is->macros); k++) {
+		m = sne_vec_nth(&is->macros, k);
+		memset(&n, 0, sizeof(struct snexpr_inode));
+		n.type = SNE_OP_FUNC;
+		n.flags = SNEXPR_IMAGE_MDEF;
+		for(i = 0; i < SNEXPR_MACRO_NARGS && m->params[i] != NULL; i++)
+			;
+		n.nargs = (uint32_t)i + 1;
+		if(is->np != NULL) {
+			memcpy(is->np++, &n, sizeof(struct snexpr_inode));
+		}
+		is->nnodes++;
+		if(snexpr_image_node(is, &m->body) < 0) {
+			return -1;
+		}
+		for(i = 0; i < (int)n.nargs - 1; i++) {
+			p = snexpr_varref(m->params[i]);
+			if(snexpr_image_node(is, &p) < 0) {
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+static void snexpr_image_state_free(struct snexpr_istate *is)
+{
+	sne_vec_free(&is->strs);
+	sne_vec_free(&is->sptrs);
+	sne_vec_free(&is->vars);
+	sne_vec_free(&is->funcs);
+	sne_vec_free(&is->macros);
+	sne_vec_free(&is->names);
+}
+
+/*
+ * Write the image of the expression in buf - return its size, written only
+ * when it is not greater than size (buf can be NULL to get the size), or 0
+ * on error
+ */
+static inline size_t snexpr_image_write(struct snexpr *e, void *buf, size_t size)
+{
+	struct snexpr_istate is;
+	struct snexpr_ihdr h;
+	struct snexpr_iref r;
+	const char *name;
+	char *p;
+	size_t isize = 0;
+	int i;
+	int j;
+
+	if(e == NULL) {
+		return 0;
+	}
+	memset(&is, 0, sizeof(struct snexpr_istate));
+	if(snexpr_image_node(&is, e) < 0 || snexpr_image_macros(&is) < 0) {
+		goto done;
+	}
+	/* the names of the variables and functions are in the strings too */
+	for(i = 0; i < sne_vec_len(&is.vars) + sne_vec_len(&is.funcs); i++) {
+		name = (i < sne_vec_len(&is.vars))
+					   ? sne_vec_nth(&is.vars, i)->name
+					   : sne_vec_nth(&is.funcs, i - sne_vec_len(&is.vars))->name;
+		j = snexpr_image_str(&is, name, strlen(name));
+		if(j < 0 || sne_vec_push(&is.names, j) < 0) {
+			goto done;
+		}
+	}
+	isize = sizeof(struct snexpr_ihdr)
+			+ is.nnodes * sizeof(struct snexpr_inode)
+			+ (sne_vec_len(&is.vars) + sne_vec_len(&is.funcs))
+					  * sizeof(struct snexpr_iref)
+			+ is.ssize;
+	if(buf == NULL || size < isize) {
+		goto done;
+	}
+	memset(&h, 0, sizeof(struct snexpr_ihdr));
+	memcpy(h.magic, SNEXPR_IMAGE_MAGIC, 4);
+	h.version = SNEXPR_IMAGE_VERSION;
+	h.bom = SNEXPR_IMAGE_BOM;
+#ifdef SNEXPR_INT64
+	h.flags = SNEXPR_IMAGE_INT64;
+#endif
+	h.nnodes = is.nnodes;
+	h.nvars = (uint32_t)sne_vec_len(&is.vars);
+	h.nfuncs = (uint32_t)sne_vec_len(&is.funcs);
+	h.ssize = is.ssize;
+	p = (char *)buf;
+	memcpy(p, &h, sizeof(struct snexpr_ihdr));
+	p += sizeof(struct snexpr_ihdr);
+	/* second pass, the strings are found in the table */
+	is.np = (struct snexpr_inode *)p;
+	is.nnodes = 0;
+	if(snexpr_image_node(&is, e) < 0 || snexpr_image_macros(&is) < 0) {
+		isize = 0;
+		goto done;
+	}
+	p = (char *)is.np;
+	for(i = 0; i < sne_vec_len(&is.names); i++) {
+		r = sne_vec_nth(&is.strs, sne_vec_nth(&is.names, i));
+		memcpy(p, &r, sizeof(struct snexpr_iref));
+		p += sizeof(struct snexpr_iref);
+	}
+	for(i = 0; i < sne_vec_len(&is.strs); i++) {
+		memcpy(p, sne_vec_nth(&is.sptrs, i), sne_vec_nth(&is.strs, i).slen);
+		p += sne_vec_nth(&is.strs, i).slen;
+		*p++ = '\0';
+	}
+
+done:
+	snexpr_image_state_free(&is);
+	return isize;
+}
+
+struct snexpr_iload
+{
+	struct snexpr_ihdr h;
+	const char *nodes;
+	const char *strs;
+	struct snexpr_var **vars;
+	struct snexpr_func **funcs;
+	struct snexpr_macro *macros; /* in the arena */
+	uint32_t nmacros;
+	uint32_t pos; /* index of the next node */
+	int depth; /* of the node being built */
+	struct snexpr_apack ap;
+};
+
+/* the string of the reference, NULL if it is not in the table */
+static inline const char *snexpr_image_ref(
+		struct snexpr_iload *ld, struct snexpr_iref *r)
+{
+	if(r->slen >= ld->h.ssize || r->soff > ld->h.ssize - 1 - r->slen
+			|| ld->strs[r->soff + r->slen] != '\0') {
+		return NULL;
+	}
+	return ld->strs + r->soff;
+}
+
+/* check the nodes, computing the size of their parameters and contexts */
+static int snexpr_image_measure(struct snexpr_iload *ld)
+{
+	struct snexpr_inode n;
+	struct snexpr_func *f;
+	uint32_t i;
+
+	for(i = 0; i < ld->h.nnodes; i++) {
+		memcpy(&n, ld->nodes + i * sizeof(struct snexpr_inode),
+				sizeof(struct snexpr_inode));
+		if(n.type <= SNE_OP_UNKNOWN || n.type > SNE_OP_FUNC
+				|| n.nargs >= ld->h.nnodes) {
+			return -1;
+		}
+		if((n.flags & (SNEXPR_IMAGE_MCALL | SNEXPR_IMAGE_MDEF))
+				&& n.type != SNE_OP_FUNC) {
+			return -1;
+		}
+		if(n.flags & SNEXPR_IMAGE_MDEF) {
+			/* only the body and the parameters, in the macro */
+			if(n.nargs < 1 || n.nargs > SNEXPR_MACRO_NARGS + 1) {
+				return -1;
+			}
+			ld->nmacros++;
+			ld->ap.nsize += snexpr_arena_align(sizeof(struct snexpr_macro));
+			continue;
+		}
+		if(n.flags & SNEXPR_IMAGE_MCALL) {
+			ld->ap.nclean++;
+		} else if(n.type == SNE_OP_FUNC) {
+			if(n.u.idx >= ld->h.nfuncs) {
+				return -1;
+			}
+			f = ld->funcs[n.u.idx];
+			if(f->ctxsz > 0) {
+				ld->ap.nsize += snexpr_arena_align(f->ctxsz);
+			}
+			if((f->ctxsz > 0 && f->cleanup != NULL)
+					|| (f->fflags & SNEXPR_FN_PURE)) {
+				ld->ap.nclean++;
+			}
+		} else if(snexpr_is_compiled(n.type)) {
+			ld->ap.nclean++;
+		}
+		ld->ap.nsize += snexpr_arena_align(n.nargs * sizeof(struct snexpr));
+	}
+	return 0;
+}
+
+/* build the next node in dst, with its parameters */
+static int snexpr_image_build(struct snexpr_iload *ld, struct snexpr *dst)
+{
+	sne_vec_expr_t *args = &dst->param.op.args;
+	struct snexpr_inode n;
+	struct snexpr_func *f;
+	const char *p;
+	uint32_t i;
+
+	if(ld->pos >= ld->h.nnodes) {
+		return -1;
+	}
+	memcpy(&n, ld->nodes + ld->pos * sizeof(struct snexpr_inode),
+			sizeof(struct snexpr_inode));
+	ld->pos++;
+	memset(dst, 0, sizeof(struct snexpr));
+	dst->type = (enum snexpr_type)n.type;
+	dst->eflags = SNEXPR_ARENA;
+	if(n.flags & SNEXPR_IMAGE_OPNUM) {
+		dst->eflags |= SNEXPR_OPNUM;
+	}
+	switch(dst->type) {
+		case SNE_OP_CONSTNUM:
+#ifdef SNEXPR_INT64
+			dst->param.num.nval = n.u.ival;
+#else
+			dst->param.num.nval = (snexpr_num_t)n.u.fval;
+#endif
+			return (n.nargs == 0) ? 0 : -1;
+		case SNE_OP_CONSTSTZ:
+			p = snexpr_image_ref(ld, &n.u.str);
+			if(p == NULL || n.nargs != 0) {
+				return -1;
+			}
+			/* the string stays in the image */
+			dst->param.stz.sval = (char *)p;
+			dst->param.stz.slen = n.u.str.slen;
+			return 0;
+		case SNE_OP_VAR:
+			if(n.u.idx >= ld->h.nvars || n.nargs != 0) {
+				return -1;
+			}
+			dst->param.var.vref = ld->vars[n.u.idx];
+			return 0;
+		case SNE_OP_FUNC:
+			if(n.flags & SNEXPR_IMAGE_MDEF) {
+				return -1;
+			}
+			if(n.flags & SNEXPR_IMAGE_MCALL) {
+				if(n.u.idx >= ld->nmacros || n.nargs > SNEXPR_MACRO_NARGS) {
+					return -1;
+				}
+				f = &ld->macros[n.u.idx].f;
+			} else {
+				f = ld->funcs[n.u.idx];
+			}
+			if((f->fflags & SNEXPR_FN_NARGS) && n.nargs != (uint32_t)f->nargs) {
+				return -1;
+			}
+			dst->param.func.f = f;
+			if(f->ctxsz > 0) {
+				dst->param.func.context = ld->ap.np;
+				ld->ap.np += snexpr_arena_align(f->ctxsz);
+			}
+			if(snexpr_arena_needs_clean(dst)) {
+				ld->ap.clean[ld->ap.nclean++] = dst;
+			}
+			args = &dst->param.func.args;
+			break;
+		default:
+			if(n.nargs
+					!= ((snexpr_is_unary(dst->type) || dst->type == SNE_OP_IN)
+									? 1u
+									: 2u)) {
+				return -1;
+			}
+			break;
+	}
+	args->buf = snexpr_arena_nodes(&ld->ap, (int)n.nargs);
+	args->len = args->cap = (int)n.nargs;
+	if(n.nargs > 0 && ++ld->depth >= SNEXPR_MAX_DEPTH) {
+		return -1; /* too deep */
+	}
+	for(i = 0; i < n.nargs; i++) {
+		if(snexpr_image_build(ld, &args->buf[i]) < 0) {
+			return -1;
+		}
+	}
+	if(n.nargs > 0) {
+		ld->depth--;
+	}
+	if(dst->type == SNE_OP_ASSIGN && args->buf[0].type != SNE_OP_VAR) {
+		return -1;
+	}
+	if(snexpr_is_match(dst->type)) {
+		ld->ap.clean[ld->ap.nclean++] = dst;
+		if(args->buf[1].type == SNE_OP_CONSTSTZ) {
+			dst->param.op.match = snexpr_match_new(
+					args->buf[1].param.stz.sval, args->buf[1].param.stz.slen);
+			if(dst->param.op.match == NULL) {
+				return -1;
+			}
+		}
+	} else if(dst->type == SNE_OP_IN) {
+		ld->ap.clean[ld->ap.nclean++] = dst;
+		p = snexpr_image_ref(ld, &n.u.str);
+		if(p == NULL) {
+			return -1;
+		}
+		dst->param.op.set = snexpr_set_load(p, n.u.str.slen);
+		if(dst->param.op.set == NULL) {
+			return -1;
+		}
+	}
+	/* the operand types have to be the ones known by snexpr_optimize() */
+	if((dst->eflags & SNEXPR_OPNUM)
+			&& (!(dst->type == SNE_OP_PLUS
+						|| (dst->type >= SNE_OP_LT && dst->type <= SNE_OP_NE))
+					|| snexpr_static_type(&args->buf[0]) != SNE_ST_NUM
+					|| snexpr_static_type(&args->buf[1]) != SNE_ST_NUM)) {
+		return -1;
+	}
+	return 0;
+}
+
+/* build the next macro, its body and its parameters */
+static int snexpr_image_macro(struct snexpr_iload *ld, struct snexpr_macro *m)
+{
+	struct snexpr_inode n;
+	struct snexpr_inode pn;
+	struct snexpr p;
+	uint32_t i;
+
+	if(ld->pos >= ld->h.nnodes) {
+		return -1;
+	}
+	memcpy(&n, ld->nodes + ld->pos * sizeof(struct snexpr_inode),
+			sizeof(struct snexpr_inode));
+	ld->pos++;
+	if(!(n.flags & SNEXPR_IMAGE_MDEF)
+			|| snexpr_image_build(ld, &m->body) < 0) {
+		return -1;
+	}
+	for(i = 0; i < n.nargs - 1; i++) {
+		/* only variables, the local p must not be kept for the cleanup */
+		if(ld->pos >= ld->h.nnodes) {
+			return -1;
+		}
+		memcpy(&pn, ld->nodes + ld->pos * sizeof(struct snexpr_inode),
+				sizeof(struct snexpr_inode));
+		if(pn.type != SNE_OP_VAR || pn.nargs != 0
+				|| snexpr_image_build(ld, &p) < 0) {
+			return -1;
+		}
+		m->params[i] = p.param.var.vref;
+	}
+	return 0;
+}
+
+/* the macros of the image cannot call themselves, even indirectly */
+static int snexpr_image_mcheck(struct snexpr *e)
+{
+	sne_vec_expr_t *args = snexpr_node_args(e);
+	struct snexpr_macro *m;
+	int i;
+
+	if(e->type == SNE_OP_FUNC && (e->param.func.f->fflags & SNEXPR_FN_MACRO)) {
+		m = (struct snexpr_macro *)e->param.func.f;
+		if(m->mflags & SNEXPR_MACRO_VISIT) {
+			return -1;
+		}
+		if(!(m->mflags & SNEXPR_MACRO_DONE)) {
+			m->mflags |= SNEXPR_MACRO_VISIT;
+			if(snexpr_image_mcheck(&m->body) < 0) {
+				return -1;
+			}
+			m->mflags = (m->mflags & ~SNEXPR_MACRO_VISIT) | SNEXPR_MACRO_DONE;
+		}
+	}
+	for(i = 0; args != NULL && i < sne_vec_len(args); i++) {
+		if(snexpr_image_mcheck(&sne_vec_nth(args, i)) < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Load the expression from the image of size bytes, adding its variables
+ * to vars and finding its functions in funcs - return NULL if the image is
+ * not valid or not made for this build, or a function is not found (like
+ * snexpr_create(), evcbf is set to be used by snexpr_eval())
+ */
+static inline struct snexpr *snexpr_image_load(const void *img, size_t size,
+		struct snexpr_var_list *vars, struct snexpr_func *funcs,
+		snexternval_cbf_t evcbf)
+{
+	struct snexpr_iload ld;
+	struct snexpr_iref r;
+	struct snexpr_arena *a = NULL;
+	const char *names;
+	const char *p;
+	size_t hsize;
+	size_t csize;
+	uint32_t i;
+
+	memset(&ld, 0, sizeof(struct snexpr_iload));
+	if(img == NULL || size < sizeof(struct snexpr_ihdr)) {
+		return NULL;
+	}
+	memcpy(&ld.h, img, sizeof(struct snexpr_ihdr));
+	if(memcmp(ld.h.magic, SNEXPR_IMAGE_MAGIC, 4) != 0
+			|| ld.h.version != SNEXPR_IMAGE_VERSION
+			|| ld.h.bom != SNEXPR_IMAGE_BOM
+#ifdef SNEXPR_INT64
+			|| ld.h.flags != SNEXPR_IMAGE_INT64
+#else
+			|| ld.h.flags != 0
+#endif
+			|| ld.h.nnodes == 0) {
+		return NULL;
+	}
+	hsize = size - sizeof(struct snexpr_ihdr);
+	if(ld.h.nnodes > hsize / sizeof(struct snexpr_inode)
+			|| ld.h.nvars > hsize / sizeof(struct snexpr_iref)
+			|| ld.h.nfuncs > hsize / sizeof(struct snexpr_iref)
+			|| (size_t)ld.h.nnodes * sizeof(struct snexpr_inode)
+							   + ((size_t)ld.h.nvars + ld.h.nfuncs)
+										 * sizeof(struct snexpr_iref)
+							   + ld.h.ssize
+					   != hsize) {
+		return NULL;
+	}
+	ld.nodes = (const char *)img + sizeof(struct snexpr_ihdr);
+	names = ld.nodes + (size_t)ld.h.nnodes * sizeof(struct snexpr_inode);
+	ld.strs = names
+			  + ((size_t)ld.h.nvars + ld.h.nfuncs) * sizeof(struct snexpr_iref);
+
+	ld.vars = (struct snexpr_var **)snexpr_malloc(
+			((size_t)ld.h.nvars + ld.h.nfuncs + 1) * sizeof(void *));
+	if(ld.vars == NULL) {
+		return NULL;
+	}
+	ld.funcs = (struct snexpr_func **)(ld.vars + ld.h.nvars);
+	for(i = 0; i < ld.h.nvars + ld.h.nfuncs; i++) {
+		memcpy(&r, names + i * sizeof(struct snexpr_iref),
+				sizeof(struct snexpr_iref));
+		p = snexpr_image_ref(&ld, &r);
+		if(p == NULL) {
+			goto error;
+		}
+		if(i < ld.h.nvars) {
+			ld.vars[i] = snexpr_var_find(vars, p, r.slen);
+			if(ld.vars[i] == NULL) {
+				goto error;
+			}
+		} else {
+			ld.funcs[i - ld.h.nvars] = snexpr_func_find(funcs, p, r.slen);
+			if(ld.funcs[i - ld.h.nvars] == NULL) {
+				goto error; /* function not available */
+			}
+		}
+	}
+	if(snexpr_image_measure(&ld) < 0) {
+		goto error;
+	}
+	hsize = snexpr_arena_align(sizeof(struct snexpr_arena));
+	csize = snexpr_arena_align(ld.ap.nclean * sizeof(struct snexpr *));
+	a = (struct snexpr_arena *)snexpr_calloc(1, hsize + csize + ld.ap.nsize);
+	if(a == NULL) {
+		goto error;
+	}
+	a->size = hsize + csize + ld.ap.nsize;
+	a->clean = (struct snexpr **)((char *)a + hsize);
+	ld.ap.clean = a->clean;
+	ld.ap.nclean = 0;
+	ld.ap.np = (char *)a + hsize + csize;
+	ld.macros = (struct snexpr_macro *)ld.ap.np;
+	for(i = 0; i < ld.nmacros; i++) {
+		ld.macros[i].f.name = "";
+		ld.macros[i].f.fflags = SNEXPR_FN_MACRO;
+		ld.macros[i].refs = -1;
+		ld.ap.np += snexpr_arena_align(sizeof(struct snexpr_macro));
+	}
+	if(snexpr_image_build(&ld, &a->root) < 0) {
+		goto error;
+	}
+	for(i = 0; i < ld.nmacros; i++) {
+		if(snexpr_image_macro(&ld, &ld.macros[i]) < 0) {
+			goto error;
+		}
+	}
+	if(ld.pos != ld.h.nnodes) {
+		goto error;
+	}
+	/* before the recursive checks, which need the bodies not too deep */
+	if(snexpr_depth(&a->root, SNEXPR_MAX_DEPTH) > SNEXPR_MAX_DEPTH) {
+		goto error;
+	}
+	for(i = 0; i < ld.nmacros; i++) {
+		if(snexpr_depth(&ld.macros[i].body, SNEXPR_MAX_DEPTH) > SNEXPR_MAX_DEPTH
+				|| snexpr_image_mcheck(&ld.macros[i].body) < 0) {
+			goto error;
+		}
+	}
+	a->nclean = ld.ap.nclean;
+	snexpr_free(ld.vars);
+	_snexternval_cbf = evcbf;
+	return &a->root;
+
+error:
+	/* the function contexts were not used, no cleanup */
+	if(a != NULL) {
+		for(i = 0; i < (uint32_t)ld.ap.nclean; i++) {
+			if(snexpr_is_compiled(ld.ap.clean[i]->type)) {
+				snexpr_compiled_free(ld.ap.clean[i]);
+			}
+		}
+		snexpr_free(a);
+	}
+	snexpr_free(ld.vars);
+	return NULL;
+}
+
+/*
+ * Compiled expressions
+ *
+ * snexpr_compile() turns the tree built by snexpr_create() into a linear
+ * array of instructions that is executed by a loop over a value stack,
+ * without recursion and without allocating the intermediate results. The
+ * program keeps references to the nodes of the tree, which must not be
+ * destroyed while the program is in use.
+ */
+enum snexpr_vmop
+{
+	SNE_VM_NUM,		/* push a number */
+	SNE_VM_STZ,		/* push the string of a constant node (not copied) */
+	SNE_VM_NAN,		/* push NaN (unknown node type) */
+	SNE_VM_VAR,		/* push the value of a variable */
+	SNE_VM_FUNC,	/* push the result of a function */
+	SNE_VM_NEG,
+	SNE_VM_NOT,
+	SNE_VM_BNOT,
+	SNE_VM_CHKNUM,	/* check that the left operand is a number */
+	SNE_VM_POW,
+	SNE_VM_MUL,
+	SNE_VM_DIV,
+	SNE_VM_REM,
+	SNE_VM_PLUS,
+	SNE_VM_MINUS,
+	SNE_VM_SHL,
+	SNE_VM_SHR,
+	SNE_VM_CMP,		/* comparison, arg is the SNE_OP_LT ... SNE_OP_NE type */
+	SNE_VM_ADDNUM,	/* addition of numbers, from snexpr_optimize() */
+	SNE_VM_CMPNUM,	/* comparison of numbers, from snexpr_optimize() */
+	SNE_VM_CONCAT,	/* chain of additions, arg is the number of operands */
+	SNE_VM_MATCH,	/* match operator of the node, arg is its type */
+	SNE_VM_IN,		/* membership in the set of the node */
+	SNE_VM_BAND,
+	SNE_VM_BOR,
+	SNE_VM_BXOR,
+	SNE_VM_ANDL,	/* left side of &&, jump to arg if false */
+	SNE_VM_ANDR,	/* right side of && */
+	SNE_VM_ORL,		/* left side of ||, jump to arg if true */
+	SNE_VM_ORR,		/* right side of || */
+	SNE_VM_ASSIGN,	/* assign the top of the stack to a variable */
+	SNE_VM_CATCH,	/* left side of comma, errors resume at arg */
+	SNE_VM_UNCATCH, /* discard the left side of comma */
+	SNE_VM_ERROR,
+};
+
+struct snexpr_insn
+{
+	enum snexpr_vmop op;
+	int arg;
+	union
+	{
+		snexpr_num_t nval;
+		struct snexpr *node;
+	} u;
+};
+
+typedef sne_vec(struct snexpr_insn) sne_vec_insn_t;
+
+struct snexpr_prog
+{
+	struct snexpr_insn *code;
+	int ncode;
+	int maxstack; /* max depth of the value stack */
+	int maxcatch; /* max nesting of comma error handlers */
+};
+
+struct snexpr_cstate
+{
+	sne_vec_insn_t code;
+	int depth;
+	int maxdepth;
+	int ncatch;
+	int maxcatch;
+};
+
+static inline int snexpr_emit(
+		struct snexpr_cstate *cs, enum snexpr_vmop op, int arg, int delta)
+{
+	struct snexpr_insn in;
+	memset(&in, 0, sizeof(struct snexpr_insn));
+	in.op = op;
+	in.arg = arg;
+	if(sne_vec_push(&cs->code, in) == -1) {
+		return -1;
+	}
+	cs->depth += delta;
+	if(cs->depth > cs->maxdepth) {
+		cs->maxdepth = cs->depth;
+	}
+	return sne_vec_len(&cs->code) - 1;
+}
+
+/* if the evaluation of the node can change variables or call functions */
+static int snexpr_has_effects(struct snexpr *e)
+{
+	int i;
+
+	switch(e->type) {
+		case SNE_OP_ASSIGN:
+			return 1;
+		case SNE_OP_FUNC:
+			if(!(e->param.func.f->fflags & SNEXPR_FN_PURE)) {
+				return 1;
+			}
+			for(i = 0; i < sne_vec_len(&e->param.func.args); i++) {
+				if(snexpr_has_effects(&sne_vec_nth(&e->param.func.args, i))) {
+					return 1;
+				}
+			}
+			return 0;
+		case SNE_OP_CONSTNUM:
+		case SNE_OP_CONSTSTZ:
+		case SNE_OP_VAR:
+			return 0;
+		default:
+			for(i = 0; i < sne_vec_len(&e->param.op.args); i++) {
+				if(snexpr_has_effects(&sne_vec_nth(&e->param.op.args, i))) {
+					return 1;
+				}
+			}
+			return 0;
+	}
+}
+
+static int snexpr_compile_node(struct snexpr_cstate *cs, struct snexpr *e)
+{
+	enum snexpr_vmop op = SNE_VM_ERROR;
+	struct snexpr *n;
+	int pos;
+	int k;
+	int i;
+	int j;
+
+	switch(e->type) {
+		case SNE_OP_CONSTNUM:
+			if((pos = snexpr_emit(cs, SNE_VM_NUM, 0, 1)) < 0) {
+				return -1;
+			}
+			sne_vec_nth(&cs->code, pos).u.nval = e->param.num.nval;
+			return 0;
+		case SNE_OP_CONSTSTZ:
+		case SNE_OP_VAR:
+		case SNE_OP_FUNC:
+			op = (e->type == SNE_OP_CONSTSTZ)
+						 ? SNE_VM_STZ
+						 : ((e->type == SNE_OP_VAR) ? SNE_VM_VAR : SNE_VM_FUNC);
+			if((pos = snexpr_emit(cs, op, 0, 1)) < 0) {
+				return -1;
+			}
+			sne_vec_nth(&cs->code, pos).u.node = e;
+			return 0;
+		case SNE_OP_UNARY_MINUS:
+		case SNE_OP_UNARY_LOGICAL_NOT:
+		case SNE_OP_UNARY_BITWISE_NOT:
+			if(snexpr_compile_node(cs, &e->param.op.args.buf[0]) < 0) {
+				return -1;
+			}
+			op = (e->type == SNE_OP_UNARY_MINUS)
+						 ? SNE_VM_NEG
+						 : ((e->type == SNE_OP_UNARY_LOGICAL_NOT) ? SNE_VM_NOT
+																  : SNE_VM_BNOT);
+			return (snexpr_emit(cs, op, 0, 0) < 0) ? -1 : 0;
+		case SNE_OP_LOGICAL_AND:
+		case SNE_OP_LOGICAL_OR:
+			if(snexpr_compile_node(cs, &e->param.op.args.buf[0]) < 0) {
+				return -1;
+			}
+			/* the left value is consumed when the right side is evaluated */
+			pos = snexpr_emit(cs,
+					(e->type == SNE_OP_LOGICAL_AND) ? SNE_VM_ANDL : SNE_VM_ORL, 0,
+					-1);
+			if(pos < 0 || snexpr_compile_node(cs, &e->param.op.args.buf[1]) < 0) {
+				return -1;
+			}
+			if(snexpr_emit(cs,
+					   (e->type == SNE_OP_LOGICAL_AND) ? SNE_VM_ANDR : SNE_VM_ORR,
+					   0, 0)
+					< 0) {
+				return -1;
+			}
+			sne_vec_nth(&cs->code, pos).arg = sne_vec_len(&cs->code);
+			return 0;
+		case SNE_OP_ASSIGN:
+			if(snexpr_compile_node(cs, &e->param.op.args.buf[1]) < 0) {
+				return -1;
+			}
+			if(sne_vec_nth(&e->param.op.args, 0).type != SNE_OP_VAR) {
+				return (snexpr_emit(cs, SNE_VM_ERROR, 0, 0) < 0) ? -1 : 0;
+			}
+			if((pos = snexpr_emit(cs, SNE_VM_ASSIGN, 0, 0)) < 0) {
+				return -1;
+			}
+			sne_vec_nth(&cs->code, pos).u.node = &e->param.op.args.buf[0];
+			return 0;
+		case SNE_OP_COMMA:
+			/* errors on the left side are ignored, like in snexpr_eval() */
+			if((pos = snexpr_emit(cs, SNE_VM_CATCH, 0, 0)) < 0) {
+				return -1;
+			}
+			cs->ncatch++;
+			if(cs->ncatch > cs->maxcatch) {
+				cs->maxcatch = cs->ncatch;
+			}
+			if(snexpr_compile_node(cs, &e->param.op.args.buf[0]) < 0) {
+				return -1;
+			}
+			cs->ncatch--;
+			if(snexpr_emit(cs, SNE_VM_UNCATCH, 0, -1) < 0) {
+				return -1;
+			}
+			sne_vec_nth(&cs->code, pos).arg = sne_vec_len(&cs->code);
+			return snexpr_compile_node(cs, &e->param.op.args.buf[1]);
+		case SNE_OP_POWER:
+			op = SNE_VM_POW;
+			break;
+		case SNE_OP_MULTIPLY:
+			op = SNE_VM_MUL;
+			break;
+		case SNE_OP_DIVIDE:
+			op = SNE_VM_DIV;
+			break;
+		case SNE_OP_REMAINDER:
+			op = SNE_VM_REM;
+			break;
+		case SNE_OP_PLUS:
+			if((k = snexpr_concat_len(e)) > 0) {
+				for(n = e, i = k - 1; i > 0; i--) {
+					n = &n->param.op.args.buf[0];
+				}
+				if(snexpr_compile_node(cs, n) < 0) {
+					return -1;
+				}
+				/* the right operands, from the bottom of the chain */
+				for(i = 1; i < k; i++) {
+					n = e;
+					for(j = k - 1; j > i; j--) {
+						n = &n->param.op.args.buf[0];
+					}
+					if(snexpr_compile_node(cs, &n->param.op.args.buf[1]) < 0) {
+						return -1;
+					}
+				}
+				return (snexpr_emit(cs, SNE_VM_CONCAT, k, 1 - k) < 0) ? -1 : 0;
+			}
+			op = SNE_VM_PLUS;
+			break;
+		case SNE_OP_MINUS:
+			op = SNE_VM_MINUS;
+			break;
+		case SNE_OP_SHL:
+			op = SNE_VM_SHL;
+			break;
+		case SNE_OP_SHR:
+			op = SNE_VM_SHR;
+			break;
+		case SNE_OP_LT:
+		case SNE_OP_LE:
+		case SNE_OP_GT:
+		case SNE_OP_GE:
+		case SNE_OP_EQ:
+		case SNE_OP_NE:
+			op = SNE_VM_CMP;
+			break;
+		case SNE_OP_MATCH:
+		case SNE_OP_NMATCH:
+			/* the node keeps the compiled pattern */
+			if(snexpr_compile_node(cs, &e->param.op.args.buf[0]) < 0
+					|| snexpr_compile_node(cs, &e->param.op.args.buf[1]) < 0) {
+				return -1;
+			}
+			if((pos = snexpr_emit(cs, SNE_VM_MATCH, (int)e->type, -1)) < 0) {
+				return -1;
+			}
+			sne_vec_nth(&cs->code, pos).u.node = e;
+			return 0;
+		case SNE_OP_IN:
+			if(snexpr_compile_node(cs, &e->param.op.args.buf[0]) < 0
+					|| (pos = snexpr_emit(cs, SNE_VM_IN, 0, 0)) < 0) {
+				return -1;
+			}
+			sne_vec_nth(&cs->code, pos).u.node = e;
+			return 0;
+		case SNE_OP_BITWISE_AND:
+			op = SNE_VM_BAND;
+			break;
+		case SNE_OP_BITWISE_OR:
+			op = SNE_VM_BOR;
+			break;
+		case SNE_OP_BITWISE_XOR:
+			op = SNE_VM_BXOR;
+			break;
+		default:
+			return (snexpr_emit(cs, SNE_VM_NAN, 0, 1) < 0) ? -1 : 0;
+	}
+
+	/* binary operators */
+	if(snexpr_compile_node(cs, &e->param.op.args.buf[0]) < 0) {
+		return -1;
+	}
+	/* the type of the left operand is checked before evaluating the right
+	 * side, when doing it later would run the side effects of the right side
+	 * for an expression that fails */
+	if(op != SNE_VM_PLUS && op != SNE_VM_CMP
+			&& snexpr_static_type(&e->param.op.args.buf[0]) != SNE_ST_NUM
+			&& snexpr_has_effects(&e->param.op.args.buf[1])
+			&& snexpr_emit(cs, SNE_VM_CHKNUM, 0, 0) < 0) {
+		return -1;
+	}
+	if(snexpr_compile_node(cs, &e->param.op.args.buf[1]) < 0) {
+		return -1;
+	}
+	if(e->eflags & SNEXPR_OPNUM) {
+		op = (op == SNE_VM_PLUS) ? SNE_VM_ADDNUM : SNE_VM_CMPNUM;
+	}
+	if((pos = snexpr_emit(cs, op, (int)e->type, -1)) < 0) {
+		return -1;
+	}
+	if(e->param.op.args.buf[1].eflags & (SNEXPR_DUALNUM | SNEXPR_DUALSTZ)) {
+		/* the literal is converted with its other representation */
+		sne_vec_nth(&cs->code, pos).u.node = &e->param.op.args.buf[1];
+	}
+	return 0;
+}
+
+static inline struct snexpr_prog *snexpr_compile(struct snexpr *e)
+{
+	struct snexpr_cstate cs;
+	struct snexpr_prog *p = NULL;
+
+	if(e == NULL) {
+		return NULL;
+	}
+	memset(&cs, 0, sizeof(struct snexpr_cstate));
+	if(snexpr_compile_node(&cs, e) < 0) {
+		sne_vec_free(&cs.code);
+		return NULL;
+	}
+	p = (struct snexpr_prog *)snexpr_calloc(1, sizeof(struct snexpr_prog));
+	if(p == NULL) {
+		sne_vec_free(&cs.code);
+		return NULL;
+	}
+	p->code = cs.code.buf;
+	p->ncode = cs.code.len;
+	p->maxstack = cs.maxdepth;
+	p->maxcatch = cs.maxcatch;
+	return p;
+}
+
+static inline void snexpr_prog_destroy(struct snexpr_prog *p)
+{
+	if(p == NULL) {
+		return;
+	}
+	if(p->code != NULL) {
+		snexpr_free(p->code);
+	}
+	snexpr_free(p);
+}
+
+#define SNEXPR_VM_LSTACK 16
+
+#define snexpr_vm_binnum(_EXPR_) do { \
+		a = &stk[sp - 2]; \
+		b = &stk[sp - 1]; \
+		if(a->type != SNE_OP_CONSTNUM || b->type != SNE_OP_CONSTNUM) { \
+			goto error; \
+		} \
+		a->param.num.nval = (_EXPR_); \
+		sp--; \
+	} while(0)
+
+/* make room for n more items on a stack of the scratch area, the buffer
+ * pointer is accessed with memcpy() like in sne_vec_expand() */
+static inline int snexpr_scratch_grow(
+		void *bufp, int *len, int *cap, int memsz, int n)
+{
+	void *buf;
+	void *ptr;
+	if(*len + n <= *cap) {
+		return 0;
+	}
+	memcpy(&buf, bufp, sizeof(void *));
+	ptr = snexpr_realloc(buf, (*len + n) * memsz);
+	if(ptr == NULL) {
+		return -1;
+	}
+	memcpy(bufp, &ptr, sizeof(void *));
+	*cap = *len + n;
+	return 0;
+}
+
+/*
+ * Execute a compiled expression, storing the result in the value res
+ * - return 0 on success, -1 on error. The stacks are taken from the
+ * scratch area of the context when it is not NULL, otherwise they are
+ * local or allocated for large programs.
+ */
+static int snexpr_prog_run(
+		struct snexpr_prog *p, struct snexpr_ctx *ctx, struct snexpr *res)
+{
+	struct snexpr_scratch *sc = snexpr_ctx_scratch(ctx);
+	struct snexpr lstk[SNEXPR_VM_LSTACK];
+	int lhstk[2 * SNEXPR_VM_LSTACK];
+	struct snexpr *stk = lstk;
+	int *hstk = lhstk;
+	struct snexpr *a;
+	struct snexpr *b;
+	struct snexpr_insn *in;
+	struct snexpr tv;
+	snexpr_num_t n;
+	int i;
+	int pc;
+	int sp = 0;
+	int hp = 0;
+	int vbase = 0;
+	int hbase = 0;
+	int ret = -1;
+
+	if(sc != NULL) {
+		vbase = sc->vlen;
+		hbase = sc->hlen;
+		if(snexpr_scratch_grow(&sc->vstk, &sc->vlen, &sc->vcap,
+				   sizeof(struct snexpr), p->maxstack)
+						< 0
+				|| snexpr_scratch_grow(&sc->hstk, &sc->hlen, &sc->hcap,
+						   sizeof(int), 2 * p->maxcatch)
+						   < 0) {
+			return -1;
+		}
+		sc->vlen += p->maxstack;
+		sc->hlen += 2 * p->maxcatch;
+		stk = sc->vstk + vbase;
+		hstk = sc->hstk + hbase;
+	} else {
+		if(p->maxstack > SNEXPR_VM_LSTACK) {
+			stk = (struct snexpr *)snexpr_malloc(p->maxstack * sizeof(struct snexpr));
+			if(stk == NULL) {
+				return -1;
+			}
+		}
+		if(p->maxcatch > SNEXPR_VM_LSTACK) {
+			hstk = (int *)snexpr_malloc(2 * p->maxcatch * sizeof(int));
+			if(hstk == NULL) {
+				goto done;
+			}
+		}
+	}
+
+	for(pc = 0; pc < p->ncode; pc++) {
+		in = &p->code[pc];
+		switch(in->op) {
+			case SNE_VM_NUM:
+				snexpr_val_setnum(&stk[sp++], in->u.nval);
+				continue;
+			case SNE_VM_STZ:
+				if(in->u.node->param.stz.sval == NULL) {
+					goto error;
+				}
+				stk[sp].type = SNE_OP_CONSTSTZ;
+				stk[sp].eflags = 0;
+				stk[sp].param.stz.slen = in->u.node->param.stz.slen;
+				stk[sp++].param.stz.sval = in->u.node->param.stz.sval;
+				continue;
+			case SNE_VM_NAN:
+				snexpr_val_setnum(&stk[sp++], SNEXPR_NUM_NAN);
+				continue;
+			case SNE_VM_VAR:
+			case SNE_VM_FUNC:
+				/* callbacks can run other evaluations using the scratch area */
+				i = (in->op == SNE_VM_VAR)
+							? snexpr_val_var(ctx, &tv, in->u.node->param.var.vref)
+							: snexpr_val_func(ctx, &tv, in->u.node);
+				if(sc != NULL) {
+					stk = sc->vstk + vbase;
+					hstk = sc->hstk + hbase;
+				}
+				snexpr_val_move(&stk[sp++], &tv);
+				if(i < 0) {
+					goto error;
+				}
+				continue;
+			case SNE_VM_NEG:
+				if(stk[sp - 1].type != SNE_OP_CONSTNUM) {
+					goto error;
+				}
+				stk[sp - 1].param.num.nval =
+						snexpr_num_neg(stk[sp - 1].param.num.nval);
+				continue;
+			case SNE_VM_NOT:
+				if(stk[sp - 1].type != SNE_OP_CONSTNUM) {
+					goto error;
+				}
+				stk[sp - 1].param.num.nval = !stk[sp - 1].param.num.nval;
+				continue;
+			case SNE_VM_BNOT:
+				if(stk[sp - 1].type != SNE_OP_CONSTNUM) {
+					goto error;
+				}
+				stk[sp - 1].param.num.nval = ~(to_int(stk[sp - 1].param.num.nval));
+				continue;
+			case SNE_VM_CHKNUM:
+				if(stk[sp - 1].type != SNE_OP_CONSTNUM) {
+					goto error;
+				}
+				continue;
+			case SNE_VM_POW:
+				snexpr_vm_binnum(
+						snexpr_num_pow(a->param.num.nval, b->param.num.nval));
+				continue;
+			case SNE_VM_MUL:
+				snexpr_vm_binnum(
+						snexpr_num_mul(a->param.num.nval, b->param.num.nval));
+				continue;
+			case SNE_VM_DIV:
+				if(stk[sp - 1].type == SNE_OP_CONSTNUM
+						&& stk[sp - 1].param.num.nval == 0) {
+					goto error;
+				}
+				snexpr_vm_binnum(
+						snexpr_num_div(a->param.num.nval, b->param.num.nval));
+				continue;
+			case SNE_VM_REM:
+#ifdef SNEXPR_INT64
+				if(stk[sp - 1].type == SNE_OP_CONSTNUM
+						&& stk[sp - 1].param.num.nval == 0) {
+					goto error;
+				}
+#endif
+				snexpr_vm_binnum(
+						snexpr_num_rem(a->param.num.nval, b->param.num.nval));
+				continue;
+			case SNE_VM_MINUS:
+				snexpr_vm_binnum(
+						snexpr_num_sub(a->param.num.nval, b->param.num.nval));
+				continue;
+			case SNE_VM_SHL:
+				snexpr_vm_binnum(
+						snexpr_num_shl(a->param.num.nval, b->param.num.nval));
+				continue;
+			case SNE_VM_SHR:
+				snexpr_vm_binnum(
+						snexpr_num_shr(a->param.num.nval, b->param.num.nval));
+				continue;
+			case SNE_VM_BAND:
+				snexpr_vm_binnum(
+						to_int(a->param.num.nval) & to_int(b->param.num.nval));
+				continue;
+			case SNE_VM_BOR:
+				snexpr_vm_binnum(
+						to_int(a->param.num.nval) | to_int(b->param.num.nval));
+				continue;
+			case SNE_VM_BXOR:
+				snexpr_vm_binnum(
+						to_int(a->param.num.nval) ^ to_int(b->param.num.nval));
+				continue;
+			case SNE_VM_PLUS:
+				if(in->u.node != NULL && stk[sp - 2].type != stk[sp - 1].type) {
+					snexpr_val_dual(&stk[sp - 1], in->u.node);
+				}
+				if(snexpr_val_plus(sc, &stk[sp - 2], &stk[sp - 1]) < 0) {
+					goto error;
+				}
+				sp--;
+				continue;
+			case SNE_VM_CONCAT:
+				if(snexpr_val_concat(sc, &stk[sp - in->arg], in->arg) < 0) {
+					sp -= in->arg - 1;
+					goto error;
+				}
+				sp -= in->arg - 1;
+				continue;
+			case SNE_VM_CMP:
+				if(in->u.node != NULL && stk[sp - 2].type != stk[sp - 1].type) {
+					snexpr_val_dual(&stk[sp - 1], in->u.node);
+				}
+				if(snexpr_val_cmp(sc, (enum snexpr_type)in->arg, &stk[sp - 2],
+						   &stk[sp - 1])
+						< 0) {
+					goto error;
+				}
+				sp--;
+				continue;
+			case SNE_VM_MATCH:
+				if(snexpr_val_match(sc, (enum snexpr_type)in->arg,
+						   in->u.node->param.op.match, &stk[sp - 2],
+						   &stk[sp - 1])
+						< 0) {
+					goto error;
+				}
+				sp--;
+				continue;
+			case SNE_VM_IN:
+				if(snexpr_val_in(in->u.node->param.op.set, &stk[sp - 1]) < 0) {
+					goto error;
+				}
+				continue;
+			case SNE_VM_ADDNUM:
+				stk[sp - 2].param.num.nval = snexpr_num_add(
+						stk[sp - 2].param.num.nval, stk[sp - 1].param.num.nval);
+				sp--;
+				continue;
+			case SNE_VM_CMPNUM:
+				stk[sp - 2].param.num.nval =
+						snexpr_cmp_num((enum snexpr_type)in->arg,
+								stk[sp - 2].param.num.nval, stk[sp - 1].param.num.nval);
+				sp--;
+				continue;
+			case SNE_VM_ANDL:
+				n = snexpr_val_num(&stk[sp - 1]);
+				snexpr_val_release(&stk[sp - 1]);
+				if(n == 0) {
+					snexpr_val_setnum(&stk[sp - 1], 0);
+					pc = in->arg - 1;
+				} else {
+					sp--;
+				}
+				continue;
+			case SNE_VM_ORL:
+				n = snexpr_val_num(&stk[sp - 1]);
+				snexpr_val_release(&stk[sp - 1]);
+				if(n != 0 && !snexpr_num_isnan(n)) {
+					snexpr_val_setnum(&stk[sp - 1], n);
+					pc = in->arg - 1;
+				} else {
+					sp--;
+				}
+				continue;
+			case SNE_VM_ANDR:
+			case SNE_VM_ORR:
+				n = snexpr_val_num(&stk[sp - 1]);
+				snexpr_val_release(&stk[sp - 1]);
+				snexpr_val_setnum(&stk[sp - 1], (n != 0) ? n : 0);
+				continue;
+			case SNE_VM_ASSIGN:
+				if(snexpr_var_assign(in->u.node->param.var.vref, &stk[sp - 1])
+						< 0) {
+					goto error;
+				}
+				continue;
+			case SNE_VM_CATCH:
+				hstk[hp++] = in->arg;
+				hstk[hp++] = sp;
+				continue;
+			case SNE_VM_UNCATCH:
+				hp -= 2;
+				snexpr_val_release(&stk[--sp]);
+				continue;
+			default:
+				goto error;
+		}
+	error:
+		if(hp == 0) {
+			goto done;
+		}
+		/* resume with the right side of the innermost comma */
+		hp -= 2;
+		while(sp > hstk[hp + 1]) {
+			snexpr_val_release(&stk[--sp]);
+		}
+		pc = hstk[hp] - 1;
+	}
+
+	if(sp == 1) {
+		snexpr_val_move(res, &stk[0]);
+		sp = 0;
+		ret = 0;
+	}
+
+done:
+	while(sp > 0) {
+		snexpr_val_release(&stk[--sp]);
+	}
+	if(sc != NULL) {
+		sc->vlen = vbase;
+		sc->hlen = hbase;
+	} else {
+		if(stk != lstk) {
+			snexpr_free(stk);
+		}
+		if(hstk != lhstk) {
+			snexpr_free(hstk);
+		}
+	}
+	return ret;
+}
+
+/*
+ * Evaluate a compiled expression writing the result in the value res, with
+ * the same rules as snexpr_eval_into()
+ */
+static inline int snexpr_prog_eval_into(
+		struct snexpr_prog *p, struct snexpr_ctx *ctx, struct snexpr *res)
+{
+	int ret;
+
+	if(p == NULL) {
+		return -1;
+	}
+	if(ctx != NULL && ctx->scratch.depth++ == 0) {
+		snexpr_scratch_reset(&ctx->scratch);
+	}
+	ret = snexpr_prog_run(p, ctx, res);
+	if(ret == 0 && snexpr_result_unborrow(snexpr_ctx_scratch(ctx), res) < 0) {
+		ret = -1;
+	}
+	if(ctx != NULL) {
+		ctx->scratch.depth--;
+	}
+	return ret;
+}
+
+/*
+ * Evaluate a compiled expression, returning the result like snexpr_eval()
+ */
+static inline struct snexpr *snexpr_prog_eval(struct snexpr_prog *p)
+{
+	struct snexpr v;
+
+	if(snexpr_prog_eval_into(p, NULL, &v) < 0) {
+		return NULL;
+	}
+	return snexpr_val_result(&v);
+}
+
+/*
+ * Batch evaluation
+ *
+ * snexpr_prog_eval_batch() evaluates a compiled expression for many rows,
+ * taking the values of the variables from columns of numbers indexed by the
+ * slot of the variable. Numeric programs are run one operation at a time
+ * over blocks of rows, with SIMD kernels for the arithmetic and comparison
+ * operators when the target has them (AVX, SSE2 or AArch64 NEON, disabled
+ * by defining SNEXPR_NO_SIMD). The other programs are evaluated row by row.
+ */
+#define SNEXPR_BATCH_ROWS 256
+
+#if !defined(SNEXPR_NO_SIMD) && !defined(SNEXPR_INT64) && defined(__AVX__)
+#include <immintrin.h>
+#define SNEXPR_VW 8
+typedef __m256 snexpr_vf_t;
+#define snexpr_vf_load(p) _mm256_loadu_ps(p)
+#define snexpr_vf_store(p, v) _mm256_storeu_ps(p, v)
+#define snexpr_vf_add(a, b) _mm256_add_ps(a, b)
+#define snexpr_vf_sub(a, b) _mm256_sub_ps(a, b)
+#define snexpr_vf_mul(a, b) _mm256_mul_ps(a, b)
+#define snexpr_vf_div(a, b) _mm256_div_ps(a, b)
+#define snexpr_vf_bool(m) _mm256_and_ps(m, _mm256_set1_ps(1.0f))
+#define snexpr_vf_lt(a, b) _mm256_cmp_ps(a, b, _CMP_LT_OQ)
+#define snexpr_vf_le(a, b) _mm256_cmp_ps(a, b, _CMP_LE_OQ)
+#define snexpr_vf_gt(a, b) _mm256_cmp_ps(a, b, _CMP_GT_OQ)
+#define snexpr_vf_ge(a, b) _mm256_cmp_ps(a, b, _CMP_GE_OQ)
+#define snexpr_vf_eq(a, b) _mm256_cmp_ps(a, b, _CMP_EQ_OQ)
+#define snexpr_vf_ne(a, b) _mm256_cmp_ps(a, b, _CMP_NEQ_UQ)
+#elif !defined(SNEXPR_NO_SIMD) && !defined(SNEXPR_INT64) && defined(__SSE2__)
+#include <emmintrin.h>
+#define SNEXPR_VW 4
+typedef __m128 snexpr_vf_t;
+#define snexpr_vf_load(p) _mm_loadu_ps(p)
+#define snexpr_vf_store(p, v) _mm_storeu_ps(p, v)
+#define snexpr_vf_add(a, b) _mm_add_ps(a, b)
+#define snexpr_vf_sub(a, b) _mm_sub_ps(a, b)
+#define snexpr_vf_mul(a, b) _mm_mul_ps(a, b)
+#define snexpr_vf_div(a, b) _mm_div_ps(a, b)
+#define snexpr_vf_bool(m) _mm_and_ps(m, _mm_set1_ps(1.0f))
+#define snexpr_vf_lt(a, b) _mm_cmplt_ps(a, b)
+#define snexpr_vf_le(a, b) _mm_cmple_ps(a, b)
+#define snexpr_vf_gt(a, b) _mm_cmpgt_ps(a, b)
+#define snexpr_vf_ge(a, b) _mm_cmpge_ps(a, b)
+#define snexpr_vf_eq(a, b) _mm_cmpeq_ps(a, b)
+#define snexpr_vf_ne(a, b) _mm_cmpneq_ps(a, b)
+#elif !defined(SNEXPR_NO_SIMD) && !defined(SNEXPR_INT64) && defined(__ARM_NEON) \
+		&& defined(__aarch64__)
+#include <arm_neon.h>
+#define SNEXPR_VW 4
+typedef float32x4_t snexpr_vf_t;
+#define snexpr_vf_load(p) vld1q_f32(p)
+#define snexpr_vf_store(p, v) vst1q_f32(p, v)
+#define snexpr_vf_add(a, b) vaddq_f32(a, b)
+#define snexpr_vf_sub(a, b) vsubq_f32(a, b)
+#define snexpr_vf_mul(a, b) vmulq_f32(a, b)
+#define snexpr_vf_div(a, b) vdivq_f32(a, b)
+#define snexpr_vf_bool(m) \
+	vreinterpretq_f32_u32(vandq_u32(m, vreinterpretq_u32_f32(vdupq_n_f32(1.0f))))
+#define snexpr_vf_lt(a, b) vcltq_f32(a, b)
+#define snexpr_vf_le(a, b) vcleq_f32(a, b)
+#define snexpr_vf_gt(a, b) vcgtq_f32(a, b)
+#define snexpr_vf_ge(a, b) vcgeq_f32(a, b)
+#define snexpr_vf_eq(a, b) vceqq_f32(a, b)
+#define snexpr_vf_ne(a, b) vmvnq_u32(vceqq_f32(a, b))
+#else
+#define SNEXPR_VW 1
+#endif
+
+#if SNEXPR_VW > 1
+#define snexpr_batch_vloop(_VEXPR_)                                 \
+	for(; i + SNEXPR_VW <= n; i += SNEXPR_VW) {                     \
+		snexpr_vf_t va = snexpr_vf_load(a + i);                     \
+		snexpr_vf_t vb = snexpr_vf_load(b + i);                     \
+		snexpr_vf_store(a + i, _VEXPR_);                            \
+	}
+#else
+#define snexpr_batch_vloop(_VEXPR_)
+#endif
+
+#define snexpr_batch_loop(_EXPR_)    \
+	for(; i < n; i++) {              \
+		a[i] = (_EXPR_);             \
+	}
+
+/* a = a <op> b over n rows, the row errors of b are added to the ones of a */
+static void snexpr_batch_binop(struct snexpr_insn *in, snexpr_num_t *a,
+		const snexpr_num_t *b, unsigned char *ea, const unsigned char *eb, int n)
+{
+	int i = 0;
+
+	switch(in->op) {
+		case SNE_VM_PLUS:
+		case SNE_VM_ADDNUM:
+		case SNE_VM_CONCAT:
+			snexpr_batch_vloop(snexpr_vf_add(va, vb));
+			snexpr_batch_loop(snexpr_num_add(a[i], b[i]));
+			break;
+		case SNE_VM_MINUS:
+			snexpr_batch_vloop(snexpr_vf_sub(va, vb));
+			snexpr_batch_loop(snexpr_num_sub(a[i], b[i]));
+			break;
+		case SNE_VM_MUL:
+			snexpr_batch_vloop(snexpr_vf_mul(va, vb));
+			snexpr_batch_loop(snexpr_num_mul(a[i], b[i]));
+			break;
+		case SNE_VM_DIV:
+			snexpr_batch_vloop(snexpr_vf_div(va, vb));
+			snexpr_batch_loop((b[i] != 0) ? snexpr_num_div(a[i], b[i]) : 0);
+			for(i = 0; i < n; i++) {
+				ea[i] |= (b[i] == 0);
+			}
+			break;
+		case SNE_VM_POW:
+			snexpr_batch_loop(snexpr_num_pow(a[i], b[i]));
+			break;
+		case SNE_VM_REM:
+#ifdef SNEXPR_INT64
+			snexpr_batch_loop((b[i] != 0) ? snexpr_num_rem(a[i], b[i]) : 0);
+			for(i = 0; i < n; i++) {
+				ea[i] |= (b[i] == 0);
+			}
+#else
+			snexpr_batch_loop(snexpr_num_rem(a[i], b[i]));
+#endif
+			break;
+		case SNE_VM_SHL:
+			snexpr_batch_loop(snexpr_num_shl(a[i], b[i]));
+			break;
+		case SNE_VM_SHR:
+			snexpr_batch_loop(snexpr_num_shr(a[i], b[i]));
+			break;
+		case SNE_VM_BAND:
+			snexpr_batch_loop(to_int(a[i]) & to_int(b[i]));
+			break;
+		case SNE_VM_BOR:
+			snexpr_batch_loop(to_int(a[i]) | to_int(b[i]));
+			break;
+		case SNE_VM_BXOR:
+			snexpr_batch_loop(to_int(a[i]) ^ to_int(b[i]));
+			break;
+		default:
+			/* SNE_VM_CMP and SNE_VM_CMPNUM */
+			switch((enum snexpr_type)in->arg) {
+				case SNE_OP_LT:
+					snexpr_batch_vloop(snexpr_vf_bool(snexpr_vf_lt(va, vb)));
+					snexpr_batch_loop(a[i] < b[i]);
+					break;
+				case SNE_OP_LE:
+					snexpr_batch_vloop(snexpr_vf_bool(snexpr_vf_le(va, vb)));
+					snexpr_batch_loop(a[i] <= b[i]);
+					break;
+				case SNE_OP_GT:
+					snexpr_batch_vloop(snexpr_vf_bool(snexpr_vf_gt(va, vb)));
+					snexpr_batch_loop(a[i] > b[i]);
+					break;
+				case SNE_OP_GE:
+					snexpr_batch_vloop(snexpr_vf_bool(snexpr_vf_ge(va, vb)));
+					snexpr_batch_loop(a[i] >= b[i]);
+					break;
+				case SNE_OP_EQ:
+					snexpr_batch_vloop(snexpr_vf_bool(snexpr_vf_eq(va, vb)));
+					snexpr_batch_loop(a[i] == b[i]);
+					break;
+				default:
+					snexpr_batch_vloop(snexpr_vf_bool(snexpr_vf_ne(va, vb)));
+					snexpr_batch_loop(a[i] != b[i]);
+			}
+	}
+	for(i = 0; i < n; i++) {
+		ea[i] |= eb[i];
+	}
+}
+
+/*
+ * Stack depth needed to run the program over blocks of rows, -1 if it uses
+ * strings, functions or assignments and has to be evaluated row by row
+ */
+static int snexpr_batch_depth(struct snexpr_prog *p)
+{
+	int depth = 0;
+	int maxdepth = 0;
+	int pc;
+
+	for(pc = 0; pc < p->ncode; pc++) {
+		switch(p->code[pc].op) {
+			case SNE_VM_NUM:
+			case SNE_VM_NAN:
+			case SNE_VM_VAR:
+				depth++;
+				break;
+			case SNE_VM_NEG:
+			case SNE_VM_NOT:
+			case SNE_VM_BNOT:
+			case SNE_VM_IN:
+			case SNE_VM_CHKNUM:
+			case SNE_VM_ANDL:
+			case SNE_VM_ORL:
+			case SNE_VM_CATCH:
+				break;
+			case SNE_VM_CONCAT:
+				depth -= p->code[pc].arg - 1;
+				break;
+			case SNE_VM_POW:
+			case SNE_VM_MUL:
+			case SNE_VM_DIV:
+			case SNE_VM_REM:
+			case SNE_VM_PLUS:
+			case SNE_VM_MINUS:
+			case SNE_VM_SHL:
+			case SNE_VM_SHR:
+			case SNE_VM_CMP:
+			case SNE_VM_ADDNUM:
+			case SNE_VM_CMPNUM:
+			case SNE_VM_BAND:
+			case SNE_VM_BOR:
+			case SNE_VM_BXOR:
+			case SNE_VM_ANDR:
+			case SNE_VM_ORR:
+			case SNE_VM_UNCATCH:
+				depth--;
+				break;
+			default:
+				return -1;
+		}
+		if(depth > maxdepth) {
+			maxdepth = depth;
+		}
+	}
+	return maxdepth;
+}
+
+/* evaluate the program for each row, assigning the column variables */
+static int snexpr_batch_rows(struct snexpr_prog *p, struct snexpr_ctx *ctx,
+		const snexpr_num_t *const *cols, int ncols, size_t nrows, snexpr_num_t *out)
+{
+	struct snexpr_var *v;
+	struct snexpr r;
+	size_t row;
+	int pc;
+
+	for(row = 0; row < nrows; row++) {
+		for(pc = 0; pc < p->ncode; pc++) {
+			if(p->code[pc].op != SNE_VM_VAR) {
+				continue;
+			}
+			v = p->code[pc].u.node->param.var.vref;
+			if(v->slot < ncols && cols[v->slot] != NULL) {
+				snexpr_val_setnum(&r, cols[v->slot][row]);
+				snexpr_var_assign(v, &r);
+			}
+		}
+		if(snexpr_prog_eval_into(p, ctx, &r) < 0) {
+			out[row] = SNEXPR_NUM_NAN;
+			continue;
+		}
+		out[row] = (r.type == SNE_OP_CONSTNUM) ? r.param.num.nval
+											   : SNEXPR_NUM_NAN;
+		snexpr_result_free(&r);
+	}
+	return 0;
+}
+
+/*
+ * Evaluate the compiled expression for nrows rows, writing the numeric
+ * results in out - the value of the variable with the slot i is taken from
+ * cols[i] when i < ncols and cols[i] is not NULL, otherwise it is the same
+ * for all rows. The rows that fail or have a string result are set to NaN
+ * (0 with SNEXPR_INT64, for which the SIMD kernels are not used).
+ * Return 0 on success, -1 on error. When the program is evaluated row by
+ * row, the column variables are assigned with the values of each row.
+ */
+static inline int snexpr_prog_eval_batch(struct snexpr_prog *p,
+		struct snexpr_ctx *ctx, const snexpr_num_t *const *cols, int ncols,
+		size_t nrows, snexpr_num_t *out)
+{
+	struct snexpr_insn *in;
+	struct snexpr_var *v;
+	struct snexpr r;
+	snexpr_num_t *consts = NULL;
+	snexpr_num_t *vals = NULL;
+	unsigned char *errs = NULL;
+	snexpr_num_t *a;
+	snexpr_num_t *b;
+	unsigned char *ea;
+	unsigned char *eb;
+	size_t base;
+	int depth;
+	int bn;
+	int sp;
+	int pc;
+	int i;
+	int ret = -1;
+
+	if(p == NULL || out == NULL || (ncols > 0 && cols == NULL)) {
+		return -1;
+	}
+	depth = snexpr_batch_depth(p);
+	if(depth <= 0) {
+		return snexpr_batch_rows(p, ctx, cols, ncols, nrows, out);
+	}
+	/* the variables without column are evaluated once */
+	consts = (snexpr_num_t *)snexpr_malloc(p->ncode * sizeof(snexpr_num_t));
+	if(consts == NULL) {
+		return -1;
+	}
+	for(pc = 0; pc < p->ncode; pc++) {
+		if(p->code[pc].op != SNE_VM_VAR) {
+			continue;
+		}
+		v = p->code[pc].u.node->param.var.vref;
+		if(v->slot < ncols && cols[v->slot] != NULL) {
+			continue;
+		}
+		snexpr_val_setnum(&r, 0);
+		if(snexpr_val_var(ctx, &r, v) < 0 || r.type != SNE_OP_CONSTNUM) {
+			snexpr_val_release(&r);
+			snexpr_free(consts);
+			return snexpr_batch_rows(p, ctx, cols, ncols, nrows, out);
+		}
+		consts[pc] = r.param.num.nval;
+	}
+	vals = (snexpr_num_t *)snexpr_malloc(depth * SNEXPR_BATCH_ROWS * sizeof(snexpr_num_t));
+	errs = (unsigned char *)snexpr_malloc(depth * SNEXPR_BATCH_ROWS);
+	if(vals == NULL || errs == NULL) {
+		goto done;
+	}
+
+	for(base = 0; base < nrows; base += SNEXPR_BATCH_ROWS) {
+		bn = (nrows - base < SNEXPR_BATCH_ROWS) ? (int)(nrows - base)
+												: SNEXPR_BATCH_ROWS;
+		sp = 0;
+		for(pc = 0; pc < p->ncode; pc++) {
+			in = &p->code[pc];
+			a = vals + (sp - 1) * SNEXPR_BATCH_ROWS;
+			ea = errs + (sp - 1) * SNEXPR_BATCH_ROWS;
+			b = a + SNEXPR_BATCH_ROWS;
+			eb = ea + SNEXPR_BATCH_ROWS;
+			switch(in->op) {
+				case SNE_VM_NUM:
+				case SNE_VM_NAN:
+				case SNE_VM_VAR:
+					v = (in->op == SNE_VM_VAR) ? in->u.node->param.var.vref : NULL;
+					if(v != NULL && v->slot < ncols && cols[v->slot] != NULL) {
+						memcpy(b, cols[v->slot] + base, bn * sizeof(snexpr_num_t));
+					} else {
+						r.param.num.nval = (in->op != SNE_VM_NUM) ? SNEXPR_NUM_NAN
+																  : in->u.nval;
+						if(v != NULL) {
+							r.param.num.nval = consts[pc];
+						}
+						for(i = 0; i < bn; i++) {
+							b[i] = r.param.num.nval;
+						}
+					}
+					memset(eb, 0, bn);
+					sp++;
+					break;
+				case SNE_VM_NEG:
+					for(i = 0; i < bn; i++) {
+						a[i] = snexpr_num_neg(a[i]);
+					}
+					break;
+				case SNE_VM_NOT:
+					for(i = 0; i < bn; i++) {
+						a[i] = !a[i];
+					}
+					break;
+				case SNE_VM_BNOT:
+					for(i = 0; i < bn; i++) {
+						a[i] = ~(to_int(a[i]));
+					}
+					break;
+				case SNE_VM_IN:
+					for(i = 0; i < bn; i++) {
+						r.type = SNE_OP_CONSTNUM;
+						r.param.num.nval = a[i];
+						ea[i] |= (snexpr_val_in(in->u.node->param.op.set, &r) < 0);
+						a[i] = r.param.num.nval;
+					}
+					break;
+				case SNE_VM_CHKNUM:
+				case SNE_VM_ANDL:
+				case SNE_VM_ORL:
+				case SNE_VM_CATCH:
+					/* both sides are evaluated, there are no side effects */
+					break;
+				case SNE_VM_ANDR:
+					a -= SNEXPR_BATCH_ROWS;
+					ea -= SNEXPR_BATCH_ROWS;
+					b = a + SNEXPR_BATCH_ROWS;
+					eb = ea + SNEXPR_BATCH_ROWS;
+					for(i = 0; i < bn; i++) {
+						if(a[i] != 0) {
+							a[i] = (b[i] != 0) ? b[i] : 0;
+							ea[i] |= eb[i];
+						} else {
+							a[i] = 0; /* not -0, like snexpr_prog_run() */
+						}
+					}
+					sp--;
+					break;
+				case SNE_VM_ORR:
+					a -= SNEXPR_BATCH_ROWS;
+					ea -= SNEXPR_BATCH_ROWS;
+					b = a + SNEXPR_BATCH_ROWS;
+					eb = ea + SNEXPR_BATCH_ROWS;
+					for(i = 0; i < bn; i++) {
+						if(a[i] == 0 || snexpr_num_isnan(a[i])) {
+							a[i] = (b[i] != 0) ? b[i] : 0;
+							ea[i] |= eb[i];
+						}
+					}
+					sp--;
+					break;
+				case SNE_VM_UNCATCH:
+					/* the left side of comma and its errors are dropped */
+					sp--;
+					break;
+				case SNE_VM_CONCAT:
+					/* numbers only, added from left to right */
+					a = vals + (sp - in->arg) * SNEXPR_BATCH_ROWS;
+					ea = errs + (sp - in->arg) * SNEXPR_BATCH_ROWS;
+					for(i = 1; i < in->arg; i++) {
+						snexpr_batch_binop(in, a, a + i * SNEXPR_BATCH_ROWS, ea,
+								ea + i * SNEXPR_BATCH_ROWS, bn);
+					}
+					sp -= in->arg - 1;
+					break;
+				default:
+					a -= SNEXPR_BATCH_ROWS;
+					ea -= SNEXPR_BATCH_ROWS;
+					snexpr_batch_binop(in, a, a + SNEXPR_BATCH_ROWS, ea,
+							ea + SNEXPR_BATCH_ROWS, bn);
+					sp--;
+			}
+		}
+		if(sp != 1) {
+			goto done;
+		}
+		for(i = 0; i < bn; i++) {
+			out[base + i] = errs[i] ? SNEXPR_NUM_NAN : vals[i];
+		}
+	}
+	ret = 0;
+
+done:
+	snexpr_free(consts);
+	if(vals != NULL) {
+		snexpr_free(vals);
+	}
+	if(errs != NULL) {
+		snexpr_free(errs);
+	}
+	return ret;
+}
+
+/*
+ * Native code
+ *
+ * snexpr_jit_compile() compiles the expression and, for the numeric
+ * programs that can be evaluated in blocks of rows, generates x86-64 code
+ * when SNEXPR_JIT is defined (on a x86-64 Unix system, with float numbers):
+ * the variables are loaded from an array of numbers indexed by their slot
+ * and the result is returned in a register. The operators without an
+ * instruction are called as C functions. The other expressions, and the
+ * ones using a variable without value in the array, are evaluated with the
+ * compiled program. The code pages are mapped with mmap(), not allocated
+ * with SNEXPR_MALLOC().
+ */
+#if defined(SNEXPR_JIT) && !defined(SNEXPR_INT64) && defined(__x86_64__) \
+		&& (defined(__unix__) || defined(__APPLE__))
+#define SNEXPR_JIT_X64
+#endif
+
+typedef snexpr_num_t (*snexpr_jitfn_t)(const snexpr_num_t *vals, int *err);
+
+struct snexpr_jit
+{
+	struct snexpr_prog *prog;
+	snexpr_jitfn_t fn; /* NULL when the program is used */
+	void *code;
+	size_t csize;
+	int maxslot; /* of the variables used by the code */
+};
+
+#ifdef SNEXPR_JIT_X64
+typedef sne_vec(unsigned char) sne_vec_code_t;
+
+/* slots of the stack in the frame, the value and its error flag after it */
+#define snexpr_jit_slot(k) (-24 - 8 * (int32_t)(k))
+
+/* the operators without instruction, with the semantics of the batches */
+static snexpr_num_t snexpr_jit_binop(
+		snexpr_num_t a, snexpr_num_t b, struct snexpr_insn *in, int *err)
+{
+	unsigned char ea = 0;
+	unsigned char eb = 0;
+
+	snexpr_batch_binop(in, &a, &b, &ea, &eb, 1);
+	*err |= ea;
+	return a;
+}
+
+static snexpr_num_t snexpr_jit_unop(
+		snexpr_num_t a, struct snexpr_insn *in, int *err)
+{
+	struct snexpr r;
+
+	if(in->op == SNE_VM_BNOT) {
+		return ~(to_int(a));
+	}
+	snexpr_val_setnum(&r, a);
+	*err |= (snexpr_val_in(in->u.node->param.op.set, &r) < 0);
+	return r.param.num.nval;
+}
+
+static void snexpr_jit_bytes(sne_vec_code_t *c, const char *b, int n)
+{
+	int i;
+
+	for(i = 0; i < n; i++) {
+		sne_vec_push(c, (unsigned char)b[i]);
+	}
+}
+
+static void snexpr_jit_imm32(sne_vec_code_t *c, uint32_t v)
+{
+	int i;
+
+	for(i = 0; i < 4; i++) {
+		sne_vec_push(c, (unsigned char)(v >> (8 * i)));
+	}
+}
+
+static void snexpr_jit_imm64(sne_vec_code_t *c, const void *p)
+{
+	uint64_t v = (uint64_t)(uintptr_t)p;
+
+	snexpr_jit_imm32(c, (uint32_t)v);
+	snexpr_jit_imm32(c, (uint32_t)(v >> 32));
+}
+
+/* the instruction op with the operand [rbp + disp] and the register reg */
+static void snexpr_jit_mem(
+		sne_vec_code_t *c, const char *op, int n, int reg, int32_t disp)
+{
+	snexpr_jit_bytes(c, op, n);
+	sne_vec_push(c, (unsigned char)(0x85 | (reg << 3)));
+	snexpr_jit_imm32(c, (uint32_t)disp);
+}
+
+/* sse instruction on two registers */
+static void snexpr_jit_rr(sne_vec_code_t *c, const char *op, int n, int a, int b)
+{
+	snexpr_jit_bytes(c, op, n);
+	sne_vec_push(c, (unsigned char)(0xc0 | (a << 3) | b));
+}
+
+#define snexpr_jit_load(c, x, k) \
+	snexpr_jit_mem(c, "\xf3\x0f\x10", 3, x, snexpr_jit_slot(k))
+#define snexpr_jit_store(c, x, k) \
+	snexpr_jit_mem(c, "\xf3\x0f\x11", 3, x, snexpr_jit_slot(k))
+#define snexpr_jit_cmpss(c, a, b, pred)           \
+	do {                                          \
+		snexpr_jit_rr(c, "\xf3\x0f\xc2", 3, a, b); \
+		sne_vec_push(c, (unsigned char)(pred));   \
+	} while(0)
+#define snexpr_jit_zero(c, x) snexpr_jit_rr(c, "\x0f\x57", 2, x, x)
+
+/* xmm<x> = f, with eax */
+static void snexpr_jit_const(sne_vec_code_t *c, int x, float f)
+{
+	uint32_t v;
+
+	memcpy(&v, &f, sizeof(uint32_t));
+	sne_vec_push(c, 0xb8);
+	snexpr_jit_imm32(c, v);
+	snexpr_jit_rr(c, "\x66\x0f\x6e", 3, x, 0);
+}
+
+/* the error of the slot k is added to the one of the slot j */
+static void snexpr_jit_orerr(sne_vec_code_t *c, int j, int k)
+{
+	snexpr_jit_mem(c, "\x8b", 1, 0, snexpr_jit_slot(k) + 4);
+	snexpr_jit_mem(c, "\x09", 1, 0, snexpr_jit_slot(j) + 4);
+}
+
+/* call f(xmm0, xmm1, in, &error of the slot k) */
+static void snexpr_jit_call(
+		sne_vec_code_t *c, const void *f, struct snexpr_insn *in, int k)
+{
+	snexpr_jit_bytes(c, "\x48\xbf", 2); /* mov rdi, in */
+	snexpr_jit_imm64(c, in);
+	snexpr_jit_mem(c, "\x48\x8d", 2, 6, snexpr_jit_slot(k) + 4); /* lea rsi */
+	snexpr_jit_bytes(c, "\x48\xb8", 2); /* mov rax, f */
+	snexpr_jit_imm64(c, f);
+	snexpr_jit_bytes(c, "\xff\xd0", 2); /* call rax */
+}
+
+/* a = a && b or a = a || b as in the batches, for the slots j and j + 1 */
+static void snexpr_jit_logic(sne_vec_code_t *c, int j, int isand)
+{
+	snexpr_jit_load(c, 0, j);
+	snexpr_jit_load(c, 1, j + 1);
+	snexpr_jit_zero(c, 3);
+	/* xmm2 = (b != 0) ? b : 0 */
+	snexpr_jit_rr(c, "\x0f\x28", 2, 2, 1);
+	snexpr_jit_cmpss(c, 2, 3, 4);
+	snexpr_jit_rr(c, "\x0f\x54", 2, 2, 1);
+	/* xmm4 = mask of the rows taking the right side */
+	snexpr_jit_rr(c, "\x0f\x28", 2, 4, 0);
+	if(isand) {
+		snexpr_jit_cmpss(c, 4, 3, 4);
+	} else {
+		snexpr_jit_cmpss(c, 4, 3, 0);
+		snexpr_jit_rr(c, "\x0f\x28", 2, 5, 0);
+		snexpr_jit_cmpss(c, 5, 5, 3);
+		snexpr_jit_rr(c, "\x0f\x56", 2, 4, 5);
+	}
+	snexpr_jit_rr(c, "\x0f\x54", 2, 2, 4);
+	snexpr_jit_rr(c, "\x66\x0f\x7e", 3, 4, 0); /* movd eax, xmm4 */
+	if(isand) {
+		/* a false && is 0, not the left side that can be -0 */
+		snexpr_jit_store(c, 2, j);
+	} else {
+		snexpr_jit_rr(c, "\x0f\x55", 2, 4, 0);
+		snexpr_jit_rr(c, "\x0f\x56", 2, 4, 2);
+		snexpr_jit_store(c, 4, j);
+	}
+	snexpr_jit_mem(c, "\x23", 1, 0, snexpr_jit_slot(j + 1) + 4);
+	snexpr_jit_mem(c, "\x09", 1, 0, snexpr_jit_slot(j) + 4);
+}
+
+/* xmm0 = xmm0 <op> xmm1 as 1 or 0 */
+static void snexpr_jit_cmp(sne_vec_code_t *c, enum snexpr_type op)
+{
+	switch(op) {
+		case SNE_OP_LT:
+			snexpr_jit_cmpss(c, 0, 1, 1);
+			break;
+		case SNE_OP_LE:
+			snexpr_jit_cmpss(c, 0, 1, 2);
+			break;
+		case SNE_OP_GT:
+		case SNE_OP_GE:
+			snexpr_jit_cmpss(c, 1, 0, (op == SNE_OP_GT) ? 1 : 2);
+			snexpr_jit_rr(c, "\x0f\x28", 2, 0, 1);
+			break;
+		case SNE_OP_EQ:
+			snexpr_jit_cmpss(c, 0, 1, 0);
+			break;
+		default:
+			snexpr_jit_cmpss(c, 0, 1, 4);
+			break;
+	}
+	snexpr_jit_const(c, 2, 1.0f);
+	snexpr_jit_rr(c, "\x0f\x54", 2, 0, 2);
+}
+
+/* generate the code of the program with the stack depth given */
+static int snexpr_jit_gen(struct snexpr_jit *j, sne_vec_code_t *c, int depth)
+{
+	struct snexpr_prog *p = j->prog;
+	struct snexpr_insn *in;
+	struct snexpr_var *v;
+	int sp = 0;
+	int pc;
+	int i;
+
+	/* push rbp; mov rbp, rsp; push rbx; push r12; sub rsp, frame */
+	snexpr_jit_bytes(c, "\x55\x48\x89\xe5\x53\x41\x54\x48\x81\xec", 10);
+	snexpr_jit_imm32(c, (uint32_t)((8 * depth + 15) & ~15));
+	/* mov rbx, rdi; mov r12, rsi */
+	snexpr_jit_bytes(c, "\x48\x89\xfb\x49\x89\xf4", 6);
+	for(pc = 0; pc < p->ncode; pc++) {
+		in = &p->code[pc];
+		switch(in->op) {
+			case SNE_VM_NUM:
+			case SNE_VM_NAN:
+			case SNE_VM_VAR:
+				if(in->op == SNE_VM_VAR) {
+					v = in->u.node->param.var.vref;
+					if(v->slot < 0) {
+						return -1;
+					}
+					if(v->slot > j->maxslot) {
+						j->maxslot = v->slot;
+					}
+					/* movss xmm0, [rbx + 4 * slot] */
+					snexpr_jit_bytes(c, "\xf3\x0f\x10\x83", 4);
+					snexpr_jit_imm32(c, (uint32_t)(v->slot * sizeof(snexpr_num_t)));
+				} else {
+					snexpr_jit_const(c, 0,
+							(in->op == SNE_VM_NUM) ? in->u.nval : SNEXPR_NUM_NAN);
+				}
+				snexpr_jit_store(c, 0, sp);
+				snexpr_jit_mem(c, "\xc7", 1, 0, snexpr_jit_slot(sp) + 4);
+				snexpr_jit_imm32(c, 0);
+				sp++;
+				break;
+			case SNE_VM_NEG:
+				snexpr_jit_load(c, 0, sp - 1);
+				snexpr_jit_const(c, 1, -0.0f);
+				snexpr_jit_rr(c, "\x0f\x57", 2, 0, 1);
+				snexpr_jit_store(c, 0, sp - 1);
+				break;
+			case SNE_VM_NOT:
+				snexpr_jit_load(c, 0, sp - 1);
+				snexpr_jit_zero(c, 3);
+				snexpr_jit_cmpss(c, 0, 3, 0);
+				snexpr_jit_const(c, 2, 1.0f);
+				snexpr_jit_rr(c, "\x0f\x54", 2, 0, 2);
+				snexpr_jit_store(c, 0, sp - 1);
+				break;
+			case SNE_VM_BNOT:
+			case SNE_VM_IN:
+				snexpr_jit_load(c, 0, sp - 1);
+				snexpr_jit_call(c, (const void *)snexpr_jit_unop, in, sp - 1);
+				snexpr_jit_store(c, 0, sp - 1);
+				break;
+			case SNE_VM_CHKNUM:
+			case SNE_VM_ANDL:
+			case SNE_VM_ORL:
+			case SNE_VM_CATCH:
+				/* both sides are evaluated, there are no side effects */
+				break;
+			case SNE_VM_ANDR:
+			case SNE_VM_ORR:
+				snexpr_jit_logic(c, sp - 2, in->op == SNE_VM_ANDR);
+				sp--;
+				break;
+			case SNE_VM_UNCATCH:
+				sp--;
+				break;
+			case SNE_VM_CONCAT:
+				/* numbers only, added from left to right */
+				sp -= in->arg;
+				snexpr_jit_load(c, 0, sp);
+				for(i = 1; i < in->arg; i++) {
+					snexpr_jit_load(c, 1, sp + i);
+					snexpr_jit_rr(c, "\xf3\x0f\x58", 3, 0, 1);
+					snexpr_jit_orerr(c, sp, sp + i);
+				}
+				snexpr_jit_store(c, 0, sp);
+				sp++;
+				break;
+			default:
+				sp--;
+				snexpr_jit_load(c, 0, sp - 1);
+				snexpr_jit_load(c, 1, sp);
+				switch(in->op) {
+					case SNE_VM_PLUS:
+					case SNE_VM_ADDNUM:
+						snexpr_jit_rr(c, "\xf3\x0f\x58", 3, 0, 1);
+						break;
+					case SNE_VM_MINUS:
+						snexpr_jit_rr(c, "\xf3\x0f\x5c", 3, 0, 1);
+						break;
+					case SNE_VM_MUL:
+						snexpr_jit_rr(c, "\xf3\x0f\x59", 3, 0, 1);
+						break;
+					case SNE_VM_DIV:
+						/* 0 and an error for the division by 0 */
+						snexpr_jit_rr(c, "\xf3\x0f\x5e", 3, 0, 1);
+						snexpr_jit_zero(c, 3);
+						snexpr_jit_rr(c, "\x0f\x28", 2, 2, 1);
+						snexpr_jit_cmpss(c, 2, 3, 0);
+						snexpr_jit_rr(c, "\x66\x0f\x7e", 3, 2, 0);
+						snexpr_jit_bytes(c, "\x83\xe0\x01", 3); /* and eax, 1 */
+						snexpr_jit_mem(c, "\x09", 1, 0, snexpr_jit_slot(sp - 1) + 4);
+						snexpr_jit_rr(c, "\x0f\x55", 2, 2, 0);
+						snexpr_jit_rr(c, "\x0f\x28", 2, 0, 2);
+						break;
+					case SNE_VM_CMP:
+					case SNE_VM_CMPNUM:
+						snexpr_jit_cmp(c, (enum snexpr_type)in->arg);
+						break;
+					default:
+						snexpr_jit_call(c, (const void *)snexpr_jit_binop, in, sp - 1);
+						break;
+				}
+				snexpr_jit_store(c, 0, sp - 1);
+				snexpr_jit_orerr(c, sp - 1, sp);
+				break;
+		}
+	}
+	if(sp != 1) {
+		return -1;
+	}
+	/* the result in xmm0, its error in *r12 */
+	snexpr_jit_load(c, 0, 0);
+	snexpr_jit_mem(c, "\x8b", 1, 0, snexpr_jit_slot(0) + 4);
+	/* mov [r12], eax; lea rsp, [rbp - 16]; pop r12; pop rbx; pop rbp; ret */
+	snexpr_jit_bytes(c, "\x41\x89\x04\x24\x48\x8d\x65\xf0\x41\x5c\x5b\x5d\xc3", 13);
+	return 0;
+}
+
+/* map the code of the program, the jit is left without it on error */
+static void snexpr_jit_map(struct snexpr_jit *j)
+{
+	sne_vec_code_t c = sne_vec_init();
+	long psize = sysconf(_SC_PAGESIZE);
+	void *m;
+	int depth;
+
+	depth = snexpr_batch_depth(j->prog);
+	if(depth <= 0 || psize <= 0 || snexpr_jit_gen(j, &c, depth) < 0
+			|| sne_vec_len(&c) == 0) {
+		goto done;
+	}
+	j->csize = ((size_t)sne_vec_len(&c) + psize - 1) & ~((size_t)psize - 1);
+	m = mmap(NULL, j->csize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+			-1, 0);
+	if(m == MAP_FAILED) {
+		goto done;
+	}
+	memcpy(m, c.buf, sne_vec_len(&c));
+	if(mprotect(m, j->csize, PROT_READ | PROT_EXEC) < 0) {
+		munmap(m, j->csize);
+		goto done;
+	}
+	j->code = m;
+	j->fn = (snexpr_jitfn_t)m;
+
+done:
+	sne_vec_free(&c);
+}
+#endif
+
+/*
+ * Compile the expression, with native code when it can be done - the
+ * expression must not be destroyed while the result is used
+ */
+static inline struct snexpr_jit *snexpr_jit_compile(struct snexpr *e)
+{
+	struct snexpr_jit *j;
+
+	j = (struct snexpr_jit *)snexpr_calloc(1, sizeof(struct snexpr_jit));
+	if(j == NULL) {
+		return NULL;
+	}
+	j->maxslot = -1;
+	j->prog = snexpr_compile(e);
+	if(j->prog == NULL) {
+		snexpr_free(j);
+		return NULL;
+	}
+#ifdef SNEXPR_JIT_X64
+	snexpr_jit_map(j);
+#endif
+	return j;
+}
+
+/* if the expression is evaluated with native code */
+static inline int snexpr_jit_native(struct snexpr_jit *j)
+{
+	return j != NULL && j->fn != NULL;
+}
+
+/* the callback of snexpr_create() for the context of snexpr_jit_eval() */
+static struct snexpr *snexpr_jit_gcbf(struct snexpr_ctx *ctx, char *vname)
+{
+	(void)ctx;
+	return _snexternval_cbf(vname);
+}
+
+/*
+ * Evaluate, the value of the variable with the slot i is vals[i] when
+ * i < nvals - return 0 with the number in out, -1 on error or when the
+ * result is a string. The interpreter takes the array values bound in the
+ * context, without changing the variables, and the value of the others as
+ * usual. Without context, a local one is used, its scratch area being
+ * allocated for each call.
+ */
+static inline int snexpr_jit_eval(struct snexpr_jit *j, struct snexpr_ctx *ctx,
+		const snexpr_num_t *vals, int nvals, snexpr_num_t *out)
+{
+	struct snexpr_ctx lctx;
+	const snexpr_num_t *ovals;
+	struct snexpr r;
+	int onvals;
+	int err = 0;
+	int ret = -1;
+
+	if(j == NULL || out == NULL || (nvals > 0 && vals == NULL)) {
+		return -1;
+	}
+	if(j->fn != NULL && j->maxslot < nvals) {
+		*out = j->fn(vals, &err);
+		return err ? -1 : 0;
+	}
+	if(ctx == NULL) {
+		snexpr_ctx_init(&lctx,
+				(_snexternval_cbf != NULL) ? snexpr_jit_gcbf : NULL, NULL);
+		ctx = &lctx;
+	}
+	/* kept for an evaluation from a callback of another one */
+	ovals = ctx->vals;
+	onvals = ctx->nvals;
+	ctx->vals = vals;
+	ctx->nvals = nvals;
+	if(snexpr_prog_eval_into(j->prog, ctx, &r) == 0) {
+		if(r.type == SNE_OP_CONSTNUM) {
+			*out = r.param.num.nval;
+			ret = 0;
+		}
+		snexpr_result_free(&r);
+	}
+	ctx->vals = ovals;
+	ctx->nvals = onvals;
+	if(ctx == &lctx) {
+		snexpr_ctx_free(&lctx);
+	}
+	return ret;
+}
+
+static inline void snexpr_jit_destroy(struct snexpr_jit *j)
+{
+	if(j == NULL) {
+		return;
+	}
+#ifdef SNEXPR_JIT_X64
+	if(j->code != NULL) {
+		munmap(j->code, j->csize);
+	}
+#endif
+	snexpr_prog_destroy(j->prog);
+	snexpr_free(j);
+}
+
+/*
+ * Cache of expressions
+ *
+ * The expressions are kept by source text and functions table, parsed with
+ * snexpr_parse() for the variables list of the cache, optimized, moved in
+ * an arena and compiled, so an expression string seen again is found by a
+ * hash lookup. The cache has a bounded number of entries and drops the
+ * least recently used ones - a dropped entry still referenced is freed
+ * when released with snexpr_cache_put(). It is not locked, it should be
+ * used by one thread at a time.
+ */
+struct snexpr_centry
+{
+	unsigned int hashid;
+	char *src;
+	size_t len;
+	struct snexpr_func *funcs;
+	struct snexpr *e;
+	struct snexpr_prog *prog;
+	int refcnt;
+	int cached; /* still in the cache table */
+	struct snexpr_centry *hnext;
+	struct snexpr_centry *prev; /* lru list, most recently used first */
+	struct snexpr_centry *next;
+};
+
+struct snexpr_cache
+{
+	struct snexpr_var_list *vars;
+	struct snexpr_centry **htable;
+	unsigned int hsize;
+	int nitems;
+	int maxitems;
+	struct snexpr_centry *lru_head;
+	struct snexpr_centry *lru_tail;
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+};
+
+static inline struct snexpr_cache *snexpr_cache_new(
+		struct snexpr_var_list *vars, int maxitems)
+{
+	struct snexpr_cache *c;
+	unsigned int n = SNEXPR_VAR_HSIZE;
+
+	if(vars == NULL || maxitems <= 0) {
+		return NULL;
+	}
+	while(n < (unsigned int)maxitems) {
+		n <<= 1;
+	}
+	c = (struct snexpr_cache *)snexpr_calloc(1, sizeof(struct snexpr_cache));
+	if(c == NULL) {
+		return NULL;
+	}
+	c->htable = (struct snexpr_centry **)snexpr_calloc(n, sizeof(struct snexpr_centry *));
+	if(c->htable == NULL) {
+		snexpr_free(c);
+		return NULL;
+	}
+	c->hsize = n;
+	c->vars = vars;
+	c->maxitems = maxitems;
+	return c;
+}
+
+static inline void snexpr_centry_free(struct snexpr_centry *ce)
+{
+	snexpr_prog_destroy(ce->prog);
+	/* the global callback is not reset */
+	snexpr_release(ce->e, NULL);
+	snexpr_free(ce);
+}
+
+static inline void snexpr_cache_unlink(
+		struct snexpr_cache *c, struct snexpr_centry *ce)
+{
+	struct snexpr_centry **pe;
+
+	for(pe = &c->htable[ce->hashid & (c->hsize - 1)]; *pe; pe = &(*pe)->hnext) {
+		if(*pe == ce) {
+			*pe = ce->hnext;
+			break;
+		}
+	}
+	if(ce->prev != NULL) {
+		ce->prev->next = ce->next;
+	} else {
+		c->lru_head = ce->next;
+	}
+	if(ce->next != NULL) {
+		ce->next->prev = ce->prev;
+	} else {
+		c->lru_tail = ce->prev;
+	}
+	ce->prev = ce->next = ce->hnext = NULL;
+	ce->cached = 0;
+	c->nitems--;
+}
+
+static inline void snexpr_cache_lru_front(
+		struct snexpr_cache *c, struct snexpr_centry *ce)
+{
+	if(c->lru_head == ce) {
+		return;
+	}
+	if(ce->prev != NULL) {
+		ce->prev->next = ce->next;
+	}
+	if(ce->next != NULL) {
+		ce->next->prev = ce->prev;
+	} else if(c->lru_tail == ce) {
+		c->lru_tail = ce->prev;
+	}
+	ce->prev = NULL;
+	ce->next = c->lru_head;
+	if(c->lru_head != NULL) {
+		c->lru_head->prev = ce;
+	}
+	c->lru_head = ce;
+	if(c->lru_tail == NULL) {
+		c->lru_tail = ce;
+	}
+}
+
+/*
+ * Drop the least recently used entries over the limit - the referenced
+ * ones are only unlinked, freed by the last snexpr_cache_put()
+ */
+static inline void snexpr_cache_evict(struct snexpr_cache *c)
+{
+	struct snexpr_centry *ce = c->lru_tail;
+	struct snexpr_centry *prev;
+
+	while(c->nitems > c->maxitems && ce != NULL) {
+		prev = ce->prev;
+		snexpr_cache_unlink(c, ce);
+		c->evictions++;
+		if(ce->refcnt == 0) {
+			snexpr_centry_free(ce);
+		}
+		ce = prev;
+	}
+}
+
+/*
+ * Get the expression for the source text s, parsing it when it is not in
+ * the cache - return NULL on error. The entry is referenced, the expression
+ * (ce->e) and its compiled program (ce->prog) stay valid until the entry is
+ * released with snexpr_cache_put().
+ */
+static inline struct snexpr_centry *snexpr_cache_get(struct snexpr_cache *c,
+		const char *s, size_t len, struct snexpr_func *funcs)
+{
+	struct snexpr_centry *ce;
+	struct snexpr *e;
+	unsigned int hashid;
+
+	if(c == NULL || s == NULL) {
+		return NULL;
+	}
+	hashid = snexpr_var_hash(s, len) ^ (unsigned int)(size_t)funcs;
+	for(ce = c->htable[hashid & (c->hsize - 1)]; ce; ce = ce->hnext) {
+		if(ce->hashid == hashid && ce->len == len && ce->funcs == funcs
+				&& memcmp(ce->src, s, len) == 0) {
+			c->hits++;
+			ce->refcnt++;
+			snexpr_cache_lru_front(c, ce);
+			return ce;
+		}
+	}
+	c->misses++;
+
+	ce = (struct snexpr_centry *)snexpr_calloc(1, sizeof(struct snexpr_centry) + len + 1);
+	if(ce == NULL) {
+		return NULL;
+	}
+	ce->src = (char *)ce + sizeof(struct snexpr_centry);
+	memcpy(ce->src, s, len);
+	ce->len = len;
+	ce->funcs = funcs;
+	ce->hashid = hashid;
+	e = snexpr_parse(s, len, c->vars, funcs);
+	if(e == NULL || snexpr_optimize(e) < 0) {
+		goto error;
+	}
+	ce->e = snexpr_arena_pack(e);
+	ce->prog = snexpr_compile(ce->e);
+	if(ce->prog == NULL) {
+		goto error;
+	}
+	ce->refcnt = 1;
+	ce->cached = 1;
+	ce->hnext = c->htable[hashid & (c->hsize - 1)];
+	c->htable[hashid & (c->hsize - 1)] = ce;
+	c->nitems++;
+	snexpr_cache_lru_front(c, ce);
+	snexpr_cache_evict(c);
+	return ce;
+
+error:
+	if(ce->e == NULL) {
+		ce->e = e;
+	}
+	snexpr_centry_free(ce);
+	return NULL;
+}
+
+/* release the reference to an entry returned by snexpr_cache_get() */
+static inline void snexpr_cache_put(
+		struct snexpr_cache *c, struct snexpr_centry *ce)
+{
+	if(c == NULL || ce == NULL || ce->refcnt <= 0) {
+		return;
+	}
+	ce->refcnt--;
+	if(ce->refcnt == 0 && !ce->cached) {
+		snexpr_centry_free(ce);
+	}
+}
+
+/*
+ * Destroy the cache and its entries, which must not be referenced; the
+ * variables list is destroyed by the caller
+ */
+static inline void snexpr_cache_destroy(struct snexpr_cache *c)
+{
+	struct snexpr_centry *ce;
+
+	if(c == NULL) {
+		return;
+	}
+	while((ce = c->lru_head) != NULL) {
+		snexpr_cache_unlink(c, ce);
+		snexpr_centry_free(ce);
+	}
+	snexpr_free(c->htable);
+	snexpr_free(c);
+}
+
+/*
+ * Rule sets - many expressions evaluated together for the same input. The
+ * identical subtrees without side effects found more than once in the set
+ * (after snexpr_optimize()) are moved in shared slots and replaced by
+ * references, evaluated on first use and kept until the end of the set
+ * evaluation, so each distinct subexpression and external variable lookup
+ * is done once per input. The parameters of the functions without the
+ * evaluation context (no fctx) are left as they are, being evaluated by
+ * the function itself.
+ */
+struct snexpr_cse
+{
+	int nslots;
+	struct snexpr *slots; /* the shared subtrees */
+	struct snexpr *vals; /* their values in the current evaluation */
+	unsigned int *gens; /* evaluation of the value, 0 for none */
+	unsigned char *errs;
+	unsigned int gen;
+	struct snexpr_cdep *deps; /* variables read by the cached subtrees */
+	int *doff; /* first of the variables of each slot, NULL for a rule set */
+	unsigned long nevals; /* evaluations of the subtrees */
+};
+
+/* variable read by a cached subtree, with its version at the evaluation */
+struct snexpr_cdep
+{
+	struct snexpr_var *v;
+	unsigned int ver;
+};
+
+struct snexpr_ruleset
+{
+	struct snexpr_var_list *vars;
+	struct snexpr_func *funcs;
+	sne_vec_expr_t rules;
+	struct snexpr_prog **progs;
+	struct snexpr_var *hvars; /* the references to the slots */
+	struct snexpr_cse cse;
+	int built;
+};
+
+/* the distinct subtrees found while building the set */
+struct snexpr_csent
+{
+	unsigned int hash;
+	enum snexpr_type type;
+	unsigned int flags;
+	const void *ref; /* variable, function or string */
+	size_t slen;
+	snexpr_num_t nval;
+	int nargs;
+	int aoff; /* first of the ids of the parameters in aids */
+	int count; /* occurrences in the set */
+	int uses; /* evaluations when the shared subtrees are done once */
+	int clean; /* no side effects, no assigned variables */
+	int slot;
+	int moved;
+	int next;
+};
+
+struct snexpr_csbuild
+{
+	sne_vec(struct snexpr_csent) ents;
+	sne_vec(int) aids;
+	sne_vec(int) stk;
+	sne_vec(struct snexpr_var *) assigned;
+	int *buckets;
+	unsigned int nbuckets;
+	int *ids; /* entry of each node, in prefix order */
+	int *sizes; /* nodes in the subtree of each node */
+	int pos;
+};
+
+/*
+ * The cached value of a slot is valid while the variables it reads keep
+ * the version seen at its evaluation - the external variables not assigned
+ * can change at any time, the subtrees reading them are always evaluated
+ */
+static int snexpr_cse_fresh(struct snexpr_cse *c, int slot)
+{
+	struct snexpr_cdep *d;
+
+	if(c->gens[slot] == 0) {
+		return 0;
+	}
+	for(d = c->deps + c->doff[slot]; d < c->deps + c->doff[slot + 1]; d++) {
+		if(!(d->v->evflags & SNEXPR_VALASSIGN) || d->v->ver != d->ver) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* keep the value of a slot after the evaluation, owning its string */
+static void snexpr_cse_keep(struct snexpr_cse *c, int slot)
+{
+	struct snexpr *v = &c->vals[slot];
+	struct snexpr t;
+	struct snexpr_cdep *d;
+
+	for(d = c->deps + c->doff[slot]; d < c->deps + c->doff[slot + 1]; d++) {
+		d->ver = d->v->ver;
+	}
+	if(c->errs[slot] || v->type != SNE_OP_CONSTSTZ
+			|| (v->eflags & (SNEXPR_VALALLOC | SNEXPR_VALSSO))) {
+		return;
+	}
+	/* borrowed or in the scratch area of the context */
+	memset(&t, 0, sizeof(struct snexpr));
+	if(snexpr_val_dup(NULL, &t, v) < 0) {
+		c->errs[slot] = 1;
+		c->gens[slot] = 0;
+		return;
+	}
+	snexpr_val_move(v, &t);
+}
+
+static int snexpr_cse_value(
+		struct snexpr_ctx *ctx, struct snexpr *res, int slot)
+{
+	struct snexpr_cse *c = (ctx != NULL) ? ctx->cse : NULL;
+	struct snexpr *v;
+
+	if(c == NULL || slot < 0 || slot >= c->nslots) {
+		snexpr_val_setnum(res, 0);
+		return -1; /* used outside of the evaluation of the set */
+	}
+	v = &c->vals[slot];
+	if((c->doff != NULL) ? !snexpr_cse_fresh(c, slot) : c->gens[slot] != c->gen) {
+		snexpr_val_release(v);
+		c->errs[slot] = (snexpr_eval_r(&c->slots[slot], ctx, v) < 0);
+		c->gens[slot] = c->gen;
+		c->nevals++;
+		if(c->doff != NULL) {
+			snexpr_cse_keep(c, slot);
+		}
+	}
+	if(c->errs[slot]) {
+		snexpr_val_setnum(res, 0);
+		return -1;
+	}
+	if(v->type == SNE_OP_CONSTSTZ) {
+		snexpr_stz_borrow(res, v->param.stz.sval, v->param.stz.slen);
+		return 0;
+	}
+	snexpr_val_setnum(res, v->param.num.nval);
+	return 0;
+}
+
+/* count the nodes, collecting the assigned variables */
+static int snexpr_cse_prepare(struct snexpr_csbuild *b, struct snexpr *e)
+{
+	sne_vec_expr_t *args = snexpr_node_args(e);
+	int n = 1;
+	int k;
+	int i;
+
+	if(e->type == SNE_OP_ASSIGN
+			&& sne_vec_push(&b->assigned, e->param.op.args.buf[0].param.var.vref)
+					   < 0) {
+		return -1;
+	}
+	for(i = 0; args != NULL && i < sne_vec_len(args); i++) {
+		k = snexpr_cse_prepare(b, &sne_vec_nth(args, i));
+		if(k < 0) {
+			return -1;
+		}
+		n += k;
+	}
+	return n;
+}
+
+static unsigned int snexpr_cse_mix(unsigned int h, const void *p, size_t n)
+{
+	const unsigned char *s = (const unsigned char *)p;
+
+	while(n-- > 0) {
+		h = (h ^ *s++) * 16777619u;
+	}
+	return h;
+}
+
+/* find or add the entry of the subtree, recording the ids in prefix order */
+static int snexpr_cse_id(struct snexpr_csbuild *b, struct snexpr *e)
+{
+	sne_vec_expr_t *args = snexpr_node_args(e);
+	struct snexpr_csent ent;
+	struct snexpr_csent *c;
+	int base = sne_vec_len(&b->stk);
+	int p = b->pos++;
+	int id;
+	int i;
+
+	memset(&ent, 0, sizeof(struct snexpr_csent));
+	ent.type = e->type;
+	ent.flags = e->eflags & (SNEXPR_OPNUM | SNEXPR_DUALNUM | SNEXPR_DUALSTZ);
+	ent.clean = 1;
+	ent.slot = -1;
+	ent.nargs = (args != NULL) ? sne_vec_len(args) : 0;
+	for(i = 0; i < ent.nargs; i++) {
+		id = snexpr_cse_id(b, &sne_vec_nth(args, i));
+		if(id < 0 || sne_vec_push(&b->stk, id) < 0) {
+			return -1;
+		}
+		ent.clean = ent.clean && sne_vec_nth(&b->ents, id).clean;
+	}
+	switch(e->type) {
+		case SNE_OP_CONSTNUM:
+			ent.nval = e->param.num.nval;
+			ent.hash = snexpr_cse_mix(2166136261u, &ent.nval, sizeof(snexpr_num_t));
+			break;
+		case SNE_OP_CONSTSTZ:
+			ent.ref = (e->param.stz.sval != NULL) ? e->param.stz.sval : "";
+			ent.slen = (e->param.stz.sval != NULL) ? e->param.stz.slen : 0;
+			ent.hash = snexpr_cse_mix(2166136261u, ent.ref, ent.slen);
+			break;
+		case SNE_OP_VAR:
+			ent.ref = e->param.var.vref;
+			for(i = 0; i < sne_vec_len(&b->assigned); i++) {
+				if(sne_vec_nth(&b->assigned, i) == ent.ref) {
+					ent.clean = 0;
+				}
+			}
+			break;
+		case SNE_OP_FUNC:
+			ent.ref = e->param.func.f;
+			ent.clean = ent.clean
+						&& (e->param.func.f->fflags & SNEXPR_FN_PURE) != 0;
+			break;
+		case SNE_OP_ASSIGN:
+			ent.clean = 0;
+			break;
+		case SNE_OP_IN:
+			/* the sets with the same members are equal blocks */
+			if(e->param.op.set != NULL) {
+				ent.ref = e->param.op.set;
+				ent.slen = e->param.op.set->size;
+			}
+			ent.hash = snexpr_cse_mix(2166136261u, ent.ref, ent.slen);
+			break;
+		default:
+			break;
+	}
+	if(e->type == SNE_OP_VAR || e->type == SNE_OP_FUNC) {
+		ent.hash = snexpr_cse_mix(2166136261u, &ent.ref, sizeof(void *));
+	}
+	ent.hash = snexpr_cse_mix(ent.hash ^ (ent.type << 8) ^ ent.flags,
+			b->stk.buf + base, ent.nargs * sizeof(int));
+
+	for(id = b->buckets[ent.hash & (b->nbuckets - 1)]; id >= 0; id = c->next) {
+		c = &sne_vec_nth(&b->ents, id);
+		if(c->hash == ent.hash && c->type == ent.type && c->flags == ent.flags
+				&& c->nargs == ent.nargs && c->slen == ent.slen
+				&& memcmp(&c->nval, &ent.nval, sizeof(snexpr_num_t)) == 0
+				&& ((e->type == SNE_OP_CONSTSTZ || e->type == SNE_OP_IN)
+								? ent.slen == 0
+										  || memcmp(c->ref, ent.ref, ent.slen) == 0
+								: c->ref == ent.ref)
+				&& (ent.nargs == 0
+						|| memcmp(b->aids.buf + c->aoff, b->stk.buf + base,
+								   ent.nargs * sizeof(int))
+								   == 0)) {
+			break;
+		}
+	}
+	if(id < 0) {
+		ent.aoff = sne_vec_len(&b->aids);
+		for(i = 0; i < ent.nargs; i++) {
+			if(sne_vec_push(&b->aids, sne_vec_nth(&b->stk, base + i)) < 0) {
+				return -1;
+			}
+		}
+		ent.next = b->buckets[ent.hash & (b->nbuckets - 1)];
+		id = sne_vec_len(&b->ents);
+		if(sne_vec_push(&b->ents, ent) < 0) {
+			return -1;
+		}
+		b->buckets[ent.hash & (b->nbuckets - 1)] = id;
+	}
+	sne_vec_nth(&b->ents, id).count++;
+	b->stk.len = base;
+	b->ids[p] = id;
+	b->sizes[p] = b->pos - p;
+	return id;
+}
+
+#define snexpr_cse_candidate(c)                                   \
+	((c)->clean && (c)->count > 1 && (c)->type != SNE_OP_CONSTNUM \
+			&& (c)->type != SNE_OP_CONSTSTZ)
+
+/* the parameters of the functions without context are not shared */
+#define snexpr_cse_share_args(c, share) \
+	((share)                            \
+			&& !((c)->type == SNE_OP_FUNC  \
+					&& ((struct snexpr_func *)(c)->ref)->fctx == NULL))
+
+/* count the evaluations of the candidates when they are done once */
+static void snexpr_cse_uses(struct snexpr_csbuild *b, int p, int share)
+{
+	struct snexpr_csent *c = &sne_vec_nth(&b->ents, b->ids[p]);
+	int q = p + 1;
+	int i;
+
+	if(share && snexpr_cse_candidate(c)) {
+		if(++c->uses > 1) {
+			return;
+		}
+	}
+	share = snexpr_cse_share_args(c, share);
+	for(i = 0; i < c->nargs; i++) {
+		snexpr_cse_uses(b, q, share);
+		q += b->sizes[q];
+	}
+}
+
+/* move the first occurrence of the shared subtrees in their slots */
+static void snexpr_cse_rewrite(struct snexpr_ruleset *rs,
+		struct snexpr_csbuild *b, struct snexpr *e, int share)
+{
+	int p = b->pos++;
+	struct snexpr_csent *c = &sne_vec_nth(&b->ents, b->ids[p]);
+	sne_vec_expr_t *args;
+	int i;
+
+	if(share && c->slot >= 0) {
+		if(c->moved) {
+			snexpr_destroy_args(e);
+			*e = snexpr_varref(&rs->hvars[c->slot]);
+			b->pos = p + b->sizes[p];
+			return;
+		}
+		c->moved = 1;
+		rs->cse.slots[c->slot] = *e;
+		*e = snexpr_varref(&rs->hvars[c->slot]);
+		e = &rs->cse.slots[c->slot];
+	}
+	share = snexpr_cse_share_args(c, share);
+	args = snexpr_node_args(e);
+	for(i = 0; args != NULL && i < sne_vec_len(args); i++) {
+		snexpr_cse_rewrite(rs, b, &sne_vec_nth(args, i), share);
+	}
+}
+
+/* create a rule set for the variables list and the functions */
+static inline struct snexpr_ruleset *snexpr_ruleset_new(
+		struct snexpr_var_list *vars, struct snexpr_func *funcs)
+{
+	struct snexpr_ruleset *rs;
+
+	rs = (struct snexpr_ruleset *)snexpr_calloc(1, sizeof(struct snexpr_ruleset));
+	if(rs == NULL) {
+		return NULL;
+	}
+	rs->vars = vars;
+	rs->funcs = funcs;
+	return rs;
+}
+
+/* parse and add an expression to the set - return its index or -1 */
+static inline int snexpr_ruleset_add(
+		struct snexpr_ruleset *rs, const char *s, size_t len)
+{
+	struct snexpr *e;
+
+	if(rs->built) {
+		return -1;
+	}
+	e = snexpr_parse(s, len, rs->vars, rs->funcs);
+	if(e == NULL) {
+		return -1;
+	}
+	if(sne_vec_push(&rs->rules, *e) < 0) {
+		snexpr_destroy_args(e);
+		snexpr_free(e);
+		return -1;
+	}
+	snexpr_free(e);
+	return sne_vec_len(&rs->rules) - 1;
+}
+
+/*
+ * Optimize the expressions, share their common subtrees and compile them -
+ * return the number of shared subtrees or -1; no expression can be added
+ * after it
+ */
+static inline int snexpr_ruleset_build(struct snexpr_ruleset *rs)
+{
+	struct snexpr_csbuild b;
+	struct snexpr_cse *c = &rs->cse;
+	struct snexpr_csent *ce;
+	int n = 0;
+	int k;
+	int i;
+	int ret = -1;
+
+	if(rs->built) {
+		return -1;
+	}
+	rs->built = 1;
+	memset(&b, 0, sizeof(struct snexpr_csbuild));
+	for(i = 0; i < sne_vec_len(&rs->rules); i++) {
+		if(snexpr_optimize(&sne_vec_nth(&rs->rules, i)) < 0) {
+			goto done;
+		}
+		k = snexpr_cse_prepare(&b, &sne_vec_nth(&rs->rules, i));
+		if(k < 0) {
+			goto done;
+		}
+		n += k;
+	}
+	for(b.nbuckets = 16; b.nbuckets < 2 * (unsigned int)n; b.nbuckets <<= 1)
+		;
+	b.buckets = (int *)snexpr_malloc(b.nbuckets * sizeof(int));
+	b.ids = (int *)snexpr_malloc((n + 1) * sizeof(int));
+	b.sizes = (int *)snexpr_malloc((n + 1) * sizeof(int));
+	if(b.buckets == NULL || b.ids == NULL || b.sizes == NULL) {
+		goto done;
+	}
+	memset(b.buckets, 0xff, b.nbuckets * sizeof(int));
+	for(i = 0; i < sne_vec_len(&rs->rules); i++) {
+		if(snexpr_cse_id(&b, &sne_vec_nth(&rs->rules, i)) < 0) {
+			goto done;
+		}
+	}
+	for(i = 0, k = 0; i < sne_vec_len(&rs->rules); i++) {
+		snexpr_cse_uses(&b, k, 1);
+		k += b.sizes[k];
+	}
+	for(i = 0; i < sne_vec_len(&b.ents); i++) {
+		ce = &sne_vec_nth(&b.ents, i);
+		if(snexpr_cse_candidate(ce) && ce->uses > 1) {
+			ce->slot = c->nslots++;
+		}
+	}
+
+	if(c->nslots > 0) {
+		rs->hvars = (struct snexpr_var *)snexpr_calloc(
+				c->nslots, sizeof(struct snexpr_var));
+		c->slots = (struct snexpr *)snexpr_calloc(
+				c->nslots, sizeof(struct snexpr));
+		c->vals = (struct snexpr *)snexpr_calloc(
+				c->nslots, sizeof(struct snexpr));
+		c->gens = (unsigned int *)snexpr_calloc(
+				c->nslots, sizeof(unsigned int));
+		c->errs = (unsigned char *)snexpr_calloc(c->nslots, 1);
+		if(rs->hvars == NULL || c->slots == NULL || c->vals == NULL
+				|| c->gens == NULL || c->errs == NULL) {
+			goto done;
+		}
+		for(i = 0; i < c->nslots; i++) {
+			rs->hvars[i].evflags = SNEXPR_VALCSE;
+			rs->hvars[i].name = (char *)"";
+			rs->hvars[i].hid = i;
+		}
+		b.pos = 0;
+		for(i = 0; i < sne_vec_len(&rs->rules); i++) {
+			snexpr_cse_rewrite(rs, &b, &sne_vec_nth(&rs->rules, i), 1);
+		}
+	}
+
+	rs->progs = (struct snexpr_prog **)snexpr_calloc(
+			sne_vec_len(&rs->rules) + 1, sizeof(struct snexpr_prog *));
+	if(rs->progs == NULL) {
+		goto done;
+	}
+	for(i = 0; i < sne_vec_len(&rs->rules); i++) {
+		rs->progs[i] = snexpr_compile(&sne_vec_nth(&rs->rules, i));
+		if(rs->progs[i] == NULL) {
+			goto done;
+		}
+	}
+	ret = c->nslots;
+
+done:
+	sne_vec_free(&b.ents);
+	sne_vec_free(&b.aids);
+	sne_vec_free(&b.stk);
+	sne_vec_free(&b.assigned);
+	snexpr_free(b.buckets);
+	snexpr_free(b.ids);
+	snexpr_free(b.sizes);
+	return ret;
+}
+
+/* evaluate the set with the values of the shared subtrees kept in cse */
+static int snexpr_ruleset_run(struct snexpr_ruleset *rs, struct snexpr_cse *cse,
+		struct snexpr_ctx *ctx, struct snexpr *res)
+{
+	struct snexpr_cse *old;
+	int nerr = 0;
+	int i;
+
+	if(ctx == NULL || rs->progs == NULL) {
+		return -1;
+	}
+	if(++cse->gen == 0) {
+		/* the values of a previous evaluation must not stay valid */
+		memset(cse->gens, 0, cse->nslots * sizeof(unsigned int));
+		cse->gen = 1;
+	}
+	old = ctx->cse;
+	ctx->cse = cse;
+	if(ctx->scratch.depth++ == 0) {
+		snexpr_scratch_reset(&ctx->scratch);
+	}
+	for(i = 0; i < sne_vec_len(&rs->rules); i++) {
+		if(snexpr_prog_eval_into(rs->progs[i], ctx, &res[i]) < 0) {
+			snexpr_val_setnum(&res[i], SNEXPR_NUM_NAN);
+			nerr++;
+		}
+	}
+	ctx->scratch.depth--;
+	ctx->cse = old;
+	return nerr;
+}
+
+/*
+ * Evaluate the expressions of the set with the context, the result of
+ * the expression i is stored in res[i] (NaN if its evaluation fails) and
+ * released with snexpr_result_free() - return the number of failures. With
+ * SNEXPR_INT64 a failed expression is 0 (there is no NaN), the caller can
+ * tell it from a result 0 only by the number of failures.
+ */
+static inline int snexpr_ruleset_eval(
+		struct snexpr_ruleset *rs, struct snexpr_ctx *ctx, struct snexpr *res)
+{
+	return snexpr_ruleset_run(rs, &rs->cse, ctx, res);
+}
+
+/* number of expressions in the set, the size of the results array */
+static inline int snexpr_ruleset_size(struct snexpr_ruleset *rs)
+{
+	return sne_vec_len(&rs->rules);
+}
+
+/* destroy the set, the variables list is destroyed by the caller */
+static inline void snexpr_ruleset_destroy(struct snexpr_ruleset *rs)
+{
+	int i;
+
+	if(rs == NULL) {
+		return;
+	}
+	for(i = 0; i < sne_vec_len(&rs->rules); i++) {
+		if(rs->progs != NULL) {
+			snexpr_prog_destroy(rs->progs[i]);
+		}
+		snexpr_destroy_args(&sne_vec_nth(&rs->rules, i));
+	}
+	for(i = 0; rs->cse.slots != NULL && i < rs->cse.nslots; i++) {
+		snexpr_destroy_args(&rs->cse.slots[i]);
+		if(rs->cse.vals != NULL) {
+			snexpr_val_release(&rs->cse.vals[i]);
+		}
+	}
+	sne_vec_free(&rs->rules);
+	snexpr_free(rs->progs);
+	snexpr_free(rs->hvars);
+	snexpr_free(rs->cse.slots);
+	snexpr_free(rs->cse.vals);
+	snexpr_free(rs->cse.gens);
+	snexpr_free(rs->cse.errs);
+	snexpr_free(rs);
+}
+
+#ifdef SNEXPR_THREADS
+/*
+ * Pool of threads evaluating jobs in bulk - a job is a rule set with the
+ * user data given to the callbacks of the external variables, like for a
+ * context. The jobs of a run are split in ranges, one for each thread,
+ * taken by the owner from the front in steps of SNEXPR_POOL_GRAIN jobs,
+ * while the threads without work steal the back half of the range of
+ * another one. Each thread has its context (with its scratch area) and
+ * its values of the shared subtrees of the rule sets, so many threads can
+ * evaluate the same set. The expressions must not assign variables and
+ * must not use functions with SNEXPR_FN_PURE, the memoized calls being
+ * kept in the expressions.
+ */
+#ifndef SNEXPR_POOL_GRAIN
+#define SNEXPR_POOL_GRAIN 16
+#endif
+
+struct snexpr_job
+{
+	struct snexpr_ruleset *rs; /* built with snexpr_ruleset_build() */
+	void *data; /* user data of the context */
+	struct snexpr *res; /* snexpr_ruleset_size() results */
+	int nerr; /* failed expressions, -1 when the job was not evaluated */
+};
+
+/* values of the shared subtrees of a rule set, for a thread */
+struct snexpr_wcse
+{
+	struct snexpr_ruleset *rs;
+	struct snexpr_cse cse;
+};
+
+struct snexpr_pool;
+
+struct snexpr_worker
+{
+	struct snexpr_pool *pool;
+	pthread_t tid;
+	pthread_mutex_t lock; /* of the range of jobs */
+	size_t head;
+	size_t tail;
+	struct snexpr_ctx ctx;
+	sne_vec(struct snexpr_wcse) cses;
+	unsigned long run; /* last run done */
+	size_t nfail; /* jobs with failures in the run */
+	int id;
+};
+
+struct snexpr_pool
+{
+	pthread_mutex_t lock;
+	pthread_cond_t start;
+	pthread_cond_t done;
+	struct snexpr_worker *workers;
+	int nthreads;
+	int nstarted;
+	int active; /* threads not done with the current run */
+	int stop;
+	unsigned long run;
+	struct snexpr_job *jobs;
+};
+
+/* the values of the shared subtrees of the set for the worker */
+static struct snexpr_cse *snexpr_worker_cse(
+		struct snexpr_worker *w, struct snexpr_ruleset *rs)
+{
+	struct snexpr_wcse wc;
+	int n = rs->cse.nslots;
+	int i;
+
+	for(i = 0; i < sne_vec_len(&w->cses); i++) {
+		if(sne_vec_nth(&w->cses, i).rs == rs) {
+			return &sne_vec_nth(&w->cses, i).cse;
+		}
+	}
+	memset(&wc, 0, sizeof(struct snexpr_wcse));
+	wc.rs = rs;
+	wc.cse.nslots = n;
+	wc.cse.slots = rs->cse.slots;
+	wc.cse.vals = (struct snexpr *)snexpr_calloc(n + 1, sizeof(struct snexpr));
+	wc.cse.gens = (unsigned int *)snexpr_calloc(n + 1, sizeof(unsigned int));
+	wc.cse.errs = (unsigned char *)snexpr_calloc(n + 1, 1);
+	if(wc.cse.vals == NULL || wc.cse.gens == NULL || wc.cse.errs == NULL
+			|| sne_vec_push(&w->cses, wc) < 0) {
+		snexpr_free(wc.cse.vals);
+		snexpr_free(wc.cse.gens);
+		snexpr_free(wc.cse.errs);
+		return NULL;
+	}
+	return &sne_vec_peek(&w->cses).cse;
+}
+
+/* release the values kept for the rule sets of the run */
+static void snexpr_worker_clear(struct snexpr_worker *w)
+{
+	struct snexpr_wcse *wc;
+	int i;
+	int k;
+
+	for(i = 0; i < sne_vec_len(&w->cses); i++) {
+		wc = &sne_vec_nth(&w->cses, i);
+		for(k = 0; k < wc->cse.nslots; k++) {
+			snexpr_val_release(&wc->cse.vals[k]);
+		}
+		snexpr_free(wc->cse.vals);
+		snexpr_free(wc->cse.gens);
+		snexpr_free(wc->cse.errs);
+	}
+	sne_vec_free(&w->cses);
+	snexpr_scratch_free(&w->ctx.scratch);
+}
+
+/* evaluate the job, the string results are moved out of the scratch area */
+static void snexpr_worker_job(struct snexpr_worker *w, struct snexpr_job *j)
+{
+	struct snexpr_cse *cse;
+	struct snexpr t;
+	int n;
+	int i;
+
+	j->nerr = -1;
+	if(j->rs == NULL || j->res == NULL
+			|| (cse = snexpr_worker_cse(w, j->rs)) == NULL) {
+		w->nfail++;
+		return;
+	}
+	w->ctx.data = j->data;
+	j->nerr = snexpr_ruleset_run(j->rs, cse, &w->ctx, j->res);
+	if(j->nerr < 0) {
+		w->nfail++;
+		return;
+	}
+	n = sne_vec_len(&j->rs->rules);
+	for(i = 0; i < n; i++) {
+		if(j->res[i].type != SNE_OP_CONSTSTZ
+				|| (j->res[i].eflags & (SNEXPR_VALALLOC | SNEXPR_VALSSO))) {
+			continue;
+		}
+		memset(&t, 0, sizeof(struct snexpr));
+		if(snexpr_val_dup(NULL, &t, &j->res[i]) < 0) {
+			snexpr_val_setnum(&j->res[i], SNEXPR_NUM_NAN);
+			j->nerr++;
+			continue;
+		}
+		snexpr_val_move(&j->res[i], &t);
+	}
+	if(j->nerr > 0) {
+		w->nfail++;
+	}
+}
+
+/* take the next jobs from the front of the own range or steal half of the
+ * range of another worker - return 0 with the jobs in [*b, *e), -1 if none */
+static int snexpr_worker_take(struct snexpr_worker *w, size_t *b, size_t *e)
+{
+	struct snexpr_worker *v;
+	size_t n;
+	int i;
+
+	pthread_mutex_lock(&w->lock);
+	if(w->head < w->tail) {
+		*b = w->head;
+		n = w->tail - w->head;
+		w->head += (n < SNEXPR_POOL_GRAIN) ? n : SNEXPR_POOL_GRAIN;
+		*e = w->head;
+		pthread_mutex_unlock(&w->lock);
+		return 0;
+	}
+	pthread_mutex_unlock(&w->lock);
+	for(i = 1; i < w->pool->nthreads; i++) {
+		v = &w->pool->workers[(w->id + i) % w->pool->nthreads];
+		pthread_mutex_lock(&v->lock);
+		n = v->tail - v->head;
+		if(n == 0) {
+			pthread_mutex_unlock(&v->lock);
+			continue;
+		}
+		n = (n + 1) / 2;
+		v->tail -= n;
+		*b = v->tail;
+		pthread_mutex_unlock(&v->lock);
+		/* one step is evaluated now, the rest can be stolen from w */
+		*e = *b + ((n < SNEXPR_POOL_GRAIN) ? n : SNEXPR_POOL_GRAIN);
+		pthread_mutex_lock(&w->lock);
+		w->head = *e;
+		w->tail = *b + n;
+		pthread_mutex_unlock(&w->lock);
+		return 0;
+	}
+	return -1;
+}
+
+static void *snexpr_worker_main(void *arg)
+{
+	struct snexpr_worker *w = (struct snexpr_worker *)arg;
+	struct snexpr_pool *p = w->pool;
+	size_t b;
+	size_t e;
+
+	for(;;) {
+		pthread_mutex_lock(&p->lock);
+		while(!p->stop && p->run == w->run) {
+			pthread_cond_wait(&p->start, &p->lock);
+		}
+		if(p->stop) {
+			pthread_mutex_unlock(&p->lock);
+			return NULL;
+		}
+		w->run = p->run;
+		pthread_mutex_unlock(&p->lock);
+
+		while(snexpr_worker_take(w, &b, &e) == 0) {
+			for(; b < e; b++) {
+				snexpr_worker_job(w, &p->jobs[b]);
+			}
+		}
+		snexpr_worker_clear(w);
+
+		pthread_mutex_lock(&p->lock);
+		if(--p->active == 0) {
+			pthread_cond_signal(&p->done);
+		}
+		pthread_mutex_unlock(&p->lock);
+	}
+}
+
+static inline void snexpr_pool_destroy(struct snexpr_pool *p);
+
+/*
+ * Start a pool of nthreads threads, evaluating the jobs with contexts
+ * having the callbacks evcbf and evhcbf (which can be NULL) - return NULL
+ * on error
+ */
+static inline struct snexpr_pool *snexpr_pool_new(int nthreads,
+		snexternval_ctx_cbf_t evcbf, snexternval_handle_cbf_t evhcbf)
+{
+	struct snexpr_pool *p;
+	struct snexpr_worker *w;
+	int i;
+
+	if(nthreads <= 0) {
+		return NULL;
+	}
+	p = (struct snexpr_pool *)snexpr_calloc(1, sizeof(struct snexpr_pool));
+	if(p == NULL) {
+		return NULL;
+	}
+	p->workers = (struct snexpr_worker *)snexpr_calloc(
+			nthreads, sizeof(struct snexpr_worker));
+	if(p->workers == NULL) {
+		snexpr_free(p);
+		return NULL;
+	}
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->start, NULL);
+	pthread_cond_init(&p->done, NULL);
+	p->nthreads = nthreads;
+	for(i = 0; i < nthreads; i++) {
+		w = &p->workers[i];
+		w->pool = p;
+		w->id = i;
+		pthread_mutex_init(&w->lock, NULL);
+		snexpr_ctx_init(&w->ctx, evcbf, NULL);
+		snexpr_ctx_set_handle_cbf(&w->ctx, evhcbf);
+	}
+	for(i = 0; i < nthreads; i++) {
+		if(pthread_create(&p->workers[i].tid, NULL, snexpr_worker_main,
+				   &p->workers[i])
+				!= 0) {
+			snexpr_pool_destroy(p);
+			return NULL;
+		}
+		p->nstarted++;
+	}
+	return p;
+}
+
+/*
+ * Evaluate the jobs with the threads of the pool, waiting for all of them
+ * - the results of each job are in the order of the expressions of its
+ * set and released with snexpr_result_free(). Return the number of jobs
+ * with failed expressions, -1 on error. The pool runs one call at a time.
+ */
+static inline long snexpr_pool_run(
+		struct snexpr_pool *p, struct snexpr_job *jobs, size_t njobs)
+{
+	size_t nfail = 0;
+	int i;
+
+	if(p == NULL || (njobs > 0 && jobs == NULL)) {
+		return -1;
+	}
+	if(njobs == 0) {
+		return 0;
+	}
+	pthread_mutex_lock(&p->lock);
+	p->jobs = jobs;
+	for(i = 0; i < p->nthreads; i++) {
+		/* the workers are waiting, the ranges are not used */
+		p->workers[i].head = njobs * i / p->nthreads;
+		p->workers[i].tail = njobs * (i + 1) / p->nthreads;
+		p->workers[i].nfail = 0;
+	}
+	p->active = p->nthreads;
+	p->run++;
+	pthread_cond_broadcast(&p->start);
+	while(p->active > 0) {
+		pthread_cond_wait(&p->done, &p->lock);
+	}
+	for(i = 0; i < p->nthreads; i++) {
+		nfail += p->workers[i].nfail;
+	}
+	p->jobs = NULL;
+	pthread_mutex_unlock(&p->lock);
+	return (long)nfail;
+}
+
+/* stop the threads and destroy the pool */
+static inline void snexpr_pool_destroy(struct snexpr_pool *p)
+{
+	int i;
+
+	if(p == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&p->lock);
+	p->stop = 1;
+	pthread_cond_broadcast(&p->start);
+	pthread_mutex_unlock(&p->lock);
+	for(i = 0; i < p->nstarted; i++) {
+		pthread_join(p->workers[i].tid, NULL);
+	}
+	for(i = 0; i < p->nthreads; i++) {
+		snexpr_ctx_free(&p->workers[i].ctx);
+		pthread_mutex_destroy(&p->workers[i].lock);
+	}
+	pthread_cond_destroy(&p->done);
+	pthread_cond_destroy(&p->start);
+	pthread_mutex_destroy(&p->lock);
+	snexpr_free(p->workers);
+	snexpr_free(p);
+}
+#endif
+
+/*
+ * Incremental evaluation - the subtrees of the expression without side
+ * effects are moved in slots like for the rule sets, keeping their values
+ * between evaluations with the versions of the variables they read. When
+ * variables are assigned (by the expression or with snexpr_var_set_num()
+ * and snexpr_var_set_stz()), only the subtrees reading them are evaluated
+ * again. The operators with only variables and constants as parameters
+ * are not cached, being evaluated faster than the versions are checked.
+ */
+struct snexpr_incr
+{
+	struct snexpr e;
+	struct snexpr_var *hvars;
+	struct snexpr_cse cse;
+	int cslots;
+};
+
+typedef sne_vec(struct snexpr_var *) sne_vec_varp_t;
+typedef sne_vec(struct snexpr_cdep) sne_vec_cdep_t;
+
+/*
+ * Count (with no hvars yet) or move in slots the subtrees to cache, adding
+ * the variables read by e to vars - return 1 if e has no side effects, 0 if
+ * it has, -1 on error
+ */
+static int snexpr_incr_split(struct snexpr_incr *inc, struct snexpr *e,
+		sne_vec_varp_t *vars, sne_vec_cdep_t *deps, int share)
+{
+	sne_vec_expr_t *args = snexpr_node_args(e);
+	struct snexpr_cdep d;
+	struct snexpr *a;
+	int base = sne_vec_len(vars);
+	int clean = 1;
+	int leaves = 1;
+	int ashare = share;
+	int k;
+	int i;
+	int j;
+
+	switch(e->type) {
+		case SNE_OP_CONSTNUM:
+		case SNE_OP_CONSTSTZ:
+			return 1;
+		case SNE_OP_VAR:
+			return (sne_vec_push(vars, e->param.var.vref) < 0) ? -1 : 1;
+		case SNE_OP_ASSIGN:
+			i = snexpr_incr_split(inc, &sne_vec_nth(args, 1), vars, deps, share);
+			return (i < 0) ? -1 : 0;
+		case SNE_OP_FUNC:
+			clean = (e->param.func.f->fflags & SNEXPR_FN_PURE) != 0;
+			leaves = 0;
+			/* the function evaluates its parameters without the context */
+			ashare = share && (e->param.func.f->fctx != NULL);
+			break;
+		default:
+			break;
+	}
+	for(i = 0; i < sne_vec_len(args); i++) {
+		a = &sne_vec_nth(args, i);
+		leaves = leaves
+				 && (a->type == SNE_OP_CONSTNUM || a->type == SNE_OP_CONSTSTZ
+						 || a->type == SNE_OP_VAR);
+		k = snexpr_incr_split(inc, a, vars, deps, ashare);
+		if(k < 0) {
+			return -1;
+		}
+		clean = clean && k;
+	}
+	if(!clean || !share || leaves) {
+		return clean;
+	}
+	k = inc->cse.nslots++;
+	if(inc->hvars == NULL) {
+		return 1;
+	}
+	inc->cse.slots[k] = *e;
+	*e = snexpr_varref(&inc->hvars[k]);
+	inc->cse.doff[k] = sne_vec_len(deps);
+	for(i = base; i < sne_vec_len(vars); i++) {
+		for(j = base; j < i && sne_vec_nth(vars, j) != sne_vec_nth(vars, i);
+				j++)
+			;
+		if(j == i) {
+			d.v = sne_vec_nth(vars, i);
+			d.ver = 0;
+			if(sne_vec_push(deps, d) < 0) {
+				return -1;
+			}
+		}
+	}
+	inc->cse.doff[k + 1] = sne_vec_len(deps);
+	return 1;
+}
+
+static inline void snexpr_incr_destroy(struct snexpr_incr *inc)
+{
+	int i;
+
+	if(inc == NULL) {
+		return;
+	}
+	snexpr_destroy_args(&inc->e);
+	for(i = 0; inc->cse.slots != NULL && i < inc->cslots; i++) {
+		snexpr_destroy_args(&inc->cse.slots[i]);
+		if(inc->cse.vals != NULL) {
+			snexpr_val_release(&inc->cse.vals[i]);
+		}
+	}
+	snexpr_free(inc->hvars);
+	snexpr_free(inc->cse.slots);
+	snexpr_free(inc->cse.vals);
+	snexpr_free(inc->cse.gens);
+	snexpr_free(inc->cse.errs);
+	snexpr_free(inc->cse.doff);
+	snexpr_free(inc->cse.deps);
+	snexpr_free(inc);
+}
+
+/*
+ * Parse and optimize an expression for the incremental evaluation, all its
+ * subtrees being evaluated at the first evaluation - destroy it with
+ * snexpr_incr_destroy(), the variables list is destroyed by the caller
+ */
+static inline struct snexpr_incr *snexpr_incr_create(const char *s,
+		size_t len, struct snexpr_var_list *vars, struct snexpr_func *funcs)
+{
+	struct snexpr_incr *inc;
+	struct snexpr_cse *c;
+	struct snexpr *e;
+	sne_vec_varp_t rvars = sne_vec_init();
+	sne_vec_cdep_t deps = sne_vec_init();
+	int i;
+
+	inc = (struct snexpr_incr *)snexpr_calloc(1, sizeof(struct snexpr_incr));
+	if(inc == NULL) {
+		return NULL;
+	}
+	c = &inc->cse;
+	e = snexpr_parse(s, len, vars, funcs);
+	if(e == NULL) {
+		snexpr_free(inc);
+		return NULL;
+	}
+	inc->e = *e;
+	snexpr_free(e);
+	if(snexpr_optimize(&inc->e) < 0
+			|| snexpr_incr_split(inc, &inc->e, &rvars, &deps, 1) < 0) {
+		goto error;
+	}
+	inc->cslots = c->nslots;
+	c->nslots = 0;
+	c->gen = 1;
+	if(inc->cslots > 0) {
+		inc->hvars = (struct snexpr_var *)snexpr_calloc(
+				inc->cslots, sizeof(struct snexpr_var));
+		c->slots = (struct snexpr *)snexpr_calloc(
+				inc->cslots, sizeof(struct snexpr));
+		c->vals = (struct snexpr *)snexpr_calloc(
+				inc->cslots, sizeof(struct snexpr));
+		c->gens = (unsigned int *)snexpr_calloc(
+				inc->cslots, sizeof(unsigned int));
+		c->errs = (unsigned char *)snexpr_calloc(inc->cslots, 1);
+		c->doff = (int *)snexpr_calloc(inc->cslots + 1, sizeof(int));
+		if(inc->hvars == NULL || c->slots == NULL || c->vals == NULL
+				|| c->gens == NULL || c->errs == NULL || c->doff == NULL) {
+			goto error;
 		}
-		if(snexpr_bind(rest.s, rest.n, &es) == -1) {
-			goto cleanup;
+		for(i = 0; i < inc->cslots; i++) {
+			inc->hvars[i].evflags = SNEXPR_VALCSE;
+			inc->hvars[i].name = (char *)"";
+			inc->hvars[i].hid = i;
 		}
+		rvars.len = 0;
+		if(snexpr_incr_split(inc, &inc->e, &rvars, &deps, 1) < 0) {
+			goto error;
+		}
+		c->deps = deps.buf;
+		deps.buf = NULL;
 	}
+	sne_vec_free(&rvars);
+	sne_vec_free(&deps);
+	return inc;
 
-	result = (struct snexpr *)calloc(1, sizeof(struct snexpr));
-	if(result != NULL) {
-		if(sne_vec_len(&es) == 0) {
-			result->type = SNE_OP_CONSTNUM;
-		} else {
-			*result = sne_vec_pop(&es);
-		}
+error:
+	sne_vec_free(&rvars);
+	sne_vec_free(&deps);
+	snexpr_incr_destroy(inc);
+	return NULL;
+}
+
+/*
+ * Evaluate the expression with the context, only the cached subtrees
+ * reading variables changed since the previous evaluation being evaluated
+ * again - the result is valid until the next evaluation
+ */
+static inline int snexpr_incr_eval(
+		struct snexpr_incr *inc, struct snexpr_ctx *ctx, struct snexpr *res)
+{
+	struct snexpr_cse *old;
+	int ret;
+
+	if(ctx == NULL) {
+		return -1;
 	}
+	old = ctx->cse;
+	ctx->cse = &inc->cse;
+	ret = snexpr_eval_into(&inc->e, ctx, res);
+	ctx->cse = old;
+	return ret;
+}
 
-	int i, j;
-	struct macro m;
-	struct snexpr e;
-	struct snexpr_arg a;
-cleanup:
-	sne_vec_foreach(&macros, m, i)
+/*
+ * Flat expressions - snexpr_flat_pack() moves the nodes of an expression
+ * in a single array of small nodes, the parameters of a node being stored
+ * one after the other and referenced by the index of the first one, with
+ * the strings in a pool after the nodes. The function calls stay expression
+ * nodes, moved in a table of the same block, because the callbacks get
+ * their parameters as expressions.
+ */
+#define SNEXPR_FLAT_OPNUM (1 << 0) /* the operator has SNEXPR_OPNUM */
+#define SNEXPR_FLAT_NOSTR (1 << 1) /* string literal without value */
+
+struct snexpr_fnode
+{
+	uint8_t type;
+	uint8_t flags;
+	uint16_t nargs;
+	uint32_t first; /* index of the first parameter */
+	union
 	{
-		struct snexpr e;
-		sne_vec_foreach(&m.body, e, j)
+		snexpr_num_t nval;
+		struct
 		{
-			snexpr_destroy_args(&e);
+			uint32_t soff; /* offset in the pool */
+			uint32_t slen;
+		} str;
+		struct snexpr_var *vref;
+		uint32_t idx; /* SNE_OP_FUNC - index in the calls */
+		struct snexpr_match *match;
+		struct snexpr_set *set;
+	} u;
+};
+
+struct snexpr_flat
+{
+	size_t size;
+	uint32_t nnodes;
+	uint32_t ncalls;
+	struct snexpr *calls;
+	struct snexpr_fnode *nodes;
+	char *pool;
+};
+
+struct snexpr_fpack
+{
+	size_t nnodes;
+	size_t ncalls;
+	size_t psize;
+	struct snexpr_flat *fl;
+};
+
+/* count the nodes, the calls and the size of the strings of e */
+static int snexpr_flat_measure(struct snexpr_fpack *fp, struct snexpr *e)
+{
+	sne_vec_expr_t *args;
+	int i;
+
+	if(e->eflags & SNEXPR_ARENA) {
+		return -1;
+	}
+	fp->nnodes++;
+	if(e->type == SNE_OP_FUNC) {
+		fp->ncalls++;
+		return 0;
+	}
+	if(e->type == SNE_OP_CONSTSTZ && e->param.stz.sval != NULL) {
+		fp->psize += e->param.stz.slen + 1;
+	}
+	args = snexpr_node_args(e);
+	if(args == NULL) {
+		return 0;
+	}
+	if(sne_vec_len(args) > UINT16_MAX) {
+		return -1;
+	}
+	for(i = 0; i < sne_vec_len(args); i++) {
+		if(snexpr_flat_measure(fp, &sne_vec_nth(args, i)) < 0) {
+			return -1;
 		}
-		sne_vec_free(&m.body);
 	}
-	sne_vec_free(&macros);
+	return 0;
+}
 
-	sne_vec_foreach(&es, e, i)
-	{
-		snexpr_destroy_args(&e);
+/* set n from e, the parameters of e taking the next free nodes */
+static void snexpr_flat_fill(
+		struct snexpr_fpack *fp, struct snexpr_fnode *n, struct snexpr *e)
+{
+	struct snexpr_flat *fl = fp->fl;
+	sne_vec_expr_t *args;
+	int i;
+
+	memset(n, 0, sizeof(struct snexpr_fnode));
+	n->type = (uint8_t)e->type;
+	switch(e->type) {
+		case SNE_OP_CONSTNUM:
+			n->u.nval = e->param.num.nval;
+			return;
+		case SNE_OP_CONSTSTZ:
+			if(e->param.stz.sval == NULL) {
+				n->flags |= SNEXPR_FLAT_NOSTR;
+				return;
+			}
+			n->u.str.soff = (uint32_t)fp->psize;
+			n->u.str.slen = (uint32_t)e->param.stz.slen;
+			memcpy(fl->pool + fp->psize, e->param.stz.sval,
+					e->param.stz.slen + 1);
+			fp->psize += e->param.stz.slen + 1;
+			return;
+		case SNE_OP_VAR:
+			n->u.vref = e->param.var.vref;
+			return;
+		case SNE_OP_FUNC:
+			/* the parameters and the context go with the node */
+			n->u.idx = (uint32_t)fp->ncalls;
+			fl->calls[fp->ncalls++] = *e;
+			return;
+		default:
+			break;
 	}
-	sne_vec_free(&es);
+	if(e->eflags & SNEXPR_OPNUM) {
+		n->flags |= SNEXPR_FLAT_OPNUM;
+	}
+	if(snexpr_is_match(e->type)) {
+		n->u.match = e->param.op.match;
+		e->param.op.match = NULL;
+	} else if(e->type == SNE_OP_IN) {
+		n->u.set = e->param.op.set;
+		e->param.op.set = NULL;
+	}
+	args = &e->param.op.args;
+	n->nargs = (uint16_t)sne_vec_len(args);
+	n->first = (uint32_t)fp->nnodes;
+	fp->nnodes += n->nargs;
+	for(i = 0; i < n->nargs; i++) {
+		snexpr_flat_fill(fp, &fl->nodes[n->first + i], &sne_vec_nth(args, i));
+	}
+}
 
-	sne_vec_foreach(&as, a, i)
-	{
-		sne_vec_foreach(&a.args, e, j)
-		{
-			snexpr_destroy_args(&e);
-		}
-		sne_vec_free(&a.args);
+/* free the nodes of e after they were moved, but the function calls */
+static void snexpr_flat_release(struct snexpr *e)
+{
+	sne_vec_expr_t *args = snexpr_node_args(e);
+	int i;
+
+	if(e->type == SNE_OP_FUNC) {
+		return;
 	}
-	sne_vec_free(&as);
+	if(args == NULL) {
+		snexpr_destroy_args(e);
+		return;
+	}
+	for(i = 0; i < sne_vec_len(args); i++) {
+		snexpr_flat_release(&sne_vec_nth(args, i));
+	}
+	sne_vec_free(args);
+}
 
-	/*sne_vec_foreach(&os, o, i) {sne_vec_free(&m.body);}*/
-	sne_vec_free(&os);
-	if(result==NULL) {
-		_snexternval_cbf = NULL;
+/*
+ * Move the expression in a flat expression - return it, destroying e, or
+ * NULL keeping e if there is not enough memory, the expression is too large
+ * or e is in an arena
+ */
+static inline struct snexpr_flat *snexpr_flat_pack(struct snexpr *e)
+{
+	struct snexpr_fpack fp;
+	struct snexpr_flat *fl;
+	size_t hsize;
+	size_t csize;
+	size_t nsize;
+
+	if(e == NULL) {
+		return NULL;
+	}
+	memset(&fp, 0, sizeof(struct snexpr_fpack));
+	if(snexpr_flat_measure(&fp, e) < 0 || fp.nnodes > UINT32_MAX
+			|| fp.psize > UINT32_MAX) {
+		return NULL;
 	}
+	hsize = snexpr_arena_align(sizeof(struct snexpr_flat));
+	csize = snexpr_arena_align(fp.ncalls * sizeof(struct snexpr));
+	nsize = fp.nnodes * sizeof(struct snexpr_fnode);
+	fl = (struct snexpr_flat *)snexpr_malloc(hsize + csize + nsize + fp.psize);
+	if(fl == NULL) {
+		return NULL;
+	}
+	fl->size = hsize + csize + nsize + fp.psize;
+	fl->nnodes = (uint32_t)fp.nnodes;
+	fl->ncalls = (uint32_t)fp.ncalls;
+	fl->calls = (struct snexpr *)((char *)fl + hsize);
+	fl->nodes = (struct snexpr_fnode *)((char *)fl->calls + csize);
+	fl->pool = (char *)fl->nodes + nsize;
+	fp.fl = fl;
+	fp.nnodes = 1; /* the root */
+	fp.ncalls = 0;
+	fp.psize = 0;
+	snexpr_flat_fill(&fp, &fl->nodes[0], e);
 
-	return result;
+	snexpr_flat_release(e);
+	snexpr_free(e);
+	return fl;
 }
 
-static void snexpr_destroy_args(struct snexpr *e)
+/*
+ * Create an expression with snexpr_create() and move it in a flat
+ * expression
+ */
+static inline struct snexpr_flat *snexpr_create_flat(const char *s,
+		size_t len, struct snexpr_var_list *vars, struct snexpr_func *funcs,
+		snexternval_cbf_t evcbf)
+{
+	struct snexpr *e = snexpr_create(s, len, vars, funcs, evcbf);
+	struct snexpr_flat *fl;
+
+	if(e == NULL) {
+		return NULL;
+	}
+	fl = snexpr_flat_pack(e);
+	if(fl == NULL) {
+		snexpr_destroy(e, NULL);
+	}
+	return fl;
+}
+
+/* size of the memory block of a flat expression */
+static inline size_t snexpr_flat_size(struct snexpr_flat *fl)
+{
+	return (fl != NULL) ? fl->size : 0;
+}
+
+static inline void snexpr_flat_destroy(struct snexpr_flat *fl)
+{
+	uint32_t i;
+
+	if(fl == NULL) {
+		return;
+	}
+	for(i = 0; i < fl->ncalls; i++) {
+		snexpr_destroy_args(&fl->calls[i]);
+	}
+	for(i = 0; i < fl->nnodes; i++) {
+		if(snexpr_is_match(fl->nodes[i].type)) {
+			snexpr_match_free(fl->nodes[i].u.match);
+		} else if(fl->nodes[i].type == SNE_OP_IN) {
+			snexpr_set_free(fl->nodes[i].u.set);
+		}
+	}
+	snexpr_free(fl);
+}
+
+static int snexpr_flat_eval_r(struct snexpr_flat *fl, struct snexpr_fnode *n,
+		struct snexpr_ctx *ctx, struct snexpr *res);
+
+/* length of the chain of additions of n, like snexpr_concat_len() */
+static inline int snexpr_flat_concat_len(
+		struct snexpr_flat *fl, struct snexpr_fnode *n)
 {
+	struct snexpr_fnode *a = fl->nodes + n->first;
+	int k = 1;
+
+	if(n->type != SNE_OP_PLUS || (n->flags & SNEXPR_FLAT_OPNUM)
+			|| a->type != SNE_OP_PLUS || (a->flags & SNEXPR_FLAT_OPNUM)) {
+		return 0;
+	}
+	for(; n->type == SNE_OP_PLUS && !(n->flags & SNEXPR_FLAT_OPNUM);
+			n = fl->nodes + n->first) {
+		k++;
+	}
+	return k;
+}
+
+/* evaluate a chain of k operands, like snexpr_eval_concat() */
+static int snexpr_flat_concat(struct snexpr_flat *fl, struct snexpr_fnode *n,
+		struct snexpr_ctx *ctx, struct snexpr *res, int k)
+{
+	struct snexpr lvals[SNEXPR_CONCAT_LSIZE];
+	struct snexpr_fnode *lops[SNEXPR_CONCAT_LSIZE];
+	struct snexpr *vals = lvals;
+	struct snexpr_fnode **ops = lops;
+	int ret = -1;
 	int i;
-	struct snexpr arg;
-	if(e->type == SNE_OP_FUNC) {
-		sne_vec_foreach(&e->param.func.args, arg, i)
-		{
-			snexpr_destroy_args(&arg);
+
+	if(k > SNEXPR_CONCAT_LSIZE) {
+		vals = (struct snexpr *)snexpr_malloc(k
+				* (sizeof(struct snexpr) + sizeof(struct snexpr_fnode *)));
+		if(vals == NULL) {
+			return -1;
 		}
-		sne_vec_free(&e->param.func.args);
-		if(e->param.func.context != NULL) {
-			if(e->param.func.f->cleanup != NULL) {
-				e->param.func.f->cleanup(
-						e->param.func.f, e->param.func.context);
+		ops = (struct snexpr_fnode **)(vals + k);
+	}
+	for(i = k - 1; i > 0; i--) {
+		ops[i] = fl->nodes + n->first + 1;
+		n = fl->nodes + n->first;
+	}
+	ops[0] = n;
+	for(i = 0; i < k; i++) {
+		if(snexpr_flat_eval_r(fl, ops[i], ctx, &vals[i]) < 0) {
+			while(--i >= 0) {
+				snexpr_val_release(&vals[i]);
 			}
-			free(e->param.func.context);
-		}
-	} else if(e->type != SNE_OP_CONSTNUM && e->type != SNE_OP_CONSTSTZ
-			&& e->type != SNE_OP_VAR) {
-		sne_vec_foreach(&e->param.op.args, arg, i)
-		{
-			snexpr_destroy_args(&arg);
+			goto done;
 		}
-		sne_vec_free(&e->param.op.args);
 	}
+	ret = snexpr_val_concat(snexpr_ctx_scratch(ctx), vals, k);
+	if(ret < 0) {
+		snexpr_val_release(&vals[0]);
+	} else {
+		snexpr_val_move(res, &vals[0]);
+	}
+
+done:
+	if(vals != lvals) {
+		snexpr_free(vals);
+	}
+	return ret;
 }
 
-static void snexpr_destroy(struct snexpr *e, struct snexpr_var_list *vars)
+/* evaluation of the node n, like snexpr_eval_node() */
+static int snexpr_flat_eval_r(struct snexpr_flat *fl, struct snexpr_fnode *n,
+		struct snexpr_ctx *ctx, struct snexpr *res)
 {
-	struct snexpr_var *v;
-	_snexternval_cbf = NULL;
+	struct snexpr_scratch *sc = snexpr_ctx_scratch(ctx);
+	struct snexpr_fnode *a = fl->nodes + n->first;
+	enum snexpr_type op = (enum snexpr_type)n->type;
+	struct snexpr rv;
+	snexpr_num_t x;
+	int k;
 
-	if(e != NULL) {
-		snexpr_destroy_args(e);
-		free(e);
-	}
-	if(vars != NULL) {
-		for(v = vars->head; v;) {
-			struct snexpr_var *next = v->next;
-			if(v->evflags & SNEXPR_VALALLOC) {
-				free(v->v.sval);
+	snexpr_val_setnum(res, 0);
+	switch(op) {
+		case SNE_OP_UNARY_MINUS:
+		case SNE_OP_UNARY_LOGICAL_NOT:
+		case SNE_OP_UNARY_BITWISE_NOT:
+			if(snexpr_flat_eval_r(fl, &a[0], ctx, res) < 0) {
+				return -1;
 			}
-			free(v);
-			v = next;
-		}
+			if(res->type != SNE_OP_CONSTNUM) {
+				goto error;
+			}
+			x = res->param.num.nval;
+			if(op == SNE_OP_UNARY_MINUS) {
+				x = snexpr_num_neg(x);
+			} else if(op == SNE_OP_UNARY_LOGICAL_NOT) {
+				x = !x;
+			} else {
+				x = ~(to_int(x));
+			}
+			res->param.num.nval = x;
+			return 0;
+		case SNE_OP_POWER:
+		case SNE_OP_MULTIPLY:
+		case SNE_OP_DIVIDE:
+		case SNE_OP_REMAINDER:
+		case SNE_OP_MINUS:
+		case SNE_OP_SHL:
+		case SNE_OP_SHR:
+		case SNE_OP_BITWISE_AND:
+		case SNE_OP_BITWISE_OR:
+		case SNE_OP_BITWISE_XOR:
+			if(snexpr_flat_eval_r(fl, &a[0], ctx, res) < 0) {
+				return -1;
+			}
+			if(res->type != SNE_OP_CONSTNUM) {
+				goto error;
+			}
+			if(snexpr_flat_eval_r(fl, &a[1], ctx, &rv) < 0) {
+				goto error;
+			}
+			if(rv.type != SNE_OP_CONSTNUM) {
+				snexpr_val_release(&rv);
+				goto error;
+			}
+			return snexpr_val_numop(op, res, &rv);
+		case SNE_OP_PLUS:
+		case SNE_OP_LT:
+		case SNE_OP_LE:
+		case SNE_OP_GT:
+		case SNE_OP_GE:
+		case SNE_OP_EQ:
+		case SNE_OP_NE:
+			if(op == SNE_OP_PLUS && (k = snexpr_flat_concat_len(fl, n)) > 0) {
+				return snexpr_flat_concat(fl, n, ctx, res, k);
+			}
+			if(snexpr_flat_eval_r(fl, &a[0], ctx, res) < 0) {
+				return -1;
+			}
+			if(snexpr_flat_eval_r(fl, &a[1], ctx, &rv) < 0) {
+				goto error;
+			}
+			if(n->flags & SNEXPR_FLAT_OPNUM) {
+				res->param.num.nval = (op == SNE_OP_PLUS)
+											  ? snexpr_num_add(res->param.num.nval,
+													  rv.param.num.nval)
+											  : snexpr_cmp_num(op,
+													  res->param.num.nval,
+													  rv.param.num.nval);
+				return 0;
+			}
+			if(((op == SNE_OP_PLUS) ? snexpr_val_plus(sc, res, &rv)
+									: snexpr_val_cmp(sc, op, res, &rv))
+					< 0) {
+				snexpr_val_release(&rv);
+				goto error;
+			}
+			return 0;
+		case SNE_OP_MATCH:
+		case SNE_OP_NMATCH:
+			if(snexpr_flat_eval_r(fl, &a[0], ctx, res) < 0) {
+				return -1;
+			}
+			if(snexpr_flat_eval_r(fl, &a[1], ctx, &rv) < 0) {
+				goto error;
+			}
+			if(snexpr_val_match(sc, op, n->u.match, res, &rv) < 0) {
+				snexpr_val_release(&rv);
+				goto error;
+			}
+			return 0;
+		case SNE_OP_IN:
+			if(snexpr_flat_eval_r(fl, &a[0], ctx, res) < 0) {
+				return -1;
+			}
+			if(snexpr_val_in(n->u.set, res) < 0) {
+				goto error;
+			}
+			return 0;
+		case SNE_OP_LOGICAL_AND:
+			if(snexpr_flat_eval_r(fl, &a[0], ctx, res) < 0) {
+				return -1;
+			}
+			x = snexpr_val_num(res);
+			snexpr_val_release(res);
+			if(x != 0) {
+				if(snexpr_flat_eval_r(fl, &a[1], ctx, res) < 0) {
+					return -1;
+				}
+				x = snexpr_val_num(res);
+				snexpr_val_release(res);
+				if(x != 0) {
+					snexpr_val_setnum(res, x);
+					return 0;
+				}
+			}
+			snexpr_val_setnum(res, 0);
+			return 0;
+		case SNE_OP_LOGICAL_OR:
+			if(snexpr_flat_eval_r(fl, &a[0], ctx, res) < 0) {
+				return -1;
+			}
+			x = snexpr_val_num(res);
+			snexpr_val_release(res);
+			if(x != 0 && !snexpr_num_isnan(x)) {
+				snexpr_val_setnum(res, x);
+				return 0;
+			}
+			if(snexpr_flat_eval_r(fl, &a[1], ctx, res) < 0) {
+				return -1;
+			}
+			x = snexpr_val_num(res);
+			snexpr_val_release(res);
+			snexpr_val_setnum(res, (x != 0) ? x : 0);
+			return 0;
+		case SNE_OP_ASSIGN:
+			if(snexpr_flat_eval_r(fl, &a[1], ctx, res) < 0) {
+				return -1;
+			}
+			if(a[0].type != SNE_OP_VAR) {
+				goto error;
+			}
+			if(snexpr_var_assign(a[0].u.vref, res) < 0) {
+				goto error;
+			}
+			return 0;
+		case SNE_OP_COMMA:
+			/* errors on the left side are ignored */
+			if(snexpr_flat_eval_r(fl, &a[0], ctx, res) == 0) {
+				snexpr_val_release(res);
+			}
+			return snexpr_flat_eval_r(fl, &a[1], ctx, res);
+		case SNE_OP_CONSTNUM:
+			res->param.num.nval = n->u.nval;
+			return 0;
+		case SNE_OP_CONSTSTZ:
+			/* the string of the pool is used without copying it */
+			if(n->flags & SNEXPR_FLAT_NOSTR) {
+				return -1;
+			}
+			res->type = SNE_OP_CONSTSTZ;
+			res->param.stz.sval = fl->pool + n->u.str.soff;
+			res->param.stz.slen = n->u.str.slen;
+			return 0;
+		case SNE_OP_VAR:
+			if(snexpr_val_var(ctx, res, n->u.vref) < 0) {
+				goto error;
+			}
+			return 0;
+		case SNE_OP_FUNC:
+			if(snexpr_val_func(ctx, res, &fl->calls[n->u.idx]) < 0) {
+				goto error;
+			}
+			return 0;
+		default:
+			res->param.num.nval = SNEXPR_NUM_NAN;
+			return 0;
+	}
+
+error:
+	snexpr_val_release(res);
+	return -1;
+}
+
+/*
+ * Evaluate the flat expression, writing the result in res like
+ * snexpr_eval_into()
+ */
+static inline int snexpr_flat_eval_into(
+		struct snexpr_flat *fl, struct snexpr_ctx *ctx, struct snexpr *res)
+{
+	int ret;
+
+	if(ctx != NULL && ctx->scratch.depth++ == 0) {
+		snexpr_scratch_reset(&ctx->scratch);
+	}
+	ret = snexpr_flat_eval_r(fl, &fl->nodes[0], ctx, res);
+	if(ret == 0 && snexpr_result_unborrow(snexpr_ctx_scratch(ctx), res) < 0) {
+		ret = -1;
+	}
+	if(ctx != NULL) {
+		ctx->scratch.depth--;
 	}
+	return ret;
 }
 
 #ifdef __cplusplus
@@ -0,0 +1,676 @@
+/**
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Serge Zaitsev
+ * Copyright (c) 2022 Daniel-Constantin Mierla
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * C++17 layer over snexpr.h - move-only owners of the variables list, the
+ * context, the expression and the result, and expressions parsed at
+ * compile time from string literals, evaluated by code specialized for
+ * each node. The macros of snexpr.h (SNEXPR_INT64, SNEXPR_MALLOC(), ...)
+ * are defined before including this file.
+ */
+#ifndef SNEXPR_HPP
+#define SNEXPR_HPP
+
+#include "snexpr.h"
+
+#include <cstddef>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+
+namespace sne
+{
+
+/* the list of variables, it must outlive the expressions using it */
+class Vars
+{
+public:
+	Vars() noexcept : list_() {}
+	Vars(Vars &&o) noexcept : list_(o.list_) { o.list_ = snexpr_var_list(); }
+	Vars &operator=(Vars &&o) noexcept
+	{
+		if(this != &o) {
+			snexpr_release(NULL, &list_);
+			list_ = o.list_;
+			o.list_ = snexpr_var_list();
+		}
+		return *this;
+	}
+	Vars(const Vars &) = delete;
+	Vars &operator=(const Vars &) = delete;
+	~Vars() { snexpr_release(NULL, &list_); }
+
+	/* slot of the variable, added if not found - -1 on error */
+	int slot(std::string_view name) noexcept
+	{
+		return snexpr_var_slot(&list_, name.data(), name.size());
+	}
+	bool set(int slot, snexpr_num_t n) noexcept
+	{
+		return snexpr_var_set_num(&list_, slot, n) == 0;
+	}
+	bool set(int slot, std::string_view s)
+	{
+		std::string z(s); /* snexpr_var_set_stz() copies a C string */
+		return snexpr_var_set_stz(&list_, slot, z.c_str()) == 0;
+	}
+	struct snexpr_var_list *get() noexcept { return &list_; }
+
+private:
+	struct snexpr_var_list list_;
+};
+
+/* evaluation context, one for each thread */
+class Context
+{
+public:
+	explicit Context(snexternval_ctx_cbf_t evcbf = NULL, void *data = NULL) noexcept
+	{
+		snexpr_ctx_init(&ctx_, evcbf, data);
+	}
+	Context(Context &&o) noexcept : ctx_(o.ctx_)
+	{
+		snexpr_ctx_init(&o.ctx_, o.ctx_.evcbf, o.ctx_.data);
+	}
+	Context &operator=(Context &&o) noexcept
+	{
+		if(this != &o) {
+			snexpr_ctx_free(&ctx_);
+			ctx_ = o.ctx_;
+			snexpr_ctx_init(&o.ctx_, o.ctx_.evcbf, o.ctx_.data);
+		}
+		return *this;
+	}
+	Context(const Context &) = delete;
+	Context &operator=(const Context &) = delete;
+	~Context() { snexpr_ctx_free(&ctx_); }
+
+	void data(void *d) noexcept { ctx_.data = d; }
+	struct snexpr_ctx *get() noexcept { return &ctx_; }
+
+private:
+	struct snexpr_ctx ctx_;
+};
+
+/*
+ * Result of an evaluation - a string result of an evaluation with a
+ * context is not copied, it is valid until the next evaluation with the
+ * context, unless keep() is used
+ */
+class Value
+{
+public:
+	Value() noexcept { snexpr_val_setnum(&v_, 0); }
+	Value(Value &&o) noexcept
+	{
+		snexpr_val_move(&v_, &o.v_);
+		snexpr_val_setnum(&o.v_, 0);
+	}
+	Value &operator=(Value &&o) noexcept
+	{
+		if(this != &o) {
+			snexpr_result_free(&v_);
+			snexpr_val_move(&v_, &o.v_);
+			snexpr_val_setnum(&o.v_, 0);
+		}
+		return *this;
+	}
+	Value(const Value &) = delete;
+	Value &operator=(const Value &) = delete;
+	~Value() { snexpr_result_free(&v_); }
+
+	bool is_number() const noexcept { return v_.type == SNE_OP_CONSTNUM; }
+	bool is_string() const noexcept { return v_.type == SNE_OP_CONSTSTZ; }
+	snexpr_num_t number() const noexcept
+	{
+		return is_number() ? v_.param.num.nval : 0;
+	}
+	std::string_view str() noexcept
+	{
+		if(!is_string() || v_.param.stz.sval == NULL) {
+			return std::string_view();
+		}
+		return std::string_view(v_.param.stz.sval, snexpr_stz_len(&v_));
+	}
+	/* copy the string out of the expression and of the context */
+	bool keep() noexcept { return snexpr_result_keep(&v_) == 0; }
+	struct snexpr *get() noexcept { return &v_; }
+
+private:
+	struct snexpr v_;
+};
+
+/* expression parsed at run time, evaluated with its program once compiled */
+class Expr
+{
+public:
+	Expr() noexcept = default;
+	Expr(Expr &&o) noexcept : e_(o.e_), p_(o.p_)
+	{
+		o.e_ = NULL;
+		o.p_ = NULL;
+	}
+	Expr &operator=(Expr &&o) noexcept
+	{
+		if(this != &o) {
+			reset();
+			std::swap(e_, o.e_);
+			std::swap(p_, o.p_);
+		}
+		return *this;
+	}
+	Expr(const Expr &) = delete;
+	Expr &operator=(const Expr &) = delete;
+	~Expr() { reset(); }
+
+	/* parse for the evaluation with contexts - empty on error */
+	static Expr parse(std::string_view s, Vars &vars,
+			struct snexpr_func *funcs = NULL) noexcept
+	{
+		Expr x;
+		x.e_ = snexpr_parse(s.data(), s.size(), vars.get(), funcs);
+		return x;
+	}
+
+	explicit operator bool() const noexcept { return e_ != NULL; }
+
+	bool optimize() noexcept
+	{
+		snexpr_prog_destroy(p_);
+		p_ = NULL;
+		return e_ != NULL && snexpr_optimize(e_) == 0;
+	}
+	bool compile() noexcept
+	{
+		if(p_ == NULL && e_ != NULL) {
+			p_ = snexpr_compile(e_);
+		}
+		return p_ != NULL;
+	}
+
+	std::optional<Value> eval(Context &ctx) noexcept
+	{
+		return eval_with(ctx.get());
+	}
+	/* without context the string results are allocated */
+	std::optional<Value> eval() noexcept { return eval_with(NULL); }
+
+	struct snexpr *get() noexcept { return e_; }
+
+private:
+	std::optional<Value> eval_with(struct snexpr_ctx *ctx) noexcept
+	{
+		std::optional<Value> r(std::in_place);
+		int ret;
+
+		if(e_ == NULL) {
+			return std::nullopt;
+		}
+		ret = (p_ != NULL) ? snexpr_prog_eval_into(p_, ctx, r->get())
+						   : snexpr_eval_into(e_, ctx, r->get());
+		if(ret < 0) {
+			return std::nullopt;
+		}
+		return r;
+	}
+	void reset() noexcept
+	{
+		snexpr_prog_destroy(p_);
+		snexpr_release(e_, NULL);
+		e_ = NULL;
+		p_ = NULL;
+	}
+
+	struct snexpr *e_ = NULL;
+	struct snexpr_prog *p_ = NULL;
+};
+
+/*
+ * Expressions parsed at compile time - numbers, variables, parenthesis and
+ * the unary, arithmetic, comparison, logical, bitwise, shift and comma
+ * operators, with the precedence of snexpr.h. sne::parse() gives the nodes
+ * of the expression as a constexpr value, which has to be static and is
+ * given to sne::Static to get its evaluator, e.g.:
+ *
+ *   static constexpr auto rule = sne::parse("N1 * 2 + (N2 > 3)");
+ *   snexpr_num_t vals[rule.nvars] = {...}; // in the order of rule.slot()
+ *   std::optional<snexpr_num_t> r = sne::Static<rule>::eval(vals);
+ *
+ * The other expressions do not compile. The results are the ones of
+ * snexpr_eval() with the values of the variables set by slot.
+ */
+struct CNode
+{
+	enum snexpr_type op = SNE_OP_UNKNOWN;
+	int a = -1; /* the operands */
+	int b = -1;
+	snexpr_num_t num = 0;
+	int slot = -1;
+};
+
+/* the precedence of the operators, as in snexpr.h */
+constexpr int cprec(enum snexpr_type op)
+{
+	switch(op) {
+		case SNE_OP_UNARY_MINUS:
+		case SNE_OP_UNARY_LOGICAL_NOT:
+		case SNE_OP_UNARY_BITWISE_NOT:
+			return 1;
+		case SNE_OP_POWER:
+		case SNE_OP_MULTIPLY:
+		case SNE_OP_DIVIDE:
+		case SNE_OP_REMAINDER:
+			return 2;
+		case SNE_OP_PLUS:
+		case SNE_OP_MINUS:
+			return 3;
+		case SNE_OP_SHL:
+		case SNE_OP_SHR:
+			return 4;
+		case SNE_OP_LT:
+		case SNE_OP_LE:
+		case SNE_OP_GT:
+		case SNE_OP_GE:
+		case SNE_OP_EQ:
+		case SNE_OP_NE:
+			return 5;
+		case SNE_OP_BITWISE_AND:
+			return 6;
+		case SNE_OP_BITWISE_OR:
+			return 7;
+		case SNE_OP_BITWISE_XOR:
+			return 8;
+		case SNE_OP_LOGICAL_AND:
+			return 9;
+		case SNE_OP_LOGICAL_OR:
+			return 10;
+		case SNE_OP_COMMA:
+			return 12;
+		default:
+			return 0;
+	}
+}
+
+constexpr bool cunary(enum snexpr_type op)
+{
+	return op == SNE_OP_UNARY_MINUS || op == SNE_OP_UNARY_LOGICAL_NOT
+		   || op == SNE_OP_UNARY_BITWISE_NOT;
+}
+
+/* if the operator on the stack is applied before the new one */
+constexpr bool cpops(enum snexpr_type op, enum snexpr_type top)
+{
+	bool left = !cunary(op) && op != SNE_OP_POWER && op != SNE_OP_COMMA;
+	return (left && cprec(op) >= cprec(top)) || (cprec(op) > cprec(top));
+}
+
+constexpr bool cvfirst(char c)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_'
+		   || c == '$' || c == '@';
+}
+
+constexpr bool cdigit(char c) { return c >= '0' && c <= '9'; }
+
+template <std::size_t N> struct CExpr
+{
+	CNode nodes[N];
+	int nnodes = 0;
+	int root = -1;
+	int nvars = 0;
+	int voff[N] = {}; /* name of each variable in src */
+	int vlen[N] = {};
+	char src[N] = {};
+
+	/* slot of the variable in the values array, -1 if not used */
+	constexpr int slot(std::string_view name) const
+	{
+		for(int i = 0; i < nvars; i++) {
+			if(std::string_view(src + voff[i], vlen[i]) == name) {
+				return i;
+			}
+		}
+		return -1;
+	}
+};
+
+template <std::size_t N> constexpr CExpr<N> parse(const char (&s)[N])
+{
+	CExpr<N> x;
+	enum snexpr_type ops[N] = {}; /* SNE_OP_UNKNOWN for '(' */
+	int es[N] = {};
+	int nops = 0;
+	int nes = 0;
+	bool operand = true; /* an operand or an unary operator is expected */
+	std::size_t i = 0;
+
+	for(std::size_t k = 0; k < N; k++) {
+		x.src[k] = s[k];
+	}
+	/* apply the operator at the top of the stack */
+	auto reduce = [&]() {
+		enum snexpr_type op = ops[--nops];
+		CNode &n = x.nodes[x.nnodes];
+		n.op = op;
+		if(cunary(op)) {
+			if(nes < 1) {
+				throw "snexpr: missing operand";
+			}
+			n.a = es[nes - 1];
+			es[nes - 1] = x.nnodes++;
+			return;
+		}
+		if(nes < 2) {
+			throw "snexpr: missing operand";
+		}
+		n.a = es[nes - 2];
+		n.b = es[nes - 1];
+		nes--;
+		es[nes - 1] = x.nnodes++;
+	};
+
+	while(i < N - 1 && s[i] != '\0') {
+		char c = s[i];
+		enum snexpr_type op = SNE_OP_UNKNOWN;
+		if(c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+			i++;
+			continue;
+		}
+		if(operand) {
+			if(cdigit(c)) {
+				/* digits and fraction, exact up to 19 digits */
+				unsigned long long m = 0;
+				long double d = 1;
+				bool frac = false;
+				for(; i < N - 1 && (cdigit(s[i]) || (s[i] == '.' && !frac)); i++) {
+					if(s[i] == '.') {
+						frac = true;
+					} else if(!frac) {
+#ifdef SNEXPR_INT64
+						if(m > (unsigned long long)(LLONG_MAX - (s[i] - '0')) / 10) {
+							throw "snexpr: number out of range";
+						}
+#endif
+						m = m * 10 + (s[i] - '0');
+					} else {
+#ifndef SNEXPR_INT64
+						m = m * 10 + (s[i] - '0');
+						d *= 10;
+#endif
+					}
+				}
+				x.nodes[x.nnodes].op = SNE_OP_CONSTNUM;
+				x.nodes[x.nnodes].num = (snexpr_num_t)((long double)m / d);
+				es[nes++] = x.nnodes++;
+				operand = false;
+				continue;
+			}
+			if(cvfirst(c)) {
+				std::size_t b = i;
+				for(; i < N - 1 && (cvfirst(s[i]) || cdigit(s[i]) || s[i] == '#'); i++) {
+				}
+				std::string_view name(s + b, i - b);
+				if(name == "in" || (i < N - 1 && s[i] == '(')) {
+					throw "snexpr: functions and sets are not supported";
+				}
+				int v = x.slot(name);
+				if(v < 0) {
+					v = x.nvars++;
+					x.voff[v] = (int)b;
+					x.vlen[v] = (int)(i - b);
+				}
+				x.nodes[x.nnodes].op = SNE_OP_VAR;
+				x.nodes[x.nnodes].slot = v;
+				es[nes++] = x.nnodes++;
+				operand = false;
+				continue;
+			}
+			if(c == '(') {
+				ops[nops++] = SNE_OP_UNKNOWN;
+				i++;
+				continue;
+			}
+			if(c == '-') {
+				op = SNE_OP_UNARY_MINUS;
+			} else if(c == '!') {
+				op = SNE_OP_UNARY_LOGICAL_NOT;
+			} else if(c == '^') {
+				/* like snexpr_parse(), where ~a is a variable name */
+				op = SNE_OP_UNARY_BITWISE_NOT;
+			} else {
+				throw "snexpr: operand expected";
+			}
+			ops[nops++] = op;
+			i++;
+			continue;
+		}
+		if(c == ')') {
+			while(nops > 0 && ops[nops - 1] != SNE_OP_UNKNOWN) {
+				reduce();
+			}
+			if(nops == 0) {
+				throw "snexpr: unbalanced parenthesis";
+			}
+			nops--;
+			i++;
+			continue;
+		}
+		char c2 = (i + 1 < N - 1) ? s[i + 1] : '\0';
+		int len = 2;
+		if(c == '*' && c2 == '*') {
+			op = SNE_OP_POWER;
+		} else if(c == '<' && c2 == '<') {
+			op = SNE_OP_SHL;
+		} else if(c == '>' && c2 == '>') {
+			op = SNE_OP_SHR;
+		} else if(c == '<' && c2 == '=') {
+			op = SNE_OP_LE;
+		} else if(c == '>' && c2 == '=') {
+			op = SNE_OP_GE;
+		} else if(c == '=' && c2 == '=') {
+			op = SNE_OP_EQ;
+		} else if(c == '!' && c2 == '=') {
+			op = SNE_OP_NE;
+		} else if(c == '&' && c2 == '&') {
+			op = SNE_OP_LOGICAL_AND;
+		} else if(c == '|' && c2 == '|') {
+			op = SNE_OP_LOGICAL_OR;
+		} else if(c == '=' || c == '~' || (c == '!' && c2 == '~')) {
+			throw "snexpr: assignments and match operators are not supported";
+		} else {
+			len = 1;
+			switch(c) {
+				case '*':
+					op = SNE_OP_MULTIPLY;
+					break;
+				case '/':
+					op = SNE_OP_DIVIDE;
+					break;
+				case '%':
+					op = SNE_OP_REMAINDER;
+					break;
+				case '+':
+					op = SNE_OP_PLUS;
+					break;
+				case '-':
+					op = SNE_OP_MINUS;
+					break;
+				case '<':
+					op = SNE_OP_LT;
+					break;
+				case '>':
+					op = SNE_OP_GT;
+					break;
+				case '&':
+					op = SNE_OP_BITWISE_AND;
+					break;
+				case '|':
+					op = SNE_OP_BITWISE_OR;
+					break;
+				case '^':
+					op = SNE_OP_BITWISE_XOR;
+					break;
+				case ',':
+					op = SNE_OP_COMMA;
+					break;
+				default:
+					throw "snexpr: unknown operator";
+			}
+		}
+		while(nops > 0 && ops[nops - 1] != SNE_OP_UNKNOWN
+				&& cpops(op, ops[nops - 1])) {
+			reduce();
+		}
+		ops[nops++] = op;
+		operand = true;
+		i += len;
+	}
+	if(operand) {
+		throw "snexpr: operand expected";
+	}
+	while(nops > 0) {
+		if(ops[nops - 1] == SNE_OP_UNKNOWN) {
+			throw "snexpr: unbalanced parenthesis";
+		}
+		reduce();
+	}
+	if(nes != 1) {
+		throw "snexpr: bad expression";
+	}
+	x.root = es[0];
+	return x;
+}
+
+/* evaluator of the node I of the expression X, err is set on failure */
+template <const auto &X, int I> struct CEval
+{
+	static inline snexpr_num_t run(const snexpr_num_t *v, bool &err)
+	{
+		constexpr CNode n = X.nodes[I];
+		if constexpr(n.op == SNE_OP_CONSTNUM) {
+			return n.num;
+		} else if constexpr(n.op == SNE_OP_VAR) {
+			return v[n.slot];
+		} else if constexpr(n.op == SNE_OP_UNARY_MINUS) {
+			snexpr_num_t a = CEval<X, n.a>::run(v, err); /* a macro */
+			return snexpr_num_neg(a);
+		} else if constexpr(n.op == SNE_OP_UNARY_LOGICAL_NOT) {
+			return !CEval<X, n.a>::run(v, err);
+		} else if constexpr(n.op == SNE_OP_UNARY_BITWISE_NOT) {
+			snexpr_num_t a = CEval<X, n.a>::run(v, err); /* to_int() can be a macro */
+			return ~to_int(a);
+		} else if constexpr(n.op == SNE_OP_LOGICAL_AND) {
+			snexpr_num_t a = CEval<X, n.a>::run(v, err);
+			if(err || a == 0) {
+				return 0;
+			}
+			a = CEval<X, n.b>::run(v, err);
+			return (a != 0) ? a : 0;
+		} else if constexpr(n.op == SNE_OP_LOGICAL_OR) {
+			snexpr_num_t a = CEval<X, n.a>::run(v, err);
+			if(err || (a != 0 && !snexpr_num_isnan(a))) {
+				return a;
+			}
+			a = CEval<X, n.b>::run(v, err);
+			return (a != 0) ? a : 0;
+		} else if constexpr(n.op == SNE_OP_COMMA) {
+			/* errors on the left side are ignored */
+			bool lerr = false;
+			(void)CEval<X, n.a>::run(v, lerr);
+			return CEval<X, n.b>::run(v, err);
+		} else {
+			snexpr_num_t a = CEval<X, n.a>::run(v, err);
+			snexpr_num_t b = CEval<X, n.b>::run(v, err);
+			if constexpr(n.op == SNE_OP_PLUS) {
+				return snexpr_num_add(a, b);
+			} else if constexpr(n.op == SNE_OP_MINUS) {
+				return snexpr_num_sub(a, b);
+			} else if constexpr(n.op == SNE_OP_MULTIPLY) {
+				return snexpr_num_mul(a, b);
+			} else if constexpr(n.op == SNE_OP_DIVIDE) {
+				if(b == 0) {
+					err = true;
+					return 0;
+				}
+				return snexpr_num_div(a, b);
+			} else if constexpr(n.op == SNE_OP_REMAINDER) {
+#ifdef SNEXPR_INT64
+				if(b == 0) {
+					err = true;
+					return 0;
+				}
+#endif
+				return snexpr_num_rem(a, b);
+			} else if constexpr(n.op == SNE_OP_POWER) {
+				return snexpr_num_pow(a, b);
+			} else if constexpr(n.op == SNE_OP_SHL) {
+				return snexpr_num_shl(a, b);
+			} else if constexpr(n.op == SNE_OP_SHR) {
+				return snexpr_num_shr(a, b);
+			} else if constexpr(n.op == SNE_OP_BITWISE_AND) {
+				return to_int(a) & to_int(b);
+			} else if constexpr(n.op == SNE_OP_BITWISE_OR) {
+				return to_int(a) | to_int(b);
+			} else if constexpr(n.op == SNE_OP_BITWISE_XOR) {
+				return to_int(a) ^ to_int(b);
+			} else if constexpr(n.op == SNE_OP_LT) {
+				return a < b;
+			} else if constexpr(n.op == SNE_OP_LE) {
+				return a <= b;
+			} else if constexpr(n.op == SNE_OP_GT) {
+				return a > b;
+			} else if constexpr(n.op == SNE_OP_GE) {
+				return a >= b;
+			} else if constexpr(n.op == SNE_OP_EQ) {
+				return a == b;
+			} else {
+				static_assert(n.op == SNE_OP_NE, "snexpr: unknown node");
+				return a != b;
+			}
+		}
+	}
+};
+
+/* evaluator of an expression given by sne::parse() */
+template <const auto &X> struct Static
+{
+	static constexpr int nvars = X.nvars;
+
+	/* the value of the variable with the slot i is in v[i] */
+	static inline std::optional<snexpr_num_t> eval(const snexpr_num_t *v)
+	{
+		bool err = false;
+		snexpr_num_t r = CEval<X, X.root>::run(v, err);
+		if(err) {
+			return std::nullopt;
+		}
+		return r;
+	}
+};
+
+} // namespace sne
+
+#endif
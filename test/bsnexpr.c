@@ -0,0 +1,409 @@
+/**
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Serge Zaitsev
+ * Copyright (c) 2022 Daniel-Constantin Mierla
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Benchmark of parsing and evaluation, run with: bsnexpr [iterations]
+ *
+ * For each expression of the corpus it prints the time per snexpr_create(),
+ * the time per evaluation with snexpr_eval() (tree), snexpr_eval_into() with
+ * a context (into), the compiled program (prog), the optimized compiled
+ * program (opt), the optimized flat expression (flat) and the optimized
+ * expression compiled with snexpr_jit_compile() (jit, native code when
+ * built with SNEXPR_JIT), the allocations per evaluation and the bytes
+ * allocated for the expression tree and for the program or the flat
+ * expression. The jit takes the variables from an array, with the value of
+ * the N variables and 0 for the others, the string results fail.
+ */
+
+#include <limits.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* the allocations done by snexpr.h are counted with the SNEXPR_MALLOC()
+ * hooks, keeping the size before each block to know the released bytes */
+typedef union
+{
+	size_t size;
+	long double align;
+} bsnexpr_mhdr_t;
+
+static long _bsnexpr_nalloc = 0;
+static long _bsnexpr_nbytes = 0;
+
+static void *bsnexpr_malloc(size_t size)
+{
+	bsnexpr_mhdr_t *h = (bsnexpr_mhdr_t *)malloc(sizeof(bsnexpr_mhdr_t) + size);
+
+	if(h == NULL) {
+		return NULL;
+	}
+	h->size = size;
+	_bsnexpr_nalloc++;
+	_bsnexpr_nbytes += (long)size;
+	return h + 1;
+}
+
+static void *bsnexpr_calloc(size_t n, size_t size)
+{
+	void *p = bsnexpr_malloc(n * size);
+
+	if(p != NULL) {
+		memset(p, 0, n * size);
+	}
+	return p;
+}
+
+/* not inlined, the compiler does not know the blocks come from malloc() */
+#if defined(__GNUC__)
+__attribute__((noinline))
+#endif
+static void bsnexpr_free(void *p)
+{
+	bsnexpr_mhdr_t *h;
+
+	if(p == NULL) {
+		return;
+	}
+	h = (bsnexpr_mhdr_t *)p - 1;
+	_bsnexpr_nbytes -= (long)h->size;
+	free(h);
+}
+
+static void *bsnexpr_realloc(void *p, size_t size)
+{
+	bsnexpr_mhdr_t *h;
+	void *np;
+
+	if(p == NULL) {
+		return bsnexpr_malloc(size);
+	}
+	h = (bsnexpr_mhdr_t *)p - 1;
+	np = bsnexpr_malloc(size);
+	if(np == NULL) {
+		return NULL;
+	}
+	memcpy(np, p, (h->size < size) ? h->size : size);
+	bsnexpr_free(p);
+	return np;
+}
+
+#define SNEXPR_MALLOC(s) bsnexpr_malloc(s)
+#define SNEXPR_CALLOC(n, s) bsnexpr_calloc(n, s)
+#define SNEXPR_REALLOC(p, s) bsnexpr_realloc(p, s)
+#define SNEXPR_FREE(p) bsnexpr_free(p)
+
+#include "../snexpr.h"
+
+#define BSNEXPR_NCREATE 1000
+
+static struct snexpr *bsnexpr_extval_cbf(char *vname)
+{
+	if(vname == NULL) {
+		return NULL;
+	}
+	if(vname[0] == 'S') {
+		return snexpr_convert_stz("abc", SNE_OP_CONSTSTZ);
+	}
+	if(vname[0] == 'N') {
+		return snexpr_convert_num(atoi(vname + 1) * 10, SNE_OP_CONSTNUM);
+	}
+	return snexpr_convert_num(0, SNE_OP_CONSTNUM);
+}
+
+static struct snexpr *bsnexpr_extval_ctx_cbf(
+		struct snexpr_ctx *ctx, char *vname)
+{
+	return bsnexpr_extval_cbf(vname);
+}
+
+/* sum of the parameters */
+static struct snexpr *bsnexpr_fsum(
+		struct snexpr_func *f, sne_vec_expr_t *args, void *c)
+{
+	struct snexpr *r;
+	snexpr_num_t n = 0;
+	int i;
+
+	for(i = 0; i < sne_vec_len(args); i++) {
+		r = snexpr_eval(&sne_vec_nth(args, i));
+		if(r == NULL) {
+			return NULL;
+		}
+		if(r->type == SNE_OP_CONSTNUM) {
+			n += r->param.num.nval;
+		}
+		snexpr_result_free(r);
+	}
+	return snexpr_convert_num(n, SNE_OP_CONSTNUM);
+}
+
+/* greater of the two parameters, with a context to evaluate them */
+static struct snexpr *bsnexpr_fmax(struct snexpr_func *f,
+		sne_vec_expr_t *args, void *c, struct snexpr_ctx *ctx)
+{
+	struct snexpr a;
+	struct snexpr b;
+	snexpr_num_t n;
+
+	if(sne_vec_len(args) != 2
+			|| snexpr_eval_into(&sne_vec_nth(args, 0), ctx, &a) < 0) {
+		return NULL;
+	}
+	if(snexpr_eval_into(&sne_vec_nth(args, 1), ctx, &b) < 0) {
+		snexpr_result_free(&a);
+		return NULL;
+	}
+	n = (a.param.num.nval > b.param.num.nval) ? a.param.num.nval
+											  : b.param.num.nval;
+	snexpr_result_free(&a);
+	snexpr_result_free(&b);
+	return snexpr_convert_num(n, SNE_OP_CONSTNUM);
+}
+
+static struct snexpr_func bsnexpr_funcs[] = {
+		{"sum", bsnexpr_fsum, NULL, 0, NULL, 0, 0, SNE_OP_UNKNOWN},
+		{"max", NULL, NULL, 0, bsnexpr_fmax, SNEXPR_FN_FOLD | SNEXPR_FN_NARGS, 2,
+				SNE_OP_CONSTNUM},
+		{NULL, NULL, NULL, 0, NULL, 0, 0, SNE_OP_UNKNOWN},
+};
+
+typedef struct bsnexpr_case
+{
+	const char *name;
+	const char *s;
+} bsnexpr_case_t;
+
+static bsnexpr_case_t bsnexpr_corpus[] = {
+		{"arith", "(N1 + 2) * 3 - N2 / 4 + 7 % 3 - -N3"},
+		{"consts", "(1 + 2) * 3 - (4 << 2) + 10 / 5"},
+		{"concat", "S1 + \"-\" + N1 + \"-\" + S2 + \":\" + 42 + S3"},
+		{"compare", "N1 > 5 && S1 == \"abc\" || N2 <= 2 && S2 != \"xyz\""},
+		{"macro", "$(sq, $1 * $1), $(hyp, sq($1) + sq($2)), hyp(N1, N2)"},
+		{"funcs", "sum(N1, 2, N3) * max(N2, 5) + max(1, 2)"},
+		{"extvars", "N1 + N2 + N3 + N4 + N5 + N6 + N7 + N8"},
+		{"assign", "x = N1, y = x * 2, z = y + x, x + y + z"},
+		{"match", "(S1 =~ \"^ab\") + (S2 !~ \"bc$\") + (S3 + N1 =~ \"^[a-c]+[0-9]$\")"},
+		{"in", "(S1 in (\"INVITE\", \"ACK\", \"BYE\", \"CANCEL\", \"abc\")) + (N1 == 1 || N1 == 2 || N1 == 3 || N1 == 4 || N1 == 5)"},
+		{NULL, NULL},
+};
+
+static double bsnexpr_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+/* time of parsing and bytes allocated for the tree, in ns per expression */
+static double bsnexpr_run_create(bsnexpr_case_t *c, long *nbytes)
+{
+	static struct snexpr *el[BSNEXPR_NCREATE];
+	struct snexpr_var_list vars = {0};
+	size_t len = strlen(c->s);
+	long b0 = _bsnexpr_nbytes;
+	double t;
+	int i;
+
+	t = bsnexpr_now();
+	for(i = 0; i < BSNEXPR_NCREATE; i++) {
+		el[i] = snexpr_create(
+				c->s, len, &vars, bsnexpr_funcs, bsnexpr_extval_cbf);
+	}
+	t = bsnexpr_now() - t;
+	*nbytes = (_bsnexpr_nbytes - b0) / BSNEXPR_NCREATE;
+	for(i = 0; i < BSNEXPR_NCREATE; i++) {
+		snexpr_destroy(el[i], NULL);
+	}
+	snexpr_destroy(NULL, &vars);
+	return t / BSNEXPR_NCREATE;
+}
+
+/* evaluation modes of the expression */
+enum bsnexpr_mode
+{
+	BSNEXPR_TREE,
+	BSNEXPR_INTO,
+	BSNEXPR_PROG,
+	BSNEXPR_OPT,
+	BSNEXPR_FLAT,
+	BSNEXPR_JIT,
+};
+
+/* time of evaluation in ns and allocations per evaluation */
+static double bsnexpr_run_eval(bsnexpr_case_t *c, enum bsnexpr_mode mode,
+		long niter, double *nallocs, long *nbytes)
+{
+	struct snexpr_var_list vars = {0};
+	struct snexpr_ctx ctx;
+	struct snexpr_prog *prog = NULL;
+	struct snexpr_flat *fl = NULL;
+	struct snexpr_jit *jit = NULL;
+	snexpr_num_t *vals = NULL;
+	snexpr_num_t n;
+	struct snexpr *e;
+	struct snexpr *r;
+	struct snexpr rv;
+	double t = 0;
+	long a0;
+	long b0;
+	long i = 0;
+	int k;
+
+	e = snexpr_create(c->s, strlen(c->s), &vars, bsnexpr_funcs,
+			bsnexpr_extval_cbf);
+	if(e == NULL) {
+		return -1;
+	}
+	*nbytes = 0;
+	snexpr_ctx_init(&ctx, bsnexpr_extval_ctx_cbf, NULL);
+	if(mode >= BSNEXPR_OPT && snexpr_optimize(e) < 0) {
+		goto done;
+	}
+	if(mode == BSNEXPR_PROG || mode == BSNEXPR_OPT) {
+		b0 = _bsnexpr_nbytes;
+		prog = snexpr_compile(e);
+		if(prog == NULL) {
+			goto done;
+		}
+		*nbytes = _bsnexpr_nbytes - b0;
+	}
+	if(mode == BSNEXPR_FLAT) {
+		fl = snexpr_flat_pack(e);
+		if(fl == NULL) {
+			goto done;
+		}
+		e = NULL;
+		*nbytes = (long)snexpr_flat_size(fl);
+	}
+	if(mode == BSNEXPR_JIT) {
+		jit = snexpr_jit_compile(e);
+		vals = (snexpr_num_t *)calloc(vars.nslots + 1, sizeof(snexpr_num_t));
+		if(jit == NULL || vals == NULL) {
+			goto done;
+		}
+		for(k = 0; k < vars.nslots; k++) {
+			if(vars.slots[k]->name[0] == 'N') {
+				vals[k] = atoi(vars.slots[k]->name + 1) * 10;
+			}
+		}
+	}
+	a0 = _bsnexpr_nalloc;
+	t = bsnexpr_now();
+	for(i = 0; i < niter; i++) {
+		switch(mode) {
+			case BSNEXPR_TREE:
+				r = snexpr_eval(e);
+				if(r == NULL) {
+					goto done;
+				}
+				snexpr_result_free(r);
+				break;
+			case BSNEXPR_INTO:
+				if(snexpr_eval_into(e, &ctx, &rv) < 0) {
+					goto done;
+				}
+				snexpr_result_free(&rv);
+				break;
+			case BSNEXPR_FLAT:
+				if(snexpr_flat_eval_into(fl, &ctx, &rv) < 0) {
+					goto done;
+				}
+				snexpr_result_free(&rv);
+				break;
+			case BSNEXPR_JIT:
+				if(snexpr_jit_eval(jit, &ctx, vals, vars.nslots, &n) < 0) {
+					goto done;
+				}
+				break;
+			default:
+				if(snexpr_prog_eval_into(prog, &ctx, &rv) < 0) {
+					goto done;
+				}
+				snexpr_result_free(&rv);
+				break;
+		}
+	}
+	t = (bsnexpr_now() - t) / niter;
+	*nallocs = (double)(_bsnexpr_nalloc - a0) / niter;
+
+done:
+	if(i < niter) {
+		t = -1;
+	}
+	snexpr_prog_destroy(prog);
+	snexpr_flat_destroy(fl);
+	snexpr_jit_destroy(jit);
+	free(vals);
+	snexpr_ctx_free(&ctx);
+	snexpr_destroy(e, &vars);
+	return t;
+}
+
+int main(int argc, char *argv[])
+{
+	static const char *mnames[] = {"tree", "into", "prog", "opt", "flat", "jit"};
+	bsnexpr_case_t *c;
+	long niter = 200000;
+	long tbytes;
+	long pbytes;
+	double allocs;
+	double t;
+	int m;
+
+	if(argc > 1) {
+		niter = atol(argv[1]);
+		if(niter <= 0) {
+			fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+			return 1;
+		}
+	}
+	printf("%-8s %10s %8s | %-4s %10s %10s %8s\n", "case", "create-ns",
+			"tree-B", "mode", "eval-ns", "allocs", "prog-B");
+	for(c = bsnexpr_corpus; c->name != NULL; c++) {
+		t = bsnexpr_run_create(c, &tbytes);
+		for(m = BSNEXPR_TREE; m <= BSNEXPR_JIT; m++) {
+			if(m == BSNEXPR_TREE) {
+				printf("%-8s %10.1f %8ld | ", c->name, t, tbytes);
+			} else {
+				printf("%-8s %10s %8s | ", "", "", "");
+			}
+			allocs = 0;
+			pbytes = 0;
+			t = bsnexpr_run_eval(
+					c, (enum bsnexpr_mode)m, niter, &allocs, &pbytes);
+			if(t < 0) {
+				printf("%-4s %10s\n", mnames[m], "failed");
+				continue;
+			}
+			printf("%-4s %10.1f %10.2f %8ld\n", mnames[m], t, allocs, pbytes);
+		}
+	}
+	return 0;
+}
@@ -24,6 +24,51 @@
  */
 
 
+#include <stdlib.h>
+
+/* the blocks allocated by the library, all released at the end - the
+ * threads of the pool allocate at the same time with SNEXPR_THREADS */
+static long _snexpr_test_nblocks = 0;
+
+#ifdef SNEXPR_THREADS
+#define snexpr_test_count(n) __sync_fetch_and_add(&_snexpr_test_nblocks, n)
+#else
+#define snexpr_test_count(n) (_snexpr_test_nblocks += (n))
+#endif
+
+static void *snexpr_test_malloc(size_t size)
+{
+	snexpr_test_count(1);
+	return malloc(size);
+}
+
+static void *snexpr_test_calloc(size_t n, size_t size)
+{
+	snexpr_test_count(1);
+	return calloc(n, size);
+}
+
+static void *snexpr_test_realloc(void *p, size_t size)
+{
+	if(p == NULL) {
+		snexpr_test_count(1);
+	}
+	return realloc(p, size);
+}
+
+static void snexpr_test_free(void *p)
+{
+	if(p != NULL) {
+		snexpr_test_count(-1);
+	}
+	free(p);
+}
+
+#define SNEXPR_MALLOC(s) snexpr_test_malloc(s)
+#define SNEXPR_CALLOC(n, s) snexpr_test_calloc(n, s)
+#define SNEXPR_REALLOC(p, s) snexpr_test_realloc(p, s)
+#define SNEXPR_FREE(p) snexpr_test_free(p)
+
 #include "../snexpr.h"
 
 #include <assert.h>
@@ -31,6 +76,10 @@
 #include <sys/time.h>
 
 
+/* P1 is borrowed from the packet, it is not followed by '\0' */
+static char _snexpr_test_packet[] = "INVITE sip:alice@example.com SIP/2.0";
+static struct snexpr _snexpr_test_pval;
+
 static struct snexpr* snexpr_extval_cbf(char *vname)
 {
 	struct snexpr *e = NULL;
@@ -43,6 +92,8 @@ static struct snexpr* snexpr_extval_cbf(char *vname)
 		e = snexpr_convert_stz("abc", SNE_OP_CONSTSTZ);
 	} else if(strcmp(vname, "N1")==0) {
 		e = snexpr_convert_num(10, SNE_OP_CONSTNUM);
+	} else if(strcmp(vname, "P1")==0) {
+		e = snexpr_stz_borrow(&_snexpr_test_pval, _snexpr_test_packet + 7, 9);
 	} else {
 		e = snexpr_convert_num(0, SNE_OP_CONSTNUM);
 	}
@@ -50,6 +101,45 @@ static struct snexpr* snexpr_extval_cbf(char *vname)
 	return e;
 }
 
+/* external variables with a context - N2 is taken from the user data */
+static struct snexpr* snexpr_extval_ctx_cbf(struct snexpr_ctx *ctx, char *vname)
+{
+	if(vname!=NULL && strcmp(vname, "N2")==0) {
+		return snexpr_convert_num(*(float *)ctx->data, SNE_OP_CONSTNUM);
+	}
+	return snexpr_extval_cbf(vname);
+}
+
+/* evaluate with the compiled program and compare with the tree evaluation */
+static void snexpr_test_prog(char *s, struct snexpr *e, struct snexpr *result)
+{
+	struct snexpr_prog *prog = snexpr_compile(e);
+	struct snexpr *presult = NULL;
+	int ok = 0;
+
+	if(prog == NULL) {
+		printf("FAIL: %s cannot be compiled\n", s);
+		return;
+	}
+	presult = snexpr_prog_eval(prog);
+	if(result == NULL || presult == NULL) {
+		ok = (result == presult);
+	} else if(result->type == presult->type) {
+		if(result->type == SNE_OP_CONSTSTZ) {
+			ok = (strcmp(result->param.stz.sval, presult->param.stz.sval) == 0);
+		} else {
+			ok = (result->param.num.nval == presult->param.num.nval)
+				 || (snexpr_num_isnan(result->param.num.nval)
+						 && snexpr_num_isnan(presult->param.num.nval));
+		}
+	}
+	if(!ok) {
+		printf("FAIL: %s: compiled program result differs\n", s);
+	}
+	snexpr_result_free(presult);
+	snexpr_prog_destroy(prog);
+}
+
 static void snexpr_test_num(char *s, float expected)
 {
 	char *p = NULL;
@@ -57,9 +147,11 @@ static void snexpr_test_num(char *s, float expected)
 	struct snexpr *e = snexpr_create(s, strlen(s), &vars, NULL, snexpr_extval_cbf);
 	if(e == NULL) {
 		printf("FAIL: %s returned NULL\n", s);
+		snexpr_destroy(NULL, &vars);
 		return;
 	}
 	struct snexpr *result = snexpr_eval(e);
+	snexpr_test_prog(s, e, result);
 
 	if(result==NULL) {
 		printf("FAIL: result is NULL\n");
@@ -80,9 +172,10 @@ static void snexpr_test_num(char *s, float expected)
 		}
 	}
 
-	if((isnan(result->param.num.nval) && !isnan(expected))
+	if((snexpr_num_isnan(result->param.num.nval) && !isnan(expected))
 			|| fabs(result->param.num.nval - expected) > 0.00001f) {
-		printf("FAIL: %s: %f \t\t!= %f\n", p, result->param.num.nval, expected);
+		printf("FAIL: %s: %f \t\t!= %f\n", p, (double)result->param.num.nval,
+				expected);
 	} else {
 		printf("OK: %s \t\t== %f\n", p, expected);
 	}
@@ -103,9 +196,11 @@ static void snexpr_test_stz(char *s, char *expected)
 	struct snexpr *e = snexpr_create(s, strlen(s), &vars, NULL, snexpr_extval_cbf);
 	if(e == NULL) {
 		printf("FAIL: %s returned NULL\n", s);
+		snexpr_destroy(NULL, &vars);
 		return;
 	}
 	struct snexpr *result = snexpr_eval(e);
+	snexpr_test_prog(s, e, result);
 
 	if(result==NULL) {
 		printf("FAIL: result is NULL\n");
@@ -126,7 +221,12 @@ static void snexpr_test_stz(char *s, char *expected)
 		}
 	}
 
-	if(strlen(result->param.stz.sval)==strlen(expected)
+	if(strlen(expected) < SNEXPR_SSO_SIZE
+			&& (result->param.stz.sval != result->param.stz.sbuf
+					|| (result->eflags & SNEXPR_VALALLOC))) {
+		printf("FAIL: %s: short result not stored inline\n", p);
+	} else if(strlen(result->param.stz.sval)==strlen(expected)
+			&& result->param.stz.slen==strlen(expected)
 			&& strcmp(result->param.stz.sval, expected)==0) {
 		printf("OK: %s \t\t== \"%s\"\n", p, expected);
 	} else {
@@ -150,9 +250,11 @@ static void snexpr_test_bool(char *s, int expected)
 	struct snexpr *e = snexpr_create(s, strlen(s), &vars, NULL, NULL);
 	if(e == NULL) {
 		printf("FAIL: %s returned NULL\n", s);
+		snexpr_destroy(NULL, &vars);
 		return;
 	}
 	struct snexpr *result = snexpr_eval(e);
+	snexpr_test_prog(s, e, result);
 
 	if(result==NULL) {
 		printf("FAIL: result is NULL\n");
@@ -193,7 +295,7 @@ static void snexpr_test_bool(char *s, int expected)
 	if(b == expected) {
 		printf("OK: %s \t\t== %s\n", p, expected?"true":"false");
 	} else {
-		printf("FAIL: %s: %f \t\t!= %s\n", p, result->param.num.nval, expected?"true":"false");
+		printf("FAIL: %s: %f \t\t!= %s\n", p, (double)result->param.num.nval, expected?"true":"false");
 	}
 
 done:
@@ -205,18 +307,1265 @@ end:
 }
 
 
+static int _snexpr_test_cleanups = 0;
+
+static struct snexpr *snexpr_test_fadd(
+		struct snexpr_func *f, sne_vec_expr_t *args, void *c)
+{
+	struct snexpr *r;
+	float n = 0;
+	int i;
+
+	for(i = 0; i < sne_vec_len(args); i++) {
+		r = snexpr_eval(&sne_vec_nth(args, i));
+		if(r == NULL) {
+			return NULL;
+		}
+		if(r->type == SNE_OP_CONSTNUM) {
+			n += r->param.num.nval;
+		}
+		snexpr_result_free(r);
+	}
+	(*(int *)c)++;
+	return snexpr_convert_num(n, SNE_OP_CONSTNUM);
+}
+
+static void snexpr_test_fcleanup(struct snexpr_func *f, void *c)
+{
+	_snexpr_test_cleanups++;
+}
+
+/* multiply the parameter with N2 from the context */
+static struct snexpr *snexpr_test_fscale(struct snexpr_func *f,
+		sne_vec_expr_t *args, void *c, struct snexpr_ctx *ctx)
+{
+	struct snexpr r;
+	float n;
+
+	if(ctx == NULL || sne_vec_len(args) != 1
+			|| snexpr_eval_into(&sne_vec_nth(args, 0), ctx, &r) < 0) {
+		return NULL;
+	}
+	n = (r.type == SNE_OP_CONSTNUM) ? r.param.num.nval : 0;
+	snexpr_result_free(&r);
+	return snexpr_convert_num(n * *(float *)ctx->data, SNE_OP_CONSTNUM);
+}
+
+static int _snexpr_test_hcalls = 0;
+
+/* sum of the characters of the parameter, counting the calls */
+static struct snexpr *snexpr_test_fhash(
+		struct snexpr_func *f, sne_vec_expr_t *args, void *c)
+{
+	struct snexpr *r;
+	float n = 0;
+	size_t i;
+
+	r = snexpr_eval(&sne_vec_nth(args, 0));
+	if(r == NULL) {
+		return NULL;
+	}
+	if(r->type == SNE_OP_CONSTSTZ) {
+		for(i = 0; i < r->param.stz.slen; i++) {
+			n += (unsigned char)r->param.stz.sval[i];
+		}
+	} else {
+		n = r->param.num.nval;
+	}
+	snexpr_result_free(r);
+	_snexpr_test_hcalls++;
+	return snexpr_convert_num(n, SNE_OP_CONSTNUM);
+}
+
+static struct snexpr_func snexpr_test_funcs[] = {
+		{"add", snexpr_test_fadd, snexpr_test_fcleanup, sizeof(int), NULL, 0, 0,
+				SNE_OP_UNKNOWN},
+		{"scale", NULL, NULL, 0, snexpr_test_fscale, 0, 0, SNE_OP_UNKNOWN},
+		{"hash", snexpr_test_fhash, NULL, 0, NULL,
+				SNEXPR_FN_PURE | SNEXPR_FN_NARGS, 1, SNE_OP_CONSTNUM},
+		{NULL, NULL, NULL, 0, NULL, 0, 0, SNE_OP_UNKNOWN},
+};
+
+/* evaluate with a context, results converted to string for comparison */
+static int snexpr_test_into_check(char *s, struct snexpr *r, char *expected)
+{
+	char buf[SNEXPR_NUMSTZ_SIZE];
+	char *v = buf;
+
+	if(r->type == SNE_OP_CONSTSTZ) {
+		v = r->param.stz.sval;
+	} else if(snexpr_format_numb(buf, sizeof(buf), r->param.num.nval) < 0) {
+		return -1;
+	}
+	if(strcmp(v, expected) != 0) {
+		printf("FAIL: %s: \"%s\" \t\t!= \"%s\"\n", s, v, expected);
+		return -1;
+	}
+	return 0;
+}
+
+static void snexpr_test_into(char *s, char *expected)
+{
+	struct snexpr_var_list vars = {0};
+	struct snexpr_ctx ctx;
+	struct snexpr_prog *prog = NULL;
+	struct snexpr r;
+	float n2 = 4;
+	int i;
+	int ok = 1;
+	struct snexpr *e = snexpr_parse(s, strlen(s), &vars, snexpr_test_funcs);
+	if(e == NULL) {
+		printf("FAIL: %s returned NULL\n", s);
+		snexpr_destroy(NULL, &vars);
+		return;
+	}
+	snexpr_ctx_init(&ctx, snexpr_extval_ctx_cbf, &n2);
+	prog = snexpr_compile(e);
+	for(i = 0; i < 3; i++) {
+		if(snexpr_eval_into(e, &ctx, &r) < 0) {
+			printf("FAIL: %s: evaluation failed\n", s);
+			ok = 0;
+			break;
+		}
+		ok &= (snexpr_test_into_check(s, &r, expected) == 0);
+		snexpr_result_free(&r);
+		if(snexpr_prog_eval_into(prog, &ctx, &r) < 0) {
+			printf("FAIL: %s: program evaluation failed\n", s);
+			ok = 0;
+			break;
+		}
+		ok &= (snexpr_test_into_check(s, &r, expected) == 0);
+		snexpr_result_free(&r);
+	}
+	if(ok) {
+		printf("OK: %s \t\t== \"%s\" (scratch)\n", s, expected);
+	}
+	snexpr_prog_destroy(prog);
+	snexpr_ctx_free(&ctx);
+	snexpr_destroy(e, &vars);
+}
+
+
+/* evaluate the expression created normally and moved in an arena */
+static void snexpr_test_arena(char *s, char *expected)
+{
+	struct snexpr_var_list vars = {0};
+	struct snexpr r;
+	struct snexpr *tr;
+	int ok = 1;
+	int i;
+	struct snexpr *e;
+
+	for(i = 0; i < 2; i++) {
+		_snexpr_test_cleanups = 0;
+		e = (i == 0) ? snexpr_create(s, strlen(s), &vars, snexpr_test_funcs,
+							   snexpr_extval_cbf)
+					 : snexpr_create_arena(s, strlen(s), &vars,
+							   snexpr_test_funcs, snexpr_extval_cbf);
+		if(e == NULL) {
+			printf("FAIL: %s returned NULL\n", s);
+			snexpr_destroy(NULL, &vars);
+			return;
+		}
+		if(i == 1 && snexpr_arena_size(e) == 0) {
+			printf("FAIL: %s is not in an arena\n", s);
+			ok = 0;
+		}
+		if(snexpr_eval_into(e, NULL, &r) < 0) {
+			printf("FAIL: %s: evaluation failed\n", s);
+			ok = 0;
+		} else {
+			ok &= (snexpr_test_into_check(s, &r, expected) == 0);
+			snexpr_result_free(&r);
+		}
+		tr = snexpr_eval(e);
+		snexpr_test_prog(s, e, tr);
+		snexpr_result_free(tr);
+		snexpr_destroy(e, &vars);
+		vars.head = NULL;
+		if(strstr(s, "add(") != NULL && _snexpr_test_cleanups == 0) {
+			printf("FAIL: %s: function contexts not cleaned up\n", s);
+			ok = 0;
+		}
+	}
+	if(ok) {
+		printf("OK: %s \t\t== \"%s\" (arena)\n", s, expected);
+	}
+}
+
+/* evaluate the expression moved in a flat expression, after optimizing it */
+static void snexpr_test_flat(char *s, char *expected)
+{
+	struct snexpr_var_list vars = {0};
+	struct snexpr_flat *fl;
+	struct snexpr_ctx ctx;
+	struct snexpr r;
+	float n2 = 0;
+	int ok = 1;
+	int i;
+	struct snexpr *e = snexpr_create(
+			s, strlen(s), &vars, snexpr_test_funcs, snexpr_extval_cbf);
+	if(e == NULL || snexpr_optimize(e) < 0) {
+		printf("FAIL: %s cannot be created\n", s);
+		snexpr_destroy(e, &vars);
+		return;
+	}
+	fl = snexpr_flat_pack(e);
+	if(fl == NULL) {
+		printf("FAIL: %s cannot be packed\n", s);
+		snexpr_destroy(e, &vars);
+		return;
+	}
+	_snexpr_test_cleanups = 0;
+	snexpr_ctx_init(&ctx, snexpr_extval_ctx_cbf, &n2);
+	for(i = 0; i < 2; i++) {
+		if(snexpr_flat_eval_into(fl, (i == 0) ? NULL : &ctx, &r) < 0) {
+			printf("FAIL: %s: evaluation failed\n", s);
+			ok = 0;
+			continue;
+		}
+		ok &= (snexpr_test_into_check(s, &r, expected) == 0);
+		snexpr_result_free(&r);
+	}
+	snexpr_ctx_free(&ctx);
+	snexpr_flat_destroy(fl);
+	snexpr_destroy(NULL, &vars);
+	if(strstr(s, "add(") != NULL && _snexpr_test_cleanups == 0) {
+		printf("FAIL: %s: function contexts not cleaned up\n", s);
+		ok = 0;
+	}
+	if(ok) {
+		printf("OK: %s \t\t== \"%s\" (flat)\n", s, expected);
+	}
+}
+
+/* evaluate the optimized expression, folded tells if it must be a constant */
+static void snexpr_test_opt(char *s, char *expected, int folded)
+{
+	struct snexpr_var_list vars = {0};
+	struct snexpr_prog *prog = NULL;
+	struct snexpr r;
+	int ok = 1;
+	struct snexpr *e = snexpr_create(s, strlen(s), &vars, NULL, snexpr_extval_cbf);
+	if(e == NULL) {
+		printf("FAIL: %s returned NULL\n", s);
+		snexpr_destroy(NULL, &vars);
+		return;
+	}
+	if(snexpr_optimize(e) < 0) {
+		printf("FAIL: %s cannot be optimized\n", s);
+		ok = 0;
+	}
+	if(folded && e->type != SNE_OP_CONSTNUM && e->type != SNE_OP_CONSTSTZ) {
+		printf("FAIL: %s is not folded\n", s);
+		ok = 0;
+	}
+	if(snexpr_eval_into(e, NULL, &r) < 0) {
+		printf("FAIL: %s: evaluation failed\n", s);
+		ok = 0;
+	} else {
+		ok &= (snexpr_test_into_check(s, &r, expected) == 0);
+		snexpr_result_free(&r);
+	}
+	prog = snexpr_compile(e);
+	if(snexpr_prog_eval_into(prog, NULL, &r) < 0) {
+		printf("FAIL: %s: program evaluation failed\n", s);
+		ok = 0;
+	} else {
+		ok &= (snexpr_test_into_check(s, &r, expected) == 0);
+		snexpr_result_free(&r);
+	}
+	if(ok) {
+		printf("OK: %s \t\t== \"%s\" (optimized)\n", s, expected);
+	}
+	snexpr_prog_destroy(prog);
+	snexpr_destroy(e, &vars);
+}
+
+/* pure functions called ncalls times for 3 evaluations of the tree and
+ * 3 of the program, expected NULL when the expression is not valid */
+static void snexpr_test_pure(char *s, char *expected, int ncalls, int folded)
+{
+	struct snexpr_var_list vars = {0};
+	struct snexpr_prog *prog = NULL;
+	struct snexpr r;
+	int i;
+	int ok = 1;
+	struct snexpr *e = snexpr_create(
+			s, strlen(s), &vars, snexpr_test_funcs, snexpr_extval_cbf);
+	if(expected == NULL || e == NULL) {
+		if(expected != NULL || e != NULL) {
+			printf("FAIL: %s %s\n", s, e ? "is not NULL" : "returned NULL");
+		} else {
+			printf("OK: %s \t\t== NULL\n", s);
+		}
+		snexpr_destroy(e, &vars);
+		return;
+	}
+	if(folded && (snexpr_optimize(e) < 0 || !snexpr_is_const(e))) {
+		printf("FAIL: %s is not folded\n", s);
+		ok = 0;
+	}
+	_snexpr_test_hcalls = 0;
+	prog = snexpr_compile(e);
+	for(i = 0; i < 6 && ok; i++) {
+		if(((i < 3) ? snexpr_eval_into(e, NULL, &r)
+					: snexpr_prog_eval_into(prog, NULL, &r)) < 0) {
+			printf("FAIL: %s: evaluation failed\n", s);
+			ok = 0;
+		} else {
+			ok &= (snexpr_test_into_check(s, &r, expected) == 0);
+			snexpr_result_free(&r);
+		}
+	}
+	if(ok && _snexpr_test_hcalls != ncalls) {
+		printf("FAIL: %s: %d calls instead of %d\n", s, _snexpr_test_hcalls,
+				ncalls);
+		ok = 0;
+	}
+	if(ok) {
+		printf("OK: %s \t\t== \"%s\" (%d calls)\n", s, expected, ncalls);
+	}
+	snexpr_prog_destroy(prog);
+	snexpr_destroy(e, &vars);
+}
+
+/* write the image of the optimized expression, load and evaluate it */
+static void snexpr_test_image(char *s, char *expected)
+{
+	struct snexpr_var_list vars = {0};
+	struct snexpr_var_list lvars = {0};
+	struct snexpr_ctx ctx;
+	struct snexpr_prog *prog = NULL;
+	struct snexpr *e;
+	struct snexpr *le = NULL;
+	struct snexpr r;
+	float n2 = 4;
+	char *img = NULL;
+	size_t size;
+	int ok = 1;
+
+	e = snexpr_parse(s, strlen(s), &vars, snexpr_test_funcs);
+	if(e == NULL || snexpr_optimize(e) < 0) {
+		printf("FAIL: %s returned NULL\n", s);
+		goto end;
+	}
+	size = snexpr_image_write(e, NULL, 0);
+	img = (char *)malloc(size);
+	if(size == 0 || img == NULL || snexpr_image_write(e, img, size) != size) {
+		printf("FAIL: %s: image not written\n", s);
+		goto end;
+	}
+	if(snexpr_image_load(img, size - 1, &lvars, snexpr_test_funcs, NULL)
+			!= NULL) {
+		printf("FAIL: %s: truncated image loaded\n", s);
+		ok = 0;
+	}
+	img[4]++;
+	if(snexpr_image_load(img, size, &lvars, snexpr_test_funcs, NULL) != NULL) {
+		printf("FAIL: %s: image of another version loaded\n", s);
+		ok = 0;
+	}
+	img[4]--;
+	le = snexpr_image_load(img, size, &lvars, snexpr_test_funcs, NULL);
+	if(le == NULL) {
+		printf("FAIL: %s: image not loaded\n", s);
+		goto end;
+	}
+	snexpr_ctx_init(&ctx, snexpr_extval_ctx_cbf, &n2);
+	if(snexpr_eval_into(le, &ctx, &r) < 0) {
+		printf("FAIL: %s: evaluation failed\n", s);
+		ok = 0;
+	} else {
+		ok &= (snexpr_test_into_check(s, &r, expected) == 0);
+		snexpr_result_free(&r);
+	}
+	prog = snexpr_compile(le);
+	if(snexpr_prog_eval_into(prog, &ctx, &r) < 0) {
+		printf("FAIL: %s: program evaluation failed\n", s);
+		ok = 0;
+	} else {
+		ok &= (snexpr_test_into_check(s, &r, expected) == 0);
+		snexpr_result_free(&r);
+	}
+	if(ok) {
+		printf("OK: %s \t\t== \"%s\" (image of %d bytes)\n", s, expected,
+				(int)size);
+	}
+	snexpr_prog_destroy(prog);
+	snexpr_ctx_free(&ctx);
+
+end:
+	snexpr_destroy(le, &lvars);
+	snexpr_destroy(e, &vars);
+	if(img) free(img);
+}
+
+/* an image with a macro call as parameter of the macro is not loaded */
+static void snexpr_test_image_params(void)
+{
+	struct snexpr_var_list vars = {0};
+	struct snexpr_ihdr h;
+	struct snexpr_inode n;
+	struct snexpr *e;
+	char *s = "$(f, $1 + 1), f(2)";
+	char *img = NULL;
+	char *p;
+	size_t size;
+
+	e = snexpr_parse(s, strlen(s), &vars, snexpr_test_funcs);
+	size = (e != NULL) ? snexpr_image_write(e, NULL, 0) : 0;
+	img = (char *)malloc(size);
+	if(size == 0 || img == NULL || snexpr_image_write(e, img, size) != size) {
+		printf("FAIL: %s: image not written\n", s);
+		goto end;
+	}
+	/* the parameter $1 is the last node */
+	memcpy(&h, img, sizeof(h));
+	p = img + sizeof(h) + (h.nnodes - 1) * sizeof(n);
+	memcpy(&n, p, sizeof(n));
+	if(n.type != SNE_OP_VAR) {
+		printf("FAIL: %s: last node is not the parameter\n", s);
+		goto end;
+	}
+	n.type = SNE_OP_FUNC;
+	n.flags = SNEXPR_IMAGE_MCALL;
+	n.u.idx = 0;
+	memcpy(p, &n, sizeof(n));
+	if(snexpr_image_load(img, size, &vars, snexpr_test_funcs, NULL) != NULL) {
+		printf("FAIL: %s: image with a call as parameter loaded\n", s);
+	} else {
+		printf("OK: image with a call as parameter rejected\n");
+	}
+
+end:
+	snexpr_destroy(e, &vars);
+	if(img) free(img);
+}
+
+/* the same expressions taken many times from a cache with 2 entries */
+static void snexpr_test_cache(void)
+{
+	struct snexpr_var_list vars = {0};
+	struct snexpr_cache *c = snexpr_cache_new(&vars, 2);
+	struct snexpr_centry *ce;
+	struct snexpr_centry *held = NULL;
+	struct snexpr r;
+	char *exprs[] = {"x=2, x*3", "\"a\" + 1", "(60*60*24) * 2", "x=2, x*3"};
+	char *results[] = {"6", "a1", "172800", "6"};
+	int ok = 1;
+	int i;
+	int j;
+
+	for(i = 0; i < 3; i++) {
+		for(j = 0; j < 4; j++) {
+			ce = snexpr_cache_get(c, exprs[j], strlen(exprs[j]), NULL);
+			if(ce == NULL || snexpr_prog_eval_into(ce->prog, NULL, &r) < 0) {
+				printf("FAIL: %s: cache evaluation failed\n", exprs[j]);
+				ok = 0;
+				continue;
+			}
+			ok &= (snexpr_test_into_check(exprs[j], &r, results[j]) == 0);
+			snexpr_result_free(&r);
+			if(i == 0 && j == 0) {
+				/* referenced while evicted */
+				held = ce;
+				continue;
+			}
+			snexpr_cache_put(c, ce);
+		}
+	}
+	if(c->nitems != 2 || c->hits != 2 || c->misses != 10 || c->evictions == 0) {
+		printf("FAIL: cache counters: %d items, %lu hits, %lu misses\n",
+				c->nitems, c->hits, c->misses);
+		ok = 0;
+	}
+	if(held != NULL && (snexpr_eval_into(held->e, NULL, &r) < 0
+							   || snexpr_test_into_check(held->src, &r, "6") < 0)) {
+		ok = 0;
+	}
+	snexpr_cache_put(c, held);
+	snexpr_cache_destroy(c);
+	snexpr_destroy(NULL, &vars);
+	if(ok) {
+		printf("OK: cache of expressions\n");
+	}
+}
+
+/* many variables set by slot, like a host updating its values */
+static void snexpr_test_vars(char *s, int nvars, float expected)
+{
+	struct snexpr_var_list vars = {0};
+	struct snexpr *e = NULL;
+	struct snexpr *result = NULL;
+	char name[16];
+	int slot;
+	int i;
+
+	for(i = 0; i < nvars; i++) {
+		snprintf(name, sizeof(name), "v%d", i);
+		slot = snexpr_var_slot(&vars, name, strlen(name));
+		if(slot != i) {
+			printf("FAIL: %s: slot %d for %s\n", s, slot, name);
+			goto done;
+		}
+	}
+	e = snexpr_create(s, strlen(s), &vars, NULL, NULL);
+	if(e == NULL) {
+		printf("FAIL: %s returned NULL\n", s);
+		goto done;
+	}
+	for(i = 0; i < nvars; i++) {
+		snexpr_var_set_num(&vars, i, (float)i);
+	}
+	snexpr_var_set_stz(&vars, 0, "unused");
+	snexpr_var_set_num(&vars, 0, 1);
+	result = snexpr_eval(e);
+	if(result == NULL || result->param.num.nval != expected) {
+		printf("FAIL: %s != %f\n", s, expected);
+	} else {
+		printf("OK: %s == %f (%d variables)\n", s, expected, nvars);
+	}
+done:
+	snexpr_result_free(result);
+	snexpr_destroy(e, &vars);
+}
+
+/* variables resolved to handles once, their values taken from a table */
+static int snexpr_test_resolve_cbf(void *data, char *vname)
+{
+	if(strcmp(vname, "N1")==0) {
+		return 0;
+	} else if(strcmp(vname, "H3")==0) {
+		return 3;
+	}
+	return -1;
+}
+
+static struct snexpr* snexpr_test_handle_cbf(struct snexpr_ctx *ctx, int hid)
+{
+	return snexpr_convert_num(((float *)ctx->data)[hid], SNE_OP_CONSTNUM);
+}
+
+static void snexpr_test_handles(char *s, float expected)
+{
+	struct snexpr_var_list vars = {0};
+	struct snexpr_ctx ctx;
+	struct snexpr *e;
+	struct snexpr_prog *prog;
+	struct snexpr r;
+	float vals[4] = {10, 0, 0, 5};
+	int n;
+
+	e = snexpr_parse(s, strlen(s), &vars, NULL);
+	if(e == NULL) {
+		printf("FAIL: %s returned NULL\n", s);
+		snexpr_destroy(NULL, &vars);
+		return;
+	}
+	n = snexpr_var_resolve(&vars, snexpr_test_resolve_cbf, NULL);
+	snexpr_ctx_init(&ctx, snexpr_extval_ctx_cbf, vals);
+	snexpr_ctx_set_handle_cbf(&ctx, snexpr_test_handle_cbf);
+	prog = snexpr_compile(e);
+	if(snexpr_prog_eval_into(prog, &ctx, &r) < 0) {
+		printf("FAIL: %s: evaluation failed\n", s);
+	} else if(r.type != SNE_OP_CONSTNUM || r.param.num.nval != expected) {
+		printf("FAIL: %s != %f\n", s, expected);
+	} else {
+		printf("OK: %s == %f (%d handles)\n", s, expected, n);
+	}
+	snexpr_result_free(&r);
+	snexpr_prog_destroy(prog);
+	snexpr_ctx_free(&ctx);
+	snexpr_destroy(e, &vars);
+}
+
+/* evaluate over columns and compare with the evaluation of each row */
+#define SNEXPR_TEST_ROWS 300
+static void snexpr_test_batch(char *s)
+{
+	struct snexpr_var_list vars = {0};
+	struct snexpr *e = NULL;
+	struct snexpr_prog *prog = NULL;
+	struct snexpr r;
+	snexpr_num_t ca[SNEXPR_TEST_ROWS];
+	snexpr_num_t cb[SNEXPR_TEST_ROWS];
+	snexpr_num_t out[SNEXPR_TEST_ROWS];
+	const snexpr_num_t *cols[2] = {ca, cb};
+	snexpr_num_t n;
+	int i;
+
+	snexpr_var_slot(&vars, "a", 1);
+	snexpr_var_slot(&vars, "b", 1);
+	e = snexpr_create(s, strlen(s), &vars, NULL, snexpr_extval_cbf);
+	prog = snexpr_compile(e);
+	if(prog == NULL) {
+		printf("FAIL: %s: compile failed\n", s);
+		goto done;
+	}
+	for(i = 0; i < SNEXPR_TEST_ROWS; i++) {
+		ca[i] = (snexpr_num_t)(i % 7 - 3);
+		cb[i] = (snexpr_num_t)(i % 5 - 2) / 2;
+	}
+	if(snexpr_prog_eval_batch(prog, NULL, cols, 2, SNEXPR_TEST_ROWS, out) < 0) {
+		printf("FAIL: %s: batch evaluation failed\n", s);
+		goto done;
+	}
+	for(i = 0; i < SNEXPR_TEST_ROWS; i++) {
+		snexpr_var_set_num(&vars, 0, ca[i]);
+		snexpr_var_set_num(&vars, 1, cb[i]);
+		n = SNEXPR_NUM_NAN;
+		if(snexpr_prog_eval_into(prog, NULL, &r) == 0) {
+			if(r.type == SNE_OP_CONSTNUM) {
+				n = r.param.num.nval;
+			}
+			snexpr_result_free(&r);
+		}
+		if(n != out[i] && !(snexpr_num_isnan(n) && snexpr_num_isnan(out[i]))) {
+			printf("FAIL: %s: row %d: %f != %f\n", s, i, (double)out[i],
+					(double)n);
+			goto done;
+		}
+	}
+	printf("OK: %s (%d rows)\n", s, SNEXPR_TEST_ROWS);
+done:
+	snexpr_prog_destroy(prog);
+	snexpr_destroy(e, &vars);
+}
+
+
+/* evaluate row by row with the jit and with the program, native tells if
+ * the jit has native code when it can be generated */
+static void snexpr_test_jit(char *s, int native)
+{
+	struct snexpr_var_list vars = {0};
+	struct snexpr *e = NULL;
+	struct snexpr_prog *prog = NULL;
+	struct snexpr_jit *jit = NULL;
+	struct snexpr r;
+	snexpr_num_t vals[2];
+	snexpr_num_t n = 0;
+	snexpr_num_t m;
+	int i;
+
+	snexpr_var_slot(&vars, "a", 1);
+	snexpr_var_slot(&vars, "b", 1);
+	e = snexpr_create(s, strlen(s), &vars, NULL, snexpr_extval_cbf);
+	prog = snexpr_compile(e);
+	jit = snexpr_jit_compile(e);
+	if(prog == NULL || jit == NULL) {
+		printf("FAIL: %s: compile failed\n", s);
+		goto done;
+	}
+#ifdef SNEXPR_JIT_X64
+	if(snexpr_jit_native(jit) != native) {
+		printf("FAIL: %s: native %d != %d\n", s, snexpr_jit_native(jit), native);
+		goto done;
+	}
+#else
+	(void)native;
+#endif
+	for(i = 0; i < SNEXPR_TEST_ROWS; i++) {
+		vals[0] = (snexpr_num_t)(i % 7 - 3);
+		vals[1] = (snexpr_num_t)(i % 5 - 2) / 2;
+		m = SNEXPR_NUM_NAN;
+		if(snexpr_jit_eval(jit, NULL, vals, 2, &n) < 0) {
+			n = SNEXPR_NUM_NAN;
+		}
+		snexpr_var_set_num(&vars, 0, vals[0]);
+		snexpr_var_set_num(&vars, 1, vals[1]);
+		if(snexpr_prog_eval_into(prog, NULL, &r) == 0) {
+			if(r.type == SNE_OP_CONSTNUM) {
+				m = r.param.num.nval;
+			}
+			snexpr_result_free(&r);
+		}
+		if(n != m && !(snexpr_num_isnan(n) && snexpr_num_isnan(m))) {
+			printf("FAIL: %s: row %d: %f != %f\n", s, i, (double)n, (double)m);
+			goto done;
+		}
+	}
+	printf("OK: %s (jit, %d rows)\n", s, SNEXPR_TEST_ROWS);
+done:
+	snexpr_jit_destroy(jit);
+	snexpr_prog_destroy(prog);
+	snexpr_destroy(e, &vars);
+}
+
+#ifdef SNEXPR_THREADS
+/* evaluations of a shared jit by a thread with its context, a + b, b = 2 */
+static void *snexpr_test_jit_run(void *arg)
+{
+	struct snexpr_jit *jit = (struct snexpr_jit *)arg;
+	struct snexpr_ctx ctx;
+	snexpr_num_t vals[1];
+	snexpr_num_t n;
+	long nfail = 0;
+	int i;
+
+	snexpr_ctx_init(&ctx, NULL, NULL);
+	for(i = 0; i < 1000; i++) {
+		vals[0] = (snexpr_num_t)i;
+		if(snexpr_jit_eval(jit, &ctx, vals, 1, &n) < 0 || n != i + 2) {
+			nfail++;
+		}
+	}
+	snexpr_ctx_free(&ctx);
+	return (void *)nfail;
+}
+#endif
+
+/* the interpreter of the jit does not change the variables of vals */
+static void snexpr_test_jit_vars(void)
+{
+	char *s = "a + b";
+	struct snexpr_var_list vars = {0};
+	struct snexpr *e = NULL;
+	struct snexpr_jit *jit = NULL;
+	struct snexpr_var *v;
+	snexpr_num_t vals[1] = {5};
+	snexpr_num_t n = 0;
+
+	snexpr_var_slot(&vars, "a", 1);
+	snexpr_var_slot(&vars, "b", 1);
+	snexpr_var_set_stz(&vars, 0, "a1");
+	snexpr_var_set_num(&vars, 1, 2);
+	e = snexpr_create(s, strlen(s), &vars, NULL, snexpr_extval_cbf);
+	jit = snexpr_jit_compile(e);
+	if(jit == NULL) {
+		printf("FAIL: %s: compile failed\n", s);
+		goto done;
+	}
+	/* b has no value in vals */
+	if(snexpr_jit_eval(jit, NULL, vals, 1, &n) < 0 || n != 7) {
+		printf("FAIL: %s: %f != 7\n", s, (double)n);
+		goto done;
+	}
+	v = snexpr_var_at(&vars, 0);
+	if(!(v->evflags & SNEXPR_TSTRING) || strcmp(v->v.sval, "a1") != 0) {
+		printf("FAIL: %s: a changed by the evaluation\n", s);
+		goto done;
+	}
+#ifdef SNEXPR_THREADS
+	{
+		pthread_t th[4];
+		void *nfail;
+		int i;
+
+		for(i = 0; i < 4; i++) {
+			pthread_create(&th[i], NULL, snexpr_test_jit_run, jit);
+		}
+		for(i = 0; i < 4; i++) {
+			pthread_join(th[i], &nfail);
+			if(nfail != NULL) {
+				printf("FAIL: %s: %ld evaluations failed in a thread\n", s,
+						(long)nfail);
+				goto done;
+			}
+		}
+	}
+#endif
+	printf("OK: %s (jit, variables kept)\n", s);
+done:
+	snexpr_jit_destroy(jit);
+	snexpr_destroy(e, &vars);
+}
+
+
+#ifdef SNEXPR_PROFILE
+/* evaluate n times, the root and the leftmost variable or function have to
+ * be evaluated n times, the latter calling its callback n times */
+static void snexpr_test_prof(char *s, unsigned long n)
+{
+	struct snexpr_var_list vars = {0};
+	struct snexpr *e;
+	struct snexpr *a;
+	struct snexpr r;
+	unsigned long i;
+	unsigned long cbcount;
+
+	e = snexpr_create(s, strlen(s), &vars, snexpr_test_funcs, snexpr_extval_cbf);
+	if(e == NULL) {
+		printf("FAIL: %s returned NULL\n", s);
+		snexpr_destroy(NULL, &vars);
+		return;
+	}
+	for(i = 0; i < n; i++) {
+		if(snexpr_eval_into(e, NULL, &r) == 0) {
+			snexpr_result_free(&r);
+		}
+	}
+	for(a = e; a->type != SNE_OP_VAR && a->type != SNE_OP_FUNC;) {
+		a = &sne_vec_nth(&a->param.op.args, 0);
+	}
+	cbcount = (a->type == SNE_OP_VAR) ? a->param.var.vref->prof.cbcount
+									  : a->prof.cbcount;
+	if(e->prof.count != n || a->prof.count != n || cbcount != n
+			|| e->prof.time < a->prof.time) {
+		printf("FAIL: %s: profile counters\n", s);
+		snexpr_prof_dump(stdout, e, s);
+	} else {
+		printf("OK: %s (profiled %lu times)\n", s, n);
+	}
+	snexpr_prof_reset(e);
+	if(e->prof.count != 0 || a->prof.count != 0) {
+		printf("FAIL: %s: profile counters not reset\n", s);
+	}
+	snexpr_destroy(e, &vars);
+}
+#endif
+
+static int _snexpr_test_lookups = 0;
+
+static struct snexpr *snexpr_extval_count_cbf(
+		struct snexpr_ctx *ctx, char *vname)
+{
+	_snexpr_test_lookups++;
+	return snexpr_extval_ctx_cbf(ctx, vname);
+}
+
+/* rules sharing subexpressions, each one evaluated once per input */
+static void snexpr_test_ruleset(void)
+{
+	char *rules[] = {"S1 + \":\" + N1",
+			"(S1 + \":\" + N1) + \"/\" + scale(N1 * 2)",
+			"scale(N1 * 2) - N1", "x = N1 * 2, x + N1", "x + 1", NULL};
+	char *expected[] = {"abc:10", "abc:10/80", "70", "30", "21"};
+	struct snexpr_var_list vars = {0};
+	struct snexpr_ruleset *rs;
+	struct snexpr_ctx ctx;
+	struct snexpr res[5];
+	float n2 = 4;
+	int nslots;
+	int i;
+	int k;
+	int ok = 1;
+
+	rs = snexpr_ruleset_new(&vars, snexpr_test_funcs);
+	for(i = 0; rules[i] != NULL; i++) {
+		if(snexpr_ruleset_add(rs, rules[i], strlen(rules[i])) != i) {
+			printf("FAIL: %s returned NULL\n", rules[i]);
+			ok = 0;
+		}
+	}
+	nslots = snexpr_ruleset_build(rs);
+	if(nslots != 3 || snexpr_ruleset_add(rs, "1", 1) != -1) {
+		printf("FAIL: rule set built with %d shared subtrees\n", nslots);
+		ok = 0;
+	}
+	snexpr_ctx_init(&ctx, snexpr_extval_count_cbf, &n2);
+	for(k = 0; k < 2 && ok; k++) {
+		_snexpr_test_lookups = 0;
+		if(snexpr_ruleset_eval(rs, &ctx, res) != 0) {
+			printf("FAIL: rule set evaluation failed\n");
+			ok = 0;
+		}
+		for(i = 0; rules[i] != NULL; i++) {
+			if(ok) {
+				ok &= (snexpr_test_into_check(rules[i], &res[i], expected[i])
+						== 0);
+			}
+			snexpr_result_free(&res[i]);
+		}
+		/* S1 and N1 looked up once, 9 times without sharing */
+		if(ok && _snexpr_test_lookups != 2) {
+			printf("FAIL: rule set: %d lookups instead of 2\n",
+					_snexpr_test_lookups);
+			ok = 0;
+		}
+	}
+	if(ok) {
+		printf("OK: rule set of %d expressions == \"%s\" (%d shared)\n", i,
+				expected[i - 1], nslots);
+	}
+	snexpr_ctx_free(&ctx);
+	snexpr_ruleset_destroy(rs);
+	snexpr_destroy(NULL, &vars);
+}
+
+#ifdef SNEXPR_THREADS
+#define SNEXPR_TEST_NRULES 5
+
+/*
+ * jobs evaluated by the pool, compared with the rule set evaluated in order
+ * - the pattern changing with the jobs is compiled by each thread
+ */
+static void snexpr_test_pool(int nthreads, int njobs)
+{
+	char *rules[] = {"S1 + \":\" + N2", "(N2 * 2 + N1) * (N2 > 3)",
+			"(S1 + \":\" + N2) + \"/\" + scale(N2 * 2 + N1)", "N1 / (N2 - 5)",
+#ifndef SNEXPR_NO_REGEX
+			"(S1 + N2) =~ (\"^a.c\" + N2 % 5)", NULL};
+#else
+			"(S1 + N2) =~ (\"^abc\" + N2 % 5)", NULL};
+#endif
+	struct snexpr_var_list vars = {0};
+	struct snexpr_ruleset *rs;
+	struct snexpr_pool *pool;
+	struct snexpr_job *jobs;
+	struct snexpr_ctx ctx;
+	struct snexpr *res;
+	struct snexpr r[SNEXPR_TEST_NRULES];
+	char buf[SNEXPR_NUMSTZ_SIZE];
+	float *vals;
+	long nfail;
+	int i;
+	int k;
+	int n;
+	int run;
+	int ok = 1;
+
+	rs = snexpr_ruleset_new(&vars, snexpr_test_funcs);
+	for(i = 0; rules[i] != NULL; i++) {
+		snexpr_ruleset_add(rs, rules[i], strlen(rules[i]));
+	}
+	if(snexpr_ruleset_build(rs) < 0 || snexpr_ruleset_size(rs) != SNEXPR_TEST_NRULES) {
+		printf("FAIL: pool: rule set not built\n");
+		snexpr_ruleset_destroy(rs);
+		snexpr_destroy(NULL, &vars);
+		return;
+	}
+	jobs = (struct snexpr_job *)calloc(njobs, sizeof(struct snexpr_job));
+	res = (struct snexpr *)calloc(SNEXPR_TEST_NRULES * njobs, sizeof(struct snexpr));
+	vals = (float *)calloc(njobs, sizeof(float));
+	for(k = 0; k < njobs; k++) {
+		vals[k] = (float)(k % 37);
+		jobs[k].rs = rs;
+		jobs[k].data = &vals[k];
+		jobs[k].res = &res[SNEXPR_TEST_NRULES * k];
+	}
+	pool = snexpr_pool_new(nthreads, snexpr_extval_ctx_cbf, NULL);
+	snexpr_ctx_init(&ctx, snexpr_extval_ctx_cbf, NULL);
+	for(run = 0; run < 2 && ok; run++) {
+		/* the division by 0 fails when N2 is 5 */
+		nfail = snexpr_pool_run(pool, jobs, njobs);
+		if(nfail != (njobs + 31) / 37) {
+			printf("FAIL: pool: %ld jobs failed\n", nfail);
+			ok = 0;
+		}
+		for(k = 0; k < njobs; k++) {
+			ctx.data = &vals[k];
+			n = snexpr_ruleset_eval(rs, &ctx, r);
+			if(ok && jobs[k].nerr != n) {
+				printf("FAIL: pool: job %d has %d errors\n", k, jobs[k].nerr);
+				ok = 0;
+			}
+			for(i = 0; i < SNEXPR_TEST_NRULES; i++) {
+				if(ok && r[i].type == SNE_OP_CONSTSTZ) {
+					ok &= (snexpr_test_into_check(rules[i], &jobs[k].res[i],
+								   r[i].param.stz.sval)
+							== 0);
+				} else if(ok) {
+					snexpr_format_numb(buf, sizeof(buf), r[i].param.num.nval);
+					ok &= (snexpr_test_into_check(rules[i], &jobs[k].res[i], buf)
+							== 0);
+				}
+				if(jobs[k].nerr >= 0) {
+					snexpr_result_free(&jobs[k].res[i]);
+				}
+				snexpr_result_free(&r[i]);
+			}
+		}
+	}
+	if(ok) {
+		printf("OK: pool of %d threads, %d jobs\n", nthreads, njobs);
+	}
+	snexpr_ctx_free(&ctx);
+	snexpr_pool_destroy(pool);
+	free(vals);
+	free(res);
+	free(jobs);
+	snexpr_ruleset_destroy(rs);
+	snexpr_destroy(NULL, &vars);
+}
+#endif
+
+/* evaluations of the cached subtrees after changes of the variables */
+static void snexpr_test_incr(void)
+{
+	char *s = "(a * 2 + 1) * (b - 3) + hash(c + 1) + (S1 + c == \"abc5\")";
+	char *expected[] = {"10", "10", "13", "13"};
+	int nevals[] = {6, 2, 4, 4};
+	int ncalls[] = {1, 0, 0, 1};
+	struct snexpr_var_list vars = {0};
+	struct snexpr_incr *inc;
+	struct snexpr_ctx ctx;
+	struct snexpr r;
+	unsigned long n = 0;
+	float n2 = 4;
+	int i;
+	int ok = 1;
+
+	inc = snexpr_incr_create(s, strlen(s), &vars, snexpr_test_funcs);
+	if(inc == NULL) {
+		printf("FAIL: %s returned NULL\n", s);
+		snexpr_destroy(NULL, &vars);
+		return;
+	}
+	snexpr_var_set_num(&vars, snexpr_var_slot(&vars, "a", 1), 1);
+	snexpr_var_set_num(&vars, snexpr_var_slot(&vars, "b", 1), 4);
+	snexpr_var_set_num(&vars, snexpr_var_slot(&vars, "c", 1), 5);
+	snexpr_ctx_init(&ctx, snexpr_extval_ctx_cbf, &n2);
+	for(i = 0; i < 4 && ok; i++) {
+		if(i == 2) {
+			snexpr_var_set_num(&vars, snexpr_var_slot(&vars, "b", 1), 5);
+		} else if(i == 3) {
+			snexpr_var_set_num(&vars, snexpr_var_slot(&vars, "c", 1), 6);
+		}
+		_snexpr_test_hcalls = 0;
+		if(snexpr_incr_eval(inc, &ctx, &r) < 0) {
+			printf("FAIL: %s: evaluation failed\n", s);
+			ok = 0;
+			break;
+		}
+		ok &= (snexpr_test_into_check(s, &r, expected[i]) == 0);
+		snexpr_result_free(&r);
+		if(ok && (inc->cse.nevals - n != (unsigned long)nevals[i]
+						 || _snexpr_test_hcalls != ncalls[i])) {
+			printf("FAIL: %s: %lu subtrees and %d calls instead of %d and %d\n",
+					s, inc->cse.nevals - n, _snexpr_test_hcalls, nevals[i],
+					ncalls[i]);
+			ok = 0;
+		}
+		n = inc->cse.nevals;
+	}
+	if(ok) {
+		printf("OK: %s \t\t== \"%s\" (incremental)\n", s, expected[3]);
+	}
+	snexpr_ctx_free(&ctx);
+	snexpr_incr_destroy(inc);
+	snexpr_destroy(NULL, &vars);
+}
+
+/* the literal patterns are checked by the parser, the others when used */
+static void snexpr_test_match(void)
+{
+	struct snexpr_var_list vars = {0};
+	struct snexpr r;
+	char *s = "p = \"^(a|b\", S1 =~ p";
+	struct snexpr *e = snexpr_parse("S1 =~ \"a[\"", 9, &vars, NULL);
+
+	if(e != NULL) {
+		printf("FAIL: invalid literal pattern accepted\n");
+		snexpr_destroy(e, &vars);
+		return;
+	}
+	snexpr_destroy(NULL, &vars);
+	e = snexpr_parse(s, strlen(s), &vars, NULL);
+	if(e == NULL) {
+		printf("FAIL: %s returned NULL\n", s);
+		snexpr_destroy(NULL, &vars);
+		return;
+	}
+	if(snexpr_eval_into(e, NULL, &r) == 0) {
+		printf("FAIL: %s: invalid pattern matched\n", s);
+		snexpr_result_free(&r);
+	} else {
+		printf("OK: invalid patterns rejected\n");
+	}
+	snexpr_destroy(e, &vars);
+}
+
+/* the lists are made only of literals, the chains of == become sets */
+static void snexpr_test_set(void)
+{
+	struct snexpr_var_list vars = {0};
+	struct snexpr r;
+	char *s = "x == 1 || x == \"abc\" || x == -2 || (x == \"BYE\" || x == 5)";
+	char *t = "x == 1 || x == 2 || y == 3 || x == 4";
+	struct snexpr *e = snexpr_parse("x in (1, y)", 11, &vars, NULL);
+	int slot;
+	int ok = 1;
+
+	if(e != NULL) {
+		printf("FAIL: list with a variable accepted\n");
+		snexpr_destroy(e, &vars);
+		return;
+	}
+	snexpr_destroy(NULL, &vars);
+	e = snexpr_parse(s, strlen(s), &vars, NULL);
+	if(e == NULL || snexpr_optimize(e) < 0 || e->type != SNE_OP_IN) {
+		printf("FAIL: %s is not a set\n", s);
+		snexpr_destroy(e, &vars);
+		return;
+	}
+	slot = snexpr_var_slot(&vars, "x", 1);
+	snexpr_var_set_stz(&vars, slot, "BYE");
+	ok &= (snexpr_eval_into(e, NULL, &r) == 0 && r.param.num.nval == 1);
+	snexpr_var_set_num(&vars, slot, -2);
+	ok &= (snexpr_eval_into(e, NULL, &r) == 0 && r.param.num.nval == 1);
+	snexpr_var_set_stz(&vars, slot, "-2.0");
+	ok &= (snexpr_eval_into(e, NULL, &r) == 0 && r.param.num.nval == 0);
+	if(!ok) {
+		printf("FAIL: %s: wrong set\n", s);
+	}
+	snexpr_destroy(e, &vars);
+	e = snexpr_parse(t, strlen(t), &vars, NULL);
+	if(e == NULL || snexpr_optimize(e) < 0 || e->type == SNE_OP_IN) {
+		printf("FAIL: %s is a set\n", t);
+		ok = 0;
+	}
+	snexpr_destroy(e, &vars);
+	if(ok) {
+		printf("OK: sets of literals\n");
+	}
+}
+
+/* n operands separated by sep, each one given by item */
+static char *snexpr_test_chain(char *s, int n, char *item, char *sep)
+{
+	char *p = s;
+	int i;
+
+	for(i = 0; i < n; i++) {
+		p += sprintf(p, "%s%s", (i > 0) ? sep : "", item);
+	}
+	return p;
+}
+
+/* the deep trees are evaluated and copied, the too deep ones rejected */
+static void snexpr_test_deep(void)
+{
+	struct snexpr_var_list vars = {0};
+	struct snexpr_ctx ctx;
+	struct snexpr c = snexpr_init();
+	struct snexpr *e;
+	struct snexpr r;
+	static char s[32 * SNEXPR_MAX_DEPTH];
+	char *p;
+	int ok = 1;
+	int i;
+	int k;
+
+	snexpr_ctx_init(&ctx, NULL, NULL);
+	snexpr_test_chain(s, SNEXPR_MAX_DEPTH / 2, "x = x + 1", ", ");
+	e = snexpr_parse(s, strlen(s), &vars, NULL);
+	if(e == NULL) {
+		printf("FAIL: comma sequence not parsed\n");
+		snexpr_ctx_free(&ctx);
+		snexpr_destroy(NULL, &vars);
+		return;
+	}
+	ok &= (snexpr_eval_into(e, &ctx, &r) == 0
+			&& r.param.num.nval == SNEXPR_MAX_DEPTH / 2);
+	ok &= (snexpr_eval_into(e, NULL, &r) == 0
+			&& r.param.num.nval == SNEXPR_MAX_DEPTH);
+	snexpr_copy(&c, e);
+	ok &= (snexpr_eval_into(&c, &ctx, &r) == 0
+			&& r.param.num.nval == 3 * (SNEXPR_MAX_DEPTH / 2));
+	snexpr_destroy_args(&c);
+	snexpr_destroy(e, &vars);
+	p = snexpr_test_chain(s, SNEXPR_MAX_DEPTH / 2, "0", " || ");
+	strcpy(p, " || 7 || 1");
+	e = snexpr_parse(s, strlen(s), &vars, NULL);
+	ok &= (e != NULL && snexpr_eval_into(e, &ctx, &r) == 0
+			&& r.param.num.nval == 7);
+	snexpr_destroy(e, &vars);
+	if(!ok) {
+		printf("FAIL: wrong values of the deep expressions\n");
+	}
+	/* too deep in parentheses, in a macro body or with the calls of macros */
+	for(i = 0; i < 3; i++) {
+		p = s;
+		if(i == 0) {
+			for(k = 0; k < SNEXPR_MAX_DEPTH; k++) {
+				p += sprintf(p, "1 - (");
+			}
+			p += sprintf(p, "1%*s", SNEXPR_MAX_DEPTH, "");
+			memset(p - SNEXPR_MAX_DEPTH, ')', SNEXPR_MAX_DEPTH);
+		} else {
+			p += sprintf(p, "$(f, ");
+			p = snexpr_test_chain(p, SNEXPR_MAX_DEPTH / ((i == 1) ? 1 : 2),
+					"$1", " - ");
+			p += sprintf(p, "), ");
+			p = snexpr_test_chain(p, SNEXPR_MAX_DEPTH / 2 + 1, "1", ", ");
+			sprintf(p, ", f(1)");
+		}
+		e = snexpr_parse(s, strlen(s), &vars, NULL);
+		if(e != NULL) {
+			printf("FAIL: expression %d deeper than %d parsed\n", i,
+					SNEXPR_MAX_DEPTH);
+			snexpr_destroy(e, NULL);
+			ok = 0;
+		}
+		snexpr_destroy(NULL, &vars);
+	}
+	snexpr_ctx_free(&ctx);
+	if(ok) {
+		printf("OK: deep expressions\n");
+	}
+}
+
+/* all the blocks allocated with the SNEXPR_MALLOC() hooks are released */
+static void snexpr_test_blocks(void)
+{
+	if(_snexpr_test_nblocks != 0) {
+		printf("FAIL: %ld blocks not released\n", _snexpr_test_nblocks);
+	} else {
+		printf("OK: all blocks released\n");
+	}
+}
+
 int main(int argc, char *argv[])
 {
+#ifdef SNEXPR_INT64
+	/* the numbers are exact integers, the tests with fractions are skipped */
+	snexpr_test_into("16777217 + 1", "16777218");
+	snexpr_test_into("1 << 40 | 5", "1099511627781");
+	snexpr_test_into("2 ** 62 - 1", "4611686018427387903");
+	snexpr_test_into("7 / 2 + -7 / 2 + 3.9 * 2", "6");
+	snexpr_test_into("123456789012 + \"8\"", "123456789020");
+	snexpr_test_into("\"n=\" + (N1 * -1000000000000)", "n=-10000000000000");
+	snexpr_test_into("7 % 0, 9 % 4", "1");
+	snexpr_test_into("9223372036854775807 * 2", "-2");
+	snexpr_test_into("9223372036854775807 + 1", "-9223372036854775808");
+	snexpr_test_into("-9223372036854775807 - 2", "9223372036854775807");
+	snexpr_test_into("(1 << 64) + (1 << -1) + (1 << 63 >> 63)", "-1");
+	snexpr_test_into("(-8 >> 64) + (8 >> 70) + (-8 >> 1)", "-5");
+	snexpr_test_opt("-(9223372036854775807 + 1) + (3 << 64)", "-9223372036854775808", 1);
+	snexpr_test_pure("9223372036854775807 + 0", "9223372036854775807", 0, 1);
+	snexpr_test_pure("9223372036854775808", NULL, 0, 0);
+	snexpr_test_pure("1 + 18446744073709551615", NULL, 0, 0);
+	snexpr_test_pure("99999999999999999999", NULL, 0, 0);
+
+	printf("\n");
+
+	snexpr_test_batch("a * 3 + b / 2 - N1");
+	snexpr_test_batch("a / b + a % b, (a & 6) << 33");
+	snexpr_test_batch("a * 9223372036854775807 - (a << b + 62) + (a >> b * 64)");
+	snexpr_test_batch("-(a - 9223372036854775807 - 1) + (b << a * 20)");
+
+	printf("\n");
+#endif
 	snexpr_test_num("1+\"2\"", 1 + 2);
 	snexpr_test_num("10-2", 10 - 2);
 	snexpr_test_num("2*3", 2 * 3);
 	snexpr_test_num("2+3*4", 2 + 3 * 4);
 	snexpr_test_num("(2+3)*4", (2 + 3) * 4);
 	snexpr_test_num("2*3+4", 2 * 3 + 4);
+#ifndef SNEXPR_INT64
 	snexpr_test_num("2+3/2", 2 + 3.0 / 2.0);
 	snexpr_test_num("1/3*6/4*2", 1.0 / 3 * 6 / 4.0 * 2);
 	snexpr_test_num("1*3/6*4/2", 1.0 * 3 / 6 * 4.0 / 2.0);
+#endif
 	snexpr_test_num("(1+2)*3", (1 + 2) * 3);
+	snexpr_test_num("-(2+3)", -(2 + 3));
+	snexpr_test_num("1<<4|3", (1 << 4) | 3);
+	snexpr_test_num("2 && 3", 3);
+	snexpr_test_num("0 || 4", 4);
+	snexpr_test_num("!0 + 1", 2);
+	snexpr_test_num("1/0, 5", 5);
+	snexpr_test_num("x=2, y=x*3, y+1", 7);
+	snexpr_test_num("$(sqr, $1 * $1), 5*sqr(2)", 20);
+	snexpr_test_num("$(sq, $1 * $1), $(hyp, sq($1) + sq($2)), hyp(3, 4) + sq(hyp(1, 2))", 50);
+	snexpr_test_num("$(f, $1 * 10), $(g, f($1 + 1) + $1), g(2)", 32);
+	snexpr_test_num("N1*2", 20);
+	snexpr_test_num("- 1 + 3", 2);
+	snexpr_test_num("2 <= 3 != 0", 1);
+	snexpr_test_num("2**3 >= 8 && 9 >> 1 == 4", 1);
+	snexpr_test_num("x=1 # first\n y=x+1\n y*2", 4);
+	snexpr_test_num("1 + \"2\" + 3 + \"4\"", 10);
+	snexpr_test_num("\"a\" + 1/0 + \"b\", 3", 3);
 
 	printf("\n");
 
@@ -225,12 +1574,184 @@ int main(int argc, char *argv[])
 	snexpr_test_stz("s=\"4\",s=s+\"5\"", "45");
 	snexpr_test_stz("S1+\"d\"", "abcd");
 	snexpr_test_stz("\"3\"+\"4\\\"5\"", "34\"5");
+	snexpr_test_stz("P1", "sip:alice");
+	snexpr_test_stz("P1 + \"/\" + P1", "sip:alice/sip:alice");
+	snexpr_test_stz("\"a\"+1+\"b\"+2+\"c\"+3+\"d\"+4+\"e\"+5+\"f\"+6+\"g\"+7+\"h\"+8+\"i\"+9",
+			"a1b2c3d4e5f6g7h8i9");
 
 	printf("\n");
 
 	snexpr_test_bool("\"1\" == \"2\"", 0);
 	snexpr_test_bool("\"12\" == \"1\" + 2", 1);
 	snexpr_test_bool("(\"abc\" == \"abc\")", 1);
+	snexpr_test_bool("\"sip:alice@example.com\" =~ \"^sip:\"", 1);
+	snexpr_test_bool("\"alice.example.com\" =~ \"\\\\.com$\"", 1);
+	snexpr_test_bool("\"alice\" =~ \"^ali$\"", 0);
+	snexpr_test_bool("\"alice\" !~ \"lic\"", 0);
+#ifndef SNEXPR_NO_REGEX
+	snexpr_test_bool("\"INVITE sip:bob\" =~ \"^(INVITE|ACK) sip:[a-z]+$\"", 1);
+	snexpr_test_bool("12345 =~ \"^[0-9]{5}$\" && \"a\" + \"b\" =~ \"ab\" == 1", 1);
+#else
+	snexpr_test_bool("12345 =~ \"^12345$\" && \"a\" + \"b\" =~ \"ab\" == 1", 1);
+#endif
+	snexpr_test_bool("p = \"^a\", (\"abc\" =~ p) && (\"xbc\" !~ p)", 1);
+	snexpr_test_bool("\"BYE\" in (\"INVITE\", \"ACK\", \"BYE\")", 1);
+	snexpr_test_bool("\"bye\" in (\"INVITE\", \"ACK\", \"BYE\") || 7 in (1, 2)", 0);
+	snexpr_test_bool("(-2 in (1, -2, 3)) + (\"5\" in (5, 6)) + (5 in (\"5\", 6))", 1);
+	snexpr_test_bool("(\"5.0\" in (5)) + (0 in (-0)) + (1 + 1 in (2))", 1);
+
+	printf("\n");
+
+	snexpr_test_into("(2+3)*4 > 10", "1");
+#ifndef SNEXPR_INT64
+	snexpr_test_into("N1 * 2.5", "25");
+#endif
+	snexpr_test_into("S1 + \"/\" + 4 + \"/\" + S1", "abc/4/abc");
+	snexpr_test_into("\"id-\" + (1+2)", "id-3");
+#ifndef SNEXPR_INT64
+	snexpr_test_into("S1 + \"/\" + N1 + \"/\" + 1.5 + \"?\" + S1", "abc/10/1.5?abc");
+#endif
+	snexpr_test_into("N2 * N1", "40");
+	snexpr_test_into("(P1 == \"sip:alice\") + (P1 > \"sip:al\") + (P1 < \"sip:alice@\")", "3");
+	snexpr_test_into("x = P1, (P1 == x) && P1", "1");
+	snexpr_test_into("scale(N1 + 1) + scale(S1)", "44");
+#ifndef SNEXPR_NO_REGEX
+	snexpr_test_into("(P1 =~ \"^sip:[a-z]+$\") + (P1 =~ \"alice\") + (P1 =~ \"com\")", "2");
+#else
+	snexpr_test_into("(P1 =~ \"^sip:\") + (P1 =~ \"alice\") + (P1 =~ \"com\")", "2");
+#endif
+	snexpr_test_into("(P1 in (\"sip:bob\", \"sip:alice\")) + (N1 in (\"10\", 20))", "2");
+
+	printf("\n");
+
+	snexpr_test_arena("add(2, 3) * add(N1, 1)", "55");
+	snexpr_test_arena("add(hash(S1), 3) + hash(N1)", "307");
+	snexpr_test_arena("s=\"ab\", t=s+\"cd\", $(m, $1+t), m(\"x\")", "xabcd");
+#ifndef SNEXPR_NO_REGEX
+	snexpr_test_arena("(S1 =~ \"^a.c$\") + add(N1 =~ 1, 1)", "3");
+#else
+	snexpr_test_arena("(S1 =~ \"^abc$\") + add(N1 =~ 1, 1)", "3");
+#endif
+	snexpr_test_arena("add(S1 in (\"x\", \"abc\"), N1 in (1, 2))", "1");
+
+	printf("\n");
+
+	snexpr_test_flat("(N1 + 2) * 3 - N2 + (S1 + \"x\" == \"abcx\")", "37");
+	snexpr_test_flat("x = \"ab\", y = x + \"ab\" + S1, y + add(N1, 1)", "abababc11");
+	snexpr_test_flat("0 && (x=1), 1 || (x=2), P1 + (!x + -N1 * (N1 > \"9\"))", "sip:alice-9");
+	snexpr_test_flat("$(f, $1 * 10), $(g, f($1 + 1) + $1), g(2) + f(N1)", "132");
+#ifndef SNEXPR_NO_REGEX
+	snexpr_test_flat("p = S1 + \"$\", (\"xabc\" =~ p) + (P1 !~ \"^sip:.*x$\")", "2");
+#else
+	snexpr_test_flat("p = S1 + \"$\", (\"xabc\" =~ p) + (P1 !~ \"^sip:x\")", "2");
+#endif
+	snexpr_test_flat("(S1 in (\"abc\", 1)) + (N1 + 1 in (11, \"a\")) * 2", "3");
+
+	printf("\n");
+
+	snexpr_test_image("(N1 + 2) * 3 - N2 + (S1 + \"x\" == \"abcx\")", "33");
+	snexpr_test_image("x = \"ab\", y = x + \"ab\" + S1, y + add(N1, 1)", "abababc1");
+	snexpr_test_image("$(sq, $1 * $1), (7 & 13) + hash(7) + sq(scale(N1))", "1612");
+	snexpr_test_image("$(f, $1 * 10), $(g, f($1 + 1) + $1), g(2) + f(N1)", "132");
+#ifndef SNEXPR_NO_REGEX
+	snexpr_test_image("(S1 =~ \"b\") + (S1 + 1 =~ \"^[a-c]+1$\")", "2");
+#else
+	snexpr_test_image("(S1 =~ \"b\") + (S1 + 1 =~ \"^abc1$\")", "2");
+#endif
+	snexpr_test_image("(S1 in (\"a\", \"abc\", 3)) + (N1 in (1, 10, -1)) * 2", "3");
+	snexpr_test_image_params();
+
+	printf("\n");
+
+	snexpr_test_opt("\"prefix-\" + 10", "prefix-10", 1);
+	snexpr_test_opt("(60*60*24) * N1", "864000", 0);
+	snexpr_test_opt("N1 + \"5\" > 14", "1", 0);
+	snexpr_test_opt("S1 + 1 + (2 < 3)", "abc11", 0);
+	snexpr_test_opt("0 && (x=1), 1 || (x=2), x", "0", 0);
+	snexpr_test_opt("\"a\" == \"a\", S1 < 2", "0", 0);
+	snexpr_test_opt("1/0 + N1, 7", "7", 0);
+	snexpr_test_opt("(S1 + 42 == \"abc42\") + (N1 == \"10\") + (S1 > 5)", "3", 0);
+#ifndef SNEXPR_INT64
+	snexpr_test_opt("(N1 + \"2.5\") * 2 + (S1 + 0.25 == \"abc0.25\")", "26", 0);
+#endif
+	snexpr_test_opt("\"abc\" =~ \"^a\" + \"b\"", "1", 1);
+#ifndef SNEXPR_NO_REGEX
+	snexpr_test_opt("\"x\" + S1 =~ \"^x\" + \"[a-c]\"", "1", 0);
+#else
+	snexpr_test_opt("\"x\" + S1 =~ \"^x\" + \"ab\"", "1", 0);
+#endif
+	snexpr_test_opt("(\"ACK\" in (\"INVITE\", \"ACK\")) + 1", "2", 1);
+
+	printf("\n");
+
+	snexpr_test_pure("hash(\"abc\") + hash(\"abc\")", "588", 2, 0);
+	snexpr_test_pure("hash(S1) * 2 + hash(N1 - 1)", "597", 2, 0);
+	snexpr_test_pure("hash(hash(S1 + 1))", "343", 2, 0);
+	snexpr_test_pure("hash(add(2)) + hash(1)", "3", 7, 0);
+	snexpr_test_pure("hash(\"abc\") * 2 + hash(7)", "595", 0, 1);
+	snexpr_test_pure("hash(1, 2)", NULL, 0, 0);
+	snexpr_test_pure("hash()", NULL, 0, 0);
+
+	printf("\n");
+
+	snexpr_test_cache();
+
+	printf("\n");
+
+	snexpr_test_ruleset();
+#ifdef SNEXPR_THREADS
+	snexpr_test_pool(4, 1000);
+	snexpr_test_pool(8, 3);
+	snexpr_test_pool(1, 100);
+#endif
+
+	printf("\n");
+
+	snexpr_test_incr();
+
+	printf("\n");
+
+	snexpr_test_vars("v0 + v7 * v250", 1751, 1 + 7 * 250);
+	snexpr_test_vars("$(f, $1 + v2), f(v1) + f(3)", 8, 1 + 2 + 3 + 2);
+
+	printf("\n");
+
+	snexpr_test_handles("N1 * 2 + H3 + (S1 == \"abc\")", 10 * 2 + 5 + 1);
+	snexpr_test_handles("N2 + H3, x = N1, x = x + 1", 11);
+
+	printf("\n");
+
+	snexpr_test_batch("a * 2 + b / 4 - N1");
+	snexpr_test_batch("a / b + 1");
+	snexpr_test_batch("(a < b) + (a >= 0 && b != 0) * 3 || a % 2");
+	snexpr_test_batch("((a + 3) << 2 | b & 7) ^ ~a, a ** 2 - -b");
+	snexpr_test_batch("1 / b, a + 1 + b + N1 == !a");
+	snexpr_test_batch("x = a + b, S1 + x == \"abc0\" || x");
+	snexpr_test_batch("(a in (1, 3, 5, -7)) * 2 + (b + 1 in (0, 2))");
+	snexpr_test_batch("(-a && 1) ** -1 + (-b || 0) ** -1");
+	snexpr_test_jit("a * 2 + b / 4 - N1", 1);
+	snexpr_test_jit("a / b + 1", 1);
+	snexpr_test_jit("(a < b) + (a >= 0 && b != 0) * 3 || a % 2", 1);
+	snexpr_test_jit("((a + 3) << 2 | b & 7) ^ ~a, a ** 2 - -b", 1);
+	snexpr_test_jit("!a + (a > b) - (a <= b) * (a == 1) + (b != 0.5) / -a", 1);
+	snexpr_test_jit("(a in (1, 3, 5, -7)) * 2 + (b + 1 in (0, 2))", 1);
+	snexpr_test_jit("1 / b, a + 1 + b + N1 == !a", 1);
+	snexpr_test_jit("x = a + b, S1 + x == \"abc0\" || x", 0);
+	snexpr_test_jit("(-a && 1) ** -1 + (-b || 0) ** -1", 1);
+	snexpr_test_jit_vars();
+
+	printf("\n");
+
+#ifdef SNEXPR_PROFILE
+	snexpr_test_prof("add(N1, 2) * 3", 5);
+	snexpr_test_prof("N1 == \"10\" && S1", 3);
+
+	printf("\n");
+#endif
 
+	snexpr_test_match();
+	snexpr_test_set();
+	snexpr_test_deep();
+	snexpr_test_blocks();
 	return 0;
 }
@@ -0,0 +1,258 @@
+/**
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Serge Zaitsev
+ * Copyright (c) 2022 Daniel-Constantin Mierla
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* tests of the C++ layer, run with: tsnexpp */
+
+#include <stdlib.h>
+
+/* the blocks allocated by the library, all released at the end */
+static long _snexpr_test_nblocks = 0;
+
+static void *snexpr_test_malloc(size_t size)
+{
+	_snexpr_test_nblocks++;
+	return malloc(size);
+}
+
+static void *snexpr_test_calloc(size_t n, size_t size)
+{
+	_snexpr_test_nblocks++;
+	return calloc(n, size);
+}
+
+static void *snexpr_test_realloc(void *p, size_t size)
+{
+	if(p == NULL) {
+		_snexpr_test_nblocks++;
+	}
+	return realloc(p, size);
+}
+
+static void snexpr_test_free(void *p)
+{
+	if(p != NULL) {
+		_snexpr_test_nblocks--;
+	}
+	free(p);
+}
+
+#define SNEXPR_MALLOC(s) snexpr_test_malloc(s)
+#define SNEXPR_CALLOC(n, s) snexpr_test_calloc(n, s)
+#define SNEXPR_REALLOC(p, s) snexpr_test_realloc(p, s)
+#define SNEXPR_FREE(p) snexpr_test_free(p)
+
+#include "../snexpr.hpp"
+
+#include <stdio.h>
+
+static int _snexpr_test_fails = 0;
+
+#define SNEXPR_TEST_FAIL(...)        \
+	do {                             \
+		printf("FAIL: " __VA_ARGS__); \
+		_snexpr_test_fails++;        \
+	} while(0)
+
+/* N2 is taken from the user data of the context */
+static struct snexpr *snexpr_test_ctx_cbf(struct snexpr_ctx *ctx, char *vname)
+{
+	if(vname != NULL && strcmp(vname, "N2") == 0) {
+		return snexpr_convert_num(*(snexpr_num_t *)ctx->data, SNE_OP_CONSTNUM);
+	}
+	if(vname != NULL && strcmp(vname, "S1") == 0) {
+		return snexpr_convert_stz((char *)"abc", SNE_OP_CONSTSTZ);
+	}
+	return snexpr_convert_num(0, SNE_OP_CONSTNUM);
+}
+
+/* external variables of the C expressions made with snexpr_create() */
+static struct snexpr *snexpr_test_cbf(char *vname)
+{
+	return snexpr_convert_num((strcmp(vname, "N1") == 0) ? 10 : 0, SNE_OP_CONSTNUM);
+}
+
+/* the same numbers or both failed */
+static bool snexpr_test_same(
+		std::optional<snexpr_num_t> a, std::optional<snexpr_num_t> b)
+{
+	if(!a || !b) {
+		return !a && !b;
+	}
+	return *a == *b || (snexpr_num_isnan(*a) && snexpr_num_isnan(*b));
+}
+
+/*
+ * evaluate the expression parsed at compile time and at run time for a
+ * grid of values of its variables
+ */
+template <const auto &X> static void snexpr_test_static(const char *s)
+{
+	static const snexpr_num_t vals[] = {0, 1, -1, (snexpr_num_t)2.5, -3, 7, 100};
+	const int nv = (int)(sizeof(vals) / sizeof(vals[0]));
+	sne::Vars vars;
+	snexpr_num_t v[X.nvars + 1] = {};
+	int slots[X.nvars + 1] = {};
+	int rows = 1;
+	int i;
+	int k;
+
+	sne::Expr e = sne::Expr::parse(s, vars);
+	if(!e) {
+		SNEXPR_TEST_FAIL("%s: parse failed\n", s);
+		return;
+	}
+	for(i = 0; i < X.nvars; i++) {
+		slots[i] = vars.slot(std::string_view(X.src + X.voff[i], X.vlen[i]));
+		rows = (rows < 10000) ? rows * nv : rows;
+	}
+	for(k = 0; k < rows; k++) {
+		int r = k;
+		for(i = 0; i < X.nvars; i++, r /= nv) {
+			v[i] = vals[r % nv];
+			vars.set(slots[i], v[i]);
+		}
+		std::optional<sne::Value> rv = e.eval();
+		std::optional<snexpr_num_t> n;
+		if(rv && rv->is_number()) {
+			n = rv->number();
+		}
+		std::optional<snexpr_num_t> m = sne::Static<X>::eval(v);
+		if(!snexpr_test_same(m, n)) {
+			SNEXPR_TEST_FAIL("%s: row %d: %f != %f\n", s, k,
+					m ? (double)*m : -1.0, n ? (double)*n : -1.0);
+			return;
+		}
+	}
+	printf("OK: %s (static, %d rows)\n", s, rows);
+}
+
+#define SNEXPR_TEST_STATIC(S)                    \
+	do {                                         \
+		static constexpr auto _x = sne::parse(S); \
+		snexpr_test_static<_x>(S);               \
+	} while(0)
+
+/* the C++ objects do not reset the callback of the C expressions */
+static void snexpr_test_global()
+{
+	struct snexpr_var_list cvars = {};
+	const char *s = "N1 * 2";
+	struct snexpr *ce = snexpr_create(s, strlen(s), &cvars, NULL, snexpr_test_cbf);
+	struct snexpr *r;
+
+	if(ce == NULL) {
+		SNEXPR_TEST_FAIL("%s: create failed\n", s);
+		return;
+	}
+	{
+		sne::Vars vars;
+		sne::Expr e = sne::Expr::parse("a + 1", vars);
+		e.eval();
+	}
+	r = snexpr_eval(ce);
+	if(r == NULL || r->type != SNE_OP_CONSTNUM || r->param.num.nval != 20) {
+		SNEXPR_TEST_FAIL("%s: callback reset by the C++ objects\n", s);
+	} else {
+		printf("OK: %s (callback of snexpr_create() kept)\n", s);
+	}
+	snexpr_result_free(r);
+	snexpr_destroy(ce, &cvars);
+}
+
+/* the owners of the C structures are moved, not copied */
+static void snexpr_test_moves()
+{
+	sne::Vars vars;
+	snexpr_num_t n2 = 4;
+	sne::Context ctx(snexpr_test_ctx_cbf, &n2);
+	int a = vars.slot("a");
+
+	sne::Expr e = sne::Expr::parse("S1 + \":\" + (a * N2)", vars);
+	sne::Expr e2 = std::move(e);
+	if(e || !e2 || !e2.optimize() || !e2.compile()) {
+		SNEXPR_TEST_FAIL("expression not moved\n");
+		return;
+	}
+	vars.set(a, 3);
+	sne::Context ctx2 = std::move(ctx);
+	std::optional<sne::Value> r = e2.eval(ctx2);
+	if(!r || r->str() != "abc:12") {
+		SNEXPR_TEST_FAIL("string result with a context\n");
+		return;
+	}
+	/* a short string is inline in the value */
+	sne::Value v = std::move(*r);
+	if(!v.keep() || v.str() != "abc:12" || !r->is_number()) {
+		SNEXPR_TEST_FAIL("value not moved\n");
+		return;
+	}
+	vars.set(a, 30000000);
+	r = e2.eval(ctx2);
+	if(!r || !r->keep()) {
+		SNEXPR_TEST_FAIL("long string result\n");
+		return;
+	}
+	sne::Value w = std::move(*r);
+	n2 = 0;
+	vars.set(a, std::string_view("xyz"));
+	if(w.str() != "abc:120000000" || v.str() != "abc:12") {
+		SNEXPR_TEST_FAIL("kept values changed\n");
+		return;
+	}
+	sne::Expr bad = sne::Expr::parse("(1 +", vars);
+	if(bad || bad.eval()) {
+		SNEXPR_TEST_FAIL("bad expression parsed\n");
+		return;
+	}
+	printf("OK: moves of vars, context, expression and values\n");
+}
+
+int main()
+{
+	static_assert(sne::parse("a * b + c").nvars == 3, "variables");
+	static_assert(sne::parse("x - 1, x").slot("x") == 0, "slot");
+
+	SNEXPR_TEST_STATIC("a * 2 + b / 4 - 7");
+	SNEXPR_TEST_STATIC("a / b + 1");
+	SNEXPR_TEST_STATIC("(a < b) + (a >= 0 && b != 0) * 3 || a % 2");
+	SNEXPR_TEST_STATIC("((a + 3) << 2 | b & 7) ^ ^a, a ** 2 - -b");
+	SNEXPR_TEST_STATIC("^a + 1");
+	SNEXPR_TEST_STATIC("^(a - b) ^ -^b * 2");
+	SNEXPR_TEST_STATIC("!a + (a > b) - (a <= b) * (a == 1) + (b != 2.5) / -a");
+	SNEXPR_TEST_STATIC("1 / b, a + 1 + b == !a");
+	SNEXPR_TEST_STATIC("2 ** 3 ** 2 - a / b ** 2 * 3");
+	SNEXPR_TEST_STATIC("-2 ** 2 + a ^ b | c & 5 || a && !c");
+	SNEXPR_TEST_STATIC("2 <= 3 != 0 + a - 0.25");
+	SNEXPR_TEST_STATIC("a * 9223372036854775807 + (b << a * 30) - (b >> -a)");
+	snexpr_test_moves();
+	snexpr_test_global();
+
+	if(_snexpr_test_nblocks != 0) {
+		SNEXPR_TEST_FAIL("%ld blocks not released\n", _snexpr_test_nblocks);
+	} else {
+		printf("OK: all blocks released\n");
+	}
+	return _snexpr_test_fails != 0;
+}